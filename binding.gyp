@@ -1,54 +1,82 @@
 {
+  "target_defaults": {
+    "sources": [
+      "src/cpp/common/logging.cpp",
+      "src/cpp/common/cpu_affinity.cpp",
+      "src/cpp/common/json.cpp",
+      "src/cpp/common/metrics.cpp",
+      "src/cpp/common/thermal.cpp",
+      "src/cpp/model/llm_model.cpp",
+      "src/cpp/model/sampler.cpp",
+      "src/cpp/model/model_registry.cpp",
+      "src/cpp/model/speculative.cpp",
+      "src/cpp/model/token_pieces.cpp",
+      "src/cpp/model/embedding.cpp",
+      "src/cpp/model/grammar.cpp",
+      "src/cpp/model/chat_template.cpp",
+      "src/cpp/model/stop_sequences.cpp",
+      "src/cpp/model/lora_adapters.cpp",
+      "src/cpp/inference/inference_engine.cpp",
+      "src/cpp/inference/request_scheduler.cpp",
+      "src/cpp/inference/prompt_processor.cpp",
+      "src/cpp/inference/session_store.cpp",
+      "src/cpp/inference/batch_job.cpp",
+      "src/cpp/inference/thermal_governor.cpp"
+    ],
+    "include_dirs": [
+      "<!@(node -p \"require('node-addon-api').include\")",
+      "src/cpp",
+      "third_party/llama.cpp/include",
+      "third_party/llama.cpp/src",
+      "third_party/llama.cpp/ggml/include",
+      "third_party/llama.cpp/ggml/src"
+    ],
+    "dependencies": [
+      "<!(node -p \"require('node-addon-api').gyp\")"
+    ],
+    "cflags!": [ "-fno-exceptions" ],
+    "cflags_cc!": [ "-fno-exceptions" ],
+    "cflags_cc": [ "-fvisibility=hidden", "-fPIC" ],
+    "defines": [ "NAPI_DISABLE_CPP_EXCEPTIONS" ],
+    "xcode_settings": {
+      "GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+      "CLANG_CXX_LIBRARY": "libc++",
+      "MACOSX_DEPLOYMENT_TARGET": "10.7"
+    },
+    "msvs_settings": {
+      "VCCLCompilerTool": {
+        "ExceptionHandling": 1
+      }
+    },
+    "libraries": [
+      "-L<(module_root_dir)/third_party/llama.cpp/build/bin",
+      "-lllama",
+      "-lggml",
+      "-lggml-base",
+      "-lggml-cpu"
+    ],
+    "library_dirs": [
+      "<(module_root_dir)/third_party/llama.cpp/build/bin"
+    ],
+    "link_settings": {
+      "libraries": [
+        "-lpthread",
+        "-lm"
+      ]
+    }
+  },
   "targets": [
     {
       "target_name": "llm_node",
+      "sources": [ "src/cpp/bindings/node_binding.cpp" ]
+    },
+    {
+      "target_name": "llm_node_test",
       "sources": [
         "src/cpp/bindings/node_binding.cpp",
-        "src/cpp/model/llm_model.cpp",
-        "src/cpp/inference/inference_engine.cpp",
-        "src/cpp/inference/prompt_processor.cpp"
-      ],
-      "include_dirs": [
-        "<!@(node -p \"require('node-addon-api').include\")",
-        "src/cpp",
-        "third_party/llama.cpp/include",
-        "third_party/llama.cpp/src",
-        "third_party/llama.cpp/ggml/include",
-        "third_party/llama.cpp/ggml/src"
+        "src/cpp/bindings/test_hooks.cpp"
       ],
-      "dependencies": [
-        "<!(node -p \"require('node-addon-api').gyp\")"
-      ],
-      "cflags!": [ "-fno-exceptions" ],
-      "cflags_cc!": [ "-fno-exceptions" ],
-      "cflags_cc": [ "-fvisibility=hidden", "-fPIC" ],
-      "defines": [ "NAPI_DISABLE_CPP_EXCEPTIONS" ],
-      "xcode_settings": {
-        "GCC_ENABLE_CPP_EXCEPTIONS": "YES",
-        "CLANG_CXX_LIBRARY": "libc++",
-        "MACOSX_DEPLOYMENT_TARGET": "10.7"
-      },
-      "msvs_settings": {
-        "VCCLCompilerTool": {
-          "ExceptionHandling": 1
-        }
-      },
-      "libraries": [
-        "-L<(module_root_dir)/third_party/llama.cpp/build/bin",
-        "-lllama",
-        "-lggml",
-        "-lggml-base",
-        "-lggml-cpu"
-      ],
-      "library_dirs": [
-        "<(module_root_dir)/third_party/llama.cpp/build/bin"
-      ],
-      "link_settings": {
-        "libraries": [
-          "-lpthread",
-          "-lm"
-        ]
-      }
+      "defines": [ "LLM_TEST_HOOKS" ]
     }
   ]
-} 
\ No newline at end of file
+}
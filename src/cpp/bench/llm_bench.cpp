@@ -0,0 +1,356 @@
+// llm_bench: prefill/decode throughput sweeps against a GGUF model.
+//
+//   llm_bench -m model.gguf [-p 64,256,512] [-n 64] [-b 512] [-ub 512]
+//             [-t 4] [-tb 4] [-c 2048] [-r 5] [-o csv|json]
+//
+// Every comma-separated list is swept as a cartesian product. Each combination
+// runs one untimed warmup plus `reps` timed runs with a cold KV cache.
+
+#include "model/llm_model.h"
+#include "common/json.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sys/resource.h>
+
+using namespace local_llm;
+
+namespace {
+
+struct BenchOptions {
+    std::string model_path;
+    std::vector<int> prompt_lengths = {64, 256, 512};
+    std::vector<int> batch_sizes = {512};
+    std::vector<int> ubatch_sizes = {512};
+    std::vector<int> threads = {4};
+    std::vector<int> threads_batch = {0};  // 0 = same as threads
+    std::vector<int> context_sizes = {2048};
+    int gen_tokens = 64;
+    int reps = 5;
+    std::string format = "csv";
+};
+
+struct BenchResult {
+    int prompt_tokens;
+    int gen_tokens;
+    int batch_size;
+    int ubatch_size;
+    int threads;
+    int threads_batch;
+    int context_size;
+    double prefill_tps;
+    double decode_tps;
+    double ttft_p50_ms;
+    double ttft_p99_ms;
+    double peak_rss_mb;
+};
+
+std::vector<int> parse_list(const std::string& arg) {
+    std::vector<int> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            values.push_back(std::atoi(item.c_str()));
+        }
+    }
+    return values;
+}
+
+void print_usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " -m MODEL [options]\n"
+              << "  -m,  --model PATH          GGUF model to benchmark\n"
+              << "  -p,  --prompt-lengths N,.. prompt lengths in tokens (default 64,256,512)\n"
+              << "  -n,  --gen-tokens N        tokens to generate per run (default 64)\n"
+              << "  -b,  --batch-sizes N,..    logical batch sizes (default 512)\n"
+              << "  -ub, --ubatch-sizes N,..   physical batch sizes (default 512)\n"
+              << "  -t,  --threads N,..        decode threads (default 4)\n"
+              << "  -tb, --threads-batch N,..  prefill threads, 0 = same as -t (default 0)\n"
+              << "  -c,  --context-sizes N,..  context sizes (default 2048)\n"
+              << "  -r,  --reps N              timed repetitions per combination (default 5)\n"
+              << "  -o,  --output csv|json     output format (default csv)\n";
+}
+
+bool parse_args(int argc, char** argv, BenchOptions& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "-m" || arg == "--model") {
+            opts.model_path = value;
+        } else if (arg == "-p" || arg == "--prompt-lengths") {
+            opts.prompt_lengths = parse_list(value);
+        } else if (arg == "-n" || arg == "--gen-tokens") {
+            opts.gen_tokens = std::atoi(value.c_str());
+        } else if (arg == "-b" || arg == "--batch-sizes") {
+            opts.batch_sizes = parse_list(value);
+        } else if (arg == "-ub" || arg == "--ubatch-sizes") {
+            opts.ubatch_sizes = parse_list(value);
+        } else if (arg == "-t" || arg == "--threads") {
+            opts.threads = parse_list(value);
+        } else if (arg == "-tb" || arg == "--threads-batch") {
+            opts.threads_batch = parse_list(value);
+        } else if (arg == "-c" || arg == "--context-sizes") {
+            opts.context_sizes = parse_list(value);
+        } else if (arg == "-r" || arg == "--reps") {
+            opts.reps = std::max(1, std::atoi(value.c_str()));
+        } else if (arg == "-o" || arg == "--output") {
+            opts.format = value;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+    return !opts.model_path.empty();
+}
+
+double percentile(std::vector<double> values, double pct) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(pct / 100.0 * (values.size() - 1) + 0.5);
+    return values[std::min(idx, values.size() - 1)];
+}
+
+// Restart the peak RSS at the current RSS, so each row reports its own peak
+// rather than the largest one of the whole sweep (Linux 4.0+)
+bool reset_peak_rss() {
+    std::ofstream f("/proc/self/clear_refs");
+    f << "5";
+    return (bool)f.flush();
+}
+
+// Peak RSS since the last reset_peak_rss(); the process-wide high-water mark
+// when /proc cannot tell
+double peak_rss_mb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::atof(line.c_str() + 6) / 1024.0;  // in kB
+        }
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+    return usage.ru_maxrss / 1024.0;  // ru_maxrss is in KB on Linux
+}
+
+// Synthetic prompt of exactly n tokens (BOS included when the vocab wants it)
+std::vector<llama_token> make_prompt(LLMModel& model, int n) {
+    std::string text;
+    std::vector<llama_token> tokens;
+    while ((int)tokens.size() < n) {
+        text += "The quick brown fox jumps over the lazy dog while the benchmark keeps running. ";
+        tokens = model.tokenize_prompt(text);
+    }
+    tokens.resize(n);
+    return tokens;
+}
+
+struct RunTiming {
+    double ttft_ms = 0.0;
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+    bool ok = false;
+};
+
+RunTiming run_once(LLMModel& model, const std::vector<llama_token>& prompt, int gen_tokens) {
+    using clock = std::chrono::high_resolution_clock;
+    RunTiming timing;
+    
+    model.reset_kv_cache();
+    if (!model.ensure_context()) {
+        return timing;
+    }
+    int slot = model.acquire_slot(prompt);
+    if (slot < 0) {
+        return timing;
+    }
+    model.begin_sequence(slot, prompt, gen_tokens, nullptr);
+    SequenceSlot& s = model.slot(slot);
+    
+    auto t_start = clock::now();
+    auto t_first = t_start;
+    bool have_first = false;
+    while (s.is_active()) {
+        if (!model.decode_step()) {
+            break;
+        }
+        if (!have_first && s.n_generated > 0) {
+            t_first = clock::now();
+            have_first = true;
+        }
+    }
+    auto t_end = clock::now();
+    
+    if (s.error.empty() && have_first) {
+        double prefill_s = std::chrono::duration<double>(t_first - t_start).count();
+        double decode_s = std::chrono::duration<double>(t_end - t_first).count();
+        timing.ttft_ms = prefill_s * 1000.0;
+        timing.prefill_tps = prefill_s > 0.0 ? prompt.size() / prefill_s : 0.0;
+        timing.decode_tps = decode_s > 0.0 && s.n_generated > 1 ? (s.n_generated - 1) / decode_s : 0.0;
+        timing.ok = true;
+    } else if (!s.error.empty()) {
+        std::cerr << "[llm_bench] Run failed: " << s.error << std::endl;
+    }
+    model.release_slot(slot);
+    return timing;
+}
+
+// RFC 4180 field: quoted, embedded quotes doubled
+std::string csv_quote(const std::string& text) {
+    std::string out = "\"";
+    for (char c : text) {
+        out += c;
+        if (c == '"') {
+            out += '"';
+        }
+    }
+    return out + "\"";
+}
+
+void print_csv(const BenchOptions& opts, const std::vector<BenchResult>& results) {
+    std::cout << "model,prompt_tokens,gen_tokens,batch_size,ubatch_size,threads,threads_batch,"
+                 "context_size,reps,prefill_tps,decode_tps,ttft_p50_ms,ttft_p99_ms,peak_rss_mb\n";
+    for (const auto& r : results) {
+        std::cout << csv_quote(opts.model_path) << "," << r.prompt_tokens << "," << r.gen_tokens << ","
+                  << r.batch_size << "," << r.ubatch_size << "," << r.threads << ","
+                  << r.threads_batch << "," << r.context_size << "," << opts.reps << ","
+                  << r.prefill_tps << "," << r.decode_tps << "," << r.ttft_p50_ms << ","
+                  << r.ttft_p99_ms << "," << r.peak_rss_mb << "\n";
+    }
+}
+
+void print_json(const BenchOptions& opts, const std::vector<BenchResult>& results) {
+    std::cout << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        std::cout << "  {\"model\":" << json_quote(opts.model_path)
+                  << ",\"prompt_tokens\":" << r.prompt_tokens
+                  << ",\"gen_tokens\":" << r.gen_tokens
+                  << ",\"batch_size\":" << r.batch_size
+                  << ",\"ubatch_size\":" << r.ubatch_size
+                  << ",\"threads\":" << r.threads
+                  << ",\"threads_batch\":" << r.threads_batch
+                  << ",\"context_size\":" << r.context_size
+                  << ",\"reps\":" << opts.reps
+                  << ",\"prefill_tps\":" << r.prefill_tps
+                  << ",\"decode_tps\":" << r.decode_tps
+                  << ",\"ttft_p50_ms\":" << r.ttft_p50_ms
+                  << ",\"ttft_p99_ms\":" << r.ttft_p99_ms
+                  << ",\"peak_rss_mb\":" << r.peak_rss_mb
+                  << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "]\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    BenchOptions opts;
+    if (!parse_args(argc, argv, opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    ModelConfig config;
+    config.model_path = opts.model_path;
+    config.parallel_sequences = 1;
+    
+    LLMModel model;
+    if (!model.initialize(config)) {
+        std::cerr << "[llm_bench] Failed to load model: " << opts.model_path << std::endl;
+        return 1;
+    }
+    
+    std::vector<BenchResult> results;
+    const bool per_row_rss = reset_peak_rss();
+    if (!per_row_rss) {
+        std::cerr << "[llm_bench] Cannot reset the peak RSS, rows report the process-wide peak" << std::endl;
+    }
+    for (int ctx_size : opts.context_sizes) {
+    for (int batch : opts.batch_sizes) {
+    for (int ubatch : opts.ubatch_sizes) {
+        if (ubatch > batch) continue;
+    for (int threads : opts.threads) {
+    for (int tb : opts.threads_batch) {
+        const int threads_batch = tb > 0 ? tb : threads;
+        
+        // Context-affecting settings trigger a rebuild in ensure_context()
+        model.set_context_size(ctx_size);
+        model.set_batch_size(batch);
+        model.set_ubatch_size(ubatch);
+        model.set_threads(threads);
+        model.set_threads_batch(threads_batch);
+        if (!model.ensure_context()) {
+            std::cerr << "[llm_bench] Failed to create context for n_ctx=" << ctx_size << std::endl;
+            continue;
+        }
+        
+        for (int n_prompt : opts.prompt_lengths) {
+            if (n_prompt + opts.gen_tokens > ctx_size) {
+                std::cerr << "[llm_bench] Skipping prompt " << n_prompt << ": exceeds context " << ctx_size << std::endl;
+                continue;
+            }
+            std::vector<llama_token> prompt = make_prompt(model, n_prompt);
+            if (per_row_rss) {
+                reset_peak_rss();
+            }
+            
+            // Warmup: page in weights and allocate compute buffers
+            run_once(model, prompt, std::min(opts.gen_tokens, 8));
+            
+            std::vector<double> ttfts, prefill, decode;
+            for (int rep = 0; rep < opts.reps; ++rep) {
+                RunTiming t = run_once(model, prompt, opts.gen_tokens);
+                if (!t.ok) continue;
+                ttfts.push_back(t.ttft_ms);
+                prefill.push_back(t.prefill_tps);
+                decode.push_back(t.decode_tps);
+            }
+            if (ttfts.empty()) continue;
+            
+            BenchResult r;
+            r.prompt_tokens = n_prompt;
+            r.gen_tokens = opts.gen_tokens;
+            r.batch_size = batch;
+            r.ubatch_size = ubatch;
+            r.threads = threads;
+            r.threads_batch = threads_batch;
+            r.context_size = ctx_size;
+            r.prefill_tps = percentile(prefill, 50);
+            r.decode_tps = percentile(decode, 50);
+            r.ttft_p50_ms = percentile(ttfts, 50);
+            r.ttft_p99_ms = percentile(ttfts, 99);
+            r.peak_rss_mb = peak_rss_mb();
+            results.push_back(r);
+            std::cerr << "[llm_bench] p=" << n_prompt << " b=" << batch << " ub=" << ubatch
+                      << " t=" << threads << "/" << threads_batch << " c=" << ctx_size
+                      << ": prefill " << r.prefill_tps << " tok/s, decode " << r.decode_tps
+                      << " tok/s, TTFT p50 " << r.ttft_p50_ms << " ms" << std::endl;
+        }
+    }
+    }
+    }
+    }
+    }
+    
+    if (opts.format == "json") {
+        print_json(opts, results);
+    } else {
+        print_csv(opts, results);
+    }
+    
+    LLMModel::cleanup_backend();
+    return 0;
+}
@@ -1,26 +1,232 @@
 #include <napi.h>
 #include "../inference/inference_engine.h"
+#include "../common/logging.h"
+#include "../common/cpu_affinity.h"
 #include <memory>
 #include <thread>
 #include <functional>
-#include <iostream> // Added for logging
-#include <cstddef>  // Added for std::flush
+#include <chrono>
+#include <string>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#ifdef LLM_TEST_HOOKS
+#include "test_hooks.h"
+#endif
+
+// Per-stream delivery state. Tokens are appended on the scheduler thread and
+// handed to JS in batches: one ThreadSafeFunction call per flush rather than
+// per token. A flush happens once flush_tokens pieces are pending or
+// flush_interval has passed since the last one (checked as tokens arrive), and
+// always before the final message. The scheduler thread is the only producer.
+//
+// Backpressure: at most kMaxInFlight calls wait on the JS side. While the
+// consumer is behind, text keeps coalescing here instead of blocking the
+// decode loop; once more than max_buffered_bytes pile up, the request is
+// cancelled and the stream ends with an error.
+class StreamDelivery {
+public:
+    StreamDelivery(Napi::ThreadSafeFunction tsfn, int flush_tokens, int flush_interval_ms,
+                   size_t max_buffered_bytes, local_llm::InferenceEngine* engine)
+        : tsfn_(std::move(tsfn)),
+          flush_tokens_(flush_tokens > 0 ? flush_tokens : 1),
+          flush_interval_(std::chrono::milliseconds(flush_interval_ms > 0 ? flush_interval_ms : 0)),
+          last_flush_(std::chrono::steady_clock::now()),
+          max_buffered_bytes_(max_buffered_bytes),
+          engine_(engine) {
+        pending_.reserve(256);
+    }
+    
+    // The request cancelled on overflow; known once the engine accepted it
+    void set_request_id(uint64_t request_id) { request_id_.store(request_id); }
+    
+    void on_text(const std::string& text) {
+        if (overflowed_) {
+            request_stop();
+            return;
+        }
+        pending_ += text;
+        pending_tokens_++;
+        
+        if (pending_.size() > max_buffered_bytes_ && in_flight_->load() >= kMaxInFlight) {
+            LLM_LOG_WARN("LLMNodeBinding", "Stream consumer fell behind by " << pending_.size()
+                                           << " bytes, cancelling request " << request_id_.load());
+            overflowed_ = true;
+            pending_.clear();
+            pending_tokens_ = 0;
+            request_stop();
+            return;
+        }
+        
+        if (pending_tokens_ >= flush_tokens_) {
+            flush();
+            return;
+        }
+        if (flush_interval_.count() > 0) {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_flush_ >= flush_interval_) {
+                flush();
+            }
+        }
+    }
+    
+    // Flush what is buffered, deliver the final message (if any) and release
+    void finish(const std::string& final_message) {
+        flush(true);
+        if (overflowed_) {
+            send("Error: Stream consumer too slow");
+        } else if (!final_message.empty()) {
+            send(final_message);
+        }
+        tsfn_.Release();
+    }
+    
+private:
+    static constexpr int kMaxInFlight = 64;
+    
+    // `force` sends even while the consumer is behind (the stream is ending)
+    void flush(bool force = false) {
+        if (pending_tokens_ == 0) {
+            return;
+        }
+        if (!force && in_flight_->load() >= kMaxInFlight) {
+            return;  // keep coalescing until JS catches up
+        }
+        std::string text;
+        text.reserve(pending_.capacity());
+        text.swap(pending_);
+        pending_tokens_ = 0;
+        last_flush_ = std::chrono::steady_clock::now();
+        send(std::move(text));
+    }
+    
+    void send(std::string text) {
+        auto text_ptr = std::make_shared<std::string>(std::move(text));
+        auto in_flight = in_flight_;
+        auto callback = [text_ptr, in_flight](Napi::Env env, Napi::Function js_callback) {
+            in_flight->fetch_sub(1);
+            try {
+                js_callback.Call({Napi::String::New(env, *text_ptr)});
+            } catch (const std::exception& e) {
+                LLM_LOG_ERROR("LLMNodeBinding", "Exception in callback: " << e.what());
+            }
+        };
+        
+        // The queue is unbounded (in_flight_ is the bound), so this never blocks
+        in_flight_->fetch_add(1);
+        napi_status status = tsfn_.NonBlockingCall(callback);
+        if (status != napi_ok) {
+            in_flight_->fetch_sub(1);
+            LLM_LOG_ERROR("LLMNodeBinding", "NonBlockingCall failed with status " << status);
+        }
+    }
+    
+    void request_stop() {
+        const uint64_t request_id = request_id_.load();
+        if (!stop_sent_ && request_id != 0) {
+            stop_sent_ = engine_->stop_generation(request_id);
+        }
+    }
+    
+    Napi::ThreadSafeFunction tsfn_;
+    std::string pending_;
+    int pending_tokens_ = 0;
+    const int flush_tokens_;
+    const std::chrono::steady_clock::duration flush_interval_;
+    std::chrono::steady_clock::time_point last_flush_;
+    
+    const size_t max_buffered_bytes_;
+    local_llm::InferenceEngine* engine_;
+    std::shared_ptr<std::atomic<int>> in_flight_ = std::make_shared<std::atomic<int>>(0);
+    std::atomic<uint64_t> request_id_{0};
+    bool overflowed_ = false;
+    bool stop_sent_ = false;
+};
+
+// Runs a blocking engine call on the libuv thread pool and settles a Promise
+// with the converted result, or rejects it when `error_of` reports a message.
+// The owning binding object is referenced until the worker completes, so the
+// engine cannot be torn down underneath it.
+template <typename Result>
+class EngineWorker : public Napi::AsyncWorker {
+public:
+    EngineWorker(Napi::Env env, Napi::Object owner,
+                 std::function<Result()> work,
+                 std::function<Napi::Value(Napi::Env, Result&)> convert,
+                 std::function<std::string(const Result&)> error_of = nullptr)
+        : Napi::AsyncWorker(env, "LLMEngineWorker"),
+          deferred_(Napi::Promise::Deferred::New(env)),
+          owner_(Napi::Persistent(owner)),
+          work_(std::move(work)),
+          convert_(std::move(convert)),
+          error_of_(std::move(error_of)) {}
+    
+    Napi::Promise GetPromise() { return deferred_.Promise(); }
+    
+    void Execute() override {
+        result_ = work_();
+    }
+    
+    void OnOK() override {
+        const std::string error = error_of_ ? error_of_(result_) : std::string();
+        if (!error.empty()) {
+            deferred_.Reject(Napi::Error::New(Env(), error).Value());
+            return;
+        }
+        deferred_.Resolve(convert_(Env(), result_));
+    }
+    
+    void OnError(const Napi::Error& error) override {
+        deferred_.Reject(error.Value());
+    }
+    
+private:
+    Napi::Promise::Deferred deferred_;
+    Napi::ObjectReference owner_;
+    std::function<Result()> work_;
+    std::function<Napi::Value(Napi::Env, Result&)> convert_;
+    std::function<std::string(const Result&)> error_of_;
+    Result result_{};
+};
 
 class LLMNodeBinding : public Napi::ObjectWrap<LLMNodeBinding> {
 private:
     std::unique_ptr<local_llm::InferenceEngine> engine_;
-    Napi::ThreadSafeFunction callback_tsfn_;
-    std::thread worker_thread_;
-    bool callback_tsfn_initialized_ = false;
+    std::string jobs_dir_ = "jobs";  // ModelConfig::jobs_dir of the last initialize
 
 public:
     static Napi::Object Init(Napi::Env env, Napi::Object exports) {
         Napi::Function func = DefineClass(env, "LLMNodeBinding", {
             InstanceMethod("initialize", &LLMNodeBinding::Initialize),
+            InstanceMethod("initializeAsync", &LLMNodeBinding::InitializeAsync),
             InstanceMethod("generate", &LLMNodeBinding::Generate),
+            InstanceMethod("generateAsync", &LLMNodeBinding::GenerateAsync),
             InstanceMethod("generateStream", &LLMNodeBinding::GenerateStream),
             InstanceMethod("isReady", &LLMNodeBinding::IsReady),
             InstanceMethod("getModelInfo", &LLMNodeBinding::GetModelInfo),
+            InstanceMethod("getModelInfoAsync", &LLMNodeBinding::GetModelInfoAsync),
+            InstanceMethod("preloadModel", &LLMNodeBinding::PreloadModel),
+            InstanceMethod("getLoadedModels", &LLMNodeBinding::GetLoadedModels),
+            InstanceMethod("tokenizeAsync", &LLMNodeBinding::TokenizeAsync),
+            InstanceMethod("tokenize", &LLMNodeBinding::Tokenize),
+            InstanceMethod("detokenize", &LLMNodeBinding::Detokenize),
+            InstanceMethod("countTokens", &LLMNodeBinding::CountTokens),
+            InstanceMethod("applyChatTemplate", &LLMNodeBinding::ApplyChatTemplate),
+            InstanceMethod("generateFromTokens", &LLMNodeBinding::GenerateFromTokens),
+            InstanceMethod("embed", &LLMNodeBinding::Embed),
+            InstanceMethod("generateBatch", &LLMNodeBinding::GenerateBatch),
+            InstanceMethod("saveSession", &LLMNodeBinding::SaveSession),
+            InstanceMethod("loadSession", &LLMNodeBinding::LoadSession),
+            InstanceMethod("deleteSession", &LLMNodeBinding::DeleteSession),
+            InstanceMethod("getMetrics", &LLMNodeBinding::GetMetrics),
+            InstanceMethod("getQueueStats", &LLMNodeBinding::GetQueueStats),
+            InstanceMethod("getWarmupStats", &LLMNodeBinding::GetWarmupStats),
+            InstanceMethod("getGovernorState", &LLMNodeBinding::GetGovernorState),
+            InstanceMethod("getPrometheusMetrics", &LLMNodeBinding::GetPrometheusMetrics),
+            InstanceMethod("loadLora", &LLMNodeBinding::LoadLora),
+            InstanceMethod("getLoraAdapters", &LLMNodeBinding::GetLoraAdapters),
             InstanceMethod("setTemperature", &LLMNodeBinding::SetTemperature),
             InstanceMethod("setTopP", &LLMNodeBinding::SetTopP),
             InstanceMethod("setTopK", &LLMNodeBinding::SetTopK),
@@ -32,6 +238,7 @@ public:
             InstanceMethod("setRepeatPenaltyLastN", &LLMNodeBinding::SetRepeatPenaltyLastN),
             InstanceMethod("setFrequencyPenalty", &LLMNodeBinding::SetFrequencyPenalty),
             InstanceMethod("setPresencePenalty", &LLMNodeBinding::SetPresencePenalty),
+            InstanceMethod("setMirostat", &LLMNodeBinding::SetMirostat),
             InstanceMethod("setMirostatTau", &LLMNodeBinding::SetMirostatTau),
             InstanceMethod("setMirostatEta", &LLMNodeBinding::SetMirostatEta),
             InstanceMethod("setMirostatM", &LLMNodeBinding::SetMirostatM),
@@ -46,46 +253,45 @@ public:
             InstanceMethod("setFlashAttn", &LLMNodeBinding::SetFlashAttn),
             InstanceMethod("setOffloadKqv", &LLMNodeBinding::SetOffloadKqv),
             InstanceMethod("setEmbeddings", &LLMNodeBinding::SetEmbeddings),
+            InstanceMethod("setThreads", &LLMNodeBinding::SetThreads),
             InstanceMethod("setThreadsBatch", &LLMNodeBinding::SetThreadsBatch),
             InstanceMethod("setUbatchSize", &LLMNodeBinding::SetUbatchSize),
             InstanceMethod("stopGeneration", &LLMNodeBinding::StopGeneration),
-            StaticMethod("getSystemInfo", &LLMNodeBinding::GetSystemInfo)
+            StaticMethod("getSystemInfo", &LLMNodeBinding::GetSystemInfo),
+            StaticMethod("setLogLevel", &LLMNodeBinding::SetLogLevel)
         });
 
         exports.Set("LLMNodeBinding", func);
+#ifdef LLM_TEST_HOOKS
+        exports.Set("testing", MakeTestHooks(env));
+#endif
         return exports;
     }
 
     LLMNodeBinding(const Napi::CallbackInfo& info) : Napi::ObjectWrap<LLMNodeBinding>(info) {
-        std::cerr << "[LLMNodeBinding] Constructor called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "Constructor called, this=" << this);
         engine_ = std::make_unique<local_llm::InferenceEngine>();
     }
 
     ~LLMNodeBinding() {
-        std::cerr << "[LLMNodeBinding] Destructor called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "Destructor called, this=" << this);
+        // Tearing down the engine completes (and releases) every outstanding stream
         engine_->stop_generation();
-        if (worker_thread_.joinable()) {
-            worker_thread_.join();
-        }
-        if (callback_tsfn_initialized_) {
-            callback_tsfn_.Release();
-            callback_tsfn_initialized_ = false;
-        }
+        engine_.reset();
     }
 
-    Napi::Value Initialize(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] Initialize called, this=" << this << std::endl << std::flush;
+    // Read the initialize() options object; throws a TypeError and returns
+    // false if it is missing
+    static bool ParseModelConfig(const Napi::CallbackInfo& info, local_llm::ModelConfig& config) {
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsObject()) {
             Napi::TypeError::New(env, "Expected object argument").ThrowAsJavaScriptException();
-            return env.Null();
+            return false;
         }
 
         Napi::Object config_obj = info[0].As<Napi::Object>();
         
-        local_llm::ModelConfig config;
-        
         if (config_obj.Has("modelPath")) {
             config.model_path = config_obj.Get("modelPath").As<Napi::String>().Utf8Value();
         }
@@ -102,10 +308,64 @@ public:
             config.threads = config_obj.Get("threads").As<Napi::Number>().Int32Value();
         }
         
+        // Prefill uses the decode thread count unless told otherwise
+        config.threads_batch = config.threads;
+        if (config_obj.Has("threadsBatch")) {
+            config.threads_batch = config_obj.Get("threadsBatch").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("ubatchSize")) {
+            config.ubatch_size = config_obj.Get("ubatchSize").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("cpuMask")) {
+            config.cpu_mask = config_obj.Get("cpuMask").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("cpuStrict")) {
+            config.cpu_strict = config_obj.Get("cpuStrict").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("threadpoolPoll")) {
+            config.threadpool_poll = config_obj.Get("threadpoolPoll").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("flashAttn")) {
+            config.flash_attn = config_obj.Get("flashAttn").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("offloadKqv")) {
+            config.offload_kqv = config_obj.Get("offloadKqv").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("defragThold")) {
+            config.defrag_thold = config_obj.Get("defragThold").As<Napi::Number>().FloatValue();
+        }
+        
+        if (config_obj.Has("ropeFreqBase")) {
+            config.rope_freq_base = config_obj.Get("ropeFreqBase").As<Napi::Number>().FloatValue();
+        }
+        
+        if (config_obj.Has("ropeFreqScale")) {
+            config.rope_freq_scale = config_obj.Get("ropeFreqScale").As<Napi::Number>().FloatValue();
+        }
+        
         if (config_obj.Has("gpuLayers")) {
             config.gpu_layers = config_obj.Get("gpuLayers").As<Napi::Number>().Int32Value();
         }
         
+        if (config_obj.Has("useMmap")) {
+            config.use_mmap = config_obj.Get("useMmap").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("useMlock")) {
+            config.use_mlock = config_obj.Get("useMlock").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("modelRamBudgetMb")) {
+            config.model_ram_budget_mb = config_obj.Get("modelRamBudgetMb").As<Napi::Number>().Int32Value();
+        }
+        
         if (config_obj.Has("temperature")) {
             config.temperature = config_obj.Get("temperature").As<Napi::Number>().FloatValue();
         }
@@ -122,16 +382,174 @@ public:
             config.repeat_penalty = config_obj.Get("repeatPenalty").As<Napi::Number>().FloatValue();
         }
         
+        if (config_obj.Has("parallelSequences")) {
+            config.parallel_sequences = config_obj.Get("parallelSequences").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("draftModelPath")) {
+            config.draft_model_path = config_obj.Get("draftModelPath").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("draftMax")) {
+            config.draft_max = config_obj.Get("draftMax").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("draftPMin")) {
+            config.draft_p_min = config_obj.Get("draftPMin").As<Napi::Number>().FloatValue();
+        }
+        
+        if (config_obj.Has("promptLookup")) {
+            config.prompt_lookup = config_obj.Get("promptLookup").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("lookupNgramMin")) {
+            config.lookup_ngram_min = config_obj.Get("lookupNgramMin").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("lookupNgramMax")) {
+            config.lookup_ngram_max = config_obj.Get("lookupNgramMax").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("maxQueueDepth")) {
+            config.max_queue_depth = config_obj.Get("maxQueueDepth").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("prefillChunk")) {
+            config.prefill_chunk = config_obj.Get("prefillChunk").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("overflowPolicy")) {
+            std::string policy = config_obj.Get("overflowPolicy").As<Napi::String>().Utf8Value();
+            if (!local_llm::parse_overflow_policy(policy, config.overflow_policy)) {
+                Napi::TypeError::New(env, "overflowPolicy must be one of error, truncate_head, "
+                                          "keep_system_prefix, sliding_window").ThrowAsJavaScriptException();
+                return false;
+            }
+        }
+        
+        if (config_obj.Has("cacheTypeK") || config_obj.Has("cacheTypeV")) {
+            const char* keys[] = {"cacheTypeK", "cacheTypeV"};
+            ggml_type* types[] = {&config.cache_type_k, &config.cache_type_v};
+            for (int i = 0; i < 2; ++i) {
+                if (!config_obj.Has(keys[i])) {
+                    continue;
+                }
+                std::string name = config_obj.Get(keys[i]).As<Napi::String>().Utf8Value();
+                if (!local_llm::parse_cache_type(name, *types[i])) {
+                    Napi::TypeError::New(env, std::string(keys[i]) + " must be one of f16, q8_0, q4_0")
+                        .ThrowAsJavaScriptException();
+                    return false;
+                }
+            }
+        }
+        
+        if (config_obj.Has("contextAuto")) {
+            config.context_auto = config_obj.Get("contextAuto").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("kvRamBudgetMb")) {
+            config.kv_ram_budget_mb = config_obj.Get("kvRamBudgetMb").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("overflowKeep")) {
+            config.overflow_keep = config_obj.Get("overflowKeep").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("thermalGovernor")) {
+            config.thermal_governor = config_obj.Get("thermalGovernor").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("thermalTargetC")) {
+            config.thermal_target_c = config_obj.Get("thermalTargetC").As<Napi::Number>().FloatValue();
+        }
+        
+        if (config_obj.Has("thermalIntervalMs")) {
+            config.thermal_interval_ms = config_obj.Get("thermalIntervalMs").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("warmup")) {
+            config.warmup = config_obj.Get("warmup").As<Napi::Boolean>().Value();
+        }
+        
+        if (config_obj.Has("warmupSystemPrompt")) {
+            config.warmup_system_prompt = config_obj.Get("warmupSystemPrompt").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("loraDir")) {
+            config.lora_dir = config_obj.Get("loraDir").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("loraCacheSize")) {
+            config.lora_cache_size = config_obj.Get("loraCacheSize").As<Napi::Number>().Int32Value();
+        }
+        
+        if (config_obj.Has("loraScale")) {
+            config.lora_scale = config_obj.Get("loraScale").As<Napi::Number>().FloatValue();
+        }
+        
+        if (config_obj.Has("sessionDir")) {
+            config.session_dir = config_obj.Get("sessionDir").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("jobsDir")) {
+            config.jobs_dir = config_obj.Get("jobsDir").As<Napi::String>().Utf8Value();
+        }
+        
+        if (config_obj.Has("sessionDiskBudgetMb")) {
+            config.session_disk_budget_mb = config_obj.Get("sessionDiskBudgetMb").As<Napi::Number>().Int32Value();
+        }
+        
         if (config_obj.Has("seed")) {
             config.seed = config_obj.Get("seed").As<Napi::Number>().Int32Value();
         }
+        return true;
+    }
+
+    Napi::Value Initialize(const Napi::CallbackInfo& info) {
+        LLM_LOG_DEBUG("LLMNodeBinding", "Initialize called, this=" << this);
+        Napi::Env env = info.Env();
+        
+        local_llm::ModelConfig config;
+        if (!ParseModelConfig(info, config)) {
+            return env.Null();
+        }
+        jobs_dir_ = config.jobs_dir;
 
         bool success = engine_->initialize(config);
+        if (success) {
+            // Keep the event loop off the cores ggml computes on
+            local_llm::pin_current_thread(engine_->host_cpus());
+        }
         return Napi::Boolean::New(env, success);
     }
 
+    Napi::Value InitializeAsync(const Napi::CallbackInfo& info) {
+        LLM_LOG_DEBUG("LLMNodeBinding", "InitializeAsync called, this=" << this);
+        Napi::Env env = info.Env();
+        
+        local_llm::ModelConfig config;
+        if (!ParseModelConfig(info, config)) {
+            return env.Null();
+        }
+        jobs_dir_ = config.jobs_dir;
+        
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<bool>(env, info.This().As<Napi::Object>(),
+            [engine, config]() { return engine->initialize(config); },
+            [engine](Napi::Env env, bool& success) -> Napi::Value {
+                // Runs on the JS thread: keep the event loop off the compute cores
+                if (success) {
+                    local_llm::pin_current_thread(engine->host_cpus());
+                }
+                return Napi::Boolean::New(env, success);
+            });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+
     Napi::Value Generate(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] Generate called, this=" << this << ", engine_=" << engine_.get() << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "Generate called, this=" << this << ", engine_=" << engine_.get());
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsString()) {
@@ -140,7 +558,7 @@ public:
         }
 
         std::string prompt = info[0].As<Napi::String>().Utf8Value();
-        std::cerr << "[LLMNodeBinding] Prompt received: '" << prompt << "'" << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "Prompt received: '" << prompt << "'");
         int max_tokens = 256;
         
         if (info.Length() > 1 && info[1].IsNumber()) {
@@ -151,96 +569,695 @@ public:
         return Napi::String::New(env, result);
     }
 
-    Napi::Value GenerateStream(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] GenerateStream called, this=" << this << std::endl << std::flush;
+    Napi::Value GenerateAsync(const Napi::CallbackInfo& info) {
+        LLM_LOG_DEBUG("LLMNodeBinding", "GenerateAsync called, this=" << this);
         Napi::Env env = info.Env();
         
-        if (info.Length() < 2 || !info[0].IsString() || !info[1].IsFunction()) {
-            Napi::TypeError::New(env, "Expected string and function arguments").ThrowAsJavaScriptException();
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected string argument").ThrowAsJavaScriptException();
             return env.Null();
         }
 
         std::string prompt = info[0].As<Napi::String>().Utf8Value();
-        Napi::Function callback = info[1].As<Napi::Function>();
         int max_tokens = 256;
         
-        if (info.Length() > 2 && info[2].IsNumber()) {
-            max_tokens = info[2].As<Napi::Number>().Int32Value();
+        if (info.Length() > 1 && info[1].IsNumber()) {
+            max_tokens = info[1].As<Napi::Number>().Int32Value();
         }
+        local_llm::RequestOptions options = ToRequestOptions(env, info.Length() > 2 ? info[2] : env.Undefined());
+        
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::string>(env, info.This().As<Napi::Object>(),
+            [engine, prompt, max_tokens, options]() { return engine->generate_text(prompt, max_tokens, options); },
+            [](Napi::Env env, std::string& result) -> Napi::Value { return Napi::String::New(env, result); });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
 
-        // Stop any previous generation first
-        engine_->stop_generation();
-        if (worker_thread_.joinable()) {
-            worker_thread_.join();
+    // Per-request options from { grammar, jsonSchema, priority, deadlineMs,
+    // stop }; the schema may be given as an object or as JSON text, priority
+    // is "interactive" (default) or "batch", and stop is a string or an array
+    // of strings (stop strings) and numbers (stop token ids)
+    static local_llm::RequestOptions ToRequestOptions(Napi::Env env, Napi::Value options_value) {
+        local_llm::RequestOptions request;
+        if (!options_value.IsObject()) {
+            return request;
+        }
+        Napi::Object options = options_value.As<Napi::Object>();
+        if (options.Has("grammar") && options.Get("grammar").IsString()) {
+            request.grammar = options.Get("grammar").As<Napi::String>().Utf8Value();
+        }
+        if (options.Has("jsonSchema")) {
+            Napi::Value schema = options.Get("jsonSchema");
+            if (schema.IsString()) {
+                request.json_schema = schema.As<Napi::String>().Utf8Value();
+            } else if (schema.IsObject()) {
+                Napi::Function stringify = env.Global().Get("JSON").As<Napi::Object>()
+                                              .Get("stringify").As<Napi::Function>();
+                request.json_schema = stringify.Call({schema}).As<Napi::String>().Utf8Value();
+            }
+        }
+        if (options.Has("priority") && options.Get("priority").IsString()) {
+            const std::string priority = options.Get("priority").As<Napi::String>().Utf8Value();
+            request.priority = priority == "batch" ? local_llm::RequestPriority::Batch
+                                                   : local_llm::RequestPriority::Interactive;
+        }
+        if (options.Has("deadlineMs") && options.Get("deadlineMs").IsNumber()) {
+            request.deadline_ms = options.Get("deadlineMs").As<Napi::Number>().Int32Value();
+        }
+        if (options.Has("stop")) {
+            Napi::Value stop = options.Get("stop");
+            if (stop.IsString()) {
+                request.stop.push_back(stop.As<Napi::String>().Utf8Value());
+            } else if (stop.IsArray()) {
+                Napi::Array list = stop.As<Napi::Array>();
+                for (uint32_t i = 0; i < list.Length(); ++i) {
+                    Napi::Value item = list.Get(i);
+                    if (item.IsString()) {
+                        request.stop.push_back(item.As<Napi::String>().Utf8Value());
+                    } else if (item.IsNumber()) {
+                        request.stop_tokens.push_back(item.As<Napi::Number>().Int32Value());
+                    }
+                }
+            }
         }
+        if (options.Has("lora") && options.Get("lora").IsString()) {
+            request.adapter = options.Get("lora").As<Napi::String>().Utf8Value();
+        }
+        return request;
+    }
 
-        // Release previous ThreadSafeFunction if it exists
-        if (callback_tsfn_initialized_) {
-            callback_tsfn_.Release();
-            callback_tsfn_initialized_ = false;
+    // Per-stream delivery from the optional { flushTokens, flushIntervalMs,
+    // maxBufferedBytes } argument. The default of one token per call keeps the
+    // unbatched behaviour.
+    std::shared_ptr<StreamDelivery> MakeDelivery(Napi::Env env, Napi::Function callback,
+                                                 Napi::Value options_value) {
+        int flush_tokens = 1;
+        int flush_interval_ms = 0;
+        size_t max_buffered_bytes = 1 << 20;
+        if (options_value.IsObject()) {
+            Napi::Object options = options_value.As<Napi::Object>();
+            if (options.Has("flushTokens") && options.Get("flushTokens").IsNumber()) {
+                flush_tokens = options.Get("flushTokens").As<Napi::Number>().Int32Value();
+            }
+            if (options.Has("flushIntervalMs") && options.Get("flushIntervalMs").IsNumber()) {
+                flush_interval_ms = options.Get("flushIntervalMs").As<Napi::Number>().Int32Value();
+                // A time bound alone should not be cut short by the token bound
+                if (!options.Has("flushTokens")) {
+                    flush_tokens = std::numeric_limits<int>::max();
+                }
+            }
+            if (options.Has("maxBufferedBytes") && options.Get("maxBufferedBytes").IsNumber()) {
+                max_buffered_bytes = (size_t)std::max<int64_t>(
+                    1, options.Get("maxBufferedBytes").As<Napi::Number>().Int64Value());
+            }
         }
 
-        // Create thread-safe function for callback with larger queue and better error handling
-        callback_tsfn_ = Napi::ThreadSafeFunction::New(
+        // Each stream gets its own thread-safe function so concurrent streams don't
+        // tear down each other's callbacks; it is released once the request completes
+        return std::make_shared<StreamDelivery>(Napi::ThreadSafeFunction::New(
             env,
             callback,
             "LLMStreamCallback",
-            2000,  // max_queue_size = 2000 (allow more queued callbacks)
+            0,  // unbounded queue; StreamDelivery bounds the calls in flight itself
             1
-        );
-        callback_tsfn_initialized_ = true;
-
-        // Start generation in worker thread
-        worker_thread_ = std::thread([this, prompt, max_tokens]() {
-            std::cerr << "[LLMNodeBinding] Starting generation thread for prompt: '" << prompt << "'" << std::endl;
-            engine_->generate_text_stream(prompt, [this](const std::string& text) {
-                std::cerr << "[LLMNodeBinding] Received text from engine: '" << text << "' (length: " << text.length() << ")" << std::endl;
-                auto callback = [text](Napi::Env env, Napi::Function js_callback) {
-                    try {
-                        // std::cerr << "[LLMNodeBinding] Executing JS callback with text: '" << text << "'" << std::endl;
-                        js_callback.Call({Napi::String::New(env, text)});
-                        // std::cerr << "[LLMNodeBinding] JS callback completed successfully" << std::endl;
-                    } catch (const std::exception& e) {
-                        std::cerr << "[LLMNodeBinding] Exception in callback: " << e.what() << std::endl;
-                    }
-                };
-                
-                // Try NonBlockingCall first, fall back to BlockingCall if queue is full
-                napi_status status = callback_tsfn_.NonBlockingCall(callback);
-                if (status != napi_ok) {
-                    std::cerr << "[LLMNodeBinding] NonBlockingCall failed with status " << status 
-                              << ", trying BlockingCall for text: '" << text << "'" << std::endl;
-                    
-                    // Fall back to blocking call if non-blocking fails
-                    status = callback_tsfn_.BlockingCall(callback);
-                    if (status != napi_ok) {
-                        std::cerr << "[LLMNodeBinding] BlockingCall also failed with status " << status << std::endl;
-                    }
-                } else {
-                    std::cerr << "[LLMNodeBinding] Successfully queued callback for text: '" << text << "'" << std::endl;
-                }
-            }, max_tokens);
-            std::cerr << "[LLMNodeBinding] Generation thread completed" << std::endl;
-        });
+        ), flush_tokens, flush_interval_ms, max_buffered_bytes, engine_.get());
+    }
 
-        return env.Undefined();
+    Napi::Value GenerateStream(const Napi::CallbackInfo& info) {
+        LLM_LOG_DEBUG("LLMNodeBinding", "GenerateStream called, this=" << this);
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 2 || !info[0].IsString() || !info[1].IsFunction()) {
+            Napi::TypeError::New(env, "Expected string and function arguments").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        std::string prompt = info[0].As<Napi::String>().Utf8Value();
+        int max_tokens = 256;
+        
+        if (info.Length() > 2 && info[2].IsNumber()) {
+            max_tokens = info[2].As<Napi::Number>().Int32Value();
+        }
+        
+        Napi::Value options = info.Length() > 3 ? info[3] : env.Undefined();
+        auto delivery = MakeDelivery(env, info[1].As<Napi::Function>(), options);
+
+        // The engine schedules the request and returns immediately
+        uint64_t request_id = engine_->generate_text_stream(prompt, [delivery](const std::string& text) {
+            LLM_LOG_DEBUG("LLMNodeBinding", "Received text from engine: '" << text << "' (length: " << text.length() << ")");
+            delivery->on_text(text);
+        }, max_tokens, [delivery](const std::string& final_message) {
+            LLM_LOG_DEBUG("LLMNodeBinding", "Stream completed");
+            delivery->finish(final_message);
+        }, ToRequestOptions(env, options));
+        delivery->set_request_id(request_id);
+
+        // Pass back to stopGeneration(id) to cancel just this stream
+        return Napi::Number::New(env, (double)request_id);
+    }
+
+    // generateStream() for a prompt tokenized up front: (Int32Array, callback, maxTokens, options)
+    Napi::Value GenerateFromTokens(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 2 || !IsInt32Array(info[0]) || !info[1].IsFunction()) {
+            Napi::TypeError::New(env, "Expected Int32Array and function arguments").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+
+        // The request outlives this call, so its one copy is made here
+        Napi::Int32Array array = info[0].As<Napi::Int32Array>();
+        std::vector<int32_t> tokens(array.Data(), array.Data() + array.ElementLength());
+        int max_tokens = 256;
+        
+        if (info.Length() > 2 && info[2].IsNumber()) {
+            max_tokens = info[2].As<Napi::Number>().Int32Value();
+        }
+        
+        Napi::Value options = info.Length() > 3 ? info[3] : env.Undefined();
+        auto delivery = MakeDelivery(env, info[1].As<Napi::Function>(), options);
+
+        uint64_t request_id = engine_->generate_tokens_stream(std::move(tokens), [delivery](const std::string& text) {
+            delivery->on_text(text);
+        }, max_tokens, [delivery](const std::string& final_message) {
+            delivery->finish(final_message);
+        }, ToRequestOptions(env, options));
+        delivery->set_request_id(request_id);
+        return Napi::Number::New(env, (double)request_id);
     }
 
     Napi::Value IsReady(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] IsReady called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "IsReady called, this=" << this);
         Napi::Env env = info.Env();
         return Napi::Boolean::New(env, engine_->is_ready());
     }
 
     Napi::Value GetModelInfo(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] GetModelInfo called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "GetModelInfo called, this=" << this);
         Napi::Env env = info.Env();
         std::string info_str = engine_->get_model_info();
         return Napi::String::New(env, info_str);
     }
 
+    Napi::Value PreloadModel(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected model path string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        std::string model_path = info[0].As<Napi::String>().Utf8Value();
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<bool>(env, info.This().As<Napi::Object>(),
+            [engine, model_path]() { return engine->preload_model(model_path); },
+            [](Napi::Env env, bool& success) -> Napi::Value { return Napi::Boolean::New(env, success); });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+
+    Napi::Value GetLoadedModels(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string models = engine_->get_loaded_models();
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, models)});
+    }
+
+    Napi::Value GetModelInfoAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::string>(env, info.This().As<Napi::Object>(),
+            [engine]() { return engine->get_model_info(); },
+            [](Napi::Env env, std::string& result) -> Napi::Value { return Napi::String::New(env, result); });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+
+    static bool IsInt32Array(const Napi::Value& value) {
+        return value.IsTypedArray() &&
+               value.As<Napi::TypedArray>().TypedArrayType() == napi_int32_array;
+    }
+    
+    // Hand a token vector to JS without copying: the Int32Array views the
+    // vector's storage, which is freed when the array is collected
+    static Napi::Int32Array ToInt32Array(Napi::Env env, std::vector<int32_t>&& tokens) {
+        if (tokens.empty()) {
+            return Napi::Int32Array::New(env, 0);
+        }
+        auto* storage = new std::vector<int32_t>(std::move(tokens));
+        Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(
+            env, storage->data(), storage->size() * sizeof(int32_t),
+            [](Napi::Env, void*, std::vector<int32_t>* owned) { delete owned; }, storage);
+        return Napi::Int32Array::New(env, storage->size(), buffer, 0);
+    }
+    
+    Napi::Value Tokenize(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected string argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        return ToInt32Array(env, engine_->tokenize(info[0].As<Napi::String>().Utf8Value()));
+    }
+    
+    Napi::Value Detokenize(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !IsInt32Array(info[0])) {
+            Napi::TypeError::New(env, "Expected Int32Array argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        // Read straight from the caller's buffer
+        Napi::Int32Array array = info[0].As<Napi::Int32Array>();
+        std::string text;
+        if (!engine_->detokenize(array.Data(), array.ElementLength(), text)) {
+            Napi::Error::New(env, engine_->is_ready() ? "Token id out of range" : "Model not loaded")
+                .ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        return Napi::String::New(env, text);
+    }
+    
+    // applyChatTemplate([{ role, content }], { conversationId, addGenerationPrompt = true })
+    // -> Int32Array of prompt tokens for generateFromTokens(). Passing the same
+    // conversationId with a growing message list only tokenizes the new turns.
+    Napi::Value ApplyChatTemplate(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsArray()) {
+            Napi::TypeError::New(env, "Expected array of messages").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        Napi::Array array = info[0].As<Napi::Array>();
+        std::vector<local_llm::ChatMessage> messages;
+        messages.reserve(array.Length());
+        for (uint32_t i = 0; i < array.Length(); ++i) {
+            Napi::Value item = array.Get(i);
+            if (!item.IsObject()) {
+                Napi::TypeError::New(env, "Messages must be { role, content } objects").ThrowAsJavaScriptException();
+                return env.Null();
+            }
+            Napi::Object message = item.As<Napi::Object>();
+            if (!message.Get("role").IsString() || !message.Get("content").IsString()) {
+                Napi::TypeError::New(env, "Messages must be { role, content } objects").ThrowAsJavaScriptException();
+                return env.Null();
+            }
+            messages.push_back({message.Get("role").As<Napi::String>().Utf8Value(),
+                                message.Get("content").As<Napi::String>().Utf8Value()});
+        }
+        
+        std::string conversation_id;
+        bool add_generation_prompt = true;
+        if (info.Length() > 1 && info[1].IsObject()) {
+            Napi::Object options = info[1].As<Napi::Object>();
+            if (options.Has("conversationId") && options.Get("conversationId").IsString()) {
+                conversation_id = options.Get("conversationId").As<Napi::String>().Utf8Value();
+            }
+            if (options.Has("addGenerationPrompt") && options.Get("addGenerationPrompt").IsBoolean()) {
+                add_generation_prompt = options.Get("addGenerationPrompt").As<Napi::Boolean>().Value();
+            }
+        }
+        
+        std::vector<int32_t> tokens;
+        std::string error;
+        if (!engine_->apply_chat_template(conversation_id, messages, add_generation_prompt, tokens, error)) {
+            Napi::Error::New(env, error).ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        return ToInt32Array(env, std::move(tokens));
+    }
+    
+    struct EmbedResult {
+        std::vector<float> data;
+        int n_embd = 0;
+        std::string error;
+    };
+    
+    // embed(texts, { normalize = true }) -> Promise<Float32Array> holding one
+    // row of n_embd floats per text (n_embd = length / texts.length)
+    Napi::Value Embed(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsArray()) {
+            Napi::TypeError::New(env, "Expected array of strings").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        Napi::Array array = info[0].As<Napi::Array>();
+        std::vector<std::string> texts;
+        texts.reserve(array.Length());
+        for (uint32_t i = 0; i < array.Length(); ++i) {
+            Napi::Value item = array.Get(i);
+            if (!item.IsString()) {
+                Napi::TypeError::New(env, "Expected array of strings").ThrowAsJavaScriptException();
+                return env.Null();
+            }
+            texts.push_back(item.As<Napi::String>().Utf8Value());
+        }
+        
+        bool normalize = true;
+        if (info.Length() > 1 && info[1].IsObject()) {
+            Napi::Object options = info[1].As<Napi::Object>();
+            if (options.Has("normalize")) {
+                normalize = options.Get("normalize").As<Napi::Boolean>().Value();
+            }
+        }
+        
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<EmbedResult>(env, info.This().As<Napi::Object>(),
+            [engine, texts, normalize]() {
+                EmbedResult result;
+                if (!engine->embed(texts, normalize, result.data, result.n_embd, result.error) &&
+                    result.error.empty()) {
+                    result.error = "Embedding failed";
+                }
+                return result;
+            },
+            [](Napi::Env env, EmbedResult& result) -> Napi::Value {
+                if (result.data.empty()) {
+                    return Napi::Float32Array::New(env, 0);
+                }
+                // The Float32Array views the engine's buffer; freed with the array
+                auto* storage = new std::vector<float>(std::move(result.data));
+                Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(
+                    env, storage->data(), storage->size() * sizeof(float),
+                    [](Napi::Env, void*, std::vector<float>* owned) { delete owned; }, storage);
+                return Napi::Float32Array::New(env, storage->size(), buffer, 0);
+            },
+            [](const EmbedResult& result) { return result.error; });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+    
+    struct BatchRun {
+        local_llm::BatchSummary summary;
+        std::vector<std::string> lines;  // result JSON by input index, when not written to a file
+        std::string error;
+    };
+    
+    // generateBatch(input, { maxTokens = 256, outputPath, grammar, jsonSchema })
+    // -> Promise. `input` is an array of prompts (strings or { id, prompt,
+    // maxTokens }) or the name of a JSONL file of the same in jobsDir. With
+    // outputPath (also a name in jobsDir) each result is appended there as a
+    // JSONL line the moment it finishes and the promise resolves to the
+    // summary; otherwise the summary carries `results` in input order.
+    Napi::Value GenerateBatch(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        std::vector<local_llm::BatchItem> items;
+        std::string input_path;
+        if (info.Length() > 0 && info[0].IsString()) {
+            const std::string name = info[0].As<Napi::String>().Utf8Value();
+            if (!local_llm::valid_job_name(name)) {
+                Napi::TypeError::New(env, "Invalid batch file name: " + name).ThrowAsJavaScriptException();
+                return env.Null();
+            }
+            input_path = jobs_dir_ + "/" + name;
+        } else if (info.Length() > 0 && info[0].IsArray()) {
+            Napi::Array array = info[0].As<Napi::Array>();
+            items.reserve(array.Length());
+            for (uint32_t i = 0; i < array.Length(); ++i) {
+                Napi::Value value = array.Get(i);
+                local_llm::BatchItem item;
+                if (value.IsString()) {
+                    item.prompt = value.As<Napi::String>().Utf8Value();
+                } else if (value.IsObject() && value.As<Napi::Object>().Get("prompt").IsString()) {
+                    Napi::Object object = value.As<Napi::Object>();
+                    item.prompt = object.Get("prompt").As<Napi::String>().Utf8Value();
+                    if (object.Has("id") && !object.Get("id").IsUndefined()) {
+                        item.id = object.Get("id").ToString().Utf8Value();
+                    }
+                    if (object.Has("maxTokens") && object.Get("maxTokens").IsNumber()) {
+                        item.max_tokens = object.Get("maxTokens").As<Napi::Number>().Int32Value();
+                    }
+                } else {
+                    Napi::TypeError::New(env, "Batch items must be strings or { prompt } objects")
+                        .ThrowAsJavaScriptException();
+                    return env.Null();
+                }
+                items.push_back(std::move(item));
+            }
+        } else {
+            Napi::TypeError::New(env, "Expected array of prompts or JSONL path").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        int max_tokens = 256;
+        std::string output_path;
+        local_llm::RequestOptions options;
+        if (info.Length() > 1 && info[1].IsObject()) {
+            Napi::Object opts = info[1].As<Napi::Object>();
+            if (opts.Has("maxTokens") && opts.Get("maxTokens").IsNumber()) {
+                max_tokens = opts.Get("maxTokens").As<Napi::Number>().Int32Value();
+            }
+            if (opts.Has("outputPath") && opts.Get("outputPath").IsString()) {
+                const std::string name = opts.Get("outputPath").As<Napi::String>().Utf8Value();
+                if (!local_llm::valid_job_name(name)) {
+                    Napi::TypeError::New(env, "Invalid batch output name: " + name).ThrowAsJavaScriptException();
+                    return env.Null();
+                }
+                output_path = jobs_dir_ + "/" + name;
+            }
+            options = ToRequestOptions(env, opts);
+        }
+        
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<BatchRun>(env, info.This().As<Napi::Object>(),
+            [engine, items, input_path, output_path, max_tokens, options]() mutable {
+                BatchRun run;
+                if (!input_path.empty() && !local_llm::read_batch_jsonl(input_path, items, run.error)) {
+                    return run;
+                }
+                std::ofstream out;
+                if (!output_path.empty()) {
+                    out.open(output_path, std::ios::out | std::ios::trunc);
+                    if (!out) {
+                        run.error = "Cannot open batch output: " + output_path;
+                        return run;
+                    }
+                } else {
+                    run.lines.resize(items.size());
+                }
+                auto on_result = [&run, &out, &output_path](const local_llm::BatchItemResult& result) {
+                    if (output_path.empty()) {
+                        run.lines[result.index] = local_llm::batch_result_json(result);
+                    } else {
+                        out << local_llm::batch_result_json(result) << '\n';
+                        out.flush();
+                    }
+                };
+                if (!engine->generate_batch(items, max_tokens, on_result, run.summary, run.error, options) &&
+                    run.error.empty()) {
+                    run.error = "Batch failed";
+                }
+                return run;
+            },
+            [output_path](Napi::Env env, BatchRun& run) -> Napi::Value {
+                std::string json = local_llm::batch_summary_json(run.summary);
+                if (output_path.empty()) {
+                    std::string results = ",\"results\":[";
+                    for (size_t i = 0; i < run.lines.size(); ++i) {
+                        results += (i > 0 ? "," : "") + run.lines[i];
+                    }
+                    json.insert(json.size() - 1, results + "]");
+                }
+                Napi::Object json_object = env.Global().Get("JSON").As<Napi::Object>();
+                Napi::Function parse = json_object.Get("parse").As<Napi::Function>();
+                return parse.Call(json_object, {Napi::String::New(env, json)});
+            },
+            [](const BatchRun& run) { return run.error; });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+    
+    Napi::Value CountTokens(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected string argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        return Napi::Number::New(env, engine_->count_tokens(info[0].As<Napi::String>().Utf8Value()));
+    }
+    
+    Napi::Value TokenizeAsync(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected string argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        std::string text = info[0].As<Napi::String>().Utf8Value();
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::vector<int32_t>>(env, info.This().As<Napi::Object>(),
+            [engine, text]() { return engine->tokenize(text); },
+            [](Napi::Env env, std::vector<int32_t>& tokens) -> Napi::Value {
+                return ToInt32Array(env, std::move(tokens));
+            });
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+
+    // Resolves to {success, error} rather than rejecting: a missing session is
+    // an expected outcome (the caller just prefills as usual)
+    static Napi::Value SessionResult(Napi::Env env, std::string& error) {
+        Napi::Object result = Napi::Object::New(env);
+        result.Set("success", Napi::Boolean::New(env, error.empty()));
+        if (!error.empty()) {
+            result.Set("error", Napi::String::New(env, error));
+        }
+        return result;
+    }
+    
+    Napi::Value SaveSession(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected session id string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        std::string session_id = info[0].As<Napi::String>().Utf8Value();
+        uint64_t request_id = 0;
+        if (info.Length() > 1 && info[1].IsNumber()) {
+            request_id = (uint64_t)info[1].As<Napi::Number>().Int64Value();
+        }
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::string>(env, info.This().As<Napi::Object>(),
+            [engine, session_id, request_id]() {
+                std::string error;
+                if (!engine->save_session(session_id, request_id, error) && error.empty()) {
+                    error = "Failed to save session";
+                }
+                return error;
+            },
+            SessionResult);
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+    
+    Napi::Value LoadSession(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected session id string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        std::string session_id = info[0].As<Napi::String>().Utf8Value();
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::string>(env, info.This().As<Napi::Object>(),
+            [engine, session_id]() {
+                std::string error;
+                if (!engine->load_session(session_id, error) && error.empty()) {
+                    error = "Failed to load session";
+                }
+                return error;
+            },
+            SessionResult);
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+    
+    Napi::Value DeleteSession(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected session id string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        return Napi::Boolean::New(env, engine_->delete_session(info[0].As<Napi::String>().Utf8Value()));
+    }
+    
+    Napi::Value GetMetrics(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string metrics = engine_->get_metrics();
+        
+        // Hand JS a plain object rather than a JSON string
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, metrics)});
+    }
+    
+    Napi::Value GetQueueStats(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string stats = engine_->get_queue_stats();
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, stats)});
+    }
+
+    Napi::Value GetWarmupStats(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string stats = engine_->get_warmup_stats();
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, stats)});
+    }
+
+    Napi::Value GetGovernorState(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string state = engine_->get_governor_state();
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, state)});
+    }
+    
+    Napi::Value LoadLora(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Expected adapter name string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        std::string name = info[0].As<Napi::String>().Utf8Value();
+        local_llm::InferenceEngine* engine = engine_.get();
+        auto* worker = new EngineWorker<std::string>(env, info.This().As<Napi::Object>(),
+            [engine, name]() {
+                std::string error;
+                if (!engine->load_lora(name, error) && error.empty()) {
+                    error = "Failed to load LoRA adapter";
+                }
+                return error;
+            },
+            SessionResult);
+        Napi::Promise promise = worker->GetPromise();
+        worker->Queue();
+        return promise;
+    }
+    
+    Napi::Value GetLoraAdapters(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        std::string adapters = engine_->get_lora_adapters();
+        Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+        Napi::Function parse = json.Get("parse").As<Napi::Function>();
+        return parse.Call(json, {Napi::String::New(env, adapters)});
+    }
+    
+    Napi::Value GetPrometheusMetrics(const Napi::CallbackInfo& info) {
+        return Napi::String::New(info.Env(), engine_->get_prometheus_metrics());
+    }
+
     Napi::Value SetTemperature(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] SetTemperature called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "SetTemperature called, this=" << this);
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -254,7 +1271,7 @@ public:
     }
 
     Napi::Value SetTopP(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] SetTopP called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "SetTopP called, this=" << this);
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -268,7 +1285,7 @@ public:
     }
 
     Napi::Value SetTopK(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] SetTopK called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "SetTopK called, this=" << this);
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -282,7 +1299,7 @@ public:
     }
 
     Napi::Value SetRepeatPenalty(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] SetRepeatPenalty called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "SetRepeatPenalty called, this=" << this);
         Napi::Env env = info.Env();
         
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -372,6 +1389,17 @@ public:
         return env.Undefined();
     }
 
+    Napi::Value SetMirostat(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1 || !info[0].IsNumber()) {
+            Napi::TypeError::New(env, "Expected number argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        int mode = info[0].As<Napi::Number>().Int32Value();
+        engine_->set_mirostat(mode);
+        return env.Undefined();
+    }
+
     Napi::Value SetMirostatTau(const Napi::CallbackInfo& info) {
         Napi::Env env = info.Env();
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -526,6 +1554,17 @@ public:
         return env.Undefined();
     }
 
+    Napi::Value SetThreads(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        if (info.Length() < 1 || !info[0].IsNumber()) {
+            Napi::TypeError::New(env, "Expected number argument").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        int threads = info[0].As<Napi::Number>().Int32Value();
+        engine_->set_threads(threads);
+        return env.Undefined();
+    }
+
     Napi::Value SetThreadsBatch(const Napi::CallbackInfo& info) {
         Napi::Env env = info.Env();
         if (info.Length() < 1 || !info[0].IsNumber()) {
@@ -549,8 +1588,14 @@ public:
     }
 
     Napi::Value StopGeneration(const Napi::CallbackInfo& info) {
-        std::cerr << "[LLMNodeBinding] StopGeneration called, this=" << this << std::endl << std::flush;
+        LLM_LOG_DEBUG("LLMNodeBinding", "StopGeneration called, this=" << this);
         Napi::Env env = info.Env();
+        
+        // stopGeneration(id) cancels one stream, stopGeneration() cancels all of them
+        if (info.Length() > 0 && info[0].IsNumber()) {
+            uint64_t request_id = (uint64_t)info[0].As<Napi::Number>().Int64Value();
+            return Napi::Boolean::New(env, engine_->stop_generation(request_id));
+        }
         engine_->stop_generation();
         return env.Undefined();
     }
@@ -560,6 +1605,23 @@ public:
         std::string info_str = local_llm::InferenceEngine::get_system_info();
         return Napi::String::New(env, info_str);
     }
+
+    static Napi::Value SetLogLevel(const Napi::CallbackInfo& info) {
+        Napi::Env env = info.Env();
+        
+        if (info.Length() < 1 || !info[0].IsString()) {
+            Napi::TypeError::New(env, "Log level must be a string").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        
+        local_llm::LogLevel level;
+        if (!local_llm::parse_log_level(info[0].As<Napi::String>().Utf8Value(), level)) {
+            Napi::TypeError::New(env, "Log level must be one of debug, info, warn, error, none").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        local_llm::set_log_level(level);
+        return env.Undefined();
+    }
 };
 
 Napi::Object Init(Napi::Env env, Napi::Object exports) {
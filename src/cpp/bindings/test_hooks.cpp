@@ -0,0 +1,290 @@
+#include "test_hooks.h"
+#include "../common/cpu_affinity.h"
+#include "../common/metrics.h"
+#include "../model/grammar.h"
+#include "../model/speculative.h"
+#include "../model/stop_sequences.h"
+#include "../model/token_pieces.h"
+#include "../inference/batch_job.h"
+#include "../inference/thermal_governor.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<std::string> ToStrings(const Napi::Array& array) {
+    std::vector<std::string> out;
+    for (uint32_t i = 0; i < array.Length(); ++i) {
+        out.push_back(array.Get(i).As<Napi::String>().Utf8Value());
+    }
+    return out;
+}
+
+double NumberOr(const Napi::Object& obj, const char* key, double fallback) {
+    return obj.Has(key) && obj.Get(key).IsNumber() ? obj.Get(key).As<Napi::Number>().DoubleValue() : fallback;
+}
+
+bool BoolOr(const Napi::Object& obj, const char* key, bool fallback) {
+    return obj.Has(key) && obj.Get(key).IsBoolean() ? obj.Get(key).As<Napi::Boolean>().Value() : fallback;
+}
+
+Napi::Value ParseJson(Napi::Env env, const std::string& text) {
+    Napi::Object json = env.Global().Get("JSON").As<Napi::Object>();
+    return json.Get("parse").As<Napi::Function>().Call(json, {Napi::String::New(env, text)});
+}
+
+// stopStream(stops, chunks) -> { streamed: [text released per chunk], output, stopped }
+// Feeds the chunks through the StopMatcher calls LLMModel::emit_token makes
+Napi::Value StopStream(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 2 || !info[0].IsArray() || !info[1].IsArray()) {
+        Napi::TypeError::New(env, "Expected (stops[], chunks[])").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    local_llm::StopMatcher stop;
+    stop.reset(ToStrings(info[0].As<Napi::Array>()));
+    const std::vector<std::string> chunks = ToStrings(info[1].As<Napi::Array>());
+
+    Napi::Array streamed = Napi::Array::New(env);
+    std::string output;
+    size_t n_streamed = 0;
+    bool stopped = false;
+    for (const auto& chunk : chunks) {
+        const size_t n_before = output.size();
+        output += chunk;
+        if (stop.truncate(output, n_before, n_streamed)) {
+            stopped = true;
+            streamed.Set(streamed.Length(), Napi::String::New(env, ""));
+            break;
+        }
+        const size_t n_complete = stop.streamable_length(output, n_streamed);
+        streamed.Set(streamed.Length(), Napi::String::New(env, output.substr(n_streamed, n_complete - n_streamed)));
+        n_streamed = n_complete;
+    }
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("streamed", streamed);
+    result.Set("output", Napi::String::New(env, output));
+    result.Set("stopped", Napi::Boolean::New(env, stopped));
+    return result;
+}
+
+// utf8CompleteLength(buffer, from = 0) -> bytes that end on a character boundary
+Napi::Value Utf8CompleteLength(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsBuffer()) {
+        Napi::TypeError::New(env, "Expected a Buffer").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    Napi::Buffer<char> buffer = info[0].As<Napi::Buffer<char>>();
+    const std::string bytes(buffer.Data(), buffer.Length());
+    const size_t from = info.Length() > 1 && info[1].IsNumber() ? info[1].As<Napi::Number>().Uint32Value() : 0;
+    return Napi::Number::New(env, (double)local_llm::utf8_complete_length(bytes, from));
+}
+
+// jsonSchemaToGbnf(schema) -> { ok, gbnf, error }
+Napi::Value JsonSchemaToGbnf(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected schema string").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    std::string gbnf;
+    std::string error;
+    const bool ok = local_llm::json_schema_to_gbnf(info[0].As<Napi::String>().Utf8Value(), gbnf, error);
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("ok", Napi::Boolean::New(env, ok));
+    result.Set("gbnf", Napi::String::New(env, gbnf));
+    result.Set("error", Napi::String::New(env, error));
+    return result;
+}
+
+// parseCpuList(spec) -> [cpu, ...], or null if malformed
+Napi::Value ParseCpuList(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected CPU list string").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    std::vector<int> cpus;
+    if (!local_llm::parse_cpu_list(info[0].As<Napi::String>().Utf8Value(), cpus)) {
+        return env.Null();
+    }
+    Napi::Array result = Napi::Array::New(env, cpus.size());
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        result.Set((uint32_t)i, Napi::Number::New(env, cpus[i]));
+    }
+    return result;
+}
+
+// readBatchJsonl(path) -> { ok, items: [{ id, prompt, maxTokens }], error }
+Napi::Value ReadBatchJsonl(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected path string").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    std::vector<local_llm::BatchItem> items;
+    std::string error;
+    const bool ok = local_llm::read_batch_jsonl(info[0].As<Napi::String>().Utf8Value(), items, error);
+    Napi::Array list = Napi::Array::New(env, items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        Napi::Object item = Napi::Object::New(env);
+        item.Set("id", Napi::String::New(env, items[i].id));
+        item.Set("prompt", Napi::String::New(env, items[i].prompt));
+        item.Set("maxTokens", Napi::Number::New(env, items[i].max_tokens));
+        list.Set((uint32_t)i, item);
+    }
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("ok", Napi::Boolean::New(env, ok));
+    result.Set("items", list);
+    result.Set("error", Napi::String::New(env, error));
+    return result;
+}
+
+// governorSteps({ threads, threadsBatch, prefillChunk, targetC, hysteresisC }, readings)
+// -> the governor state after each reading, plus whether the level changed.
+// A reading is { temperatureC, tripC, throttled, freqCapped, curFreqKhz,
+// maxFreqKhz, limitFreqKhz, busy }; freqCapped stands in for firmware flags.
+Napi::Value GovernorSteps(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 2 || !info[0].IsObject() || !info[1].IsArray()) {
+        Napi::TypeError::New(env, "Expected (options, readings[])").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    Napi::Object options = info[0].As<Napi::Object>();
+    local_llm::GovernorLimits full_speed;
+    full_speed.threads = (int)NumberOr(options, "threads", 4);
+    full_speed.threads_batch = (int)NumberOr(options, "threadsBatch", full_speed.threads);
+    full_speed.prefill_chunk = (int)NumberOr(options, "prefillChunk", 512);
+    local_llm::GovernorSettings settings;
+    settings.target_c = NumberOr(options, "targetC", settings.target_c);
+    settings.hysteresis_c = NumberOr(options, "hysteresisC", settings.hysteresis_c);
+
+    local_llm::ThermalGovernor governor(settings, full_speed, nullptr);
+    Napi::Array readings = info[1].As<Napi::Array>();
+    Napi::Array steps = Napi::Array::New(env, readings.Length());
+    for (uint32_t i = 0; i < readings.Length(); ++i) {
+        Napi::Object r = readings.Get(i).As<Napi::Object>();
+        local_llm::ThermalReading reading;
+        reading.has_temperature = r.Has("temperatureC");
+        reading.temperature_c = NumberOr(r, "temperatureC", 0.0);
+        reading.trip_c = NumberOr(r, "tripC", 0.0);
+        reading.throttled = BoolOr(r, "throttled", false);
+        reading.cur_freq_khz = (uint64_t)NumberOr(r, "curFreqKhz", 0.0);
+        reading.max_freq_khz = (uint64_t)NumberOr(r, "maxFreqKhz", 0.0);
+        reading.limit_freq_khz = (uint64_t)NumberOr(r, "limitFreqKhz", 0.0);
+        reading.has_firmware_flags = r.Has("freqCapped");
+        reading.freq_capped = BoolOr(r, "freqCapped", false);
+        const bool changed = governor.update(reading, BoolOr(r, "busy", false));
+        Napi::Object step = ParseJson(env, governor.state_json()).As<Napi::Object>();
+        step.Set("changed", Napi::Boolean::New(env, changed));
+        steps.Set(i, step);
+    }
+    return steps;
+}
+
+// ngramDraft(histories, { nMax, ngramMin, ngramMax }) -> the draft proposed
+// for each history (resident tokens plus the pending one), fed in order to one
+// source as successive steps of sequence 0
+Napi::Value NgramDraft(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsArray()) {
+        Napi::TypeError::New(env, "Expected (histories[], options)").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    Napi::Object options = info.Length() > 1 && info[1].IsObject() ? info[1].As<Napi::Object>()
+                                                                    : Napi::Object::New(env);
+    local_llm::NgramDraftSource source(1, (int)NumberOr(options, "ngramMin", 2), (int)NumberOr(options, "ngramMax", 4));
+    const int n_max = (int)NumberOr(options, "nMax", 8);
+
+    Napi::Array histories = info[0].As<Napi::Array>();
+    Napi::Array drafts = Napi::Array::New(env, histories.Length());
+    for (uint32_t i = 0; i < histories.Length(); ++i) {
+        Napi::Array history = histories.Get(i).As<Napi::Array>();
+        if (history.Length() == 0) {
+            Napi::TypeError::New(env, "A history needs at least the pending token").ThrowAsJavaScriptException();
+            return env.Null();
+        }
+        local_llm::SequenceSlot slot;
+        slot.id = 0;
+        for (uint32_t j = 0; j + 1 < history.Length(); ++j) {
+            slot.cache.push_back(history.Get(j).As<Napi::Number>().Int32Value());
+        }
+        slot.pending = history.Get(history.Length() - 1).As<Napi::Number>().Int32Value();
+
+        std::vector<llama_token> out;
+        std::vector<local_llm::DraftRequest> requests(1);
+        requests[0].slot = &slot;
+        requests[0].n_max = n_max;
+        requests[0].out = &out;
+        source.draft(requests);
+
+        Napi::Array draft = Napi::Array::New(env, out.size());
+        for (size_t j = 0; j < out.size(); ++j) {
+            draft.Set((uint32_t)j, Napi::Number::New(env, out[j]));
+        }
+        drafts.Set(i, draft);
+    }
+    return drafts;
+}
+
+// renderMetrics({ counters: { name: n }, gauges: { name: v },
+//                 histograms: { name: { bounds: [...], values: [...] } } })
+// -> Prometheus text of a registry holding just those metrics
+Napi::Value RenderMetrics(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    if (info.Length() < 1 || !info[0].IsObject()) {
+        Napi::TypeError::New(env, "Expected metrics object").ThrowAsJavaScriptException();
+        return env.Null();
+    }
+    Napi::Object spec = info[0].As<Napi::Object>();
+    local_llm::MetricsRegistry registry;
+    auto each = [&spec](const char* key, const std::function<void(const std::string&, Napi::Value)>& fn) {
+        if (!spec.Has(key) || !spec.Get(key).IsObject()) {
+            return;
+        }
+        Napi::Object group = spec.Get(key).As<Napi::Object>();
+        Napi::Array names = group.GetPropertyNames();
+        for (uint32_t i = 0; i < names.Length(); ++i) {
+            const std::string name = names.Get(i).As<Napi::String>().Utf8Value();
+            fn(name, group.Get(name));
+        }
+    };
+    each("counters", [&registry](const std::string& name, Napi::Value value) {
+        registry.counter(name, "Test counter").inc((uint64_t)value.As<Napi::Number>().Int64Value());
+    });
+    each("gauges", [&registry](const std::string& name, Napi::Value value) {
+        registry.gauge(name, "Test gauge").set(value.As<Napi::Number>().DoubleValue());
+    });
+    each("histograms", [&registry](const std::string& name, Napi::Value value) {
+        Napi::Object h = value.As<Napi::Object>();
+        std::vector<double> bounds;
+        Napi::Array b = h.Get("bounds").As<Napi::Array>();
+        for (uint32_t i = 0; i < b.Length(); ++i) {
+            bounds.push_back(b.Get(i).As<Napi::Number>().DoubleValue());
+        }
+        local_llm::Histogram& histogram = registry.histogram(name, "Test histogram", bounds);
+        Napi::Array values = h.Get("values").As<Napi::Array>();
+        for (uint32_t i = 0; i < values.Length(); ++i) {
+            histogram.observe(values.Get(i).As<Napi::Number>().DoubleValue());
+        }
+    });
+    return Napi::String::New(env, registry.render());
+}
+
+} // namespace
+
+Napi::Object MakeTestHooks(Napi::Env env) {
+    Napi::Object hooks = Napi::Object::New(env);
+    hooks.Set("stopStream", Napi::Function::New(env, StopStream));
+    hooks.Set("utf8CompleteLength", Napi::Function::New(env, Utf8CompleteLength));
+    hooks.Set("jsonSchemaToGbnf", Napi::Function::New(env, JsonSchemaToGbnf));
+    hooks.Set("parseCpuList", Napi::Function::New(env, ParseCpuList));
+    hooks.Set("readBatchJsonl", Napi::Function::New(env, ReadBatchJsonl));
+    hooks.Set("governorSteps", Napi::Function::New(env, GovernorSteps));
+    hooks.Set("ngramDraft", Napi::Function::New(env, NgramDraft));
+    hooks.Set("renderMetrics", Napi::Function::New(env, RenderMetrics));
+    return hooks;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <napi.h>
+
+// Pure functions of llm_core that have no model-backed JS API, exported as
+// `testing` so test/test.js can check their behaviour directly. Only the
+// llm_node_test addon (built with LLM_TEST_HOOKS) has them; llm_node does not.
+Napi::Object MakeTestHooks(Napi::Env env);
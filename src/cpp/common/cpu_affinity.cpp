@@ -0,0 +1,116 @@
+#include "cpu_affinity.h"
+#include "logging.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <sched.h>
+#include <pthread.h>
+
+namespace local_llm {
+
+static long read_max_freq_khz(int cpu) {
+    std::ifstream f("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cpufreq/cpuinfo_max_freq");
+    long khz = 0;
+    if (f.is_open()) {
+        f >> khz;
+    }
+    return khz;
+}
+
+CpuTopology detect_cpu_topology() {
+    CpuTopology topo;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                topo.cpus.push_back(cpu);
+            }
+        }
+    }
+    if (topo.cpus.empty()) {
+        topo.cpus.push_back(0);
+    }
+
+    // Without cpufreq (containers, some kernels) every core counts as fast
+    long best = 0;
+    std::vector<long> freqs;
+    for (int cpu : topo.cpus) {
+        freqs.push_back(read_max_freq_khz(cpu));
+        best = std::max(best, freqs.back());
+    }
+    for (size_t i = 0; i < topo.cpus.size(); ++i) {
+        if (best == 0 || freqs[i] == best) {
+            topo.performance.push_back(topo.cpus[i]);
+        }
+    }
+    return topo;
+}
+
+bool parse_cpu_list(const std::string& spec, std::vector<int>& cpus) {
+    cpus.clear();
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+        char* end = nullptr;
+        const long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            const char* range_end = end + 1;
+            last = std::strtol(range_end, &end, 10);
+            if (end == range_end) {
+                return false;
+            }
+        }
+        if (*end != '\0' || end == item.c_str() || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back((int)cpu);
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return !cpus.empty();
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+    std::ostringstream oss;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            j++;
+        }
+        if (i > 0) {
+            oss << ",";
+        }
+        oss << cpus[i];
+        if (j > i) {
+            oss << "-" << cpus[j];
+        }
+        i = j + 1;
+    }
+    return oss.str();
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        LLM_LOG_WARN("CpuAffinity", "Could not pin thread to CPUs " << format_cpu_list(cpus));
+        return false;
+    }
+    return true;
+}
+
+} // namespace local_llm
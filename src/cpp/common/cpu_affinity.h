@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace local_llm {
+
+// The CPUs this process may run on. On big.LITTLE parts `performance` holds
+// the cores with the highest maximum frequency; on a homogeneous SoC such as
+// the Pi 5's four Cortex-A76 it is every core.
+struct CpuTopology {
+    std::vector<int> cpus;
+    std::vector<int> performance;
+};
+
+// Read the affinity mask and cpufreq limits of the running process
+CpuTopology detect_cpu_topology();
+
+// Parse a CPU list like "0-3", "1,2,3" or "0-1,4"; false on malformed input
+bool parse_cpu_list(const std::string& spec, std::vector<int>& cpus);
+
+// Inverse of parse_cpu_list, with ranges collapsed
+std::string format_cpu_list(const std::vector<int>& cpus);
+
+// Restrict the calling thread to `cpus`; an empty set leaves it alone
+bool pin_current_thread(const std::vector<int>& cpus);
+
+} // namespace local_llm
@@ -0,0 +1,352 @@
+#include "json.h"
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <sstream>
+
+namespace local_llm {
+
+const JsonValue* JsonValue::get(const std::string& key) const {
+    if (type != Type::Object) {
+        return nullptr;
+    }
+    for (const auto& member : object) {
+        if (member.first == key) {
+            return &member.second;
+        }
+    }
+    return nullptr;
+}
+
+namespace {
+
+// Recursive-descent parser over the raw text
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : text_(text) {}
+
+    bool parse(JsonValue& out, std::string& error) {
+        skip_space();
+        if (!parse_value(out, 0)) {
+            error = error_ + " at offset " + std::to_string(pos_);
+            return false;
+        }
+        skip_space();
+        if (pos_ != text_.size()) {
+            error = "Trailing characters at offset " + std::to_string(pos_);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // Deep enough for any schema, shallow enough to never overflow the stack
+    static const int kMaxDepth = 128;
+
+    const std::string& text_;
+    size_t pos_ = 0;
+    std::string error_;
+
+    bool fail(const char* message) {
+        error_ = message;
+        return false;
+    }
+
+    void skip_space() {
+        while (pos_ < text_.size() &&
+               (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            pos_++;
+        }
+    }
+
+    bool consume(const char* literal) {
+        size_t n = 0;
+        while (literal[n]) {
+            n++;
+        }
+        if (text_.compare(pos_, n, literal) != 0) {
+            return false;
+        }
+        pos_ += n;
+        return true;
+    }
+
+    bool parse_value(JsonValue& out, int depth) {
+        if (depth > kMaxDepth) {
+            return fail("Nesting too deep");
+        }
+        if (pos_ >= text_.size()) {
+            return fail("Unexpected end of input");
+        }
+        const char c = text_[pos_];
+        if (c == '{') return parse_object(out, depth);
+        if (c == '[') return parse_array(out, depth);
+        if (c == '"') {
+            out.type = JsonValue::Type::String;
+            return parse_string(out.string);
+        }
+        if (consume("true")) {
+            out.type = JsonValue::Type::Bool;
+            out.boolean = true;
+            return true;
+        }
+        if (consume("false")) {
+            out.type = JsonValue::Type::Bool;
+            out.boolean = false;
+            return true;
+        }
+        if (consume("null")) {
+            out.type = JsonValue::Type::Null;
+            return true;
+        }
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            return parse_number(out);
+        }
+        return fail("Unexpected character");
+    }
+
+    bool parse_object(JsonValue& out, int depth) {
+        out.type = JsonValue::Type::Object;
+        pos_++;  // '{'
+        skip_space();
+        if (pos_ < text_.size() && text_[pos_] == '}') {
+            pos_++;
+            return true;
+        }
+        while (true) {
+            skip_space();
+            if (pos_ >= text_.size() || text_[pos_] != '"') {
+                return fail("Expected member name");
+            }
+            std::string key;
+            if (!parse_string(key)) {
+                return false;
+            }
+            skip_space();
+            if (pos_ >= text_.size() || text_[pos_] != ':') {
+                return fail("Expected ':'");
+            }
+            pos_++;
+            skip_space();
+            out.object.emplace_back(std::move(key), JsonValue());
+            if (!parse_value(out.object.back().second, depth + 1)) {
+                return false;
+            }
+            skip_space();
+            if (pos_ < text_.size() && text_[pos_] == ',') {
+                pos_++;
+                continue;
+            }
+            if (pos_ < text_.size() && text_[pos_] == '}') {
+                pos_++;
+                return true;
+            }
+            return fail("Expected ',' or '}'");
+        }
+    }
+
+    bool parse_array(JsonValue& out, int depth) {
+        out.type = JsonValue::Type::Array;
+        pos_++;  // '['
+        skip_space();
+        if (pos_ < text_.size() && text_[pos_] == ']') {
+            pos_++;
+            return true;
+        }
+        while (true) {
+            skip_space();
+            out.array.emplace_back();
+            if (!parse_value(out.array.back(), depth + 1)) {
+                return false;
+            }
+            skip_space();
+            if (pos_ < text_.size() && text_[pos_] == ',') {
+                pos_++;
+                continue;
+            }
+            if (pos_ < text_.size() && text_[pos_] == ']') {
+                pos_++;
+                return true;
+            }
+            return fail("Expected ',' or ']'");
+        }
+    }
+
+    static void append_utf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    bool parse_hex4(uint32_t& cp) {
+        if (pos_ + 4 > text_.size()) {
+            return fail("Truncated \\u escape");
+        }
+        cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char h = text_[pos_++];
+            cp <<= 4;
+            if (h >= '0' && h <= '9') cp |= (uint32_t)(h - '0');
+            else if (h >= 'a' && h <= 'f') cp |= (uint32_t)(h - 'a' + 10);
+            else if (h >= 'A' && h <= 'F') cp |= (uint32_t)(h - 'A' + 10);
+            else return fail("Bad \\u escape");
+        }
+        return true;
+    }
+
+    bool parse_string(std::string& out) {
+        pos_++;  // opening quote
+        while (pos_ < text_.size()) {
+            const char c = text_[pos_++];
+            if (c == '"') {
+                return true;
+            }
+            if ((unsigned char)c < 0x20) {
+                return fail("Control character in string");
+            }
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= text_.size()) {
+                break;
+            }
+            const char e = text_[pos_++];
+            switch (e) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t cp = 0;
+                    if (!parse_hex4(cp)) {
+                        return false;
+                    }
+                    // Surrogate pair
+                    if (cp >= 0xD800 && cp <= 0xDBFF && text_.compare(pos_, 2, "\\u") == 0) {
+                        pos_ += 2;
+                        uint32_t low = 0;
+                        if (!parse_hex4(low)) {
+                            return false;
+                        }
+                        if (low < 0xDC00 || low > 0xDFFF) {
+                            return fail("Bad surrogate pair");
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return fail("Bad escape");
+            }
+        }
+        return fail("Unterminated string");
+    }
+
+    bool parse_number(JsonValue& out) {
+        const char* start = text_.c_str() + pos_;
+        char* end = nullptr;
+        out.number = std::strtod(start, &end);
+        if (end == start) {
+            return fail("Bad number");
+        }
+        out.type = JsonValue::Type::Number;
+        pos_ += (size_t)(end - start);
+        return true;
+    }
+};
+
+void write_json(const JsonValue& value, std::ostringstream& oss) {
+    switch (value.type) {
+        case JsonValue::Type::Null:
+            oss << "null";
+            break;
+        case JsonValue::Type::Bool:
+            oss << (value.boolean ? "true" : "false");
+            break;
+        case JsonValue::Type::Number: {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.17g", value.number);
+            oss << buf;
+            break;
+        }
+        case JsonValue::Type::String:
+            oss << json_quote(value.string);
+            break;
+        case JsonValue::Type::Array:
+            oss << "[";
+            for (size_t i = 0; i < value.array.size(); ++i) {
+                if (i > 0) oss << ",";
+                write_json(value.array[i], oss);
+            }
+            oss << "]";
+            break;
+        case JsonValue::Type::Object:
+            oss << "{";
+            for (size_t i = 0; i < value.object.size(); ++i) {
+                if (i > 0) oss << ",";
+                oss << json_quote(value.object[i].first) << ":";
+                write_json(value.object[i].second, oss);
+            }
+            oss << "}";
+            break;
+    }
+}
+
+} // namespace
+
+bool parse_json(const std::string& text, JsonValue& out, std::string& error) {
+    out = JsonValue();
+    JsonParser parser(text);
+    return parser.parse(out, error);
+}
+
+std::string to_json(const JsonValue& value) {
+    std::ostringstream oss;
+    write_json(value, oss);
+    return oss.str();
+}
+
+std::string json_quote(const std::string& text) {
+    std::string out;
+    out.reserve(text.size() + 2);
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+    return out;
+}
+
+} // namespace local_llm
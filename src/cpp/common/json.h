@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace local_llm {
+
+// Minimal JSON document model: enough to read request payloads such as JSON
+// schemas. Object members keep their source order, which schema conversion
+// relies on for property order.
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0.0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    bool is_null() const { return type == Type::Null; }
+    bool is_bool() const { return type == Type::Bool; }
+    bool is_number() const { return type == Type::Number; }
+    bool is_string() const { return type == Type::String; }
+    bool is_array() const { return type == Type::Array; }
+    bool is_object() const { return type == Type::Object; }
+
+    // Member of an object, or null if absent (or not an object)
+    const JsonValue* get(const std::string& key) const;
+};
+
+// Parse a complete JSON text; false (with a position in `error`) if malformed
+bool parse_json(const std::string& text, JsonValue& out, std::string& error);
+
+// Serialise a value back to compact JSON
+std::string to_json(const JsonValue& value);
+
+// `text` as a quoted JSON string literal
+std::string json_quote(const std::string& text);
+
+} // namespace local_llm
@@ -0,0 +1,55 @@
+#include "logging.h"
+#include <cstdio>
+#include <cstdlib>
+
+namespace local_llm {
+
+static int initial_log_level() {
+    LogLevel level = LogLevel::Info;
+    const char* env = std::getenv("LLM_LOG_LEVEL");
+    if (env) {
+        parse_log_level(env, level);
+    }
+    return (int)level;
+}
+
+namespace detail {
+std::atomic<int> g_log_level(initial_log_level());
+}
+
+void set_log_level(LogLevel level) {
+    detail::g_log_level.store((int)level, std::memory_order_relaxed);
+}
+
+LogLevel get_log_level() {
+    return (LogLevel)detail::g_log_level.load(std::memory_order_relaxed);
+}
+
+bool parse_log_level(const std::string& name, LogLevel& level) {
+    if (name == "debug") level = LogLevel::Debug;
+    else if (name == "info") level = LogLevel::Info;
+    else if (name == "warn" || name == "warning") level = LogLevel::Warn;
+    else if (name == "error") level = LogLevel::Error;
+    else if (name == "none" || name == "off") level = LogLevel::None;
+    else return false;
+    return true;
+}
+
+void log_write(int level, const char* tag, const std::string& message) {
+    static const char* names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    const char* name = (level >= 0 && level < 4) ? names[level] : "LOG";
+    
+    // One buffer, one write: stderr is unbuffered and lines must not interleave
+    std::string line;
+    line.reserve(message.size() + 32);
+    line += '[';
+    line += tag;
+    line += "] ";
+    line += name;
+    line += ": ";
+    line += message;
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), stderr);
+}
+
+} // namespace local_llm
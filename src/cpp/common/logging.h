@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <sstream>
+#include <string>
+
+// Leveled logging for llm_core and the Node binding.
+//
+//   LLM_LOG_DEBUG("LLMModel", "decoded token " << id);
+//
+// Two gates keep disabled logging free:
+//  - compile time: statements below LLM_LOG_MIN_LEVEL are compiled out entirely
+//    (set -DLLM_LOG_MIN_LEVEL=1 for production builds to drop debug logs);
+//  - run time: the level from LLM_LOG_LEVEL (debug|info|warn|error|none, default
+//    info) or set_log_level() is checked before the message is formatted, so a
+//    disabled statement costs one relaxed atomic load.
+// Enabled messages are formatted into one line and written with a single call.
+
+#define LLM_LOG_LEVEL_DEBUG 0
+#define LLM_LOG_LEVEL_INFO  1
+#define LLM_LOG_LEVEL_WARN  2
+#define LLM_LOG_LEVEL_ERROR 3
+#define LLM_LOG_LEVEL_NONE  4
+
+#ifndef LLM_LOG_MIN_LEVEL
+#define LLM_LOG_MIN_LEVEL LLM_LOG_LEVEL_DEBUG
+#endif
+
+namespace local_llm {
+
+enum class LogLevel : int {
+    Debug = LLM_LOG_LEVEL_DEBUG,
+    Info = LLM_LOG_LEVEL_INFO,
+    Warn = LLM_LOG_LEVEL_WARN,
+    Error = LLM_LOG_LEVEL_ERROR,
+    None = LLM_LOG_LEVEL_NONE
+};
+
+namespace detail {
+extern std::atomic<int> g_log_level;
+}
+
+inline bool log_enabled(int level) {
+    return level >= detail::g_log_level.load(std::memory_order_relaxed);
+}
+
+void set_log_level(LogLevel level);
+LogLevel get_log_level();
+
+// Parse "debug", "info", "warn", "error" or "none"; returns false if unknown
+bool parse_log_level(const std::string& name, LogLevel& level);
+
+// Write one formatted line to stderr
+void log_write(int level, const char* tag, const std::string& message);
+
+} // namespace local_llm
+
+#define LLM_LOG(level, tag, expr)                                              \
+    do {                                                                       \
+        if ((level) >= LLM_LOG_MIN_LEVEL && ::local_llm::log_enabled(level)) { \
+            std::ostringstream llm_log_oss_;                                   \
+            llm_log_oss_ << expr;                                              \
+            ::local_llm::log_write((level), (tag), llm_log_oss_.str());        \
+        }                                                                      \
+    } while (0)
+
+#define LLM_LOG_DEBUG(tag, expr) LLM_LOG(LLM_LOG_LEVEL_DEBUG, tag, expr)
+#define LLM_LOG_INFO(tag, expr)  LLM_LOG(LLM_LOG_LEVEL_INFO, tag, expr)
+#define LLM_LOG_WARN(tag, expr)  LLM_LOG(LLM_LOG_LEVEL_WARN, tag, expr)
+#define LLM_LOG_ERROR(tag, expr) LLM_LOG(LLM_LOG_LEVEL_ERROR, tag, expr)
@@ -0,0 +1,157 @@
+#include "metrics.h"
+#include <cmath>
+#include <sstream>
+
+namespace local_llm {
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)), buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::observe(double value) {
+    size_t i = 0;
+    while (i < bounds_.size() && value > bounds_[i]) {
+        i++;
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+    }
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Family* MetricsRegistry::find(const std::string& name) {
+    for (auto& family : families_) {
+        if (family->name == name) {
+            return family.get();
+        }
+    }
+    return nullptr;
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Family* family = find(name);
+    if (!family) {
+        families_.push_back(std::unique_ptr<Family>(new Family{name, help, nullptr, nullptr, nullptr}));
+        family = families_.back().get();
+    }
+    if (!family->counter) {
+        family->counter.reset(new Counter());
+    }
+    return *family->counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Family* family = find(name);
+    if (!family) {
+        families_.push_back(std::unique_ptr<Family>(new Family{name, help, nullptr, nullptr, nullptr}));
+        family = families_.back().get();
+    }
+    if (!family->gauge) {
+        family->gauge.reset(new Gauge());
+    }
+    return *family->gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      std::vector<double> bounds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Family* family = find(name);
+    if (!family) {
+        families_.push_back(std::unique_ptr<Family>(new Family{name, help, nullptr, nullptr, nullptr}));
+        family = families_.back().get();
+    }
+    if (!family->histogram) {
+        family->histogram.reset(new Histogram(std::move(bounds)));
+    }
+    return *family->histogram;
+}
+
+// Prometheus wants "+Inf"/"NaN" spelled out and plain decimals otherwise
+static void write_value(std::ostringstream& oss, double value) {
+    if (std::isnan(value)) {
+        oss << "NaN";
+    } else if (std::isinf(value)) {
+        oss << (value > 0 ? "+Inf" : "-Inf");
+    } else {
+        oss << value;
+    }
+}
+
+std::string MetricsRegistry::render() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream oss;
+    oss.precision(10);
+    for (const auto& family : families_) {
+        oss << "# HELP " << family->name << " " << family->help << "\n";
+        if (family->counter) {
+            oss << "# TYPE " << family->name << " counter\n"
+                << family->name << " " << family->counter->value() << "\n";
+        } else if (family->gauge) {
+            oss << "# TYPE " << family->name << " gauge\n" << family->name << " ";
+            write_value(oss, family->gauge->value());
+            oss << "\n";
+        } else if (family->histogram) {
+            const Histogram& h = *family->histogram;
+            oss << "# TYPE " << family->name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < h.bounds().size(); ++i) {
+                cumulative += h.bucket(i);
+                oss << family->name << "_bucket{le=\"";
+                write_value(oss, h.bounds()[i]);
+                oss << "\"} " << cumulative << "\n";
+            }
+            cumulative += h.bucket(h.bounds().size());
+            oss << family->name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+            oss << family->name << "_sum ";
+            write_value(oss, h.sum());
+            oss << "\n" << family->name << "_count " << h.count() << "\n";
+        }
+    }
+    return oss.str();
+}
+
+CoreMetrics& core_metrics() {
+    static CoreMetrics metrics = [] {
+        MetricsRegistry& r = MetricsRegistry::instance();
+        const std::vector<double> latency = {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+        const std::vector<double> rate = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+        return CoreMetrics{
+            r.counter("llm_requests_total", "Requests that finished, in any way"),
+            r.counter("llm_request_errors_total", "Requests that finished with an error"),
+            r.counter("llm_requests_cancelled_total", "Requests cancelled before they finished"),
+            r.counter("llm_requests_rejected_total", "Requests refused because the queue was full"),
+            r.counter("llm_prompt_tokens_total", "Prompt tokens of admitted requests"),
+            r.counter("llm_generated_tokens_total", "Tokens generated"),
+            r.counter("llm_prefix_reused_tokens_total", "Prompt tokens served from the prefix cache"),
+            r.counter("llm_prefix_cache_hits_total", "Requests that reused a cached prefix"),
+            r.counter("llm_prefix_cache_misses_total", "Requests that prefilled from scratch"),
+            r.histogram("llm_ttft_seconds", "Time to first token", latency),
+            r.histogram("llm_queue_wait_seconds", "Time a request waited for a slot", latency),
+            r.histogram("llm_prefill_tokens_per_second", "Prompt processing speed per request", rate),
+            r.histogram("llm_decode_tokens_per_second", "Generation speed per request", rate),
+            r.gauge("llm_active_sequences", "Sequences prefilling or generating"),
+            r.gauge("llm_kv_cache_used_cells", "KV cache cells in use"),
+            r.gauge("llm_kv_cache_cells", "KV cache size in cells"),
+            r.gauge("llm_queue_interactive", "Interactive requests waiting for a slot"),
+            r.gauge("llm_queue_batch", "Batch requests waiting for a slot"),
+            r.gauge("llm_cpu_temperature_celsius", "SoC temperature"),
+            r.gauge("llm_cpu_frequency_hertz", "Current frequency of the first CPU"),
+            r.gauge("llm_cpu_frequency_max_hertz", "Maximum frequency of the first CPU"),
+            r.gauge("llm_thermal_throttled", "1 while the SoC is thermally throttled"),
+        };
+    }();
+    return metrics;
+}
+
+} // namespace local_llm
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Process-wide metrics for llm_core, rendered in the Prometheus text format.
+//
+//   core_metrics().generated_tokens.inc();
+//
+// Metrics are registered once (under a lock) and then updated through plain
+// references with relaxed atomics, so recording on every token costs a few
+// uncontended atomic adds and never blocks the decode loop.
+
+namespace local_llm {
+
+class Counter {
+public:
+    void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+public:
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_{0.0};
+};
+
+// Fixed upper bounds chosen at registration; observe() is one bucket
+// increment plus the count and sum
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double value);
+
+    const std::vector<double>& bounds() const { return bounds_; }
+    // Non-cumulative count of bucket i (i == bounds().size() is +Inf)
+    uint64_t bucket(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> count_{0};
+    std::atomic<double> sum_{0.0};
+};
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance();
+
+    // A registry of its own, e.g. to render metrics in isolation; the
+    // process-wide metrics all live in instance()
+    MetricsRegistry() = default;
+
+    // Register a metric, or return the one already registered under `name`
+    Counter& counter(const std::string& name, const std::string& help);
+    Gauge& gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help, std::vector<double> bounds);
+
+    // Every metric in the Prometheus text exposition format (version 0.0.4)
+    std::string render() const;
+
+private:
+    struct Family {
+        std::string name;
+        std::string help;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    Family* find(const std::string& name);
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Family>> families_;
+};
+
+// The metrics the inference core records
+struct CoreMetrics {
+    // Requests by outcome
+    Counter& requests;
+    Counter& request_errors;
+    Counter& requests_cancelled;
+    Counter& requests_rejected;
+
+    // Tokens in and out, and how much of the input the prefix cache served
+    Counter& prompt_tokens;
+    Counter& generated_tokens;
+    Counter& prefix_reused_tokens;
+    Counter& prefix_cache_hits;
+    Counter& prefix_cache_misses;
+
+    // Per-request latency and throughput
+    Histogram& ttft_seconds;
+    Histogram& queue_wait_seconds;
+    Histogram& prefill_tokens_per_second;
+    Histogram& decode_tokens_per_second;
+
+    // State, refreshed after every decode step or at scrape time
+    Gauge& active_sequences;
+    Gauge& kv_cells_used;
+    Gauge& kv_cells_total;
+    Gauge& queued_interactive;
+    Gauge& queued_batch;
+    Gauge& cpu_temperature;
+    Gauge& cpu_frequency;
+    Gauge& cpu_frequency_max;
+    Gauge& thermal_throttled;
+};
+
+CoreMetrics& core_metrics();
+
+} // namespace local_llm
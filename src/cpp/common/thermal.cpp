@@ -0,0 +1,75 @@
+#include "thermal.h"
+#include <fstream>
+#include <string>
+
+namespace local_llm {
+
+namespace {
+
+bool read_number(const std::string& path, long long& value) {
+    std::ifstream in(path);
+    return static_cast<bool>(in >> value);
+}
+
+bool read_hex(const std::string& path, unsigned long& value) {
+    std::ifstream in(path);
+    std::string text;
+    if (!(in >> text)) {
+        return false;
+    }
+    try {
+        value = std::stoul(text, nullptr, 16);
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+ThermalReading read_thermal() {
+    ThermalReading reading;
+    const std::string zone = "/sys/class/thermal/thermal_zone0/";
+    long long value = 0;
+    if (read_number(zone + "temp", value)) {
+        reading.has_temperature = true;
+        reading.temperature_c = value / 1000.0;
+    }
+    for (int i = 0; i < 8; ++i) {
+        std::ifstream type(zone + "trip_point_" + std::to_string(i) + "_type");
+        std::string name;
+        if (!(type >> name)) {
+            break;
+        }
+        if (name == "passive" && read_number(zone + "trip_point_" + std::to_string(i) + "_temp", value)) {
+            reading.trip_c = value / 1000.0;
+            break;
+        }
+    }
+
+    const std::string cpufreq = "/sys/devices/system/cpu/cpu0/cpufreq/";
+    if (read_number(cpufreq + "scaling_cur_freq", value)) {
+        reading.cur_freq_khz = (uint64_t)value;
+    }
+    if (read_number(cpufreq + "cpuinfo_max_freq", value)) {
+        reading.max_freq_khz = (uint64_t)value;
+    }
+    if (read_number(cpufreq + "scaling_max_freq", value)) {
+        reading.limit_freq_khz = (uint64_t)value;
+    }
+
+    // Bit 1: ARM frequency capped; bit 2: currently throttled; bit 3: soft
+    // temperature limit active
+    unsigned long flags = 0;
+    if (read_hex("/sys/devices/platform/soc/soc:firmware/get_throttled", flags)) {
+        reading.has_firmware_flags = true;
+        reading.freq_capped = (flags & 0x2) != 0;
+        reading.throttled = (flags & 0xC) != 0;
+    } else {
+        reading.throttled = reading.has_temperature && reading.trip_c > 0.0 &&
+                            reading.temperature_c >= reading.trip_c;
+    }
+    return reading;
+}
+
+} // namespace local_llm
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+namespace local_llm {
+
+// SoC thermal state from sysfs. Fields that cannot be read stay zero.
+struct ThermalReading {
+    bool has_temperature = false;
+    double temperature_c = 0.0;    // thermal_zone0
+    double trip_c = 0.0;           // first passive trip point of thermal_zone0 (0 = none)
+    uint64_t cur_freq_khz = 0;     // cpu0 scaling_cur_freq
+    uint64_t max_freq_khz = 0;     // cpu0 cpuinfo_max_freq
+    uint64_t limit_freq_khz = 0;   // cpu0 scaling_max_freq (the policy's own limit)
+    bool throttled = false;
+    bool has_firmware_flags = false;  // get_throttled was readable
+    bool freq_capped = false;         // firmware: ARM frequency capped
+};
+
+// Read the current state. `throttled` and `freq_capped` come from the
+// Raspberry Pi firmware's get_throttled flags when the kernel exposes them;
+// without them `throttled` falls back to the temperature having reached the
+// passive trip point and `freq_capped` stays false.
+ThermalReading read_thermal();
+
+} // namespace local_llm
@@ -0,0 +1,93 @@
+#include "batch_job.h"
+#include "../common/json.h"
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+namespace local_llm {
+
+bool valid_job_name(const std::string& name) {
+    if (name.empty() || name.size() > 128 || name[0] == '.') {
+        return false;
+    }
+    for (char c : name) {
+        if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool read_batch_jsonl(const std::string& path, std::vector<BatchItem>& items, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "Cannot open batch file: " + path;
+        return false;
+    }
+    items.clear();
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        JsonValue value;
+        std::string parse_error;
+        if (!parse_json(line, value, parse_error)) {
+            error = "Line " + std::to_string(line_no) + ": " + parse_error;
+            return false;
+        }
+        BatchItem item;
+        if (value.is_string()) {
+            item.prompt = value.string;
+        } else if (const JsonValue* prompt = value.get("prompt")) {
+            if (!prompt->is_string()) {
+                error = "Line " + std::to_string(line_no) + ": \"prompt\" must be a string";
+                return false;
+            }
+            item.prompt = prompt->string;
+            if (const JsonValue* id = value.get("id")) {
+                item.id = id->is_string() ? id->string : to_json(*id);
+            }
+            const JsonValue* max_tokens = value.get("maxTokens");
+            if (!max_tokens) {
+                max_tokens = value.get("max_tokens");
+            }
+            if (max_tokens) {
+                if (max_tokens->is_number() && max_tokens->number > 0) {
+                    item.max_tokens = (int)max_tokens->number;
+                }
+            }
+        } else {
+            error = "Line " + std::to_string(line_no) + ": expected a string or an object with \"prompt\"";
+            return false;
+        }
+        items.push_back(std::move(item));
+    }
+    return true;
+}
+
+std::string batch_result_json(const BatchItemResult& result) {
+    std::ostringstream oss;
+    oss << "{\"index\":" << result.index
+        << ",\"id\":" << json_quote(result.id)
+        << ",\"output\":" << json_quote(result.output)
+        << ",\"error\":" << json_quote(result.error)
+        << ",\"metrics\":" << (result.metrics.empty() ? "{}" : result.metrics)
+        << "}";
+    return oss.str();
+}
+
+std::string batch_summary_json(const BatchSummary& summary) {
+    std::ostringstream oss;
+    oss << "{\"completed\":" << summary.completed
+        << ",\"failed\":" << summary.failed
+        << ",\"prompt_tokens\":" << summary.prompt_tokens
+        << ",\"duration_ms\":" << summary.duration_ms
+        << ",\"cancelled\":" << (summary.cancelled ? "true" : "false")
+        << "}";
+    return oss.str();
+}
+
+} // namespace local_llm
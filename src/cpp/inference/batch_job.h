@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace local_llm {
+
+// One prompt of an offline batch
+struct BatchItem {
+    std::string id;      // caller's key, echoed in the result (may be empty)
+    std::string prompt;
+    int max_tokens = 0;  // 0 = the batch default
+};
+
+// Outcome of one item, reported as soon as it finishes (completion order)
+struct BatchItemResult {
+    size_t index = 0;     // position of the item in the input
+    std::string id;
+    std::string output;
+    std::string error;    // empty on success
+    std::string metrics;  // per-request metrics JSON on success
+};
+
+struct BatchSummary {
+    size_t completed = 0;
+    size_t failed = 0;
+    size_t prompt_tokens = 0;
+    double duration_ms = 0.0;
+    bool cancelled = false;
+};
+
+// Batch files are named, not pathed: they live in ModelConfig::jobs_dir, and
+// a name may not contain a separator or start with a dot
+bool valid_job_name(const std::string& name);
+
+// Read a JSONL batch: one item per line, either a JSON string (the prompt)
+// or an object with "prompt" and optional "id" and "maxTokens" (or
+// "max_tokens"). Blank lines are skipped; a malformed line fails the whole
+// file with its line number.
+bool read_batch_jsonl(const std::string& path, std::vector<BatchItem>& items, std::string& error);
+
+// One JSONL line (no newline) for a result:
+// {"index":..,"id":..,"output":..,"error":..,"metrics":{..}}
+std::string batch_result_json(const BatchItemResult& result);
+
+// Summary counters as a JSON object
+std::string batch_summary_json(const BatchSummary& summary);
+
+} // namespace local_llm
@@ -1,5 +1,8 @@
 #include "inference_engine.h"
-#include <iostream>
+#include "../common/logging.h"
+#include "../common/cpu_affinity.h"
+#include "../common/metrics.h"
+#include "../common/thermal.h"
 #include <sstream>
 #include <iomanip>
 #include <unistd.h>
@@ -10,6 +13,10 @@
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <cstring>
+#include <future>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 
 #ifdef __linux__
 #include <fstream>
@@ -18,66 +25,582 @@
 
 namespace local_llm {
 
-InferenceEngine::InferenceEngine() : stop_generation_(false) {}
+InferenceEngine::InferenceEngine() {}
 
 InferenceEngine::~InferenceEngine() {
     stop_generation();
-    if (generation_thread_.joinable()) {
-        generation_thread_.join();
+    {
+        // Its callback takes model_mutex_
+        std::lock_guard<std::mutex> lock(governor_mutex_);
+        governor_.reset();
     }
+    // The scheduler thread takes model_mutex_, so stop it before the model goes away
+    std::unique_ptr<RequestScheduler> scheduler;
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex_);
+        scheduler = std::move(scheduler_);
+    }
+    scheduler.reset();
+    
+    std::lock_guard<std::mutex> init_lock(init_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        reaper_stop_ = true;
+    }
+    retired_cv_.notify_all();
+    if (reaper_.joinable()) {
+        reaper_.join();
+    }
+    // Still draining: shutting the scheduler down fails what it had left
+    for (auto& retired : retired_) {
+        retired.first.reset();
+        retired.second.reset();
+    }
+    retired_.clear();
+}
+
+// context_auto: the largest n_ctx whose KV cache fits the budget, in whole
+// 256-token pages, capped at what the sequences could use of the training length
+static void fit_context_to_memory(LLMModel& model, const ModelConfig& config) {
+    if (!config.context_auto) {
+        return;
+    }
+    const size_t per_token = model.kv_bytes_per_token();
+    if (per_token == 0) {
+        return;
+    }
+    uint64_t budget = 0;
+    if (config.kv_ram_budget_mb > 0) {
+        budget = (uint64_t)config.kv_ram_budget_mb * 1024 * 1024;
+    } else {
+        struct sysinfo si;
+        if (sysinfo(&si) != 0) {
+            LLM_LOG_WARN("InferenceEngine", "sysinfo failed, keeping context size " << config.context_size);
+            return;
+        }
+        budget = (uint64_t)si.freeram * si.mem_unit / 4 * 3;
+    }
+    
+    const uint64_t page = 256;
+    uint64_t n_ctx = budget / per_token / page * page;
+    const uint64_t n_max = (uint64_t)std::max(1, model.n_ctx_train()) * std::max(1, config.parallel_sequences);
+    n_ctx = std::min(n_ctx, n_max);
+    if (n_ctx < page) {
+        LLM_LOG_WARN("InferenceEngine", "KV budget of " << budget / (1024 * 1024) << " MB holds under "
+                                        << page << " tokens, using " << page);
+        n_ctx = page;
+    }
+    model.set_context_size((int)n_ctx);
+    LLM_LOG_INFO("InferenceEngine", "Context sized to " << n_ctx << " tokens ("
+                                    << n_ctx * per_token / (1024 * 1024) << " MB KV of a "
+                                    << budget / (1024 * 1024) << " MB budget)");
 }
 
 bool InferenceEngine::initialize(const ModelConfig& config) {
-    std::lock_guard<std::mutex> lock(model_mutex_);
+    // May run on a worker thread while JS keeps calling in, so no engine lock
+    // is held during the (slow) model load
+    std::lock_guard<std::mutex> init_lock(init_mutex_);
+    
+    ModelRegistry& registry = ModelRegistry::instance();
+    if (config.model_ram_budget_mb > 0) {
+        registry.set_budget_bytes((uint64_t)config.model_ram_budget_mb * 1024 * 1024);
+    }
+    sessions_.configure(config.session_dir, (uint64_t)config.session_disk_budget_mb * 1024 * 1024);
+    
+    // Hot-swap when the new weights fit next to the ones in use: the old model
+    // keeps serving while the new one loads, and finishes its in-flight requests
+    const uint64_t incoming = registry.load_cost(config.model_path, LLMModel::load_params(config));
+    if (is_ready() && registry.in_use_bytes() + incoming <= registry.budget_bytes()) {
+        return hot_swap(config);
+    }
     
-    model_ = std::make_unique<LLMModel>();
-    bool success = model_->initialize(config);
+    // Otherwise tear down the old scheduler and model first so both are never resident
+    std::unique_ptr<RequestScheduler> old_scheduler;
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex_);
+        old_scheduler = std::move(scheduler_);
+    }
+    old_scheduler.reset();
+    std::unique_ptr<LLMModel> old_model;
+    {
+        std::lock_guard<std::mutex> lock(model_mutex_);
+        old_model = std::move(model_);
+        publish_snapshot();
+    }
+    old_model.reset();
+    
+    auto model = std::make_unique<LLMModel>();
+    bool success = model->initialize(config);
     
     if (success) {
-        std::cout << "Inference engine initialized successfully" << std::endl;
-        std::cout << "System info: " << get_system_info() << std::endl;
+        fit_context_to_memory(*model, config);
+        if (config.warmup) {
+            model->warmup();
+        }
+        std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+        {
+            std::lock_guard<std::mutex> lock(model_mutex_);
+            model_ = std::move(model);
+            publish_snapshot();
+        }
+        scheduler_ = std::make_unique<RequestScheduler>(model_.get(), model_mutex_,
+                                                         (size_t)std::max(0, config.max_queue_depth));
+        configure_governor(config);
+        LLM_LOG_INFO("InferenceEngine", "Inference engine initialized successfully");
+        LLM_LOG_INFO("InferenceEngine", "System info: " << get_system_info());
     } else {
-        std::cerr << "Failed to initialize inference engine" << std::endl;
+        LLM_LOG_ERROR("InferenceEngine", "Failed to initialize inference engine");
     }
     
     return success;
 }
 
-std::string InferenceEngine::generate_text(const std::string& prompt, int max_tokens) {
-    std::lock_guard<std::mutex> lock(model_mutex_);
+bool InferenceEngine::hot_swap(const ModelConfig& config) {
+    auto model = std::make_unique<LLMModel>();
+    if (!model->initialize(config)) {
+        LLM_LOG_ERROR("InferenceEngine", "Failed to load " << config.model_path << ", keeping the current model");
+        return false;
+    }
+    fit_context_to_memory(*model, config);
+    // Warmed while the old model still serves, so the switch costs nothing
+    if (config.warmup) {
+        model->warmup();
+    }
     
-    if (!model_ || !model_->is_loaded()) {
-        return "Error: Model not loaded";
+    // New requests go to the new scheduler from here on
+    std::unique_ptr<RequestScheduler> old_scheduler;
+    std::unique_ptr<LLMModel> old_model;
+    {
+        std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+        old_scheduler = std::move(scheduler_);
+        {
+            std::lock_guard<std::mutex> lock(model_mutex_);
+            old_model = std::move(model_);
+            model_ = std::move(model);
+            publish_snapshot();
+        }
+        scheduler_ = std::make_unique<RequestScheduler>(model_.get(), model_mutex_,
+                                                         (size_t)std::max(0, config.max_queue_depth));
     }
     
-    return model_->generate(prompt, max_tokens);
+    configure_governor(config);
+    
+    // The old pair finishes what it already accepted and is freed once it has
+    retire(std::move(old_scheduler), std::move(old_model));
+    LLM_LOG_INFO("InferenceEngine", "Hot-swapped to " << config.model_path);
+    return true;
 }
 
-void InferenceEngine::generate_text_stream(const std::string& prompt,
-                                         std::function<void(const std::string&)> callback,
-                                         int max_tokens) {
-    stop_generation();
-    if (generation_thread_.joinable()) {
-        generation_thread_.join();
+void InferenceEngine::configure_governor(const ModelConfig& config) {
+    std::lock_guard<std::mutex> lock(governor_mutex_);
+    governor_.reset();
+    if (!config.thermal_governor) {
+        return;
+    }
+    
+    GovernorLimits full_speed;
+    {
+        std::lock_guard<std::mutex> model_lock(model_mutex_);
+        if (!model_) {
+            return;
+        }
+        full_speed.threads = model_->threads();
+        full_speed.threads_batch = model_->threads_batch();
+        full_speed.prefill_chunk = model_->prefill_chunk();
+    }
+    GovernorSettings settings;
+    settings.target_c = config.thermal_target_c;
+    settings.interval_ms = config.thermal_interval_ms;
+    
+    // Applied under the model lock, so between decode steps
+    governor_ = std::make_unique<ThermalGovernor>(settings, full_speed, [this](const GovernorLimits& limits) {
+        std::lock_guard<std::mutex> model_lock(model_mutex_);
+        if (model_) {
+            model_->set_threads(limits.threads);
+            model_->set_threads_batch(limits.threads_batch);
+            model_->set_prefill_chunk(limits.prefill_chunk);
+        }
+    });
+    governor_->start();
+}
+
+std::string InferenceEngine::get_governor_state() {
+    std::lock_guard<std::mutex> lock(governor_mutex_);
+    return governor_ ? governor_->state_json() : "{}";
+}
+
+void InferenceEngine::retire(std::unique_ptr<RequestScheduler> scheduler, std::unique_ptr<LLMModel> model) {
+    RequestScheduler* draining = scheduler.get();
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        retired_.emplace_back(std::move(scheduler), std::move(model));
+        if (!reaper_.joinable()) {
+            reaper_ = std::thread(&InferenceEngine::reap_loop, this);
+        }
+    }
+    draining->drain([this] {
+        // Taken so the wakeup cannot slip between the reaper's check and its wait
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        retired_cv_.notify_all();
+    });
+}
+
+void InferenceEngine::reap_loop() {
+    std::unique_lock<std::mutex> lock(retired_mutex_);
+    while (!reaper_stop_) {
+        std::vector<std::pair<std::unique_ptr<RequestScheduler>, std::unique_ptr<LLMModel>>> done;
+        for (auto it = retired_.begin(); it != retired_.end();) {
+            if (it->first->drained()) {
+                done.push_back(std::move(*it));
+                it = retired_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (done.empty()) {
+            retired_cv_.wait(lock);
+            continue;
+        }
+        lock.unlock();
+        for (auto& pair : done) {
+            // Scheduler before model: its thread used the model
+            pair.first.reset();
+            pair.second.reset();
+        }
+        LLM_LOG_INFO("InferenceEngine", "Freed " << done.size() << " swapped-out model(s)");
+        lock.lock();
+    }
+}
+
+bool InferenceEngine::preload_model(const std::string& model_path) {
+    LLMModel::ensure_backend();
+    ModelConfig config;
+    config.model_path = model_path;
+    return ModelRegistry::instance().preload(model_path, LLMModel::load_params(config));
+}
+
+std::string InferenceEngine::get_loaded_models() const {
+    return ModelRegistry::instance().stats_json();
+}
+
+std::string InferenceEngine::generate_text(const std::string& prompt, int max_tokens,
+                                           const RequestOptions& options) {
+    // Goes through the scheduler so one-shot calls share the batch with streams
+    std::promise<RequestResult> done;
+    std::future<RequestResult> result = done.get_future();
+    uint64_t request_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex_);
+        if (!scheduler_) {
+            return "Error: Model not loaded";
+        }
+        // Registered like a stream, so stop_generation() aborts it too
+        CancelToken cancel = make_cancel_token();
+        {
+            std::lock_guard<std::mutex> requests_lock(requests_mutex_);
+            request_id = next_request_id_++;
+            requests_[request_id] = cancel;
+        }
+        scheduler_->submit(prompt, max_tokens, cancel, nullptr, [&done](const RequestResult& r) {
+            done.set_value(r);
+        }, options);
     }
     
-    stop_generation_ = false;
+    RequestResult r = result.get();
+    {
+        std::lock_guard<std::mutex> lock(requests_mutex_);
+        requests_.erase(request_id);
+    }
+    // A cancelled request returns what it generated until then
+    return r.error.empty() ? r.output : r.error;
+}
+
+uint64_t InferenceEngine::generate_text_stream(const std::string& prompt,
+                                             std::function<void(const std::string&)> callback,
+                                             int max_tokens,
+                                             std::function<void(const std::string&)> on_complete,
+                                             const RequestOptions& options) {
+    return submit_stream([&prompt, max_tokens, &options](RequestScheduler& scheduler, CancelToken cancel,
+                                                         RequestScheduler::TextCallback on_text,
+                                                         RequestScheduler::CompleteCallback done) {
+        scheduler.submit(prompt, max_tokens, std::move(cancel), std::move(on_text), std::move(done),
+                         options);
+    }, std::move(callback), std::move(on_complete));
+}
+
+uint64_t InferenceEngine::generate_tokens_stream(std::vector<int32_t> tokens,
+                                               std::function<void(const std::string&)> callback,
+                                               int max_tokens,
+                                               std::function<void(const std::string&)> on_complete,
+                                               const RequestOptions& options) {
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(model_mutex_);
+        const int n_vocab = model_ ? model_->n_vocab() : 0;
+        if (tokens.empty()) {
+            error = "Error: Empty token prompt";
+        } else if (std::any_of(tokens.begin(), tokens.end(),
+                               [n_vocab](int32_t t) { return t < 0 || t >= n_vocab; })) {
+            error = n_vocab > 0 ? "Error: Token id out of range" : "Error: Model not loaded";
+        }
+    }
+    if (!error.empty()) {
+        if (on_complete) {
+            on_complete(error);
+        } else {
+            callback(error);
+        }
+        return 0;
+    }
+    
+    return submit_stream([&tokens, max_tokens, &options](RequestScheduler& scheduler, CancelToken cancel,
+                                                         RequestScheduler::TextCallback on_text,
+                                                         RequestScheduler::CompleteCallback done) {
+        scheduler.submit_tokens(std::move(tokens), max_tokens, std::move(cancel),
+                                std::move(on_text), std::move(done), options);
+    }, std::move(callback), std::move(on_complete));
+}
+
+bool InferenceEngine::generate_batch(const std::vector<BatchItem>& items, int max_tokens,
+                                     const std::function<void(const BatchItemResult&)>& on_result,
+                                     BatchSummary& summary, std::string& error,
+                                     const RequestOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    summary = BatchSummary();
     
-    generation_thread_ = std::thread([this, prompt, callback, max_tokens]() {
+    // Tokenized a chunk at a time, so running streams get decode steps in
+    // between instead of waiting for the whole batch
+    const size_t kTokenizeChunk = 16;
+    std::vector<std::vector<int32_t>> tokens(items.size());
+    size_t width = 1;
+    const LLMModel* tokenizer = nullptr;
+    for (size_t begin = 0; begin < items.size() || !tokenizer; begin += kTokenizeChunk) {
         std::lock_guard<std::mutex> lock(model_mutex_);
-        
         if (!model_ || !model_->is_loaded()) {
-            callback("Error: Model not loaded");
-            return;
+            error = "Model not loaded";
+            return false;
+        }
+        if (tokenizer && model_.get() != tokenizer) {
+            error = "Model changed while the batch was being tokenized";
+            return false;
+        }
+        tokenizer = model_.get();
+        width = (size_t)model_->parallel_sequences();
+        const size_t end = std::min(items.size(), begin + kTokenizeChunk);
+        for (size_t i = begin; i < end; ++i) {
+            tokens[i] = model_->tokenize_prompt(items[i].prompt);
+            summary.prompt_tokens += tokens[i].size();
+        }
+    }
+    
+    // Group prompts by their opening tokens so a shared system prompt or
+    // few-shot header runs back to back and its KV cache is reused; within a
+    // group, shorter prompts go first so similar lengths share decode steps
+    const size_t kGroupPrefix = 32;
+    std::vector<size_t> order(items.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&tokens, kGroupPrefix](size_t a, size_t b) {
+        const auto& ta = tokens[a];
+        const auto& tb = tokens[b];
+        const auto ea = ta.begin() + std::min(ta.size(), kGroupPrefix);
+        const auto eb = tb.begin() + std::min(tb.size(), kGroupPrefix);
+        if (std::lexicographical_compare(ta.begin(), ea, tb.begin(), eb)) {
+            return true;
+        }
+        if (std::lexicographical_compare(tb.begin(), eb, ta.begin(), ea)) {
+            return false;
+        }
+        return ta.size() < tb.size();
+    });
+    
+    RequestOptions batch_options = options;
+    batch_options.priority = RequestPriority::Batch;
+    
+    CancelToken cancel = make_cancel_token();
+    uint64_t batch_id;
+    {
+        std::lock_guard<std::mutex> lock(requests_mutex_);
+        batch_id = next_request_id_++;
+        requests_[batch_id] = cancel;
+    }
+    
+    // A full slot set plus as many waiting, so a finishing sequence is
+    // replaced on the next step without flooding the shared queue
+    const size_t window = width * 2;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<size_t> retry;  // shed by interactive traffic, resubmitted later
+    size_t next = 0;
+    size_t in_flight = 0;
+    size_t finished = 0;
+    bool unloaded = false;  // the model went away under the batch
+    
+    auto finish = [&](size_t index, const RequestResult& r) {
+        // mutex held
+        BatchItemResult result;
+        result.index = index;
+        result.id = items[index].id;
+        if (r.cancelled) {
+            result.error = "Error: Cancelled";
+        } else if (!r.error.empty()) {
+            result.error = r.error;
+        } else {
+            result.output = r.output;
+            result.metrics = r.metrics.compare(0, 6, "[DONE]") == 0 ? r.metrics.substr(6) : r.metrics;
+        }
+        (result.error.empty() ? summary.completed : summary.failed)++;
+        finished++;
+        if (on_result) {
+            on_result(result);
         }
+    };
+    
+    std::unique_lock<std::mutex> lock(mutex);
+    while (finished < items.size()) {
+        if (cancel->load() || unloaded) {
+            // Whatever was never submitted is reported right away: cancelled,
+            // or failed if there is no model left to run it
+            RequestResult rest;
+            rest.cancelled = cancel->load();
+            if (!rest.cancelled) {
+                rest.error = "Error: Model not loaded";
+            }
+            while (!retry.empty()) {
+                finish(retry.front(), rest);
+                retry.pop_front();
+            }
+            while (next < order.size()) {
+                finish(order[next++], rest);
+            }
+            if (rest.cancelled) {
+                summary.cancelled = true;
+            }
+        }
+        if (in_flight >= window || (retry.empty() && next >= order.size())) {
+            cv.wait(lock);
+            continue;
+        }
+        const size_t index = retry.empty() ? order[next++] : retry.front();
+        if (!retry.empty()) {
+            retry.pop_front();
+        }
+        if (tokens[index].empty()) {
+            RequestResult empty;
+            empty.error = "Error: Empty prompt";
+            finish(index, empty);
+            continue;
+        }
+        in_flight++;
+        lock.unlock();
         
-        model_->generate_stream(prompt, [this, callback](const std::string& text) {
-            if (stop_generation_) {
+        const int item_max = items[index].max_tokens > 0 ? items[index].max_tokens : max_tokens;
+        uint64_t id = 0;
+        bool gone = false;
+        {
+            std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+            RequestScheduler::CompleteCallback done = [&, index](const RequestResult& r) {
+                std::lock_guard<std::mutex> done_lock(mutex);
+                in_flight--;
+                if (r.error == "Error: Queue full" && !cancel->load()) {
+                    retry.push_back(index);
+                } else {
+                    finish(index, r);
+                }
+                cv.notify_all();
+            };
+            if (scheduler_) {
+                id = scheduler_->submit_tokens(tokens[index], item_max, cancel, nullptr, std::move(done),
+                                               batch_options);
+            } else {
+                gone = true;
+            }
+        }
+        lock.lock();
+        if (gone) {
+            in_flight--;
+            RequestResult stopped;
+            stopped.error = "Error: Model not loaded";
+            finish(index, stopped);
+            unloaded = true;
+        } else if (id == 0 && !retry.empty()) {
+            // Rejected on this thread (queue full): resubmit once one of ours
+            // frees a place. With none of ours queued nothing will wake us, so
+            // then only wait out a short backoff.
+            const size_t busy = in_flight;
+            if (busy > 0) {
+                cv.wait(lock, [&] { return in_flight < busy; });
+            } else {
+                cv.wait_for(lock, std::chrono::milliseconds(20));
+            }
+        }
+    }
+    lock.unlock();
+    
+    {
+        std::lock_guard<std::mutex> requests_lock(requests_mutex_);
+        requests_.erase(batch_id);
+    }
+    summary.duration_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    LLM_LOG_INFO("InferenceEngine", "Batch of " << items.size() << " finished in "
+                                    << (int)summary.duration_ms << " ms (" << summary.failed << " failed)");
+    return true;
+}
+
+uint64_t InferenceEngine::submit_stream(const StreamSubmit& submit,
+                                        std::function<void(const std::string&)> callback,
+                                        std::function<void(const std::string&)> on_complete) {
+    std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+    if (!scheduler_) {
+        if (on_complete) {
+            on_complete("Error: Model not loaded");
+        } else {
+            callback("Error: Model not loaded");
+        }
+        return 0;
+    }
+    
+    CancelToken cancel = make_cancel_token();
+    uint64_t request_id;
+    {
+        std::lock_guard<std::mutex> lock(requests_mutex_);
+        request_id = next_request_id_++;
+        requests_[request_id] = cancel;
+    }
+    
+    const LLMModel* model = model_.get();
+    submit(*scheduler_, cancel,
+        [callback, cancel](const std::string& text) {
+            if (cancel->load(std::memory_order_relaxed)) {
                 return;
             }
             callback(text);
-        }, max_tokens);
-    });
+        },
+        [this, request_id, model, callback, on_complete](const RequestResult& r) {
+            {
+                std::lock_guard<std::mutex> lock(requests_mutex_);
+                requests_.erase(request_id);
+            }
+            // Recorded before the caller hears about completion, so it can
+            // save_session() straight from its [DONE] handler
+            if (r.error.empty() && !r.cancelled && r.slot >= 0) {
+                std::lock_guard<std::mutex> lock(completed_mutex_);
+                completed_.push_back({request_id, model, r.slot, r.slot_tick});
+                if (completed_.size() > 64) {
+                    completed_.pop_front();
+                }
+            }
+            const std::string final_message = r.cancelled ? std::string() :
+                                              (r.error.empty() ? r.metrics : r.error);
+            if (on_complete) {
+                on_complete(final_message);
+            } else if (!r.cancelled) {
+                callback(final_message);
+            }
+        });
+    return request_id;
 }
 
 bool InferenceEngine::is_ready() const {
@@ -93,6 +616,322 @@ std::string InferenceEngine::get_model_info() const {
     return model_->get_model_info();
 }
 
+std::vector<int32_t> InferenceEngine::tokenize(const std::string& text) const {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_ || !model_->is_loaded()) {
+        return {};
+    }
+    return model_->tokenize_prompt(text);
+}
+
+bool InferenceEngine::save_session(const std::string& session_id, uint64_t request_id, std::string& error) {
+    CompletedRequest ref;
+    {
+        std::lock_guard<std::mutex> lock(completed_mutex_);
+        for (auto it = completed_.rbegin(); it != completed_.rend(); ++it) {
+            if (request_id == 0 || it->request_id == request_id) {
+                ref = *it;
+                break;
+            }
+        }
+    }
+    if (ref.slot < 0) {
+        error = "No finished request to save";
+        return false;
+    }
+    
+    // Decoding waits while the state is copied into the (page-cached) file
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_ || model_.get() != ref.model || ref.slot >= model_->slot_count()) {
+        error = "The request ran on a model that is no longer loaded";
+        return false;
+    }
+    const SequenceSlot& s = model_->slot(ref.slot);
+    if (s.state != SequenceSlot::State::Idle || s.last_used != ref.slot_tick) {
+        error = "Sequence state is no longer resident (its slot was reused)";
+        return false;
+    }
+    if (!s.cache_adapter.empty()) {
+        error = "Sequences generated with a LoRA adapter are not saved";
+        return false;
+    }
+    const size_t state_size = model_->sequence_state_size(ref.slot);
+    if (state_size == 0) {
+        error = "Sequence holds no KV state";
+        return false;
+    }
+    LLMModel* model = model_.get();
+    const int slot = ref.slot;
+    return sessions_.save(session_id, model->fingerprint(), s.cache.data(), s.cache.size(), state_size,
+                          [model, slot](uint8_t* dst, size_t size) {
+                              return model->copy_sequence_state(slot, dst, size);
+                          }, error);
+}
+
+bool InferenceEngine::load_session(const std::string& session_id, std::string& error) {
+    // Mapping and validating the file needs no model lock
+    std::unique_ptr<SessionFile> file = sessions_.open(session_id, error);
+    if (!file) {
+        return false;
+    }
+    
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_ || !model_->is_loaded()) {
+        error = "Model not loaded";
+        return false;
+    }
+    if (file->fingerprint != model_->fingerprint()) {
+        error = "Session was saved with a different model";
+        return false;
+    }
+    const int slot = model_->restore_sequence(file->tokens, file->n_tokens, file->state, file->state_size);
+    if (slot < 0) {
+        error = "No idle sequence slot could take the session";
+        return false;
+    }
+    LLM_LOG_INFO("InferenceEngine", "Session " << session_id << " restored into slot " << slot
+                                    << " (" << file->n_tokens << " tokens)");
+    return true;
+}
+
+bool InferenceEngine::delete_session(const std::string& session_id) {
+    return sessions_.remove(session_id);
+}
+
+bool InferenceEngine::detokenize(const int32_t* tokens, size_t n_tokens, std::string& text) const {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_ || !model_->is_loaded()) {
+        return false;
+    }
+    const int n_vocab = model_->n_vocab();
+    if (std::any_of(tokens, tokens + n_tokens, [n_vocab](int32_t t) { return t < 0 || t >= n_vocab; })) {
+        return false;
+    }
+    text = model_->detokenize(std::vector<llama_token>(tokens, tokens + n_tokens));
+    return true;
+}
+
+bool InferenceEngine::embed(const std::vector<std::string>& texts, bool normalize,
+                            std::vector<float>& out, int& n_embd, std::string& error) {
+    std::vector<std::vector<llama_token>> inputs;
+    inputs.reserve(texts.size());
+    const LLMModel* model = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(model_mutex_);
+        if (!model_ || !model_->is_loaded()) {
+            error = "Model not loaded";
+            return false;
+        }
+        EmbeddingContext* embedder = model_->embedding_context();
+        if (!embedder) {
+            error = "Failed to create embedding context";
+            return false;
+        }
+        model = model_.get();
+        n_embd = embedder->n_embd();
+        const size_t max_tokens = (size_t)embedder->max_tokens();
+        for (size_t i = 0; i < texts.size(); ++i) {
+            std::vector<llama_token> tokens = model_->tokenize_prompt(texts[i]);
+            if (tokens.empty()) {
+                error = "Input " + std::to_string(i) + " has no tokens";
+                return false;
+            }
+            if (tokens.size() > max_tokens) {
+                LLM_LOG_WARN("InferenceEngine", "Embedding input " << i << " truncated from "
+                                                << tokens.size() << " to " << max_tokens << " tokens");
+                tokens.resize(max_tokens);
+            }
+            inputs.push_back(std::move(tokens));
+        }
+    }
+    
+    // One batch per lock, so streams interleave with a long indexing job
+    out.assign(inputs.size() * (size_t)n_embd, 0.0f);
+    size_t n_done = 0;
+    while (n_done < inputs.size()) {
+        std::lock_guard<std::mutex> lock(model_mutex_);
+        EmbeddingContext* embedder = model_.get() == model ? model_->embedding_context() : nullptr;
+        if (!embedder) {
+            error = "Model changed while embedding";
+            return false;
+        }
+        const int n = embedder->embed_chunk(inputs, n_done, out.data() + n_done * n_embd, normalize);
+        if (n <= 0) {
+            error = "Embedding failed";
+            return false;
+        }
+        n_done += n;
+    }
+    return true;
+}
+
+int InferenceEngine::count_tokens(const std::string& text) const {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_ || !model_->is_loaded()) {
+        return -1;
+    }
+    return (int)model_->tokenize_prompt(text).size();
+}
+
+bool InferenceEngine::apply_chat_template(const std::string& conversation_id,
+                                          const std::vector<ChatMessage>& messages,
+                                          bool add_generation_prompt, std::vector<int32_t>& tokens,
+                                          std::string& error) {
+    static const size_t kMaxConversations = 32;
+    
+    // Rendered from the snapshot: tokenizing only reads the vocabulary, so
+    // it does not wait for the decode step holding model_mutex_
+    const std::shared_ptr<const ModelSnapshot> current = snapshot();
+    if (!current) {
+        error = "Model not loaded";
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(chat_mutex_);
+    if (messages.empty()) {
+        error = "No messages";
+        return false;
+    }
+    
+    ChatState fresh;
+    ChatState* state = &fresh;
+    if (!conversation_id.empty()) {
+        auto it = std::find_if(conversations_.begin(), conversations_.end(),
+                               [&conversation_id](const CachedConversation& c) { return c.id == conversation_id; });
+        CachedConversation entry;
+        if (it != conversations_.end()) {
+            entry = std::move(*it);
+            conversations_.erase(it);
+        }
+        const std::vector<ChatMessage>& known = entry.state.messages;
+        const bool extends = entry.model == current->model && known.size() <= messages.size() &&
+            std::equal(known.begin(), known.end(), messages.begin(), [](const ChatMessage& a, const ChatMessage& b) {
+                return a.role == b.role && a.content == b.content;
+            });
+        if (!extends) {
+            entry.state = ChatState();
+        }
+        entry.id = conversation_id;
+        entry.model = current->model;
+        conversations_.push_back(std::move(entry));
+        if (conversations_.size() > kMaxConversations) {
+            conversations_.pop_front();
+        }
+        state = &conversations_.back().state;
+    }
+    
+    const ChatTemplate& chat = current->chat;
+    chat.append(*state, std::vector<ChatMessage>(messages.begin() + state->messages.size(), messages.end()));
+    tokens = chat.prompt(*state, add_generation_prompt);
+    if (tokens.empty()) {
+        error = "Chat template failed to render";
+        return false;
+    }
+    return true;
+}
+
+std::string InferenceEngine::get_queue_stats() {
+    QueueStats stats;
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex_);
+        if (scheduler_) {
+            stats = scheduler_->stats();
+        }
+    }
+    std::ostringstream oss;
+    oss << "{\"queued_interactive\":" << stats.queued_interactive
+        << ",\"queued_batch\":" << stats.queued_batch
+        << ",\"admitted\":" << stats.admitted
+        << ",\"rejected_full\":" << stats.rejected_full
+        << ",\"rejected_deadline\":" << stats.rejected_deadline
+        << ",\"shed\":" << stats.shed
+        << ",\"wait_ms_mean\":" << (stats.admitted > 0 ? stats.wait_ms_total / stats.admitted : 0.0)
+        << ",\"wait_ms_max\":" << stats.wait_ms_max << "}";
+    return oss.str();
+}
+
+std::string InferenceEngine::get_prometheus_metrics() {
+    CoreMetrics& core = core_metrics();
+    QueueStats stats;
+    {
+        std::lock_guard<std::mutex> lock(scheduler_mutex_);
+        if (scheduler_) {
+            stats = scheduler_->stats();
+        }
+    }
+    core.queued_interactive.set((double)stats.queued_interactive);
+    core.queued_batch.set((double)stats.queued_batch);
+    
+    // Sampled per scrape rather than per token
+    const ThermalReading thermal = read_thermal();
+    if (thermal.has_temperature) {
+        core.cpu_temperature.set(thermal.temperature_c);
+    }
+    core.cpu_frequency.set(thermal.cur_freq_khz * 1000.0);
+    core.cpu_frequency_max.set(thermal.max_freq_khz * 1000.0);
+    core.thermal_throttled.set(thermal.throttled ? 1.0 : 0.0);
+    return MetricsRegistry::instance().render();
+}
+
+std::string InferenceEngine::get_metrics() const {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_) {
+        return "{}";
+    }
+    return model_->get_last_metrics();
+}
+
+void InferenceEngine::publish_snapshot() {
+    std::shared_ptr<ModelSnapshot> next;
+    if (model_ && model_->is_loaded()) {
+        next = std::make_shared<ModelSnapshot>();
+        next->weights = model_->weights();
+        next->chat = model_->chat_template();
+        next->warmup = model_->warmup_stats();
+        next->model = model_.get();
+        next->adapters = model_->adapter_cache();
+    }
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    snapshot_ = std::move(next);
+}
+
+std::shared_ptr<const InferenceEngine::ModelSnapshot> InferenceEngine::snapshot() const {
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    return snapshot_;
+}
+
+std::string InferenceEngine::get_warmup_stats() const {
+    // Read by /api/status on the event loop, so never behind model_mutex_
+    const std::shared_ptr<const ModelSnapshot> current = snapshot();
+    const WarmupStats stats = current ? current->warmup : WarmupStats();
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1)
+        << "{\"done\":" << (stats.done ? "true" : "false")
+        << ",\"prefetch_ms\":" << stats.prefetch_ms
+        << ",\"prefetch_bytes\":" << stats.prefetch_bytes
+        << ",\"context_ms\":" << stats.context_ms
+        << ",\"decode_ms\":" << stats.decode_ms
+        << ",\"prompt_ms\":" << stats.prompt_ms
+        << ",\"prompt_tokens\":" << stats.prompt_tokens
+        << ",\"total_ms\":" << stats.total_ms
+        << "}";
+    return oss.str();
+}
+
+bool InferenceEngine::load_lora(const std::string& name, std::string& error) {
+    // Reads the file on this thread; running sequences keep decoding
+    auto snap = snapshot();
+    if (!snap) {
+        error = "Model not loaded";
+        return false;
+    }
+    return snap->adapters->load(name, error) != nullptr;
+}
+
+std::string InferenceEngine::get_lora_adapters() const {
+    auto snap = snapshot();
+    return snap ? snap->adapters->stats_json() : "{}";
+}
+
 void InferenceEngine::set_temperature(float temp) {
     std::lock_guard<std::mutex> lock(model_mutex_);
     if (model_) {
@@ -170,6 +1009,13 @@ void InferenceEngine::set_presence_penalty(float penalty) {
     }
 }
 
+void InferenceEngine::set_mirostat(int mode) {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (model_) {
+        model_->set_mirostat(mode);
+    }
+}
+
 void InferenceEngine::set_mirostat_tau(float tau) {
     std::lock_guard<std::mutex> lock(model_mutex_);
     if (model_) {
@@ -268,6 +1114,13 @@ void InferenceEngine::set_embeddings(bool enabled) {
     }
 }
 
+void InferenceEngine::set_threads(int threads) {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (model_) {
+        model_->set_threads(threads);
+    }
+}
+
 void InferenceEngine::set_threads_batch(int threads) {
     std::lock_guard<std::mutex> lock(model_mutex_);
     if (model_) {
@@ -283,7 +1136,25 @@ void InferenceEngine::set_ubatch_size(int size) {
 }
 
 void InferenceEngine::stop_generation() {
-    stop_generation_ = true;
+    std::lock_guard<std::mutex> lock(requests_mutex_);
+    for (auto& entry : requests_) {
+        entry.second->store(true);
+    }
+}
+
+bool InferenceEngine::stop_generation(uint64_t request_id) {
+    std::lock_guard<std::mutex> lock(requests_mutex_);
+    auto it = requests_.find(request_id);
+    if (it == requests_.end()) {
+        return false;
+    }
+    it->second->store(true);
+    return true;
+}
+
+std::vector<int> InferenceEngine::host_cpus() const {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    return model_ ? model_->host_cpus() : std::vector<int>();
 }
 
 LLMModel* InferenceEngine::get_model() const {
@@ -333,8 +1204,12 @@ std::string InferenceEngine::get_system_info() {
     
     // CPU info
     struct sysinfo si;
+    const CpuTopology topo = detect_cpu_topology();
+    oss << "CPU Cores: " << topo.cpus.size() << "\n";
+    if (topo.performance.size() != topo.cpus.size()) {
+        oss << "Performance Cores: " << format_cpu_list(topo.performance) << "\n";
+    }
     if (sysinfo(&si) == 0) {
-        oss << "CPU Cores: " << si.procs << "\n";
         oss << "Total RAM: " << (si.totalram / 1024 / 1024) << " MB\n";
         oss << "Free RAM: " << (si.freeram / 1024 / 1024) << " MB\n";
         oss << "Used RAM: " << ((si.totalram - si.freeram) / 1024 / 1024) << " MB\n";
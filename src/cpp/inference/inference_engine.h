@@ -1,11 +1,19 @@
 #pragma once
 
 #include "../model/llm_model.h"
+#include "request_scheduler.h"
+#include "session_store.h"
+#include "batch_job.h"
+#include "thermal_governor.h"
 #include <memory>
 #include <string>
 #include <functional>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <vector>
+#include <deque>
 
 namespace local_llm {
 
@@ -14,16 +22,52 @@ public:
     InferenceEngine();
     ~InferenceEngine();
     
-    // Initialize the inference engine
+    // Initialize the inference engine. With a model already running and RAM
+    // budget to spare, this hot-swaps: requests in flight finish on the old
+    // model, new ones go to the new model, and a failed load keeps the old one.
     bool initialize(const ModelConfig& config);
     
-    // Generate text (synchronous)
-    std::string generate_text(const std::string& prompt, int max_tokens = 256);
+    // Load a model into the shared registry so a later initialize() is instant
+    bool preload_model(const std::string& model_path);
     
-    // Generate text with streaming (asynchronous)
-    void generate_text_stream(const std::string& prompt,
+    // Models held by the registry, as JSON
+    std::string get_loaded_models() const;
+    
+    // Generate text (synchronous). `options` can constrain the output to a
+    // grammar or JSON schema; one that does not compile fails the request.
+    std::string generate_text(const std::string& prompt, int max_tokens = 256,
+                              const RequestOptions& options = RequestOptions());
+    
+    // Generate text with streaming (asynchronous). Concurrent calls are batched
+    // together. The final [DONE] metrics or error message goes to on_complete
+    // when one is given (empty if the request was cancelled), otherwise to
+    // callback. Returns a request id usable with stop_generation(id).
+    uint64_t generate_text_stream(const std::string& prompt,
                              std::function<void(const std::string&)> callback,
-                             int max_tokens = 256);
+                             int max_tokens = 256,
+                             std::function<void(const std::string&)> on_complete = nullptr,
+                             const RequestOptions& options = RequestOptions());
+    
+    // Same, for a prompt that is already tokenized (e.g. a chat template
+    // applied once and reused); ids outside the vocabulary fail the request
+    uint64_t generate_tokens_stream(std::vector<int32_t> tokens,
+                                    std::function<void(const std::string&)> callback,
+                                    int max_tokens = 256,
+                                    std::function<void(const std::string&)> on_complete = nullptr,
+                                    const RequestOptions& options = RequestOptions());
+    
+    // Offline batch for throughput, not latency. Prompts are tokenized up
+    // front and submitted grouped by their first tokens, shortest first within
+    // a group, so items sharing a prefix run back to back and reuse its KV
+    // cache and similar lengths finish together; enough are kept queued that
+    // every slot stays busy. Items go in at batch priority, behind interactive
+    // traffic. on_result is called once per item as it finishes (serialised,
+    // any thread). stop_generation() cancels the rest of the batch. False only
+    // if the batch could not start.
+    bool generate_batch(const std::vector<BatchItem>& items, int max_tokens,
+                        const std::function<void(const BatchItemResult&)>& on_result,
+                        BatchSummary& summary, std::string& error,
+                        const RequestOptions& options = RequestOptions());
     
     // Check if engine is ready
     bool is_ready() const;
@@ -31,6 +75,61 @@ public:
     // Get model information
     std::string get_model_info() const;
     
+    // Tokenize text the way prompts are (with BOS); empty if no model is loaded
+    std::vector<int32_t> tokenize(const std::string& text) const;
+    
+    // Text of a token sequence; false if no model is loaded or an id is out of range
+    bool detokenize(const int32_t* tokens, size_t n_tokens, std::string& text) const;
+    
+    // Prompt tokens `text` would cost (BOS included); -1 if no model is loaded
+    int count_tokens(const std::string& text) const;
+    
+    // Prompt tokens of a chat formatted with the model's template. With a
+    // conversation id, a call whose messages extend those of the previous call
+    // only renders and tokenizes the new messages; any other list starts over.
+    bool apply_chat_template(const std::string& conversation_id, const std::vector<ChatMessage>& messages,
+                             bool add_generation_prompt, std::vector<int32_t>& tokens, std::string& error);
+    
+    // Pooled embeddings of `texts`, row-major in `out` (n_embd floats each).
+    // Inputs are batched many to a decode; inputs longer than the embedding
+    // batch are truncated. Generation keeps running between batches.
+    bool embed(const std::vector<std::string>& texts, bool normalize,
+               std::vector<float>& out, int& n_embd, std::string& error);
+    
+    // Persist the KV cache a finished streaming request left behind (request_id
+    // 0 = the most recent one) as session `session_id`. Fails once its slot has
+    // been taken by another request.
+    bool save_session(const std::string& session_id, uint64_t request_id, std::string& error);
+    
+    // Restore a saved session into an idle sequence slot, so the next prompt
+    // that starts with the same tokens skips their prefill
+    bool load_session(const std::string& session_id, std::string& error);
+    
+    // Delete a saved session
+    bool delete_session(const std::string& session_id);
+    
+    // Per-phase timing of the most recently finished request, as JSON
+    std::string get_metrics() const;
+    
+    // Process-wide counters, gauges and histograms in the Prometheus text
+    // format; queue depth and thermal state are sampled on each call
+    std::string get_prometheus_metrics();
+    
+    // Thermal governor level, limits and last reading, as JSON ("{}" when off)
+    std::string get_governor_state();
+    
+    // Phase timings of the current model's startup warmup, as JSON
+    std::string get_warmup_stats() const;
+    
+    // Load a LoRA adapter (<loraDir>/<name>.gguf) before requests name it
+    bool load_lora(const std::string& name, std::string& error);
+    
+    // Loaded LoRA adapters and the one applied to the context, as JSON
+    std::string get_lora_adapters() const;
+    
+    // Queue depth per priority and admission counters of the current scheduler, as JSON
+    std::string get_queue_stats();
+    
     // Update generation parameters
     void set_temperature(float temp);
     void set_top_p(float top_p);
@@ -43,6 +142,7 @@ public:
     void set_repeat_penalty_last_n(int last_n);
     void set_frequency_penalty(float penalty);
     void set_presence_penalty(float penalty);
+    void set_mirostat(int mode);
     void set_mirostat_tau(float tau);
     void set_mirostat_eta(float eta);
     void set_mirostat_m(int m);
@@ -57,20 +157,109 @@ public:
     void set_flash_attn(bool enabled);
     void set_offload_kqv(bool enabled);
     void set_embeddings(bool enabled);
+    void set_threads(int threads);
     void set_threads_batch(int threads);
     void set_ubatch_size(int size);
     
-    // Stop current generation
+    // Cancel every running and queued generation
     void stop_generation();
     
+    // Cancel a single request; returns false if it already finished
+    bool stop_generation(uint64_t request_id);
+    
+    // Allowed CPUs outside the model's compute set; callers pin latency-sensitive
+    // threads (the Node event loop) here. Empty when compute uses every CPU.
+    std::vector<int> host_cpus() const;
+    
     // Get system information
     static std::string get_system_info();
 
 private:
     std::unique_ptr<LLMModel> model_;
-    std::thread generation_thread_;
+    std::unique_ptr<RequestScheduler> scheduler_;
     mutable std::mutex model_mutex_;  // Changed to mutable
-    bool stop_generation_;
+    
+    // Guards the scheduler_ pointer; initialize() swaps it from worker threads
+    std::mutex scheduler_mutex_;
+    
+    // Serialises initialize() calls
+    std::mutex init_mutex_;
+    
+    // Swapped-out schedulers draining their last requests, with their models.
+    // The reaper thread frees each pair as soon as its scheduler has drained,
+    // so the old weights do not outlive the swap.
+    std::vector<std::pair<std::unique_ptr<RequestScheduler>, std::unique_ptr<LLMModel>>> retired_;
+    std::mutex retired_mutex_;
+    std::condition_variable retired_cv_;
+    bool reaper_stop_ = false;
+    std::thread reaper_;
+    
+    // Register a streaming request and hand it to the scheduler through `submit`
+    using StreamSubmit = std::function<void(RequestScheduler&, CancelToken,
+                                            RequestScheduler::TextCallback,
+                                            RequestScheduler::CompleteCallback)>;
+    uint64_t submit_stream(const StreamSubmit& submit,
+                           std::function<void(const std::string&)> callback,
+                           std::function<void(const std::string&)> on_complete);
+    
+    // Replace the running model without stopping it first
+    bool hot_swap(const ModelConfig& config);
+    
+    // Drain a swapped-out pair and hand it to the reaper thread
+    void retire(std::unique_ptr<RequestScheduler> scheduler, std::unique_ptr<LLMModel> model);
+    
+    // Reaper thread: free retired pairs whose scheduler has drained
+    void reap_loop();
+    
+    // Thermal governor of the current model; replaced on every initialize()
+    // (init_mutex_ held), read under governor_mutex_
+    std::mutex governor_mutex_;
+    std::unique_ptr<ThermalGovernor> governor_;
+    void configure_governor(const ModelConfig& config);
+    
+    // KV sessions saved to disk
+    SessionStore sessions_;
+    
+    // Where recently completed streaming requests left their KV cache
+    struct CompletedRequest {
+        uint64_t request_id = 0;
+        const LLMModel* model = nullptr;
+        int slot = -1;
+        uint64_t slot_tick = 0;
+    };
+    std::mutex completed_mutex_;
+    std::deque<CompletedRequest> completed_;
+    
+    // What the JS thread reads about the current model, copied whenever model_
+    // changes so status calls and chat rendering never wait for a decode step
+    struct ModelSnapshot {
+        ModelHandle weights;  // keeps `chat`'s vocabulary alive
+        ChatTemplate chat;
+        WarmupStats warmup;
+        const LLMModel* model = nullptr;
+        std::shared_ptr<LoraAdapterCache> adapters;
+    };
+    mutable std::mutex snapshot_mutex_;
+    std::shared_ptr<const ModelSnapshot> snapshot_;
+    
+    // Replace the snapshot with one of model_ (model_mutex_ held)
+    void publish_snapshot();
+    
+    std::shared_ptr<const ModelSnapshot> snapshot() const;
+    
+    // Rendered chats by conversation id, most recently used last (chat_mutex_ held)
+    std::mutex chat_mutex_;
+    struct CachedConversation {
+        std::string id;
+        const LLMModel* model = nullptr;
+        ChatState state;
+    };
+    std::deque<CachedConversation> conversations_;
+    
+    // Cancel tokens of requests that have not completed yet
+    std::mutex requests_mutex_;
+    std::unordered_map<uint64_t, CancelToken> requests_;
+    uint64_t next_request_id_ = 1;
     
     // Thread-safe model access
     LLMModel* get_model() const;
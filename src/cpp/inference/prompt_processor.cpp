@@ -1,7 +1,7 @@
 #include "prompt_processor.h"
 #include <sstream>
 #include <algorithm>
-#include <regex>
+#include <cctype>
 
 namespace local_llm {
 
@@ -18,14 +18,20 @@ std::string PromptProcessor::formatPrompt(const std::string& prompt, const std::
 }
 
 std::string PromptProcessor::extractSystemMessage(const std::string& prompt) {
-    std::regex systemRegex(R"(\[SYSTEM\](.*?)\[/SYSTEM\])", std::regex::icase);
-    std::smatch match;
-    
-    if (std::regex_search(prompt, match, systemRegex)) {
-        return match[1].str();
+    // Case-insensitive search for [SYSTEM]...[/SYSTEM] on a lowered copy
+    std::string lower = prompt;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    
+    const std::string open = "[system]";
+    const size_t begin = lower.find(open);
+    if (begin == std::string::npos) {
+        return "";
     }
-    
-    return "";
+    const size_t end = lower.find("[/system]", begin + open.size());
+    if (end == std::string::npos) {
+        return "";
+    }
+    return prompt.substr(begin + open.size(), end - begin - open.size());
 }
 
 std::string PromptProcessor::formatConversation(const std::vector<std::pair<std::string, std::string>>& messages) {
@@ -45,15 +51,21 @@ std::string PromptProcessor::formatConversation(const std::vector<std::pair<std:
 }
 
 std::string PromptProcessor::cleanPrompt(const std::string& prompt) {
-    std::string cleaned = prompt;
-    
-    // Remove excessive whitespace
-    std::regex whitespaceRegex(R"(\s+)");
-    cleaned = std::regex_replace(cleaned, whitespaceRegex, " ");
-    
-    // Trim leading and trailing whitespace
-    cleaned.erase(0, cleaned.find_first_not_of(" \t\n\r"));
-    cleaned.erase(cleaned.find_last_not_of(" \t\n\r") + 1);
+    // Collapse whitespace runs to one space and trim, in a single pass
+    std::string cleaned;
+    cleaned.reserve(prompt.size());
+    bool pending_space = false;
+    for (char c : prompt) {
+        if (std::isspace((unsigned char)c)) {
+            pending_space = !cleaned.empty();
+            continue;
+        }
+        if (pending_space) {
+            cleaned += ' ';
+            pending_space = false;
+        }
+        cleaned += c;
+    }
     
     return cleaned;
 }
@@ -13,7 +13,8 @@ public:
     // Extract system message from prompt
     static std::string extractSystemMessage(const std::string& prompt);
     
-    // Format conversation history
+    // Format conversation history with Llama-2 markup. Model-aware chat
+    // formatting lives in ChatTemplate (InferenceEngine::apply_chat_template).
     static std::string formatConversation(const std::vector<std::pair<std::string, std::string>>& messages);
     
     // Clean and normalize prompt
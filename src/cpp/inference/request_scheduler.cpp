@@ -0,0 +1,385 @@
+#include "request_scheduler.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+
+namespace local_llm {
+
+RequestScheduler::RequestScheduler(LLMModel* model, std::mutex& model_mutex, size_t max_queue_depth)
+    : model_(model), model_mutex_(model_mutex), max_queue_depth_(max_queue_depth) {
+    // A finished adapter load may unblock queued requests
+    model_->adapter_cache()->set_on_loaded([this] {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            waiting_for_adapter_ = false;
+        }
+        queue_cv_.notify_all();
+    });
+    thread_ = std::thread(&RequestScheduler::run, this);
+}
+
+RequestScheduler::~RequestScheduler() {
+    model_->adapter_cache()->set_on_loaded(nullptr);
+    shutdown();
+}
+
+uint64_t RequestScheduler::submit(const std::string& prompt, int max_tokens, CancelToken cancel,
+                                  TextCallback on_text, CompleteCallback on_complete,
+                                  const RequestOptions& options) {
+    auto req = std::make_unique<Request>();
+    req->prompt = prompt;
+    req->max_tokens = max_tokens;
+    req->options = options;
+    req->cancel = std::move(cancel);
+    req->on_text = std::move(on_text);
+    req->on_complete = std::move(on_complete);
+    return enqueue(std::move(req));
+}
+
+uint64_t RequestScheduler::submit_tokens(std::vector<llama_token> tokens, int max_tokens, CancelToken cancel,
+                                         TextCallback on_text, CompleteCallback on_complete,
+                                         const RequestOptions& options) {
+    auto req = std::make_unique<Request>();
+    req->tokens = std::move(tokens);
+    req->max_tokens = max_tokens;
+    req->options = options;
+    req->cancel = std::move(cancel);
+    req->on_text = std::move(on_text);
+    req->on_complete = std::move(on_complete);
+    return enqueue(std::move(req));
+}
+
+uint64_t RequestScheduler::enqueue(std::unique_ptr<Request> req) {
+    uint64_t id = 0;
+    std::unique_ptr<Request> shed;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (!running_ || draining_) {
+            RequestResult result;
+            result.error = "Error: Scheduler stopped";
+            if (req->on_complete) {
+                req->on_complete(result);
+            }
+            return 0;
+        }
+        
+        const int priority = (int)req->options.priority;
+        bool admit = true;
+        if (max_queue_depth_ > 0 && queued() >= max_queue_depth_) {
+            // Full: batch work makes room for interactive work, anything else is turned away
+            auto& batch = pending_[(int)RequestPriority::Batch];
+            if (req->options.priority == RequestPriority::Interactive && !batch.empty()) {
+                shed = std::move(batch.back());
+                batch.pop_back();
+                stats_.shed++;
+                core_metrics().requests_rejected.inc();
+            } else {
+                stats_.rejected_full++;
+                core_metrics().requests_rejected.inc();
+                admit = false;
+            }
+        }
+        if (admit) {
+            id = next_id_++;
+            req->id = id;
+            req->enqueued = std::chrono::steady_clock::now();
+            req->deadline = req->options.deadline_ms > 0
+                ? req->enqueued + std::chrono::milliseconds(req->options.deadline_ms)
+                : std::chrono::steady_clock::time_point::max();
+            pending_[priority].push_back(std::move(req));
+        }
+    }
+    
+    // Rejections are reported outside the lock, on the caller's thread
+    RequestResult full;
+    full.error = "Error: Queue full";
+    if (shed && shed->on_complete) {
+        LLM_LOG_INFO("RequestScheduler", "Queue full, shed batch request " << shed->id);
+        shed->on_complete(full);
+    }
+    if (id == 0) {
+        if (req->on_complete) {
+            req->on_complete(full);
+        }
+        return 0;
+    }
+    queue_cv_.notify_one();
+    return id;
+}
+
+QueueStats RequestScheduler::stats() const {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    QueueStats stats = stats_;
+    stats.queued_interactive = pending_[(int)RequestPriority::Interactive].size();
+    stats.queued_batch = pending_[(int)RequestPriority::Batch].size();
+    return stats;
+}
+
+void RequestScheduler::expire_pending(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished) {
+    const auto now = std::chrono::steady_clock::now();
+    for (auto& queue : pending_) {
+        for (auto it = queue.begin(); it != queue.end();) {
+            Request& req = **it;
+            RequestResult result;
+            if (req.cancel && req.cancel->load()) {
+                result.cancelled = true;
+            } else if (now >= req.deadline) {
+                result.error = "Error: Queue deadline exceeded";
+                stats_.rejected_deadline++;
+            } else {
+                ++it;
+                continue;
+            }
+            finished.emplace_back(std::move(*it), std::move(result));
+            it = queue.erase(it);
+        }
+    }
+}
+
+void RequestScheduler::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (!running_ && !thread_.joinable()) {
+            return;
+        }
+        running_ = false;
+    }
+    queue_cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    
+    // Whatever is left never completed
+    RequestResult result;
+    result.error = "Error: Generation aborted";
+    std::deque<std::unique_ptr<Request>> pending;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (auto& queue : pending_) {
+            std::move(queue.begin(), queue.end(), std::back_inserter(pending));
+            queue.clear();
+        }
+    }
+    for (auto& req : active_) {
+        if (req && req->on_complete) {
+            req->on_complete(result);
+        }
+    }
+    active_.clear();
+    active_count_ = 0;
+    for (auto& req : pending) {
+        if (req->on_complete) {
+            req->on_complete(result);
+        }
+    }
+}
+
+void RequestScheduler::drain(std::function<void()> on_exit) {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        draining_ = true;
+        on_exit_ = std::move(on_exit);
+    }
+    queue_cv_.notify_all();
+}
+
+void RequestScheduler::run() {
+    std::vector<std::pair<std::unique_ptr<Request>, RequestResult>> finished;
+    
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            auto ready = [this] {
+                return !running_ || active_count_ > 0 || (queued() > 0 && !waiting_for_adapter_) ||
+                       (draining_ && queued() == 0);
+            };
+            if (waiting_for_adapter_) {
+                // Woken by the loader; the timeout still expires cancelled or late requests
+                queue_cv_.wait_for(lock, std::chrono::milliseconds(100), ready);
+            } else {
+                queue_cv_.wait(lock, ready);
+            }
+            if (!running_ || (draining_ && queued() == 0 && active_count_ == 0)) {
+                break;
+            }
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(model_mutex_);
+            admit_pending(finished);
+            if (active_count_ > 0) {
+                model_->decode_step();
+                collect_finished(finished);
+            }
+            model_->update_state_metrics();
+        }
+        
+        // Completion callbacks run without holding the model lock
+        CoreMetrics& core = core_metrics();
+        for (auto& item : finished) {
+            core.requests.inc();
+            if (item.second.cancelled) {
+                core.requests_cancelled.inc();
+            } else if (!item.second.error.empty()) {
+                core.request_errors.inc();
+            }
+            if (item.first->on_complete) {
+                item.first->on_complete(item.second);
+            }
+        }
+        finished.clear();
+    }
+    stopped_ = true;
+    
+    std::function<void()> on_exit;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        on_exit = std::move(on_exit_);
+    }
+    if (on_exit) {
+        on_exit();
+    }
+}
+
+void RequestScheduler::admit_pending(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished) {
+    // Swept every step, so requests stuck behind busy slots still time out
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        expire_pending(finished);
+    }
+    
+    // A context setting changed: let the running sequences drain so the
+    // context can be rebuilt before anyone new is admitted
+    if (active_count_ > 0 && model_->context_rebuild_pending()) {
+        return;
+    }
+    
+    std::vector<std::unique_ptr<Request>> held;  // adapter still loading
+    while (true) {
+        // Interactive requests first, each class in arrival order
+        std::unique_ptr<Request> req;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            auto& queue = !pending_[(int)RequestPriority::Interactive].empty()
+                ? pending_[(int)RequestPriority::Interactive]
+                : pending_[(int)RequestPriority::Batch];
+            if (queue.empty()) {
+                break;
+            }
+            req = std::move(queue.front());
+            queue.pop_front();
+        }
+        
+        // The adapter is read on the cache's thread, never under the model lock
+        if (!req->options.adapter.empty() && !req->lora) {
+            std::string error;
+            auto status = model_->adapter_cache()->find(req->options.adapter, req->lora, error);
+            if (status == LoraAdapterCache::Status::Loading) {
+                held.push_back(std::move(req));
+                continue;
+            }
+            if (status == LoraAdapterCache::Status::Failed) {
+                RequestResult result;
+                result.error = error;
+                finished.emplace_back(std::move(req), std::move(result));
+                continue;
+            }
+        }
+        
+        // Context (re)creation and tokenization are charged to this request
+        if (!model_->is_loaded() || !model_->ensure_context()) {
+            RequestResult result;
+            result.error = model_->is_loaded() ? "Failed to create context" : "Error: Model not loaded";
+            finished.emplace_back(std::move(req), std::move(result));
+            continue;
+        }
+        if ((int)active_.size() != model_->slot_count()) {
+            active_.resize(model_->slot_count());
+        }
+        
+        bool has_idle = false;
+        for (int i = 0; i < model_->slot_count(); ++i) {
+            if (model_->slot(i).state == SequenceSlot::State::Idle) {
+                has_idle = true;
+                break;
+            }
+        }
+        if (!has_idle) {
+            // Every slot is busy; the request waits for the next free one
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            pending_[(int)req->options.priority].push_front(std::move(req));
+            break;
+        }
+        
+        const double context_setup_ms = model_->last_context_setup_ms();
+        auto tokenize_start = std::chrono::high_resolution_clock::now();
+        std::vector<llama_token> tokens = req->tokens.empty() ? model_->tokenize_prompt(req->prompt)
+                                                              : std::move(req->tokens);
+        const double tokenize_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - tokenize_start).count();
+        if (tokens.empty()) {
+            RequestResult result;
+            result.error = "Tokenization failed";
+            finished.emplace_back(std::move(req), std::move(result));
+            continue;
+        }
+        
+        const double wait_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - req->enqueued).count();
+        core_metrics().queue_wait_seconds.observe(wait_ms / 1000.0);
+        core_metrics().prompt_tokens.inc(tokens.size());
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stats_.admitted++;
+            stats_.wait_ms_total += wait_ms;
+            stats_.wait_ms_max = std::max(stats_.wait_ms_max, wait_ms);
+        }
+        
+        int slot = model_->acquire_slot(tokens, req->options.adapter);
+        model_->begin_sequence(slot, std::move(tokens), req->max_tokens, req->on_text, req->cancel,
+                               req->options, req->lora);
+        model_->slot(slot).timing.queue_wait_ms = wait_ms;
+        model_->slot(slot).timing.context_setup_ms = context_setup_ms;
+        model_->slot(slot).timing.tokenize_ms = tokenize_ms;
+        LLM_LOG_DEBUG("RequestScheduler", "Request " << req->id << " admitted to slot " << slot);
+        active_[slot] = std::move(req);
+        active_count_++;
+    }
+    
+    // Held requests go back ahead of later arrivals, keeping their order
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    for (auto it = held.rbegin(); it != held.rend(); ++it) {
+        pending_[(int)(*it)->options.priority].push_front(std::move(*it));
+    }
+    waiting_for_adapter_ = !held.empty();
+}
+
+void RequestScheduler::collect_finished(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished) {
+    for (int i = 0; i < (int)active_.size(); ++i) {
+        if (!active_[i]) {
+            continue;
+        }
+        SequenceSlot& s = model_->slot(i);
+        if (s.state != SequenceSlot::State::Done) {
+            continue;
+        }
+        model_->flush_stream(i);
+        RequestResult result;
+        result.cancelled = s.cancelled;
+        result.slot = i;
+        result.slot_tick = s.last_used;
+        if (s.error.empty()) {
+            result.output = std::move(s.output);
+            result.metrics = model_->build_done_metrics(s);
+        } else {
+            result.error = s.error;
+        }
+        model_->release_slot(i);
+        finished.emplace_back(std::move(active_[i]), std::move(result));
+        active_count_--;
+    }
+}
+
+} // namespace local_llm
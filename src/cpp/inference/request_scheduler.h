@@ -0,0 +1,134 @@
+#pragma once
+
+#include "../model/llm_model.h"
+#include <memory>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+namespace local_llm {
+
+// Outcome of a scheduled request, delivered once when it leaves its slot
+struct RequestResult {
+    std::string output;   // generated text
+    std::string error;    // empty on success
+    std::string metrics;  // [DONE]{...} payload on success
+    bool cancelled = false;
+    int slot = -1;           // slot the request finished in; its KV cache stays resident
+    uint64_t slot_tick = 0;  // the slot's last_used at that point, to detect reuse
+};
+
+// Admission counters of a scheduler
+struct QueueStats {
+    size_t queued_interactive = 0;
+    size_t queued_batch = 0;
+    uint64_t admitted = 0;
+    uint64_t rejected_full = 0;      // turned away because the queue was full
+    uint64_t rejected_deadline = 0;  // waited past their deadline
+    uint64_t shed = 0;               // queued batch requests displaced by interactive ones
+    double wait_ms_total = 0.0;      // queue wait of the admitted requests
+    double wait_ms_max = 0.0;
+};
+
+// Continuous-batching scheduler: admits requests into the free sequence slots
+// of a shared llama_context and drives one batched decode step at a time, so
+// concurrent clients generate together instead of queueing behind each other.
+class RequestScheduler {
+public:
+    using TextCallback = std::function<void(const std::string&)>;
+    using CompleteCallback = std::function<void(const RequestResult&)>;
+    
+    // At most `max_queue_depth` requests wait for a slot (0 = unbounded)
+    RequestScheduler(LLMModel* model, std::mutex& model_mutex, size_t max_queue_depth = 0);
+    ~RequestScheduler();
+    
+    // Queue a request; callbacks run on the scheduler thread. Setting `cancel`
+    // drops the request from the queue or aborts its decode. Returns the request
+    // id, or 0 if the request was rejected (on_complete has then already run
+    // with "Error: Queue full").
+    uint64_t submit(const std::string& prompt, int max_tokens, CancelToken cancel,
+                    TextCallback on_text, CompleteCallback on_complete,
+                    const RequestOptions& options = RequestOptions());
+    
+    // Same, for a prompt the caller already tokenized (BOS included if wanted)
+    uint64_t submit_tokens(std::vector<llama_token> tokens, int max_tokens, CancelToken cancel,
+                           TextCallback on_text, CompleteCallback on_complete,
+                           const RequestOptions& options = RequestOptions());
+    
+    // Stop the loop and fail every request that has not finished yet
+    void shutdown();
+    
+    // Stop accepting requests but let queued and running ones finish; the
+    // loop then exits on its own (used when a model is hot-swapped out) and
+    // calls `on_exit` from the scheduler thread, which must not destroy the
+    // scheduler itself
+    void drain(std::function<void()> on_exit = nullptr);
+    
+    // The loop has exited after drain() (or shutdown())
+    bool drained() const { return stopped_.load(); }
+    
+    QueueStats stats() const;
+
+private:
+    struct Request {
+        uint64_t id = 0;
+        std::string prompt;
+        std::vector<llama_token> tokens;  // pre-tokenized prompt; `prompt` is unused then
+        int max_tokens = 0;
+        RequestOptions options;
+        LoraAdapter lora;  // set once options.adapter is loaded
+        CancelToken cancel;
+        TextCallback on_text;
+        CompleteCallback on_complete;
+        std::chrono::steady_clock::time_point enqueued;
+        std::chrono::steady_clock::time_point deadline;  // max() without a deadline
+    };
+    
+    LLMModel* model_;
+    std::mutex& model_mutex_;
+    const size_t max_queue_depth_;
+    
+    // Waiting requests, one FIFO per RequestPriority
+    mutable std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<std::unique_ptr<Request>> pending_[2];
+    QueueStats stats_;
+    bool running_ = true;
+    bool draining_ = false;
+    bool waiting_for_adapter_ = false;  // queued requests only wait for LoRA loads
+    std::function<void()> on_exit_;
+    std::atomic<bool> stopped_{false};
+    uint64_t next_id_ = 1;
+    
+    // Requests currently bound to a slot, indexed by slot; owned by the scheduler thread
+    std::vector<std::unique_ptr<Request>> active_;
+    int active_count_ = 0;
+    
+    std::thread thread_;
+    
+    void run();
+    
+    // Queue a filled-in request (or fail it if the scheduler is stopping or full)
+    uint64_t enqueue(std::unique_ptr<Request> req);
+    
+    size_t queued() const { return pending_[0].size() + pending_[1].size(); }
+    
+    // Fail queued requests that were cancelled or passed their deadline (queue mutex held)
+    void expire_pending(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished);
+    
+    // Move pending requests into idle slots (model mutex held). Requests whose
+    // LoRA adapter is still loading stay queued, in order, without blocking
+    // the ones behind them.
+    void admit_pending(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished);
+    
+    // Collect slots that reached Done (model mutex held)
+    void collect_finished(std::vector<std::pair<std::unique_ptr<Request>, RequestResult>>& finished);
+};
+
+} // namespace local_llm
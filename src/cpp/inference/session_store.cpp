@@ -0,0 +1,240 @@
+#include "session_store.h"
+#include "../common/logging.h"
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+namespace local_llm {
+
+namespace {
+
+const char kSessionMagic[4] = {'L', 'L', 'S', 'S'};
+const uint32_t kSessionVersion = 1;
+const char kSessionSuffix[] = ".session";
+
+struct SessionHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t fingerprint;
+    uint64_t n_tokens;
+    uint64_t state_size;
+};
+
+} // namespace
+
+SessionFile::~SessionFile() {
+    if (map_) {
+        munmap(map_, map_size_);
+    }
+}
+
+void SessionStore::configure(const std::string& dir, uint64_t budget_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dir_ = dir.empty() ? "sessions" : dir;
+    budget_bytes_ = budget_bytes;
+}
+
+bool SessionStore::valid_id(const std::string& id) {
+    if (id.empty() || id.size() > 128) {
+        return false;
+    }
+    return std::all_of(id.begin(), id.end(), [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '-' || c == '_';
+    });
+}
+
+std::string SessionStore::path_for(const std::string& id) const {
+    return dir_ + "/" + id + kSessionSuffix;
+}
+
+bool SessionStore::save(const std::string& id, uint64_t fingerprint,
+                        const llama_token* tokens, size_t n_tokens, size_t state_size,
+                        const std::function<size_t(uint8_t*, size_t)>& fill,
+                        std::string& error) {
+    if (!valid_id(id)) {
+        error = "Invalid session id";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        error = "Cannot create session directory " + dir_ + ": " + strerror(errno);
+        return false;
+    }
+
+    // Written under a temporary name and renamed, so a crash never leaves a
+    // half-written session that open() would have to reject
+    const std::string path = path_for(id);
+    const std::string tmp_path = path + ".tmp";
+    const size_t tokens_bytes = n_tokens * sizeof(llama_token);
+    const size_t total = sizeof(SessionHeader) + tokens_bytes + state_size;
+
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error = "Cannot create " + tmp_path + ": " + strerror(errno);
+        return false;
+    }
+    if (ftruncate(fd, (off_t)total) != 0) {
+        error = "Cannot size " + tmp_path + ": " + strerror(errno);
+        ::close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    void* map = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        error = "Cannot map " + tmp_path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    uint8_t* base = static_cast<uint8_t*>(map);
+    SessionHeader header;
+    memcpy(header.magic, kSessionMagic, sizeof(header.magic));
+    header.version = kSessionVersion;
+    header.fingerprint = fingerprint;
+    header.n_tokens = n_tokens;
+    header.state_size = state_size;
+    memcpy(base, &header, sizeof(header));
+    if (tokens_bytes > 0) {
+        memcpy(base + sizeof(header), tokens, tokens_bytes);
+    }
+
+    // The sequence state is serialised straight into the file pages
+    const size_t written = fill(base + sizeof(header) + tokens_bytes, state_size);
+    munmap(map, total);
+    if (written != state_size) {
+        error = "Failed to serialise the sequence state";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        error = "Cannot write " + path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    LLM_LOG_INFO("SessionStore", "Saved session " << id << " (" << n_tokens << " tokens, "
+                                 << total / 1024 << " KB)");
+    enforce_budget();
+    return true;
+}
+
+std::unique_ptr<SessionFile> SessionStore::open(const std::string& id, std::string& error) {
+    if (!valid_id(id)) {
+        error = "Invalid session id";
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::string path = path_for(id);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "Session not found: " + id;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionHeader)) {
+        ::close(fd);
+        error = "Session file is truncated: " + path;
+        return nullptr;
+    }
+    const size_t size = (size_t)st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        error = "Cannot map " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    // The whole file is about to be read by llama_state_seq_set_data
+    madvise(map, size, MADV_WILLNEED);
+
+    auto file = std::make_unique<SessionFile>();
+    file->map_ = map;
+    file->map_size_ = size;
+
+    SessionHeader header;
+    memcpy(&header, map, sizeof(header));
+    const uint8_t* base = static_cast<const uint8_t*>(map);
+    if (memcmp(header.magic, kSessionMagic, sizeof(header.magic)) != 0 ||
+        header.version != kSessionVersion ||
+        header.n_tokens > (size - sizeof(header)) / sizeof(llama_token) ||
+        sizeof(header) + header.n_tokens * sizeof(llama_token) + header.state_size != size) {
+        error = "Not a valid session file: " + path;
+        return nullptr;
+    }
+
+    file->fingerprint = header.fingerprint;
+    file->n_tokens = (size_t)header.n_tokens;
+    file->tokens = reinterpret_cast<const llama_token*>(base + sizeof(header));
+    file->state = base + sizeof(header) + file->n_tokens * sizeof(llama_token);
+    file->state_size = (size_t)header.state_size;
+
+    // Loading counts as use for the LRU budget
+    utimes(path.c_str(), nullptr);
+    return file;
+}
+
+bool SessionStore::remove(const std::string& id) {
+    if (!valid_id(id)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return unlink(path_for(id).c_str()) == 0;
+}
+
+void SessionStore::enforce_budget() {
+    if (budget_bytes_ == 0) {
+        return;
+    }
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir) {
+        return;
+    }
+
+    struct Entry {
+        std::string path;
+        uint64_t bytes;
+        time_t mtime;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    const size_t suffix_len = sizeof(kSessionSuffix) - 1;
+    while (struct dirent* d = readdir(dir)) {
+        const std::string name = d->d_name;
+        if (name.size() <= suffix_len || name.compare(name.size() - suffix_len, suffix_len, kSessionSuffix) != 0) {
+            continue;
+        }
+        Entry e;
+        e.path = dir_ + "/" + name;
+        struct stat st;
+        if (stat(e.path.c_str(), &st) != 0) {
+            continue;
+        }
+        e.bytes = (uint64_t)st.st_size;
+        e.mtime = st.st_mtime;
+        total += e.bytes;
+        entries.push_back(e);
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+    // The newest session is always kept, even if it alone is over budget
+    for (size_t i = 0; total > budget_bytes_ && i + 1 < entries.size(); ++i) {
+        if (unlink(entries[i].path.c_str()) == 0) {
+            LLM_LOG_INFO("SessionStore", "Evicting session " << entries[i].path);
+            total -= entries[i].bytes;
+        }
+    }
+}
+
+} // namespace local_llm
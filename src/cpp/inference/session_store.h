@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include "llama.h"
+
+namespace local_llm {
+
+// A saved session mapped read-only; the pointers stay valid while it lives
+class SessionFile {
+public:
+    ~SessionFile();
+
+    uint64_t fingerprint = 0;             // model the state was taken from
+    const llama_token* tokens = nullptr;  // tokens resident in the saved KV cache
+    size_t n_tokens = 0;
+    const uint8_t* state = nullptr;       // llama_state_seq_get_data() blob
+    size_t state_size = 0;
+
+private:
+    friend class SessionStore;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+};
+
+// On-disk store of per-sequence KV snapshots, one `<id>.session` file each:
+// a fixed header, the token list, then the llama.cpp sequence state. Files are
+// written and read through mmap, so restoring a session is a page-in rather
+// than a copy. Once the directory grows past its budget the least recently
+// used sessions (by mtime, refreshed on every load) are deleted.
+class SessionStore {
+public:
+    SessionStore() = default;
+
+    // Directory (created on demand) and disk budget in bytes (0 = unlimited)
+    void configure(const std::string& dir, uint64_t budget_bytes);
+
+    // Write a session; `fill` copies the sequence state into the mapped file
+    bool save(const std::string& id, uint64_t fingerprint,
+              const llama_token* tokens, size_t n_tokens, size_t state_size,
+              const std::function<size_t(uint8_t*, size_t)>& fill,
+              std::string& error);
+
+    // Map a saved session; null (with `error` set) if missing or corrupt
+    std::unique_ptr<SessionFile> open(const std::string& id, std::string& error);
+
+    // Delete a saved session; false if there was none
+    bool remove(const std::string& id);
+
+    // Ids are file names: letters, digits, '-' and '_' only
+    static bool valid_id(const std::string& id);
+
+private:
+    std::mutex mutex_;
+    std::string dir_ = "sessions";
+    uint64_t budget_bytes_ = 0;
+
+    std::string path_for(const std::string& id) const;
+
+    // Delete the oldest sessions until the directory fits the budget (mutex held)
+    void enforce_budget();
+};
+
+} // namespace local_llm
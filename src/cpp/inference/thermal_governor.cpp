@@ -0,0 +1,186 @@
+#include "thermal_governor.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+namespace local_llm {
+
+namespace {
+
+struct GovernorMetrics {
+    Gauge& level;
+    Gauge& threads;
+    Gauge& threads_batch;
+    Gauge& prefill_chunk;
+    Gauge& target;
+    Gauge& cpu_frequency;
+    Gauge& cpu_frequency_max;
+    Gauge& frequency_capped;
+    Counter& step_downs;
+    Counter& step_ups;
+};
+
+GovernorMetrics& governor_metrics() {
+    static GovernorMetrics metrics = [] {
+        MetricsRegistry& r = MetricsRegistry::instance();
+        return GovernorMetrics{
+            r.gauge("llm_governor_level", "Thermal governor slow-down level (0 = full speed)"),
+            r.gauge("llm_governor_threads", "Decode threads allowed by the thermal governor"),
+            r.gauge("llm_governor_threads_batch", "Prefill threads allowed by the thermal governor"),
+            r.gauge("llm_governor_prefill_chunk", "Prefill chunk allowed by the thermal governor"),
+            r.gauge("llm_governor_target_celsius", "Temperature the thermal governor holds under"),
+            r.gauge("llm_governor_cpu_frequency_hertz", "CPU frequency at the thermal governor's last sample"),
+            r.gauge("llm_governor_cpu_frequency_max_hertz", "Maximum CPU frequency at the thermal governor's last sample"),
+            r.gauge("llm_governor_frequency_capped", "CPU clock was capped by firmware or held below its limit under load"),
+            r.counter("llm_governor_step_downs_total", "Thermal governor slow-downs"),
+            r.counter("llm_governor_step_ups_total", "Thermal governor speed-ups"),
+        };
+    }();
+    return metrics;
+}
+
+} // namespace
+
+ThermalGovernor::ThermalGovernor(const GovernorSettings& settings, const GovernorLimits& full_speed, Apply apply)
+    : settings_(settings), full_speed_(full_speed), apply_(std::move(apply)), current_(full_speed) {
+    // One level per thread that can be given up, and at least one so
+    // single-threaded setups can still shrink their prefill chunk
+    max_level_ = std::max(1, std::max(full_speed_.threads, full_speed_.threads_batch) - 1);
+    GovernorMetrics& metrics = governor_metrics();
+    metrics.level.set(0);
+    metrics.threads.set(full_speed_.threads);
+    metrics.threads_batch.set(full_speed_.threads_batch);
+    metrics.prefill_chunk.set(full_speed_.prefill_chunk);
+}
+
+ThermalGovernor::~ThermalGovernor() {
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        stop_ = true;
+    }
+    stop_cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void ThermalGovernor::start() {
+    thread_ = std::thread(&ThermalGovernor::run, this);
+}
+
+GovernorLimits ThermalGovernor::limits_for(int level) const {
+    GovernorLimits limits;
+    limits.threads = std::max(1, full_speed_.threads - level);
+    limits.threads_batch = std::max(1, full_speed_.threads_batch - level);
+    limits.prefill_chunk = std::max(32, full_speed_.prefill_chunk >> level);
+    return limits;
+}
+
+bool ThermalGovernor::update(const ThermalReading& reading, bool busy) {
+    double target = settings_.target_c;
+    if (target <= 0.0) {
+        target = reading.trip_c > 0.0 ? reading.trip_c - 5.0 : 75.0;
+    }
+
+    const double temp = reading.temperature_c;
+    const double trend = has_previous_ ? temp - previous_c_ : 0.0;
+    previous_c_ = temp;
+    has_previous_ = true;
+    const double predicted = temp + std::max(0.0, trend) * kLookahead;
+    // Firmware or a power limit can clamp the clock well below the trip point.
+    // The firmware says so directly; otherwise the clock has to stay below
+    // the policy's own limit (not the hardware maximum, which a user-set
+    // scaling_max_freq is always below) while busy, sample after sample.
+    bool freq_capped = reading.freq_capped;
+    if (reading.has_firmware_flags) {
+        capped_samples_ = 0;
+    } else {
+        const uint64_t limit = reading.limit_freq_khz > 0 ? reading.limit_freq_khz : reading.max_freq_khz;
+        const bool below = busy && reading.cur_freq_khz > 0 && reading.cur_freq_khz < limit;
+        capped_samples_ = below ? capped_samples_ + 1 : 0;
+        freq_capped = capped_samples_ >= kCapSamples;
+    }
+
+    const int level = level_.load();
+    int next = level;
+    if (reading.throttled || freq_capped || (reading.has_temperature && predicted >= target)) {
+        cool_samples_ = 0;
+        next = std::min(level + 1, max_level_);
+    } else if (reading.has_temperature && temp < target - settings_.hysteresis_c && trend <= 0.0) {
+        if (++cool_samples_ >= kCoolSamples) {
+            cool_samples_ = 0;
+            next = std::max(level - 1, 0);
+        }
+    } else {
+        cool_samples_ = 0;
+    }
+
+    const GovernorLimits limits = limits_for(next);
+    {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        last_ = reading;
+        freq_capped_ = freq_capped;
+        target_c_ = target;
+        current_ = limits;
+    }
+    GovernorMetrics& metrics = governor_metrics();
+    metrics.target.set(target);
+    metrics.cpu_frequency.set(reading.cur_freq_khz * 1000.0);
+    metrics.cpu_frequency_max.set(reading.max_freq_khz * 1000.0);
+    metrics.frequency_capped.set(freq_capped ? 1.0 : 0.0);
+    if (next == level) {
+        return false;
+    }
+
+    level_.store(next);
+    (next > level ? metrics.step_downs : metrics.step_ups).inc();
+    metrics.level.set(next);
+    metrics.threads.set(limits.threads);
+    metrics.threads_batch.set(limits.threads_batch);
+    metrics.prefill_chunk.set(limits.prefill_chunk);
+    LLM_LOG_INFO("ThermalGovernor", (next > level ? "Slowing down" : "Speeding up") << " to level " << next
+                                    << " at " << temp << " C (target " << target << " C"
+                                    << (reading.throttled ? ", throttled" : "")
+                                    << (freq_capped ? ", clock capped" : "") << "): threads "
+                                    << limits.threads << "/" << limits.threads_batch
+                                    << ", prefill chunk " << limits.prefill_chunk);
+    if (apply_) {
+        apply_(limits);
+    }
+    return true;
+}
+
+std::string ThermalGovernor::state_json() const {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    std::ostringstream oss;
+    oss << "{\"level\":" << level_.load()
+        << ",\"max_level\":" << max_level_
+        << ",\"threads\":" << current_.threads
+        << ",\"threads_batch\":" << current_.threads_batch
+        << ",\"prefill_chunk\":" << current_.prefill_chunk
+        << ",\"target_c\":" << target_c_
+        << ",\"temperature_c\":" << last_.temperature_c
+        << ",\"throttled\":" << (last_.throttled ? "true" : "false")
+        << ",\"cur_freq_khz\":" << last_.cur_freq_khz
+        << ",\"max_freq_khz\":" << last_.max_freq_khz
+        << ",\"limit_freq_khz\":" << last_.limit_freq_khz
+        << ",\"freq_capped\":" << (freq_capped_ ? "true" : "false")
+        << "}";
+    return oss.str();
+}
+
+void ThermalGovernor::run() {
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (!stop_) {
+        lock.unlock();
+        // The scheduler publishes how many sequences are decoding
+        update(read_thermal(), core_metrics().active_sequences.value() > 0);
+        lock.lock();
+        stop_cv_.wait_for(lock, std::chrono::milliseconds(std::max(100, settings_.interval_ms)),
+                          [this] { return stop_; });
+    }
+}
+
+} // namespace local_llm
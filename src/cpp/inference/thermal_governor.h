@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../common/thermal.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace local_llm {
+
+// Work settings the governor scales, and their full-speed values
+struct GovernorLimits {
+    int threads = 1;
+    int threads_batch = 1;
+    int prefill_chunk = 512;
+};
+
+struct GovernorSettings {
+    double target_c = 0.0;      // hold the SoC under this (0 = 5 C below the passive trip, else 75 C)
+    double hysteresis_c = 3.0;  // cool this far below target before speeding up again
+    int interval_ms = 1000;     // sampling period
+};
+
+// Keeps a sustained workload just under the throttle point instead of
+// letting the firmware clamp the clocks. Each sample the temperature is
+// extrapolated a few periods ahead; when that reaches the target, or the
+// firmware reports throttling or a capped clock, the governor drops one
+// level: one compute thread fewer
+// and half the prefill chunk. After several cool samples it climbs a
+// level back. A level change is handed to `apply`, which the engine runs
+// between decode steps.
+class ThermalGovernor {
+public:
+    using Apply = std::function<void(const GovernorLimits&)>;
+
+    ThermalGovernor(const GovernorSettings& settings, const GovernorLimits& full_speed, Apply apply);
+    ~ThermalGovernor();
+
+    ThermalGovernor(const ThermalGovernor&) = delete;
+    ThermalGovernor& operator=(const ThermalGovernor&) = delete;
+
+    // Sample on a background thread until destroyed
+    void start();
+
+    // One control decision; true if the level (and so the limits) changed.
+    // `busy`: sequences were decoding. Without firmware flags a clock held
+    // below scaling_max_freq for several busy samples counts as a cap, so a
+    // momentary cpufreq dip does not.
+    bool update(const ThermalReading& reading, bool busy = false);
+
+    int level() const { return level_.load(); }
+
+    // Level, limits in force, target and the last reading (with clocks), as JSON
+    std::string state_json() const;
+
+private:
+    static const int kCoolSamples = 5;  // calm samples needed per step up
+    static const int kLookahead = 3;    // sampling periods the trend is extrapolated
+    static const int kCapSamples = 3;   // busy samples below the limit that make a cap
+
+    GovernorSettings settings_;
+    GovernorLimits full_speed_;
+    Apply apply_;
+    int max_level_ = 0;
+
+    std::atomic<int> level_{0};
+    int cool_samples_ = 0;
+    int capped_samples_ = 0;
+    double previous_c_ = 0.0;
+    bool has_previous_ = false;
+
+    mutable std::mutex state_mutex_;
+    GovernorLimits current_;
+    ThermalReading last_;
+    bool freq_capped_ = false;
+    double target_c_ = 0.0;
+
+    std::thread thread_;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_ = false;
+
+    GovernorLimits limits_for(int level) const;
+    void run();
+};
+
+} // namespace local_llm
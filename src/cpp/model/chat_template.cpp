@@ -0,0 +1,309 @@
+#include "chat_template.h"
+#include "../common/logging.h"
+#include <algorithm>
+
+namespace local_llm {
+
+namespace {
+
+// Message contents no template adds or rewrites
+const char* const kSentinels[] = {"XQZSYS0", "XQZUSR1", "XQZAST1", "XQZUSR2", "XQZAST2"};
+
+// Split `text` at each of `marks` (each must occur once, in order). pieces[i]
+// is the text before marks[i]; the last piece is whatever follows the last mark.
+bool cut(const std::string& text, const std::vector<std::string>& marks, std::vector<std::string>& pieces) {
+    pieces.clear();
+    size_t pos = 0;
+    for (const auto& mark : marks) {
+        const size_t at = text.find(mark, pos);
+        if (at == std::string::npos || text.find(mark, at + mark.size()) != std::string::npos) {
+            return false;
+        }
+        pieces.push_back(text.substr(pos, at - pos));
+        pos = at + mark.size();
+    }
+    pieces.push_back(text.substr(pos));
+    return true;
+}
+
+std::string trim(const std::string& text) {
+    const size_t begin = text.find_first_not_of(" \t\n\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    const size_t end = text.find_last_not_of(" \t\n\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+} // namespace
+
+bool ChatTemplate::initialize(const llama_model* model) {
+    clear();
+    if (!model) {
+        return false;
+    }
+    vocab_ = llama_model_get_vocab(model);
+    add_bos_ = llama_vocab_get_add_bos(vocab_);
+
+    const char* tmpl = llama_model_chat_template(model, nullptr);
+    from_gguf_ = tmpl && *tmpl;
+    template_ = from_gguf_ ? tmpl : "chatml";
+
+    std::string check;
+    if (!render({{"user", "hi"}}, true, check)) {
+        if (!from_gguf_) {
+            return false;
+        }
+        LLM_LOG_WARN("ChatTemplate", "Chat template of the model is not supported, using ChatML");
+        from_gguf_ = false;
+        template_ = "chatml";
+    }
+
+    if (probe()) {
+        segmented_ = true;
+        segmented_ = verify();
+    }
+    if (!segmented_) {
+        segments_.clear();
+    }
+    LLM_LOG_INFO("ChatTemplate", "Chat template: " << description());
+    return true;
+}
+
+void ChatTemplate::clear() {
+    vocab_ = nullptr;
+    template_.clear();
+    from_gguf_ = false;
+    segmented_ = false;
+    trim_content_ = false;
+    add_bos_ = false;
+    segments_.clear();
+}
+
+std::string ChatTemplate::description() const {
+    if (!vocab_) {
+        return "none";
+    }
+    return std::string(from_gguf_ ? "gguf" : "chatml") + (segmented_ ? "" : " (full render)");
+}
+
+bool ChatTemplate::render(const std::vector<ChatMessage>& messages, bool add_generation_prompt,
+                          std::string& out) const {
+    if (template_.empty()) {
+        return false;
+    }
+    std::vector<llama_chat_message> chat;
+    chat.reserve(messages.size());
+    size_t n_chars = 0;
+    for (const auto& m : messages) {
+        chat.push_back({m.role.c_str(), m.content.c_str()});
+        n_chars += m.role.size() + m.content.size();
+    }
+
+    std::vector<char> buf(n_chars * 2 + 256);
+    int32_t n = llama_chat_apply_template(template_.c_str(), chat.data(), chat.size(),
+                                          add_generation_prompt, buf.data(), (int32_t)buf.size());
+    if (n < 0) {
+        return false;
+    }
+    if ((size_t)n > buf.size()) {
+        buf.resize(n);
+        n = llama_chat_apply_template(template_.c_str(), chat.data(), chat.size(),
+                                      add_generation_prompt, buf.data(), (int32_t)buf.size());
+    }
+    out.assign(buf.data(), n);
+    return true;
+}
+
+bool ChatTemplate::probe() {
+    // Does the template strip whitespace around content?
+    std::string padded;
+    if (!render({{"user", std::string(" ") + kSentinels[1] + " "}}, false, padded)) {
+        return false;
+    }
+    if (padded.find(std::string(" ") + kSentinels[1] + " ") == std::string::npos) {
+        trim_content_ = padded.find(kSentinels[1]) != std::string::npos;
+        if (!trim_content_) {
+            return false;
+        }
+    }
+
+    // system, user, assistant, user, assistant: every transition a chat uses
+    std::string full;
+    std::vector<std::string> pieces;
+    if (!render({{"system", kSentinels[0]}, {"user", kSentinels[1]}, {"assistant", kSentinels[2]},
+                 {"user", kSentinels[3]}, {"assistant", kSentinels[4]}}, false, full) ||
+        !cut(full, {kSentinels[0], kSentinels[1], kSentinels[2], kSentinels[3], kSentinels[4]}, pieces)) {
+        return false;
+    }
+    // A template that formats later turns differently from the first is not segmentable
+    if (pieces[2] != pieces[4]) {
+        return false;
+    }
+
+    // Without a system message, ending in the generation prompt
+    std::string open;
+    std::vector<std::string> open_pieces;
+    if (!render({{"user", kSentinels[1]}, {"assistant", kSentinels[2]}, {"user", kSentinels[3]}}, true, open) ||
+        !cut(open, {kSentinels[1], kSentinels[2], kSentinels[3]}, open_pieces)) {
+        return false;
+    }
+    if (open_pieces[1] != pieces[2] || open_pieces[2] != pieces[3]) {
+        return false;
+    }
+
+    const struct { const char* from; const char* to; const std::string& text; } found[] = {
+        {"", "system", pieces[0]},
+        {"system", "user", pieces[1]},
+        {"user", "assistant", pieces[2]},
+        {"assistant", "user", pieces[3]},
+        {"", "user", open_pieces[0]},
+        {"user", "", open_pieces[3]},
+    };
+    for (const auto& f : found) {
+        Segment segment;
+        segment.from = f.from;
+        segment.to = f.to;
+        segment.text = f.text;
+        segment.tokens = tokenize(f.text, true);
+        segments_.push_back(std::move(segment));
+    }
+    return true;
+}
+
+bool ChatTemplate::verify() const {
+    const std::vector<ChatMessage> sample = {
+        {"system", "You are a concise assistant."},
+        {"user", "What is the capital of France?"},
+        {"assistant", "Paris."},
+        {"user", "And of Italy?"},
+    };
+    ChatState state;
+    append(state, sample);
+    const std::vector<llama_token> incremental = prompt(state, true);
+
+    const std::vector<llama_token> whole = render_tokens(sample, true);
+    if (whole.empty()) {
+        return false;
+    }
+    if (incremental != whole) {
+        LLM_LOG_DEBUG("ChatTemplate", "Segmented rendering differs from the template ("
+                                      << incremental.size() << " vs " << whole.size() << " tokens)");
+        return false;
+    }
+    return true;
+}
+
+const ChatTemplate::Segment* ChatTemplate::find_segment(const std::string& from, const std::string& to) const {
+    for (const auto& segment : segments_) {
+        if (segment.from == from && segment.to == to) {
+            return &segment;
+        }
+    }
+    return nullptr;
+}
+
+std::string ChatTemplate::content_of(const ChatMessage& message) const {
+    return trim_content_ ? trim(message.content) : message.content;
+}
+
+void ChatTemplate::append(ChatState& state, const std::vector<ChatMessage>& messages) const {
+    for (const auto& m : messages) {
+        const std::string from = state.messages.empty() ? std::string() : state.messages.back().role;
+        state.messages.push_back(m);
+        if (!state.incremental) {
+            continue;
+        }
+        const Segment* segment = segmented_ ? find_segment(from, m.role) : nullptr;
+        if (!segment) {
+            // From here on prompt() renders the whole conversation
+            state.incremental = false;
+            state.tokens.clear();
+            continue;
+        }
+        state.tokens.insert(state.tokens.end(), segment->tokens.begin(), segment->tokens.end());
+        if (from.empty()) {
+            prepend_bos(state.tokens);
+        }
+        // Content is plain text: special-token markup in it is not interpreted
+        const std::vector<llama_token> content = tokenize(content_of(m), false);
+        state.tokens.insert(state.tokens.end(), content.begin(), content.end());
+    }
+}
+
+std::vector<llama_token> ChatTemplate::prompt(const ChatState& state, bool add_generation_prompt) const {
+    if (state.incremental && segmented_ && !state.messages.empty()) {
+        if (!add_generation_prompt) {
+            return state.tokens;
+        }
+        const Segment* segment = find_segment(state.messages.back().role, "");
+        if (segment) {
+            std::vector<llama_token> tokens = state.tokens;
+            tokens.insert(tokens.end(), segment->tokens.begin(), segment->tokens.end());
+            return tokens;
+        }
+    }
+
+    return render_tokens(state.messages, add_generation_prompt);
+}
+
+std::vector<llama_token> ChatTemplate::render_tokens(const std::vector<ChatMessage>& messages,
+                                                     bool add_generation_prompt) const {
+    // Render with a marker in place of each content, then tokenize the text
+    // around the markers with special tokens and the contents without, so
+    // markup typed into a message never becomes a control token
+    std::vector<ChatMessage> marked = messages;
+    for (size_t i = 0; i < marked.size(); ++i) {
+        marked[i].content = "XQZMSG" + std::to_string(i) + "Z";
+    }
+    std::string text;
+    if (!render(marked, add_generation_prompt, text)) {
+        return {};
+    }
+    std::vector<llama_token> tokens;
+    size_t pos = 0;
+    for (size_t i = 0; i < marked.size(); ++i) {
+        const size_t at = text.find(marked[i].content, pos);
+        if (at == std::string::npos) {
+            continue;  // the template leaves this message out
+        }
+        const std::vector<llama_token> markup = tokenize(text.substr(pos, at - pos), true);
+        const std::vector<llama_token> content = tokenize(content_of(messages[i]), false);
+        tokens.insert(tokens.end(), markup.begin(), markup.end());
+        tokens.insert(tokens.end(), content.begin(), content.end());
+        pos = at + marked[i].content.size();
+    }
+    const std::vector<llama_token> tail = tokenize(text.substr(pos), true);
+    tokens.insert(tokens.end(), tail.begin(), tail.end());
+    prepend_bos(tokens);
+    return tokens;
+}
+
+std::vector<llama_token> ChatTemplate::tokenize(const std::string& text, bool parse_special) const {
+    std::vector<llama_token> tokens;
+    if (!vocab_ || text.empty()) {
+        return tokens;
+    }
+    tokens.resize(text.size() + 1);
+    int n_tokens = llama_tokenize(vocab_, text.c_str(), (int32_t)text.size(), tokens.data(),
+                                  (int32_t)tokens.size(), false, parse_special);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab_, text.c_str(), (int32_t)text.size(), tokens.data(),
+                                  (int32_t)tokens.size(), false, parse_special);
+    }
+    tokens.resize(std::max(n_tokens, 0));
+    return tokens;
+}
+
+void ChatTemplate::prepend_bos(std::vector<llama_token>& tokens) const {
+    if (!add_bos_) {
+        return;
+    }
+    const llama_token bos = llama_vocab_bos(vocab_);
+    if (tokens.empty() || tokens[0] != bos) {
+        tokens.insert(tokens.begin(), bos);
+    }
+}
+
+} // namespace local_llm
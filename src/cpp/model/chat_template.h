@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "llama.h"
+
+namespace local_llm {
+
+struct ChatMessage {
+    std::string role;  // "system", "user", "assistant" (others force a full render)
+    std::string content;
+};
+
+// A conversation rendered so far. `tokens` ends at the last message's content;
+// the generation prompt is added per request and never stored.
+struct ChatState {
+    std::vector<ChatMessage> messages;
+    std::vector<llama_token> tokens;
+    bool incremental = true;  // false once a message needed a full render
+};
+
+// Chat formatting with the template stored in the GGUF (ChatML if it has none).
+// At load the template is rendered once over sentinel messages and cut into
+// the fixed text between turns (role markers, system wrapper, generation
+// prompt); each of those segments is tokenized once. Appending a turn then
+// costs one cached segment plus the tokenization of the new content, so the
+// tokens of a long chat grow by exactly the new turn and keep matching the
+// prefix resident in the KV cache. Templates whose output cannot be
+// reproduced segment by segment are rendered in full on every call.
+class ChatTemplate {
+public:
+    // Read and probe the template of `model`; false if it cannot render at all
+    bool initialize(const llama_model* model);
+
+    void clear();
+
+    // "gguf" or "chatml" (the model has no template), plus " (full render)" when
+    // the template is not segmentable
+    std::string description() const;
+
+    // Append `messages` to `state`, rendering and tokenizing only them
+    void append(ChatState& state, const std::vector<ChatMessage>& messages) const;
+
+    // Prompt tokens of `state`, optionally followed by the assistant generation prompt
+    std::vector<llama_token> prompt(const ChatState& state, bool add_generation_prompt) const;
+
+    // Whole-conversation rendering through llama_chat_apply_template
+    bool render(const std::vector<ChatMessage>& messages, bool add_generation_prompt,
+                std::string& out) const;
+
+private:
+    // Fixed text between the end of one turn's content and the next one's
+    // start. `from` is empty before the first message; `to` is empty for the
+    // generation prompt.
+    struct Segment {
+        std::string from;
+        std::string to;
+        std::string text;
+        std::vector<llama_token> tokens;
+    };
+
+    const llama_vocab* vocab_ = nullptr;
+    std::string template_;
+    bool from_gguf_ = false;
+    bool segmented_ = false;
+    bool trim_content_ = false;  // the template strips whitespace around content
+    bool add_bos_ = false;
+    std::vector<Segment> segments_;
+
+    const Segment* find_segment(const std::string& from, const std::string& to) const;
+
+    // Cut the sentinel rendering into segments; false if the template does not allow it
+    bool probe();
+
+    // The segments reproduce the template on a sample conversation
+    bool verify() const;
+
+    std::string content_of(const ChatMessage& message) const;
+
+    // Full render of `messages`, tokenized the way append() tokenizes: the
+    // template's own text with special tokens, the contents as plain text.
+    // Empty if the template cannot render them.
+    std::vector<llama_token> render_tokens(const std::vector<ChatMessage>& messages,
+                                           bool add_generation_prompt) const;
+
+    std::vector<llama_token> tokenize(const std::string& text, bool parse_special) const;
+
+    // BOS the vocabulary wants, unless the rendered text already starts with it
+    void prepend_bos(std::vector<llama_token>& tokens) const;
+};
+
+} // namespace local_llm
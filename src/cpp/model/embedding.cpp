@@ -0,0 +1,120 @@
+#include "embedding.h"
+#include "llm_model.h"
+#include "../common/logging.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace local_llm {
+
+// Sequences per batch; well under llama.cpp's own sequence limit
+static const int kMaxEmbeddingSeqs = 32;
+
+EmbeddingContext::~EmbeddingContext() {
+    if (batch_initialized_) {
+        llama_batch_free(batch_);
+    }
+    if (ctx_) {
+        llama_free(ctx_);
+    }
+}
+
+bool EmbeddingContext::initialize(llama_model* model, const ModelConfig& config) {
+    model_ = model;
+    
+    // Every input has to fit one ubatch, since pooling happens per ubatch
+    n_batch_ = config.batch_size;
+    const int n_ctx_train = llama_model_n_ctx_train(model);
+    if (n_ctx_train > 0) {
+        n_batch_ = std::min(n_batch_, n_ctx_train);
+    }
+    n_seq_max_ = kMaxEmbeddingSeqs;
+    
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx = n_batch_;
+    params.n_batch = n_batch_;
+    params.n_ubatch = n_batch_;
+    params.n_seq_max = n_seq_max_;
+    params.n_threads = config.threads;
+    params.n_threads_batch = config.threads_batch > 0 ? config.threads_batch : config.threads;
+    params.embeddings = true;
+    params.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+    ctx_ = llama_init_from_model(model, params);
+    
+    // Generative models usually declare no pooling; mean-pool them
+    if (ctx_ && llama_pooling_type(ctx_) == LLAMA_POOLING_TYPE_NONE) {
+        llama_free(ctx_);
+        params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx_ = llama_init_from_model(model, params);
+    }
+    if (!ctx_) {
+        LLM_LOG_ERROR("EmbeddingContext", "Failed to create embedding context");
+        return false;
+    }
+    
+    n_embd_ = llama_model_n_embd(model);
+    batch_ = llama_batch_init(n_batch_, 0, 1);
+    batch_initialized_ = true;
+    LLM_LOG_INFO("EmbeddingContext", "Embedding context ready: n_embd=" << n_embd_ << ", n_batch="
+                                     << n_batch_ << ", pooling=" << (int)llama_pooling_type(ctx_));
+    return true;
+}
+
+void EmbeddingContext::attach_threadpool(ggml_threadpool_t threadpool, ggml_threadpool_t threadpool_batch) {
+    if (ctx_) {
+        llama_attach_threadpool(ctx_, threadpool, threadpool_batch);
+    }
+}
+
+int EmbeddingContext::embed_chunk(const std::vector<std::vector<llama_token>>& inputs, size_t begin,
+                                  float* out, bool normalize) {
+    // Pack whole inputs, one sequence each, until the batch is full
+    batch_.n_tokens = 0;
+    int n_seq = 0;
+    for (size_t i = begin; i < inputs.size() && n_seq < n_seq_max_; ++i) {
+        const std::vector<llama_token>& tokens = inputs[i];
+        if (batch_.n_tokens + (int)tokens.size() > n_batch_) {
+            break;
+        }
+        for (size_t pos = 0; pos < tokens.size(); ++pos) {
+            batch_add(batch_, tokens[pos], (llama_pos)pos, n_seq, true);
+        }
+        n_seq++;
+    }
+    if (n_seq == 0) {
+        return -1;
+    }
+    
+    // Sequences from the previous chunk must not leak into this one
+    llama_kv_self_clear(ctx_);
+    const bool encoder_only = llama_model_has_encoder(model_) && !llama_model_has_decoder(model_);
+    const int rc = encoder_only ? llama_encode(ctx_, batch_) : llama_decode(ctx_, batch_);
+    if (rc != 0) {
+        LLM_LOG_ERROR("EmbeddingContext", "Embedding batch failed with code " << rc);
+        return -1;
+    }
+    
+    for (int seq = 0; seq < n_seq; ++seq) {
+        const float* embd = llama_get_embeddings_seq(ctx_, seq);
+        if (!embd) {
+            LLM_LOG_ERROR("EmbeddingContext", "No pooled embedding for sequence " << seq);
+            return -1;
+        }
+        float* dst = out + (size_t)seq * n_embd_;
+        if (!normalize) {
+            memcpy(dst, embd, n_embd_ * sizeof(float));
+            continue;
+        }
+        double norm = 0.0;
+        for (int j = 0; j < n_embd_; ++j) {
+            norm += (double)embd[j] * embd[j];
+        }
+        const float scale = norm > 0.0 ? (float)(1.0 / std::sqrt(norm)) : 0.0f;
+        for (int j = 0; j < n_embd_; ++j) {
+            dst[j] = embd[j] * scale;
+        }
+    }
+    return n_seq;
+}
+
+} // namespace local_llm
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include "llama.h"
+
+namespace local_llm {
+
+struct ModelConfig;
+
+// A context of its own for pooled embeddings, so extracting them never
+// disturbs the generation context's KV cache or sequence slots. Many inputs
+// are packed into one batch, each under its own seq_id, and pooled per sequence.
+class EmbeddingContext {
+public:
+    EmbeddingContext() = default;
+    ~EmbeddingContext();
+    
+    // Create the context; models without a pooling type of their own are mean-pooled
+    bool initialize(llama_model* model, const ModelConfig& config);
+    
+    // Run on the generation context's threadpool
+    void attach_threadpool(ggml_threadpool_t threadpool, ggml_threadpool_t threadpool_batch);
+    
+    int n_embd() const { return n_embd_; }
+    
+    // Longest input in tokens; longer ones have to be truncated by the caller
+    int max_tokens() const { return n_batch_; }
+    
+    // Embed as many of inputs[begin..] as fit one batch into `out` (n_embd
+    // floats per input, L2-normalised if asked). Returns how many were
+    // embedded, or -1 if decoding failed.
+    int embed_chunk(const std::vector<std::vector<llama_token>>& inputs, size_t begin,
+                    float* out, bool normalize);
+    
+private:
+    llama_model* model_ = nullptr;
+    llama_context* ctx_ = nullptr;
+    llama_batch batch_;
+    bool batch_initialized_ = false;
+    int n_batch_ = 0;
+    int n_seq_max_ = 0;
+    int n_embd_ = 0;
+};
+
+} // namespace local_llm
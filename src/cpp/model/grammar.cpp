@@ -0,0 +1,402 @@
+#include "grammar.h"
+#include "../common/json.h"
+#include "../common/logging.h"
+#include <cstdio>
+#include <map>
+#include <sstream>
+
+namespace local_llm {
+
+namespace {
+
+// Shared building blocks, added to the grammar only when referenced. The
+// whitespace rule is bounded so a model cannot stall in endless indentation.
+const std::map<std::string, std::string>& primitive_rules() {
+    static const std::map<std::string, std::string> rules = {
+        {"space", "| \" \" | \"\\n\" [ \\t]{0,20}"},
+        {"boolean", "(\"true\" | \"false\") space"},
+        {"null", "\"null\" space"},
+        {"integral-part", "[0] | [1-9] [0-9]{0,15}"},
+        {"decimal-part", "[0-9]{1,16}"},
+        {"integer", "(\"-\"? integral-part) space"},
+        {"number", "(\"-\"? integral-part) (\".\" decimal-part)? ([eE] [-+]? integral-part)? space"},
+        {"char", "[^\"\\\\\\x7F\\x00-\\x1F] | [\\\\] ([\"\\\\bfnrt] | \"u\" [0-9a-fA-F]{4})"},
+        {"string", "\"\\\"\" char* \"\\\"\" space"},
+        {"value", "object | array | string | number | boolean | null"},
+        {"object", "\"{\" space ( string \":\" space value (\",\" space string \":\" space value)* )? \"}\" space"},
+        {"array", "\"[\" space ( value (\",\" space value)* )? \"]\" space"},
+    };
+    return rules;
+}
+
+// Rules each primitive refers to
+const std::map<std::string, std::vector<std::string>>& primitive_deps() {
+    static const std::map<std::string, std::vector<std::string>> deps = {
+        {"boolean", {"space"}},
+        {"null", {"space"}},
+        {"integer", {"integral-part", "space"}},
+        {"number", {"integral-part", "decimal-part", "space"}},
+        {"string", {"char", "space"}},
+        {"value", {"object", "array", "string", "number", "boolean", "null"}},
+        {"object", {"string", "value", "space"}},
+        {"array", {"value", "space"}},
+    };
+    return deps;
+}
+
+class SchemaConverter {
+public:
+    bool convert(const JsonValue& schema, std::string& gbnf, std::string& error) {
+        std::string root;
+        if (!visit(schema, root, 0)) {
+            error = error_;
+            return false;
+        }
+        std::ostringstream oss;
+        oss << "root ::= " << root << "\n";
+        for (const auto& rule : rules_) {
+            oss << rule.first << " ::= " << rule.second << "\n";
+        }
+        gbnf = oss.str();
+        return true;
+    }
+
+private:
+    static const int kMaxDepth = 64;
+
+    std::map<std::string, std::string> rules_;
+    int next_rule_ = 0;
+    std::string error_;
+
+    bool fail(const std::string& message) {
+        error_ = message;
+        return false;
+    }
+
+    // Reference a primitive, pulling in its rule and everything it needs
+    std::string use(const std::string& name) {
+        if (rules_.count(name)) {
+            return name;
+        }
+        rules_[name] = primitive_rules().at(name);
+        auto deps = primitive_deps().find(name);
+        if (deps != primitive_deps().end()) {
+            for (const auto& dep : deps->second) {
+                use(dep);
+            }
+        }
+        return name;
+    }
+
+    // Name a generated expression so nested schemas stay readable
+    std::string add_rule(const std::string& body) {
+        const std::string name = "r" + std::to_string(next_rule_++);
+        rules_[name] = body;
+        return name;
+    }
+
+    // GBNF literal matching `text` exactly
+    static std::string literal(const std::string& text) {
+        std::string out = "\"";
+        for (char c : text) {
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if ((unsigned char)c < 0x20) {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\x%02X", (unsigned char)c);
+                        out += buf;
+                    } else {
+                        out += c;
+                    }
+            }
+        }
+        return out + "\"";
+    }
+
+    // A JSON value written out exactly, e.g. an enum member
+    std::string constant(const JsonValue& value) {
+        return literal(to_json(value)) + " " + use("space");
+    }
+
+    bool visit_type(const std::string& type, const JsonValue& schema, std::string& out, int depth) {
+        if (type == "object") return visit_object(schema, out, depth);
+        if (type == "array") return visit_array(schema, out, depth);
+        if (type == "string" || type == "number" || type == "integer" ||
+            type == "boolean" || type == "null") {
+            out = use(type);
+            return true;
+        }
+        return fail("Unsupported schema type: " + type);
+    }
+
+    bool visit_alternatives(const JsonValue& list, std::string& out, int depth) {
+        if (!list.is_array() || list.array.empty()) {
+            return fail("anyOf/oneOf must be a non-empty array");
+        }
+        std::string body;
+        for (size_t i = 0; i < list.array.size(); ++i) {
+            std::string alt;
+            if (!visit(list.array[i], alt, depth + 1)) {
+                return false;
+            }
+            body += (i > 0 ? " | " : "") + alt;
+        }
+        out = add_rule(body);
+        return true;
+    }
+
+    bool visit(const JsonValue& schema, std::string& out, int depth) {
+        if (depth > kMaxDepth) {
+            return fail("Schema nested too deeply");
+        }
+        if (schema.is_bool()) {
+            // true accepts anything; false accepts nothing and cannot be generated
+            if (!schema.boolean) {
+                return fail("Schema 'false' cannot be satisfied");
+            }
+            out = use("value");
+            return true;
+        }
+        if (!schema.is_object()) {
+            return fail("Schema must be an object");
+        }
+        if (schema.get("$ref")) {
+            return fail("$ref is not supported");
+        }
+        if (const JsonValue* c = schema.get("const")) {
+            out = constant(*c);
+            return true;
+        }
+        if (const JsonValue* e = schema.get("enum")) {
+            if (!e->is_array() || e->array.empty()) {
+                return fail("enum must be a non-empty array");
+            }
+            std::string body;
+            for (size_t i = 0; i < e->array.size(); ++i) {
+                body += (i > 0 ? " | " : "") + constant(e->array[i]);
+            }
+            out = add_rule(body);
+            return true;
+        }
+        if (const JsonValue* any = schema.get("anyOf")) {
+            return visit_alternatives(*any, out, depth);
+        }
+        if (const JsonValue* one = schema.get("oneOf")) {
+            return visit_alternatives(*one, out, depth);
+        }
+
+        const JsonValue* type = schema.get("type");
+        if (!type) {
+            // Implied by the keywords, else anything goes
+            if (schema.get("properties")) return visit_object(schema, out, depth);
+            if (schema.get("items")) return visit_array(schema, out, depth);
+            out = use("value");
+            return true;
+        }
+        if (type->is_string()) {
+            return visit_type(type->string, schema, out, depth);
+        }
+        if (type->is_array() && !type->array.empty()) {
+            std::string body;
+            for (size_t i = 0; i < type->array.size(); ++i) {
+                if (!type->array[i].is_string()) {
+                    return fail("type list must hold strings");
+                }
+                std::string alt;
+                if (!visit_type(type->array[i].string, schema, alt, depth)) {
+                    return false;
+                }
+                body += (i > 0 ? " | " : "") + alt;
+            }
+            out = add_rule(body);
+            return true;
+        }
+        return fail("Bad 'type' keyword");
+    }
+
+    bool visit_object(const JsonValue& schema, std::string& out, int depth) {
+        const JsonValue* properties = schema.get("properties");
+        if (!properties || !properties->is_object() || properties->object.empty()) {
+            out = use("object");
+            return true;
+        }
+        std::vector<std::string> required_names;
+        if (const JsonValue* req = schema.get("required")) {
+            for (const auto& r : req->array) {
+                if (r.is_string()) {
+                    required_names.push_back(r.string);
+                }
+            }
+        }
+
+        // "key": value, one rule per property
+        std::vector<std::string> required;
+        std::vector<std::string> optional;
+        for (const auto& prop : properties->object) {
+            std::string value;
+            if (!visit(prop.second, value, depth + 1)) {
+                return false;
+            }
+            const std::string kv = add_rule(literal(json_quote(prop.first)) + " " + use("space") +
+                                            " \":\" " + use("space") + " " + value);
+            bool is_required = false;
+            for (const auto& name : required_names) {
+                is_required = is_required || name == prop.first;
+            }
+            (is_required ? required : optional).push_back(kv);
+        }
+
+        std::string body = "\"{\" " + use("space") + " ";
+        if (!required.empty()) {
+            for (size_t i = 0; i < required.size(); ++i) {
+                body += (i > 0 ? " \",\" " + use("space") + " " : std::string()) + required[i];
+            }
+            for (const auto& kv : optional) {
+                body += " (\",\" " + use("space") + " " + kv + ")?";
+            }
+        } else {
+            // All optional: whichever comes first needs no comma
+            body += "(";
+            for (size_t i = 0; i < optional.size(); ++i) {
+                body += (i > 0 ? " | " : "") + optional[i];
+                for (size_t j = i + 1; j < optional.size(); ++j) {
+                    body += " (\",\" " + use("space") + " " + optional[j] + ")?";
+                }
+            }
+            body += ")?";
+        }
+        body += " \"}\" " + use("space");
+        out = add_rule(body);
+        return true;
+    }
+
+    bool visit_array(const JsonValue& schema, std::string& out, int depth) {
+        std::string item;
+        if (const JsonValue* items = schema.get("items")) {
+            if (!visit(*items, item, depth + 1)) {
+                return false;
+            }
+        } else {
+            item = use("value");
+        }
+        const JsonValue* min_items = schema.get("minItems");
+        const bool non_empty = min_items && min_items->is_number() && min_items->number >= 1;
+        if (min_items && min_items->is_number() && min_items->number > 1) {
+            LLM_LOG_WARN("Grammar", "minItems > 1 is treated as 1");
+        }
+        const std::string list = item + " (\",\" " + use("space") + " " + item + ")*";
+        out = add_rule("\"[\" " + use("space") + " " + (non_empty ? list : "(" + list + ")?") +
+                       " \"]\" " + use("space"));
+        return true;
+    }
+};
+
+uint64_t hash_text(const std::string& text) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+} // namespace
+
+bool json_schema_to_gbnf(const std::string& schema, std::string& gbnf, std::string& error) {
+    JsonValue root;
+    if (!parse_json(schema, root, error)) {
+        error = "Invalid JSON schema: " + error;
+        return false;
+    }
+    SchemaConverter converter;
+    if (!converter.convert(root, gbnf, error)) {
+        error = "Unsupported JSON schema: " + error;
+        return false;
+    }
+    return true;
+}
+
+GrammarCache::~GrammarCache() {
+    clear();
+}
+
+void GrammarCache::clear() {
+    for (auto& e : entries_) {
+        llama_sampler_free(e.prototype);
+    }
+    entries_.clear();
+    vocab_ = nullptr;
+}
+
+bool ForcedTokens::find(uint64_t state, llama_token& token) const {
+    auto it = tokens_.find(state);
+    if (it == tokens_.end()) {
+        return false;
+    }
+    token = it->second;
+    return true;
+}
+
+void ForcedTokens::record(uint64_t state, llama_token token) {
+    if (tokens_.size() >= kCapacity) {
+        tokens_.clear();
+    }
+    tokens_[state] = token;
+}
+
+llama_sampler* GrammarCache::instantiate(const llama_vocab* vocab, const std::string& gbnf, std::string& error,
+                                         std::shared_ptr<ForcedTokens>* forced) {
+    if (vocab != vocab_) {
+        clear();
+        vocab_ = vocab;
+    }
+
+    const uint64_t hash = hash_text(gbnf);
+    for (auto& e : entries_) {
+        if (e.hash == hash && e.text == gbnf) {
+            e.last_used = ++tick_;
+            hits_++;
+            if (forced) {
+                *forced = e.forced;
+            }
+            return llama_sampler_clone(e.prototype);
+        }
+    }
+
+    misses_++;
+    llama_sampler* prototype = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (!prototype) {
+        error = "Grammar failed to parse";
+        return nullptr;
+    }
+    if (entries_.size() >= capacity_) {
+        auto victim = entries_.begin();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->last_used < victim->last_used) {
+                victim = it;
+            }
+        }
+        llama_sampler_free(victim->prototype);
+        entries_.erase(victim);
+    }
+    Entry entry;
+    entry.hash = hash;
+    entry.text = gbnf;
+    entry.prototype = prototype;
+    entry.forced = std::make_shared<ForcedTokens>();
+    entry.last_used = ++tick_;
+    entries_.push_back(std::move(entry));
+    LLM_LOG_DEBUG("Grammar", "Compiled grammar " << std::hex << hash << std::dec << " ("
+                             << gbnf.size() << " bytes)");
+    if (forced) {
+        *forced = entries_.back().forced;
+    }
+    return llama_sampler_clone(prototype);
+}
+
+} // namespace local_llm
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include "llama.h"
+
+namespace local_llm {
+
+// Translate a JSON schema into a GBNF grammar rooted at `root`. Supported:
+// type (including type lists), properties/required, items, enum, const,
+// anyOf/oneOf, and minItems of 0 or 1. An empty schema ("{}") accepts any
+// JSON value. Properties are emitted required-first, each in schema order;
+// additional properties are not allowed.
+bool json_schema_to_gbnf(const std::string& schema, std::string& gbnf, std::string& error);
+
+// Tokens a grammar forces, keyed by a hash of the tokens it accepted so far.
+// A grammar's state is a function of that history, so a state that allowed a
+// single token (a fixed key, a closing brace) is recognised the next time
+// without masking the whole vocabulary. Shared by every request of a grammar.
+class ForcedTokens {
+public:
+    // Start state of the hash, and the state after accepting `token`
+    static uint64_t start() { return 1469598103934665603ULL; }
+    static uint64_t advance(uint64_t state, llama_token token) {
+        return (state ^ (uint64_t)(uint32_t)token) * 1099511628211ULL;
+    }
+
+    bool find(uint64_t state, llama_token& token) const;
+    void record(uint64_t state, llama_token token);
+
+private:
+    static const size_t kCapacity = 4096;  // forgotten all at once beyond this
+    std::unordered_map<uint64_t, llama_token> tokens_;
+};
+
+// Compiled grammars of one vocabulary, keyed by a hash of their text. Parsing
+// a GBNF grammar builds its whole rule graph, so each distinct grammar is
+// parsed once and every request gets a clone of the compiled prototype.
+class GrammarCache {
+public:
+    explicit GrammarCache(size_t capacity = 16) : capacity_(capacity) {}
+    ~GrammarCache();
+
+    GrammarCache(const GrammarCache&) = delete;
+    GrammarCache& operator=(const GrammarCache&) = delete;
+
+    // A fresh grammar sampler for `gbnf`; null (with `error`) if it does not
+    // compile. `forced` is set to the forced-token table of the grammar.
+    llama_sampler* instantiate(const llama_vocab* vocab, const std::string& gbnf, std::string& error,
+                               std::shared_ptr<ForcedTokens>* forced = nullptr);
+
+    // Drop every prototype (the vocabulary is about to change)
+    void clear();
+
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    struct Entry {
+        uint64_t hash = 0;
+        std::string text;  // compared on hit, so a hash collision is only a miss
+        llama_sampler* prototype = nullptr;
+        std::shared_ptr<ForcedTokens> forced;
+        uint64_t last_used = 0;
+    };
+
+    size_t capacity_;
+    std::vector<Entry> entries_;
+    const llama_vocab* vocab_ = nullptr;
+    uint64_t tick_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+} // namespace local_llm
@@ -1,69 +1,212 @@
 #include "llm_model.h"
-#include <iostream>
+#include "../common/logging.h"
+#include "../common/cpu_affinity.h"
+#include "../common/metrics.h"
+#include "ggml-cpu.h"
 #include <sstream>
 #include <algorithm>
-#include <random>
 #include <cmath>
+#include <random>
 #include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace local_llm {
 
 // Static flag to ensure backend is initialized only once
 static bool backend_initialized = false;
 
-LLMModel::LLMModel() : ctx_(nullptr), model_(nullptr) {
-    std::cerr << "[LLMModel] Constructor called, this=" << this << std::endl;
+LLMModel::LLMModel() : ctx_(nullptr), model_(nullptr), ctx_params_(llama_context_default_params()) {
+    LLM_LOG_DEBUG("LLMModel", "Constructor called, this=" << this);
 }
 
 LLMModel::~LLMModel() {
-    std::cerr << "[LLMModel] Destructor called, this=" << this << std::endl;
+    LLM_LOG_DEBUG("LLMModel", "Destructor called, this=" << this);
     if (ctx_) {
-        std::cerr << "[LLMModel] Freeing context in destructor" << std::endl;
-        llama_free(ctx_);
-        ctx_ = nullptr;
-    }
-    if (model_) {
-        std::cerr << "[LLMModel] Freeing model in destructor" << std::endl;
-        llama_model_free(model_);
-        model_ = nullptr;
+        LLM_LOG_DEBUG("LLMModel", "Freeing context in destructor");
     }
+    free_context();
+    adapters_->clear();
+    // The registry decides when the weights themselves are freed
+    model_handle_.reset();
+    model_ = nullptr;
     // Don't call llama_backend_free() here - it should only be called once at application shutdown
 }
 
 void LLMModel::cleanup_backend() {
     if (backend_initialized) {
-        std::cerr << "[LLMModel] Cleaning up llama.cpp backend" << std::endl;
+        LLM_LOG_INFO("LLMModel", "Cleaning up llama.cpp backend");
         llama_backend_free();
         backend_initialized = false;
     }
 }
 
-bool LLMModel::initialize(const ModelConfig& config) {
-    std::cerr << "[LLMModel] initialize called, this=" << this << std::endl;
-    config_ = config;
-    
+ModelLoadParams LLMModel::load_params(const ModelConfig& config) {
+    ModelLoadParams params;
+    params.gpu_layers = config.gpu_layers;
+    params.use_mmap = config.use_mmap;
+    params.use_mlock = config.use_mlock;
+    return params;
+}
+
+void LLMModel::ensure_backend() {
     // Initialize llama.cpp backend only once
     if (!backend_initialized) {
-        std::cerr << "[LLMModel] Initializing llama.cpp backend" << std::endl;
+        LLM_LOG_INFO("LLMModel", "Initializing llama.cpp backend");
         llama_backend_init();
         backend_initialized = true;
     }
+}
+
+bool LLMModel::initialize(const ModelConfig& config) {
+    LLM_LOG_DEBUG("LLMModel", "initialize called, this=" << this);
+    config_ = config;
+    sampling_version_++;
+    rng_.seed(config_.seed < 0 ? std::random_device{}() : (uint32_t)config_.seed);
     
-    // Load model
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = config.gpu_layers;
+    // A context built for a previous model is useless now, and so are its
+    // grammars and adapters
+    free_context();
+    grammars_.clear();
+    adapters_->clear();
+    resolve_execution_policy();
     
-    model_ = llama_model_load_from_file(config.model_path.c_str(), model_params);
+    // llama.cpp only supports a quantized V cache with flash attention
+    if (config_.cache_type_v != GGML_TYPE_F16 && config_.cache_type_v != GGML_TYPE_F32 && !config_.flash_attn) {
+        LLM_LOG_WARN("LLMModel", "V cache type " << ggml_type_name(config_.cache_type_v)
+                                 << " requires flash attention, enabling it");
+        config_.flash_attn = true;
+    }
+    
+    ensure_backend();
+    
+    // Load model (or share the copy another LLMModel already has)
+    ModelRegistry& registry = ModelRegistry::instance();
+    if (config.model_ram_budget_mb > 0) {
+        registry.set_budget_bytes((uint64_t)config.model_ram_budget_mb * 1024 * 1024);
+    }
+    model_handle_ = registry.acquire(config.model_path, load_params(config));
+    model_ = model_handle_.get();
     if (model_) {
-        std::cerr << "[LLMModel] Model loaded, model_=" << model_ << std::endl;
+        LLM_LOG_INFO("LLMModel", "Model loaded, model_=" << model_);
+        adapters_->configure(model_handle_, config_.lora_dir,
+                             (size_t)std::max(1, config_.lora_cache_size), config_.lora_scale);
+    }
+    if (!model_) {
+        LLM_LOG_ERROR("LLMModel", "Failed to load model: " << config.model_path);
+        pieces_.clear();
+        chat_template_.clear();
+        return false;
     }
+    pieces_.build(llama_model_get_vocab(model_));
+    chat_template_.initialize(model_);
+    
+    // The context is created lazily on the first request and then kept alive
+    LLM_LOG_INFO("LLMModel", "Model loaded successfully: " << config.model_path);
+    return true;
+}
+
+// Read a file end to end so its pages are cached before a mapping of it is
+// touched; returns the bytes read
+static uint64_t prefetch_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<char> buf(4 << 20);
+    uint64_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+        total += (uint64_t)n;
+    }
+    close(fd);
+    return total;
+}
+
+bool LLMModel::warmup() {
+    using clock = std::chrono::high_resolution_clock;
+    auto ms_since = [](clock::time_point t) {
+        return std::chrono::duration<double, std::milli>(clock::now() - t).count();
+    };
+    warmup_stats_ = WarmupStats();
     if (!model_) {
-        std::cerr << "Failed to load model: " << config.model_path << std::endl;
         return false;
     }
+    const auto start = clock::now();
+    
+    // mlock'd or copied weights are resident already
+    if (config_.use_mmap && !config_.use_mlock) {
+        auto t = clock::now();
+        warmup_stats_.prefetch_bytes = prefetch_file(config_.model_path);
+        warmup_stats_.prefetch_ms = ms_since(t);
+    }
+    
+    auto t = clock::now();
+    if (!ensure_context()) {
+        return false;
+    }
+    warmup_stats_.context_ms = ms_since(t);
     
-    // Do NOT create context here anymore
-    std::cout << "Model loaded successfully: " << config.model_path << std::endl;
+    // One token through the whole graph; its KV entry is dropped again
+    t = clock::now();
+    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    const llama_token bos = llama_vocab_bos(vocab);
+    batch_.n_tokens = 0;
+    batch_add(batch_, bos != LLAMA_TOKEN_NULL ? bos : 0, 0, slots_[0].id, true);
+    if (llama_decode(ctx_, batch_) != 0) {
+        LLM_LOG_WARN("LLMModel", "Warmup decode failed");
+    }
+    llama_kv_self_seq_rm(ctx_, slots_[0].id, -1, -1);
+    warmup_stats_.decode_ms = ms_since(t);
+    
+    if (!config_.warmup_system_prompt.empty()) {
+        t = clock::now();
+        ChatState state;
+        chat_template_.append(state, {{"system", config_.warmup_system_prompt}});
+        const std::vector<llama_token>& tokens = state.tokens;
+        const size_t n_batch = llama_n_batch(ctx_);
+        if (tokens.empty() || tokens.size() >= llama_n_ctx(ctx_) / 2) {
+            LLM_LOG_WARN("LLMModel", "System prompt not prefilled ("
+                         << (tokens.empty() ? "chat template is rendered in full" : "too long") << ")");
+        } else {
+            bool ok = true;
+            for (size_t pos = 0; ok && pos < tokens.size(); pos += n_batch) {
+                batch_.n_tokens = 0;
+                const size_t end = std::min(tokens.size(), pos + n_batch);
+                for (size_t i = pos; i < end; ++i) {
+                    batch_add(batch_, tokens[i], (llama_pos)i, slots_[0].id, i + 1 == tokens.size());
+                }
+                ok = llama_decode(ctx_, batch_) == 0;
+            }
+            if (ok) {
+                // Slots share the prefix's KV cells rather than copies of them
+                for (auto& s : slots_) {
+                    if (s.id != slots_[0].id) {
+                        llama_kv_self_seq_cp(ctx_, slots_[0].id, s.id, -1, -1);
+                    }
+                    if (draft_) {
+                        draft_->reset_sequence(s.id);
+                    }
+                    s.cache = tokens;
+                }
+                warmup_stats_.prompt_tokens = (int)tokens.size();
+            } else {
+                LLM_LOG_WARN("LLMModel", "System prompt prefill failed");
+                llama_kv_self_seq_rm(ctx_, slots_[0].id, -1, -1);
+            }
+        }
+        warmup_stats_.prompt_ms = ms_since(t);
+    }
+    batch_.n_tokens = 0;
+    
+    warmup_stats_.total_ms = ms_since(start);
+    warmup_stats_.done = true;
+    LLM_LOG_INFO("LLMModel", "Warmup took " << (int)warmup_stats_.total_ms << " ms (prefetch "
+                             << (int)warmup_stats_.prefetch_ms << ", context " << (int)warmup_stats_.context_ms
+                             << ", decode " << (int)warmup_stats_.decode_ms << ", system prompt "
+                             << warmup_stats_.prompt_tokens << " tokens in " << (int)warmup_stats_.prompt_ms << ")");
     return true;
 }
 
@@ -74,396 +217,1326 @@ std::string LLMModel::generate(const std::string& prompt, int max_tokens) {
 void LLMModel::generate_stream(const std::string& prompt, 
                               std::function<void(const std::string&)> callback,
                               int max_tokens) {
-    std::cerr << "[LLMModel] generate_stream called, this=" << this << ", model_=" << model_ << std::endl;
+    LLM_LOG_DEBUG("LLMModel", "generate_stream called, this=" << this << ", model_=" << model_);
     if (!model_) {
         callback("Model not loaded");
         return;
     }
     
-    // Start timing
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    // Clear recent tokens for new generation (disabled for debugging)
-    // recent_tokens_.clear();
+    try {
+        std::string error;
+        int slot = run_single_sequence(prompt, max_tokens, callback, error);
+        if (slot < 0) {
+            callback(error);
+            return;
+        }
+        std::string metrics = build_done_metrics(slots_[slot]);
+        release_slot(slot);
+        LLM_LOG_DEBUG("LLMModel", "Sending [DONE] message with metrics: " << metrics);
+        callback(metrics);
+        LLM_LOG_DEBUG("LLMModel", "[DONE] message sent successfully");
+    } catch (const std::exception& e) {
+        LLM_LOG_ERROR("LLMModel", "Exception during streaming generation: " << e.what());
+        callback("Error during generation: " + std::string(e.what()));
+        reset_kv_cache();
+    } catch (...) {
+        LLM_LOG_ERROR("LLMModel", "Unknown exception during streaming generation");
+        callback("Unknown error during generation");
+        reset_kv_cache();
+    }
+}
+
+std::string LLMModel::generate_internal(const std::string& prompt, int max_tokens) {
+    LLM_LOG_DEBUG("LLMModel", "generate_internal called, this=" << this << ", model_=" << model_);
+    if (!model_) return "Model not loaded";
     
-    // Ensure any existing context is freed before creating a new one
-    if (ctx_) {
-        std::cerr << "[LLMModel] Freeing existing context before creating new one" << std::endl;
-        llama_free(ctx_);
-        ctx_ = nullptr;
+    std::string result;
+    try {
+        std::string error;
+        int slot = run_single_sequence(prompt, max_tokens, nullptr, error);
+        if (slot < 0) {
+            return error;
+        }
+        result = slots_[slot].output;
+        LLM_LOG_DEBUG("LLMModel", "generate_internal result: " << result);
+        LLM_LOG_DEBUG("LLMModel", "Metrics: " << build_done_metrics(slots_[slot]));
+        release_slot(slot);
+    } catch (const std::exception& e) {
+        LLM_LOG_ERROR("LLMModel", "Exception during generation: " << e.what());
+        reset_kv_cache();
+        return "Error during generation: " + std::string(e.what());
+    } catch (...) {
+        LLM_LOG_ERROR("LLMModel", "Unknown exception during generation");
+        reset_kv_cache();
+        return "Unknown error during generation";
+    }
+    return result;
+}
+
+int LLMModel::run_single_sequence(const std::string& prompt, int max_tokens,
+                                  std::function<void(const std::string&)> on_text,
+                                  std::string& error) {
+    // Reuse the persistent context instead of rebuilding it per request
+    if (!ensure_context()) {
+        error = "Failed to create context";
+        return -1;
+    }
+    const double context_setup_ms = last_context_setup_ms_;
+    auto tokenize_start = std::chrono::high_resolution_clock::now();
+    std::vector<llama_token> input_tokens = tokenize_prompt(prompt);
+    const double tokenize_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - tokenize_start).count();
+    LLM_LOG_DEBUG("LLMModel", "Input tokens size: " << input_tokens.size());
+    if (input_tokens.empty()) {
+        error = "Tokenization failed";
+        return -1;
     }
     
-    // Create context for this generation
+    int slot = acquire_slot(input_tokens);
+    if (slot < 0) {
+        error = "No free sequence slot";
+        return -1;
+    }
+    begin_sequence(slot, std::move(input_tokens), max_tokens, std::move(on_text));
+    slots_[slot].timing.context_setup_ms = context_setup_ms;
+    slots_[slot].timing.tokenize_ms = tokenize_ms;
+    while (slots_[slot].is_active()) {
+        if (!decode_step()) {
+            break;
+        }
+    }
+    flush_stream(slot);
+    if (!slots_[slot].error.empty()) {
+        error = slots_[slot].error;
+        release_slot(slot);
+        return -1;
+    }
+    return slot;
+}
+
+llama_context_params LLMModel::make_context_params() const {
     llama_context_params ctx_params = llama_context_default_params();
     ctx_params.n_ctx = config_.context_size;
     ctx_params.n_batch = config_.batch_size;
+    ctx_params.n_ubatch = std::min(config_.ubatch_size, config_.batch_size);
+    ctx_params.n_seq_max = std::max(1, config_.parallel_sequences);
+    ctx_params.type_k = config_.cache_type_k;
+    ctx_params.type_v = config_.cache_type_v;
     ctx_params.n_threads = config_.threads;
-    ctx_params.n_threads_batch = config_.threads;
+    ctx_params.n_threads_batch = config_.threads_batch > 0 ? config_.threads_batch : config_.threads;
+    ctx_params.rope_freq_base = config_.rope_freq_base;
+    ctx_params.rope_freq_scale = config_.rope_freq_scale;
+    ctx_params.yarn_ext_factor = config_.yarn_ext_factor;
+    ctx_params.yarn_attn_factor = config_.yarn_attn_factor;
+    ctx_params.yarn_beta_fast = config_.yarn_beta_fast;
+    ctx_params.yarn_beta_slow = config_.yarn_beta_slow;
+    ctx_params.yarn_orig_ctx = config_.yarn_orig_ctx;
+    ctx_params.defrag_thold = config_.defrag_thold;
+    ctx_params.flash_attn = config_.flash_attn;
+    ctx_params.offload_kqv = config_.offload_kqv;
+    ctx_params.embeddings = config_.embeddings;
+    return ctx_params;
+}
+
+// Everything except the thread counts, which can be changed on a live context
+static bool needs_rebuild(const llama_context_params& a, const llama_context_params& b) {
+    return a.n_ctx != b.n_ctx || a.n_batch != b.n_batch || a.n_ubatch != b.n_ubatch ||
+           a.n_seq_max != b.n_seq_max || a.type_k != b.type_k || a.type_v != b.type_v ||
+           a.rope_freq_base != b.rope_freq_base || a.rope_freq_scale != b.rope_freq_scale ||
+           a.yarn_ext_factor != b.yarn_ext_factor || a.yarn_attn_factor != b.yarn_attn_factor ||
+           a.yarn_beta_fast != b.yarn_beta_fast || a.yarn_beta_slow != b.yarn_beta_slow ||
+           a.yarn_orig_ctx != b.yarn_orig_ctx || a.defrag_thold != b.defrag_thold ||
+           a.flash_attn != b.flash_attn || a.offload_kqv != b.offload_kqv ||
+           a.embeddings != b.embeddings;
+}
+
+bool LLMModel::context_rebuild_pending() const {
+    return ctx_ && (needs_rebuild(ctx_params_, make_context_params()) || threadpool_undersized());
+}
+
+void LLMModel::resolve_execution_policy() {
+    const CpuTopology topo = detect_cpu_topology();
+    
+    std::vector<int> requested;
+    if (!config_.cpu_mask.empty() && !parse_cpu_list(config_.cpu_mask, requested)) {
+        LLM_LOG_WARN("LLMModel", "Ignoring malformed cpu_mask '" << config_.cpu_mask << "'");
+        requested.clear();
+    }
+    // Only CPUs the process is actually allowed on (taskset, cgroups)
+    compute_cpus_.clear();
+    for (int cpu : requested) {
+        if (std::find(topo.cpus.begin(), topo.cpus.end(), cpu) != topo.cpus.end()) {
+            compute_cpus_.push_back(cpu);
+        }
+    }
+    if (compute_cpus_.empty()) {
+        compute_cpus_ = topo.performance;
+    }
+    host_cpus_.clear();
+    for (int cpu : topo.cpus) {
+        if (std::find(compute_cpus_.begin(), compute_cpus_.end(), cpu) == compute_cpus_.end()) {
+            host_cpus_.push_back(cpu);
+        }
+    }
+    
+    if (config_.threads <= 0) {
+        config_.threads = (int)compute_cpus_.size();
+    }
+    if (config_.threads_batch <= 0) {
+        config_.threads_batch = config_.threads;
+    }
+    LLM_LOG_INFO("LLMModel", "Compute CPUs " << format_cpu_list(compute_cpus_) << ", host CPUs "
+                             << (host_cpus_.empty() ? "shared" : format_cpu_list(host_cpus_))
+                             << ", threads " << config_.threads << "/" << config_.threads_batch);
+}
+
+ggml_threadpool_t LLMModel::new_threadpool(int n_threads) const {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (int cpu : compute_cpus_) {
+        if (cpu < GGML_MAX_N_THREADS) {
+            params.cpumask[cpu] = true;
+        }
+    }
+    params.strict_cpu = config_.cpu_strict;
+    params.poll = (uint32_t)std::min(100, std::max(0, config_.threadpool_poll));
+    // Started by the first graph, which pins the decoding thread (worker 0)
+    // to the mask rather than whichever thread built the context
+    params.paused = true;
+    ggml_threadpool_t threadpool = ggml_threadpool_new(&params);
+    if (!threadpool) {
+        LLM_LOG_WARN("LLMModel", "Failed to create a " << n_threads << "-thread threadpool");
+    }
+    return threadpool;
+}
+
+bool LLMModel::threadpool_undersized() const {
+    if (!threadpool_) {
+        return false;
+    }
+    const int batch_threads = threadpool_batch_ ? threadpool_batch_threads_ : threadpool_threads_;
+    return ctx_params_.n_threads > threadpool_threads_ || ctx_params_.n_threads_batch > batch_threads;
+}
+
+bool LLMModel::ensure_context() {
+    last_context_setup_ms_ = 0.0;
+    if (!model_) {
+        return false;
+    }
+    if (ctx_) {
+        if (!context_rebuild_pending() || has_active_sequences()) {
+            return true;
+        }
+        LLM_LOG_INFO("LLMModel", "Context settings changed, rebuilding context");
+        free_context();
+    }
+    
+    auto setup_start = std::chrono::high_resolution_clock::now();
+    llama_context_params ctx_params = make_context_params();
+    const int n_seq = (int)ctx_params.n_seq_max;
     ctx_ = llama_init_from_model(model_, ctx_params);
     if (!ctx_) {
-        callback("Failed to create context");
-        return;
+        LLM_LOG_ERROR("LLMModel", "Failed to create context");
+        return false;
     }
-    std::vector<llama_token> input_tokens = tokenize(prompt);
-    std::cerr << "[LLMModel] Input tokens size: " << input_tokens.size() << std::endl;
-    if (input_tokens.empty()) {
-        callback("Tokenization failed");
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-        return;
+    ctx_params_ = ctx_params;
+    active_adapter_.clear();
+    active_lora_.reset();
+    adapters_->set_active("");
+    adapter_turn_ = 0;
+    kv_full_ = false;
+    
+    // One persistent pool instead of ggml spinning threads up for every graph
+    threadpool_ = new_threadpool(ctx_params.n_threads);
+    threadpool_threads_ = ctx_params.n_threads;
+    if (threadpool_ && ctx_params.n_threads_batch != ctx_params.n_threads) {
+        threadpool_batch_ = new_threadpool(ctx_params.n_threads_batch);
+        threadpool_batch_threads_ = ctx_params.n_threads_batch;
     }
-    const llama_vocab* vocab = llama_model_get_vocab(model_);
-    if (llama_vocab_get_add_bos(vocab)) {
-        input_tokens.insert(input_tokens.begin(), llama_vocab_bos(vocab));
-        // std::cerr << "[LLMModel] Added BOS token, total tokens: " << input_tokens.size() << std::endl;
+    if (threadpool_) {
+        llama_attach_threadpool(ctx_, threadpool_, threadpool_batch_);
     }
-    try {
-        for (size_t i = 0; i < input_tokens.size(); i += config_.batch_size) {
-            int n_eval = std::min((int)input_tokens.size() - (int)i, config_.batch_size);
-            llama_batch batch = llama_batch_get_one(input_tokens.data() + i, n_eval);
-            int ret = llama_decode(ctx_, batch);
-            if (ret != 0) {
-                callback("Failed to decode input tokens");
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return;
+    
+    batch_ = llama_batch_init(llama_n_batch(ctx_), 0, 1);
+    batch_initialized_ = true;
+    
+    // Lets a cancelled request interrupt prefill/decode mid-graph
+    llama_set_abort_callback(ctx_, &LLMModel::abort_callback, this);
+    
+    slots_.assign(n_seq, SequenceSlot());
+    samplers_.clear();
+    for (int i = 0; i < n_seq; ++i) {
+        slots_[i].id = i;
+        samplers_.push_back(std::make_unique<Sampler>());
+    }
+    
+    if (!config_.draft_model_path.empty()) {
+        auto draft_model = std::make_unique<DraftModelSource>();
+        if (draft_model->initialize(model_, config_, n_seq, (int)llama_n_ctx(ctx_))) {
+            if (threadpool_) {
+                draft_model->attach_threadpool(threadpool_, threadpool_batch_);
             }
+            draft_ = std::move(draft_model);
         }
-        std::string full_result;
-        int tokens_generated = 0;
-        int loop_iterations = 0;
-        // std::cerr << "[LLMModel] Starting generation loop, max_tokens: " << max_tokens << std::endl;
-        for (int i = 0; i < max_tokens; ++i) {
-            loop_iterations++;
-            // std::cerr << "[LLMModel] Loop iteration " << loop_iterations << "/" << max_tokens << std::endl;
-            float* logits = llama_get_logits(ctx_);
-            if (!logits) {
-                callback("Failed to get logits");
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return;
-            }
-            int vocab_size = llama_vocab_n_tokens(vocab);
-            std::vector<float> logits_vec(logits, logits + vocab_size);
-            llama_token next_token = sample_next_token(logits_vec);
-            // std::cerr << "[LLMModel] Generated token " << i << ": " << next_token << " (EOS: " << llama_vocab_eos(vocab) << ")" << std::endl;
-            if (next_token == llama_vocab_eos(vocab)) {
-                std::cerr << "[LLMModel] Hit EOS token, stopping generation" << std::endl;
-                break;
+    }
+    if (!draft_ && config_.prompt_lookup) {
+        draft_ = std::make_unique<NgramDraftSource>(n_seq, config_.lookup_ngram_min, config_.lookup_ngram_max);
+    }
+    last_context_setup_ms_ = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - setup_start).count();
+    LLM_LOG_INFO("LLMModel", "Created persistent context in " << last_context_setup_ms_
+                             << " ms, n_ctx=" << llama_n_ctx(ctx_)
+                             << ", n_batch=" << llama_n_batch(ctx_) << ", n_ubatch=" << llama_n_ubatch(ctx_)
+                             << ", n_seq_max=" << n_seq << ", threads=" << ctx_params.n_threads
+                             << "/" << ctx_params.n_threads_batch
+                             << (threadpool_ ? " (threadpool)" : "")
+                             << ", flash_attn=" << (ctx_params.flash_attn ? "on" : "off"));
+    return true;
+}
+
+void LLMModel::set_threads(int threads) {
+    // 0 goes back to one thread per compute CPU; a larger count than the
+    // threadpool holds rebuilds the context once no sequence is running
+    config_.threads = threads > 0 ? threads : (int)compute_cpus_.size();
+    if (ctx_) {
+        ctx_params_.n_threads = config_.threads;
+        if (config_.threads_batch <= 0) {
+            ctx_params_.n_threads_batch = config_.threads;  // prefill follows decode
+        }
+        llama_set_n_threads(ctx_, ctx_params_.n_threads, ctx_params_.n_threads_batch);
+    }
+}
+
+void LLMModel::set_threads_batch(int threads) {
+    config_.threads_batch = threads;
+    if (ctx_) {
+        // Prefill threads can change on a live context, no rebuild needed
+        ctx_params_.n_threads_batch = threads > 0 ? threads : config_.threads;
+        llama_set_n_threads(ctx_, ctx_params_.n_threads, ctx_params_.n_threads_batch);
+    }
+}
+
+void LLMModel::free_context() {
+    if (batch_initialized_) {
+        llama_batch_free(batch_);
+        batch_initialized_ = false;
+    }
+    if (ctx_) {
+        llama_free(ctx_);
+        ctx_ = nullptr;
+    }
+    slots_.clear();
+    samplers_.clear();
+    draft_.reset();
+    embedder_.reset();
+    
+    // Only after every context that used them is gone
+    if (threadpool_batch_) {
+        ggml_threadpool_free(threadpool_batch_);
+        threadpool_batch_ = nullptr;
+    }
+    if (threadpool_) {
+        ggml_threadpool_free(threadpool_);
+        threadpool_ = nullptr;
+    }
+    threadpool_threads_ = 0;
+    threadpool_batch_threads_ = 0;
+}
+
+void LLMModel::reset_kv_cache() {
+    if (ctx_) {
+        llama_kv_self_clear(ctx_);
+    }
+    for (auto& s : slots_) {
+        s.cache.clear();
+        if (draft_) {
+            draft_->reset_sequence(s.id);
+        }
+    }
+}
+
+bool LLMModel::relieve_kv_pressure(std::vector<std::pair<int, int>>& spans) {
+    // Whatever the failed decode left past each sequence's cache goes first
+    for (const auto& span : spans) {
+        const SequenceSlot& s = slots_[span.first];
+        llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)s.cache.size(), -1);
+    }
+    
+    bool shrunk = false;
+    for (auto it = spans.begin(); it != spans.end();) {
+        SequenceSlot& s = slots_[it->first];
+        if (s.state == SequenceSlot::State::Prefill) {
+            // Prefill resumes at a later step, once generating sequences finish
+            s.i_batch = -1;
+            it = spans.erase(it);
+            kv_full_ = true;
+            shrunk = true;
+            continue;
+        }
+        if (!s.draft.empty()) {
+            s.n_drafted -= (int)s.draft.size();
+            s.draft.clear();
+            shrunk = true;
+        }
+        ++it;
+    }
+    
+    if (!shrunk && spans.size() > 1) {
+        // Decode tokens alone do not fit: the longest sequence slides its
+        // window, or ends as if it reached the end of its context
+        auto longest = spans.begin();
+        for (auto it = spans.begin(); it != spans.end(); ++it) {
+            if (slots_[it->first].cache.size() > slots_[longest->first].cache.size()) {
+                longest = it;
             }
-            tokens_generated++;
-            char piece[32]; // Increased buffer size for longer tokens
-            int n_piece = llama_token_to_piece(vocab, next_token, piece, sizeof(piece), 0, false);
-            // std::cerr << "[LLMModel] Token " << next_token << " -> n_piece: " << n_piece << std::endl;
-            if (n_piece > 0) {
-                std::string token_text(piece, n_piece);
-                full_result += token_text;
-                std::cerr << "[LLMModel] Streaming token text: '" << token_text << "' (length: " << token_text.length() << ")" << std::endl;
-                callback(token_text); // Stream the token
-                std::cerr << "[LLMModel] Callback completed for token: '" << token_text << "'" << std::endl;
-            } else {
-                std::cerr << "[LLMModel] Warning: n_piece <= 0 for token " << next_token << std::endl;
+        }
+        SequenceSlot& s = slots_[longest->first];
+        if (!shift_context(s)) {
+            LLM_LOG_WARN("LLMModel", "KV cache full, ending sequence " << s.id << " at "
+                                     << s.cache.size() << " tokens");
+            llama_kv_self_seq_rm(ctx_, s.id, -1, -1);
+            s.cache.clear();
+            if (draft_) {
+                draft_->reset_sequence(s.id);
             }
-            llama_batch batch = llama_batch_get_one(&next_token, 1);
-            // std::cerr << "[LLMModel] About to decode token " << next_token << std::endl;
-            int ret = llama_decode(ctx_, batch);
-            // std::cerr << "[LLMModel] Decode result for token " << next_token << ": " << ret << std::endl;
-            if (ret != 0) {
-                std::cerr << "[LLMModel] Failed to decode generated token, ret=" << ret << std::endl;
-                callback("Failed to decode generated token");
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return;
+            s.i_batch = -1;
+            s.context_full = true;
+            s.state = SequenceSlot::State::Done;
+            spans.erase(longest);
+        }
+        shrunk = true;
+    }
+    if (!shrunk || spans.empty()) {
+        return false;
+    }
+    
+    // Only decode spans are left; lay them out again
+    batch_.n_tokens = 0;
+    batch_cancel_.clear();
+    for (auto& span : spans) {
+        SequenceSlot& s = slots_[span.first];
+        const llama_pos pos = (llama_pos)s.cache.size();
+        s.i_batch = batch_.n_tokens;
+        batch_add(batch_, s.pending, pos, s.id, true);
+        for (size_t j = 0; j < s.draft.size(); ++j) {
+            batch_add(batch_, s.draft[j], pos + 1 + (llama_pos)j, s.id, true);
+        }
+        span.second = 1 + (int)s.draft.size();
+        batch_cancel_.push_back(s.cancel);
+    }
+    return true;
+}
+
+bool LLMModel::evict_idle_slots() {
+    bool freed = false;
+    for (auto& s : slots_) {
+        if (!s.is_active() && !s.cache.empty()) {
+            llama_kv_self_seq_rm(ctx_, s.id, -1, -1);
+            s.cache.clear();
+            if (draft_) {
+                draft_->reset_sequence(s.id);
             }
-            std::cerr << "[LLMModel] Successfully decoded token " << next_token << std::endl;
+            freed = true;
         }
-        std::cerr << "[LLMModel] Generation loop completed. Total iterations: " << loop_iterations << ", Tokens generated: " << tokens_generated << std::endl;
-        
-        // Calculate timing and metrics
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-        double duration_seconds = duration.count() / 1000.0;
-        double tokens_per_second = tokens_generated / duration_seconds;
-        
-        std::cerr << "[LLMModel] generate_stream result: " << full_result << std::endl;
-        std::cerr << "[LLMModel] Metrics - Input tokens: " << input_tokens.size() 
-                  << ", Generated tokens: " << tokens_generated 
-                  << ", Duration: " << duration_seconds << "s"
-                  << ", Speed: " << tokens_per_second << " tokens/s" << std::endl;
-        
-        // Calculate additional metrics
-        double first_token_latency = 0.0;
-        if (tokens_generated > 0) {
-            // For now, we'll approximate first token latency
-            // In a more sophisticated implementation, we'd track this precisely
-            first_token_latency = duration_seconds / tokens_generated;
+    }
+    return freed;
+}
+
+uint64_t LLMModel::fingerprint() const {
+    if (!model_) {
+        return 0;
+    }
+    // Every GGUF metadata key and value (name, base model, training and
+    // quantization details) plus the file size, so fine-tunes of one base
+    // model with the same shape do not share KV sessions
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&h](const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            h ^= (unsigned char)data[i];
+            h *= 1099511628211ULL;
         }
-        
-        // Get context usage
-        int context_used = input_tokens.size() + tokens_generated;
-        double context_usage_percent = (double)context_used / config_.context_size * 100.0;
-        
-        // Send enhanced metrics as JSON
-        std::ostringstream metrics;
-        metrics << "[DONE]{\"input_tokens\":" << input_tokens.size()
-                << ",\"output_tokens\":" << tokens_generated
-                << ",\"duration_seconds\":" << duration_seconds
-                << ",\"tokens_per_second\":" << tokens_per_second
-                << ",\"first_token_latency_ms\":" << (first_token_latency * 1000.0)
-                << ",\"context_used\":" << context_used
-                << ",\"context_size\":" << config_.context_size
-                << ",\"context_usage_percent\":" << context_usage_percent
-                << ",\"temperature\":" << config_.temperature
-                << ",\"top_p\":" << config_.top_p
-                << ",\"top_k\":" << config_.top_k
-                << ",\"batch_size\":" << config_.batch_size
-                << ",\"threads\":" << config_.threads
-                << ",\"gpu_layers\":" << config_.gpu_layers
-                << ",\"max_tokens_requested\":" << max_tokens
-                << ",\"eos_hit\":" << (tokens_generated < max_tokens ? "true" : "false")
-                << "}";
-        std::cerr << "[LLMModel] Sending [DONE] message with metrics: " << metrics.str() << std::endl;
-        callback(metrics.str());
-        std::cerr << "[LLMModel] [DONE] message sent successfully" << std::endl;
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-    } catch (const std::exception& e) {
-        std::cerr << "Exception during streaming generation: " << e.what() << std::endl;
-        callback("Error during generation: " + std::string(e.what()));
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-    } catch (...) {
-        std::cerr << "Unknown exception during streaming generation" << std::endl;
-        callback("Unknown error during generation");
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
+    };
+    std::vector<char> buf(256);
+    auto mix_meta = [&](int32_t i, int32_t (*get)(const llama_model*, int32_t, char*, size_t)) {
+        int32_t n = get(model_, i, buf.data(), buf.size());
+        if (n >= (int32_t)buf.size()) {
+            buf.resize(n + 1);
+            n = get(model_, i, buf.data(), buf.size());
+        }
+        if (n > 0) {
+            mix(buf.data(), (size_t)n);
+        }
+        mix("", 1);
+    };
+    const int32_t n_meta = llama_model_meta_count(model_);
+    for (int32_t i = 0; i < n_meta; ++i) {
+        mix_meta(i, llama_model_meta_key_by_index);
+        mix_meta(i, llama_model_meta_val_str_by_index);
+    }
+
+    struct stat st;
+    const uint64_t values[] = {
+        stat(config_.model_path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0,
+        llama_model_n_params(model_),
+        llama_model_size(model_),
+    };
+    mix(reinterpret_cast<const char*>(values), sizeof(values));
+    return h;
+}
+
+size_t LLMModel::sequence_state_size(int slot) {
+    // KV computed under a LoRA adapter only matches that adapter, which the
+    // session format does not record
+    if (!ctx_ || slot < 0 || slot >= (int)slots_.size() || slots_[slot].is_active() ||
+        slots_[slot].cache.empty() || !slots_[slot].cache_adapter.empty()) {
+        return 0;
     }
+    return llama_state_seq_get_size(ctx_, slots_[slot].id);
 }
 
-std::string LLMModel::generate_internal(const std::string& prompt, int max_tokens) {
-    std::cerr << "[LLMModel] generate_internal called, this=" << this << ", model_=" << model_ << std::endl;
-    if (!model_) return "Model not loaded";
-    
-    // Start timing
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    // Clear recent tokens for new generation (disabled for debugging)
-    // recent_tokens_.clear();
+size_t LLMModel::copy_sequence_state(int slot, uint8_t* dst, size_t size) {
+    if (!ctx_ || slot < 0 || slot >= (int)slots_.size() || slots_[slot].is_active()) {
+        return 0;
+    }
+    return llama_state_seq_get_data(ctx_, dst, size, slots_[slot].id);
+}
+
+int LLMModel::restore_sequence(const llama_token* tokens, size_t n_tokens,
+                               const uint8_t* state, size_t size) {
+    if (!ensure_context() || n_tokens == 0 || n_tokens >= (size_t)llama_n_ctx(ctx_)) {
+        return -1;
+    }
+    const std::vector<llama_token> saved(tokens, tokens + n_tokens);
     
-    // Ensure any existing context is freed before creating a new one
-    if (ctx_) {
-        std::cerr << "[LLMModel] Freeing existing context before creating new one" << std::endl;
-        llama_free(ctx_);
-        ctx_ = nullptr;
+    // Already resident (e.g. the conversation never left this process)
+    for (int i = 0; i < (int)slots_.size(); ++i) {
+        SequenceSlot& s = slots_[i];
+        if (s.state == SequenceSlot::State::Idle && s.cache_adapter.empty() &&
+            common_prefix(s.cache, saved) == n_tokens) {
+            s.last_used = ++slot_tick_;
+            return i;
+        }
     }
     
-    // Create context for this generation
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = config_.context_size;
-    ctx_params.n_batch = config_.batch_size;
-    ctx_params.n_threads = config_.threads;
-    ctx_params.n_threads_batch = config_.threads;
-    ctx_ = llama_init_from_model(model_, ctx_params);
-    if (!ctx_) {
-        return "Failed to create context";
+    int victim = -1;
+    for (int i = 0; i < (int)slots_.size(); ++i) {
+        const SequenceSlot& s = slots_[i];
+        if (s.state == SequenceSlot::State::Idle &&
+            (victim < 0 || s.last_used < slots_[victim].last_used)) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return -1;
     }
     
-    // Tokenize prompt
-    std::vector<llama_token> input_tokens = tokenize(prompt);
-    if (input_tokens.empty()) return "Tokenization failed";
+    SequenceSlot& s = slots_[victim];
+    llama_kv_self_seq_rm(ctx_, s.id, -1, -1);
+    s.cache.clear();
+    if (draft_) {
+        draft_->reset_sequence(s.id);
+    }
+    if (llama_state_seq_set_data(ctx_, state, size, s.id) != size) {
+        llama_kv_self_seq_rm(ctx_, s.id, -1, -1);
+        LLM_LOG_WARN("LLMModel", "Saved sequence state does not fit this context");
+        return -1;
+    }
+    s.cache = saved;
+    s.cache_adapter.clear();
+    s.last_used = ++slot_tick_;
+    return victim;
+}
 
-    // Add BOS if needed
+std::vector<llama_token> LLMModel::tokenize_prompt(const std::string& prompt) {
+    std::vector<llama_token> tokens = tokenize(prompt);
+    if (tokens.empty()) {
+        return tokens;
+    }
     const llama_vocab* vocab = llama_model_get_vocab(model_);
     if (llama_vocab_get_add_bos(vocab)) {
-        input_tokens.insert(input_tokens.begin(), llama_vocab_bos(vocab));
+        tokens.insert(tokens.begin(), llama_vocab_bos(vocab));
     }
+    return tokens;
+}
 
-    // Simple approach: evaluate all input tokens at once
-    std::vector<llama_token> output_tokens;
-    std::string result;
-    int tokens_generated = 0;
-    try {
-        // Process input tokens in batches
-        for (size_t i = 0; i < input_tokens.size(); i += config_.batch_size) {
-            int n_eval = std::min((int)input_tokens.size() - (int)i, config_.batch_size);
-            llama_batch batch = llama_batch_get_one(input_tokens.data() + i, n_eval);
-            int ret = llama_decode(ctx_, batch);
-            if (ret != 0) {
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return "Failed to decode input tokens";
-            }
+int LLMModel::acquire_slot(const std::vector<llama_token>& prompt, const std::string& adapter) {
+    int best = -1;
+    size_t best_prefix = 0;
+    for (int i = 0; i < (int)slots_.size(); ++i) {
+        const SequenceSlot& s = slots_[i];
+        if (s.state != SequenceSlot::State::Idle) {
+            continue;
         }
-
-        // Generate new tokens
-        for (int i = 0; i < max_tokens; ++i) {
-            float* logits = llama_get_logits(ctx_);
-            if (!logits) {
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return "Failed to get logits";
-            }
-            int vocab_size = llama_vocab_n_tokens(vocab);
-            std::vector<float> logits_vec(logits, logits + vocab_size);
-            llama_token next_token = sample_next_token(logits_vec);
-            if (next_token == llama_vocab_eos(vocab)) {
-                break;
-            }
-            tokens_generated++;
-            output_tokens.push_back(next_token);
-            llama_batch batch = llama_batch_get_one(&next_token, 1);
-            int ret = llama_decode(ctx_, batch);
-            if (ret != 0) {
-                if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-                return "Failed to decode generated token";
-            }
+        size_t n = s.cache_adapter == adapter ? common_prefix(s.cache, prompt) : 0;
+        if (best < 0 || n > best_prefix ||
+            (n == best_prefix && s.last_used < slots_[best].last_used)) {
+            best = i;
+            best_prefix = n;
         }
-    } catch (const std::exception& e) {
-        std::cerr << "Exception during generation: " << e.what() << std::endl;
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-        return "Error during generation: " + std::string(e.what());
-    } catch (...) {
-        std::cerr << "Unknown exception during generation" << std::endl;
-        if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-        return "Unknown error during generation";
     }
-    // Calculate timing and metrics
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
-    double duration_seconds = duration.count() / 1000.0;
-    double tokens_per_second = tokens_generated / duration_seconds;
-    
-    result = detokenize(output_tokens);
-    std::cerr << "[LLMModel] generate_internal result: " << result << std::endl;
-    std::cerr << "[LLMModel] Metrics - Input tokens: " << input_tokens.size() 
-              << ", Generated tokens: " << tokens_generated 
-              << ", Duration: " << duration_seconds << "s"
-              << ", Speed: " << tokens_per_second << " tokens/s" << std::endl;
-    if (ctx_) { llama_free(ctx_); ctx_ = nullptr; }
-    return result;
+    return best;
 }
 
-std::vector<llama_token> LLMModel::tokenize(const std::string& text) {
-    std::vector<llama_token> tokens;
-    tokens.resize(text.size() + 1);
+bool parse_overflow_policy(const std::string& name, OverflowPolicy& policy) {
+    if (name == "error") policy = OverflowPolicy::Error;
+    else if (name == "truncate_head") policy = OverflowPolicy::TruncateHead;
+    else if (name == "keep_system_prefix") policy = OverflowPolicy::KeepSystemPrefix;
+    else if (name == "sliding_window") policy = OverflowPolicy::SlidingWindow;
+    else return false;
+    return true;
+}
+
+bool parse_cache_type(const std::string& name, ggml_type& type) {
+    if (name == "f16") type = GGML_TYPE_F16;
+    else if (name == "q8_0") type = GGML_TYPE_Q8_0;
+    else if (name == "q4_0") type = GGML_TYPE_Q4_0;
+    else return false;
+    return true;
+}
+
+size_t LLMModel::overflow_keep_tokens(const std::vector<llama_token>& prompt, size_t limit) const {
+    size_t n_keep = 0;
+    if (config_.overflow_policy != OverflowPolicy::TruncateHead) {
+        n_keep = (size_t)std::max(0, config_.overflow_keep);
+    }
+    // BOS always stays at the head
+    if (!prompt.empty() && prompt[0] == llama_vocab_bos(llama_model_get_vocab(model_))) {
+        n_keep = std::max<size_t>(n_keep, 1);
+    }
+    // Leave at least half of the window for the rest of the sequence
+    return std::min(n_keep, limit / 2);
+}
+
+bool LLMModel::fit_prompt(std::vector<llama_token>& prompt, int max_tokens, size_t& n_truncated) const {
+    n_truncated = 0;
+    const size_t n_ctx = llama_n_ctx(ctx_);
     
-    // Get vocabulary from model
-    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    // Room to generate: the requested budget, but never more than half the window
+    const size_t reserve = std::min<size_t>((size_t)std::max(1, max_tokens), n_ctx / 2);
+    if (prompt.size() + reserve <= n_ctx) {
+        return true;
+    }
+    if (config_.overflow_policy == OverflowPolicy::Error) {
+        // Only a prompt that cannot produce a single token is an error
+        return prompt.size() < n_ctx;
+    }
     
-    int n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false);
-    if (n_tokens < 0) {
-        tokens.resize(-n_tokens);
-        n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false);
+    const size_t limit = n_ctx - reserve;
+    const size_t n_keep = overflow_keep_tokens(prompt, limit);
+    n_truncated = prompt.size() - limit;
+    prompt.erase(prompt.begin() + n_keep, prompt.begin() + n_keep + n_truncated);
+    return true;
+}
+
+bool LLMModel::shift_context(SequenceSlot& s) {
+    if (config_.overflow_policy != OverflowPolicy::SlidingWindow || !llama_kv_self_can_shift(ctx_)) {
+        return false;
+    }
+    const size_t n_past = s.cache.size();
+    const size_t n_keep = overflow_keep_tokens(s.cache, n_past);
+    const size_t n_discard = (n_past - n_keep) / 2;
+    if (n_discard == 0) {
+        return false;
     }
     
-    tokens.resize(n_tokens);
-    return tokens;
+    llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)n_keep, (llama_pos)(n_keep + n_discard));
+    llama_kv_self_seq_add(ctx_, s.id, (llama_pos)(n_keep + n_discard), (llama_pos)n_past, -(llama_pos)n_discard);
+    s.cache.erase(s.cache.begin() + n_keep, s.cache.begin() + n_keep + n_discard);
+    s.n_shifts++;
+    LLM_LOG_DEBUG("LLMModel", "Sequence " << s.id << " shifted context, kept " << n_keep
+                              << ", discarded " << n_discard << " tokens");
+    return true;
 }
 
-std::string LLMModel::detokenize(const std::vector<llama_token>& tokens) {
-    std::string result;
+void LLMModel::begin_sequence(int slot, std::vector<llama_token> prompt, int max_tokens,
+                              std::function<void(const std::string&)> on_text,
+                              CancelToken cancel, const RequestOptions& options,
+                              LoraAdapter adapter) {
+    SequenceSlot& s = slots_[slot];
+    
+    size_t n_truncated = 0;
+    const bool fits = fit_prompt(prompt, max_tokens, n_truncated);
+    
+    // The scheduler only admits a request once its adapter is loaded; other
+    // callers get it if it happens to be resident
+    std::string adapter_error;
+    if (!options.adapter.empty() && !adapter &&
+        adapters_->find(options.adapter, adapter, adapter_error) == LoraAdapterCache::Status::Loading) {
+        adapter_error = "LoRA adapter is not loaded yet: " + options.adapter;
+    }
+    
+    // Longest common prefix between what is resident in the KV cache and the new prompt.
+    // At least one token has to be decoded so that fresh logits are available.
+    // KV computed under another adapter is not reusable at all.
+    size_t n_common = s.cache_adapter == options.adapter ? common_prefix(s.cache, prompt) : 0;
+    if (n_common == prompt.size()) {
+        n_common--;
+    }
+    
+    // Trim only the divergent tail; fall back to a full reset if the cache can't be cut
+    if (n_common < s.cache.size()) {
+        if (!llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)n_common, -1)) {
+            llama_kv_self_seq_rm(ctx_, s.id, -1, -1);
+            n_common = 0;
+        }
+        s.cache.resize(n_common);
+    }
+    s.cache_adapter = options.adapter;
+    
+    if (n_common > 0) {
+        prefix_cache_hits_++;
+        core_metrics().prefix_cache_hits.inc();
+        core_metrics().prefix_reused_tokens.inc(n_common);
+    } else {
+        prefix_cache_misses_++;
+        core_metrics().prefix_cache_misses.inc();
+    }
+    
+    s.state = SequenceSlot::State::Prefill;
+    s.prompt = std::move(prompt);
+    s.n_reused = n_common;
+    s.max_tokens = max_tokens;
+    s.n_generated = 0;
+    s.pending = -1;
+    s.i_batch = -1;
+    s.eos_hit = false;
+    s.stop_hit = false;
+    s.stop.reset(options.stop);
+    s.stop_tokens = options.stop_tokens;
+    s.adapter = options.adapter;
+    s.lora = std::move(adapter);
+    s.cancelled = false;
+    s.context_full = false;
+    s.n_truncated = n_truncated;
+    s.n_shifts = 0;
+    s.draft.clear();
+    s.n_drafted = 0;
+    s.n_accepted = 0;
+    s.cancel = std::move(cancel);
+    s.output.clear();
+    s.n_streamed = 0;
+    s.error.clear();
+    s.on_text = std::move(on_text);
+    s.start_time = std::chrono::high_resolution_clock::now();
+    s.timing = SequenceTiming();
+    s.timing.token_ms.reserve(std::max(0, max_tokens));
+    s.last_used = ++slot_tick_;
+    
     const llama_vocab* vocab = llama_model_get_vocab(model_);
+    samplers_[slot]->configure(config_, llama_vocab_n_tokens(vocab), sampling_version_);
+    samplers_[slot]->reset((uint32_t)rng_());
+    std::string grammar_error;
+    std::shared_ptr<ForcedTokens> forced;
+    llama_sampler* grammar = compile_constraint(options, grammar_error, forced);
+    samplers_[slot]->set_grammar(grammar, std::move(forced));
     
-    for (llama_token token : tokens) {
-        char piece[8];
-        int n_piece = llama_token_to_piece(vocab, token, piece, sizeof(piece), 0, false);
-        if (n_piece > 0) {
-            result += std::string(piece, n_piece);
+    LLM_LOG_DEBUG("LLMModel", "Sequence " << s.id << " started, reused " << n_common
+                              << "/" << s.prompt.size() << " prompt tokens");
+    if (n_truncated > 0) {
+        LLM_LOG_INFO("LLMModel", "Sequence " << s.id << " prompt exceeded the context, dropped "
+                                 << n_truncated << " tokens");
+    }
+    if (!fits) {
+        s.error = "Prompt exceeds context size";
+        s.state = SequenceSlot::State::Done;
+    } else if (!grammar_error.empty()) {
+        s.error = grammar_error;
+        s.state = SequenceSlot::State::Done;
+    } else if (!adapter_error.empty()) {
+        s.error = adapter_error;
+        s.state = SequenceSlot::State::Done;
+    }
+}
+
+bool LLMModel::apply_adapter(const SequenceSlot& s, std::string& error) {
+    static Counter& switches = MetricsRegistry::instance().counter(
+        "llm_lora_switches_total", "Changes of the LoRA adapter applied to the context");
+    
+    // Only pointers change; the next graph is built with the new adapter.
+    // The sequence's reference keeps it loaded, so nothing is read from disk.
+    llama_clear_adapter_lora(ctx_);
+    active_adapter_.clear();
+    active_lora_.reset();
+    if (s.lora && llama_set_adapter_lora(ctx_, s.lora.get(), config_.lora_scale) != 0) {
+        error = "Failed to apply LoRA adapter: " + s.adapter;
+        adapters_->set_active("");
+        return false;
+    }
+    active_adapter_ = s.adapter;
+    active_lora_ = s.lora;
+    adapters_->set_active(active_adapter_);
+    switches.inc();
+    LLM_LOG_DEBUG("LLMModel", "Context adapter: " << (s.adapter.empty() ? "(base)" : s.adapter));
+    return true;
+}
+
+void LLMModel::select_adapter_group() {
+    // The applied adapter keeps the context while its sequences have work and
+    // its turn lasts; then the adapter of the oldest other sequence takes over
+    bool current_busy = false;
+    const SequenceSlot* next = nullptr;
+    for (const auto& s : slots_) {
+        if (!s.is_active()) {
+            continue;
+        }
+        if (s.adapter == active_adapter_) {
+            current_busy = true;
+        } else if (!next || s.last_used < next->last_used) {
+            next = &s;
         }
     }
-    return result;
+    if (!next || (current_busy && adapter_turn_ < kAdapterTurnSteps)) {
+        adapter_turn_++;
+        return;
+    }
+    
+    const std::string name = next->adapter;
+    std::string error;
+    if (!apply_adapter(*next, error)) {
+        LLM_LOG_ERROR("LLMModel", error);
+        for (auto& s : slots_) {
+            if (s.is_active() && s.adapter == name) {
+                s.error = error;
+                s.state = SequenceSlot::State::Done;
+            }
+        }
+        return;
+    }
+    adapter_turn_ = 1;
+}
+
+llama_sampler* LLMModel::compile_constraint(const RequestOptions& options, std::string& error,
+                                            std::shared_ptr<ForcedTokens>& forced) {
+    std::string gbnf = options.grammar;
+    if (!options.json_schema.empty()) {
+        if (!json_schema_to_gbnf(options.json_schema, gbnf, error)) {
+            return nullptr;
+        }
+    }
+    if (gbnf.empty()) {
+        return nullptr;
+    }
+    llama_sampler* grammar = grammars_.instantiate(llama_model_get_vocab(model_), gbnf, error, &forced);
+    if (!grammar) {
+        error = "Invalid grammar: " + error;
+    }
+    return grammar;
 }
 
-llama_token LLMModel::sample_next_token(const std::vector<float>& logits) {
-    if (logits.empty()) return 0;
+bool LLMModel::decode_step() {
+    if (!ctx_) {
+        return false;
+    }
     
-    // Apply temperature
-    std::vector<float> logits_copy = logits;
-    float temp = config_.temperature;
-    if (temp > 0.0f) {
-        for (float& logit : logits_copy) {
-            logit /= temp;
+    const int n_batch = (int)llama_n_batch(ctx_);
+    const size_t n_ctx = llama_n_ctx(ctx_);
+    batch_.n_tokens = 0;
+    batch_cancel_.clear();
+    
+    // Abandoned requests leave before they cost another decode
+    for (auto& s : slots_) {
+        if (s.is_active() && s.cancel_requested()) {
+            s.cancelled = true;
+            s.state = SequenceSlot::State::Done;
         }
     }
     
-    // Temporarily disable repeat penalty to debug freezing issue
-    // Apply repeat penalty to recently generated tokens (very selective)
-    /*
-    if (config_.repeat_penalty != 1.0f && !recent_tokens_.empty()) {
-        int penalty_window = std::min(8, (int)recent_tokens_.size()); // Very small window
-        for (int i = recent_tokens_.size() - penalty_window; i < (int)recent_tokens_.size(); ++i) {
-            llama_token token = recent_tokens_[i];
-            if (token < (int)logits_copy.size()) {
-                // Only apply penalty to very recent tokens and skip common tokens
-                if (token != 13 && token != 1 && token != 2 && token != 0) { // Skip newline, BOS, EOS, PAD
-                    logits_copy[token] *= config_.repeat_penalty;
-                }
+    for (auto& s : slots_) {
+        s.i_batch = -1;
+        s.draft.clear();
+        // The next position would fall outside the context window
+        if (s.state == SequenceSlot::State::Decode && s.cache.size() >= n_ctx && !shift_context(s)) {
+            s.context_full = true;
+            s.state = SequenceSlot::State::Done;
+        }
+    }
+    select_adapter_group();
+    if (draft_) {
+        draft_tokens(n_batch, n_ctx);
+    }
+    
+    // One token per generating sequence first, so decode latency is not held up
+    // by prefill; drafted tokens follow it and are verified in the same decode
+    std::vector<std::pair<int, int>> spans;  // slot index, tokens added this step
+    for (int i = 0; i < (int)slots_.size(); ++i) {
+        SequenceSlot& s = slots_[i];
+        if (s.state != SequenceSlot::State::Decode || s.adapter != active_adapter_ ||
+            batch_.n_tokens >= n_batch) {
+            continue;
+        }
+        const int room = n_batch - batch_.n_tokens - 1;
+        if ((int)s.draft.size() > room) {
+            s.draft.resize(room);
+        }
+        const llama_pos pos = (llama_pos)s.cache.size();
+        s.i_batch = batch_.n_tokens;
+        batch_add(batch_, s.pending, pos, s.id, true);
+        for (size_t j = 0; j < s.draft.size(); ++j) {
+            batch_add(batch_, s.draft[j], pos + 1 + (llama_pos)j, s.id, true);
+        }
+        s.n_drafted += (int)s.draft.size();
+        spans.emplace_back(i, 1 + (int)s.draft.size());
+    }
+    
+    // Fill the rest of the batch with prompt chunks of newly admitted sequences.
+    // With streams generating, only a bounded chunk is ingested per step so
+    // their per-token latency stays flat; otherwise the whole batch is used.
+    // After the cache filled up, prompts wait until a generating sequence ends.
+    int prefill_budget = n_batch - batch_.n_tokens;
+    if (batch_.n_tokens > 0) {
+        const int chunk = config_.prefill_chunk > 0 ? config_.prefill_chunk : (int)llama_n_ubatch(ctx_);
+        prefill_budget = kv_full_ ? 0 : std::min(prefill_budget, chunk);
+    }
+    for (int i = 0; i < (int)slots_.size() && prefill_budget > 0; ++i) {
+        SequenceSlot& s = slots_[i];
+        if (s.state != SequenceSlot::State::Prefill || s.adapter != active_adapter_) {
+            continue;
+        }
+        const size_t n_done = s.cache.size();
+        const int n_chunk = std::min((int)(s.prompt.size() - n_done), prefill_budget);
+        prefill_budget -= n_chunk;
+        for (int j = 0; j < n_chunk; ++j) {
+            const size_t pos = n_done + j;
+            const bool last = pos + 1 == s.prompt.size();
+            if (last) {
+                s.i_batch = batch_.n_tokens;
             }
+            batch_add(batch_, s.prompt[pos], (llama_pos)pos, s.id, last);
         }
+        spans.emplace_back(i, n_chunk);
+    }
+    
+    if (batch_.n_tokens == 0) {
+        return false;
+    }
+    
+    for (const auto& span : spans) {
+        batch_cancel_.push_back(slots_[span.first].cancel);
     }
-    */
     
-    // Apply top-k sampling
-    int top_k = config_.top_k;
-    if (top_k > 0 && top_k < (int)logits_copy.size()) {
-        std::vector<std::pair<float, int>> logits_with_indices;
-        for (int i = 0; i < (int)logits_copy.size(); ++i) {
-            logits_with_indices.emplace_back(logits_copy[i], i);
+    int ret = llama_decode(ctx_, batch_);
+    if (ret == 1 && evict_idle_slots()) {
+        // No KV room: idle slots gave up their cached prefixes, try once more
+        ret = llama_decode(ctx_, batch_);
+    }
+    // Still no room: the active sequences together outgrew the shared cache.
+    // Shrink the step until it fits rather than failing every sequence in it.
+    while (ret == 1 && relieve_kv_pressure(spans)) {
+        ret = llama_decode(ctx_, batch_);
+    }
+    batch_cancel_.clear();
+    if (ret == 2) {
+        // Aborted because every sequence in the batch was cancelled. Ubatches that
+        // already ran left KV entries behind; drop them so the caches stay exact.
+        for (const auto& span : spans) {
+            SequenceSlot& s = slots_[span.first];
+            llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)s.cache.size(), -1);
+            s.cancelled = true;
+            s.state = SequenceSlot::State::Done;
         }
+        return false;
+    }
+    if (ret != 0) {
+        LLM_LOG_ERROR("LLMModel", "llama_decode failed for step, ret=" << ret);
+        for (const auto& span : spans) {
+            SequenceSlot& s = slots_[span.first];
+            llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)s.cache.size(), -1);
+            s.error = s.state == SequenceSlot::State::Prefill ? "Failed to decode input tokens"
+                                                              : "Failed to decode generated token";
+            s.state = SequenceSlot::State::Done;
+        }
+        return false;
+    }
+    
+    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    
+    for (const auto& span : spans) {
+        SequenceSlot& s = slots_[span.first];
         
-        // Sort by logit value (descending)
-        std::partial_sort(logits_with_indices.begin(), 
-                         logits_with_indices.begin() + top_k,
-                         logits_with_indices.end(),
-                         [](const auto& a, const auto& b) {
-                             return a.first > b.first;
-                         });
+        // Commit what was just decoded to the slot's view of the KV cache
+        if (s.state == SequenceSlot::State::Decode) {
+            s.cache.push_back(s.pending);
+            LLM_LOG_DEBUG("LLMModel", "Successfully decoded token " << s.pending << " for sequence " << s.id);
+        } else {
+            const size_t n_done = s.cache.size();
+            s.cache.insert(s.cache.end(), s.prompt.begin() + n_done, s.prompt.begin() + n_done + span.second);
+        }
         
-        // Keep only top-k
-        logits_with_indices.resize(top_k);
+        if (s.cancel_requested()) {
+            if (!s.draft.empty()) {
+                llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)s.cache.size(), -1);
+            }
+            s.cancelled = true;
+            s.state = SequenceSlot::State::Done;
+            continue;
+        }
+        if (s.i_batch < 0) {
+            continue;  // prefill still in progress
+        }
+        if (s.state == SequenceSlot::State::Prefill) {
+            s.timing.prefill_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::high_resolution_clock::now() - s.start_time).count();
+        }
+        s.state = SequenceSlot::State::Decode;
         
-        // Convert back to logits vector (zero out non-top-k)
-        std::fill(logits_copy.begin(), logits_copy.end(), -INFINITY);
-        for (const auto& pair : logits_with_indices) {
-            logits_copy[pair.second] = pair.first;
+        if (s.n_generated >= s.max_tokens) {
+            s.state = SequenceSlot::State::Done;
+            continue;
         }
+        
+        // Sample at the pending token's logits, then keep going through the
+        // drafted positions for as long as the target agrees with the draft
+        const size_t n_draft = s.draft.size();
+        for (size_t j = 0; ; ++j) {
+            float* logits = llama_get_logits_ith(ctx_, s.i_batch + (int32_t)j);
+            if (!logits) {
+                s.error = "Failed to get logits";
+                s.state = SequenceSlot::State::Done;
+                break;
+            }
+            auto sample_start = std::chrono::high_resolution_clock::now();
+            llama_token next_token = sample_next_token(span.first, logits);
+            auto sample_end = std::chrono::high_resolution_clock::now();
+            s.timing.sampling_ms += std::chrono::duration<double, std::milli>(sample_end - sample_start).count();
+            if (samplers_[span.first]->grammar_failed()) {
+                s.error = "Grammar allows no further token";
+                s.state = SequenceSlot::State::Done;
+                break;
+            }
+            
+            // First token: true TTFT; afterwards: the gap since the previous token
+            if (s.n_generated == 0) {
+                s.timing.ttft_ms = std::chrono::duration<double, std::milli>(sample_end - s.start_time).count();
+            } else {
+                s.timing.token_ms.push_back(std::chrono::duration<float, std::milli>(
+                    sample_end - s.timing.last_token_time).count());
+            }
+            s.timing.last_token_time = sample_end;
+            
+            if (!emit_token(s, next_token, vocab)) {
+                break;
+            }
+            if (j < n_draft && next_token == s.draft[j]) {
+                // Accepted: the drafted token's KV entry is already the right one
+                s.cache.push_back(next_token);
+                s.n_accepted++;
+                continue;
+            }
+            break;
+        }
+        
+        // Rejected drafts must not linger in the KV cache
+        if (n_draft > 0) {
+            llama_kv_self_seq_rm(ctx_, s.id, (llama_pos)s.cache.size(), -1);
+        }
+    }
+    return true;
+}
+
+bool LLMModel::emit_token(SequenceSlot& s, llama_token next_token, const llama_vocab* vocab) {
+    // End of turn counts too (<|im_end|>, <|eot_id|>, ...), not just EOS
+    if (llama_vocab_is_eog(vocab, next_token)) {
+        LLM_LOG_DEBUG("LLMModel", "Hit EOG token on sequence " << s.id << ", stopping generation");
+        s.eos_hit = true;
+        s.state = SequenceSlot::State::Done;
+        return false;
+    }
+    if (std::find(s.stop_tokens.begin(), s.stop_tokens.end(), next_token) != s.stop_tokens.end()) {
+        s.stop_hit = true;
+        s.state = SequenceSlot::State::Done;
+        return false;
     }
+    s.n_generated++;
+    core_metrics().generated_tokens.inc();
     
-    // Convert to probabilities using softmax
-    float max_logit = *std::max_element(logits_copy.begin(), logits_copy.end());
-    std::vector<float> probs(logits_copy.size());
-    float sum = 0.0f;
+    const size_t n_before = s.output.size();
+    pieces_.append(next_token, s.output);
     
-    for (size_t i = 0; i < logits_copy.size(); ++i) {
-        probs[i] = expf(logits_copy[i] - max_logit);
-        sum += probs[i];
+    // Stops the moment a stop string completes; the string itself is dropped
+    if (s.stop.truncate(s.output, n_before, s.n_streamed)) {
+        s.stop_hit = true;
+        s.state = SequenceSlot::State::Done;
+        return false;
     }
     
-    if (sum > 0.0f) {
-        for (float& prob : probs) {
-            prob /= sum;
+    // Split characters and possible stop-string starts wait for more tokens
+    const size_t n_complete = s.stop.streamable_length(s.output, s.n_streamed);
+    if (n_complete > s.n_streamed) {
+        std::string token_text = s.output.substr(s.n_streamed, n_complete - s.n_streamed);
+        s.n_streamed = n_complete;
+        if (s.on_text) {
+            LLM_LOG_DEBUG("LLMModel", "Streaming token text: '" << token_text << "' (length: " << token_text.length() << ")");
+            s.on_text(token_text); // Stream the token
         }
     }
     
-    // Sample from the distribution
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-    float r = dist(gen);
+    // The sampled token is decoded in the next step, unless the budget is used up
+    s.pending = next_token;
+    if (s.n_generated >= s.max_tokens) {
+        s.state = SequenceSlot::State::Done;
+        return false;
+    }
+    return true;
+}
+
+void LLMModel::draft_tokens(int n_batch, size_t n_ctx) {
+    int n_decoding = 0;
+    for (const auto& s : slots_) {
+        if (s.state == SequenceSlot::State::Decode && s.adapter == active_adapter_) {
+            n_decoding++;
+        }
+    }
+    if (n_decoding == 0) {
+        return;
+    }
     
-    float cumsum = 0.0f;
-    for (int i = 0; i < (int)probs.size(); ++i) {
-        cumsum += probs[i];
-        if (r <= cumsum) {
-            // Add to recent tokens for repeat penalty
-            recent_tokens_.push_back(i);
-            if (recent_tokens_.size() > 128) {
-                recent_tokens_.erase(recent_tokens_.begin());
-            }
-            return i;
+    // Share the batch evenly so every generating sequence keeps its decode token
+    const int per_seq = std::min(config_.draft_max, (n_batch - n_decoding) / n_decoding);
+    if (per_seq <= 0) {
+        return;
+    }
+    std::vector<DraftRequest> requests;
+    for (auto& s : slots_) {
+        if (s.state != SequenceSlot::State::Decode || s.adapter != active_adapter_) {
+            continue;
+        }
+        // Nothing past the token budget or the end of the context is worth drafting
+        DraftRequest r;
+        r.slot = &s;
+        r.n_max = std::min({per_seq, s.max_tokens - s.n_generated - 1, (int)(n_ctx - s.cache.size()) - 1});
+        r.out = &s.draft;
+        if (r.n_max > 0) {
+            requests.push_back(r);
+        }
+    }
+    if (!requests.empty()) {
+        draft_->draft(requests);
+    }
+}
+
+bool LLMModel::abort_callback(void* data) {
+    // Only abort when nobody in the batch still wants the result
+    auto* self = static_cast<LLMModel*>(data);
+    if (self->batch_cancel_.empty()) {
+        return false;
+    }
+    for (const auto& cancel : self->batch_cancel_) {
+        if (!cancel || !cancel->load(std::memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LLMModel::update_state_metrics() const {
+    CoreMetrics& core = core_metrics();
+    int active = 0;
+    for (const auto& s : slots_) {
+        active += s.is_active() ? 1 : 0;
+    }
+    core.active_sequences.set(active);
+    if (ctx_) {
+        core.kv_cells_used.set(llama_kv_self_used_cells(ctx_));
+        core.kv_cells_total.set(llama_n_ctx(ctx_));
+    }
+}
+
+void LLMModel::flush_stream(int slot) {
+    SequenceSlot& s = slots_[slot];
+    if (s.cancelled || !s.error.empty()) {
+        return;
+    }
+    const size_t n_complete = utf8_complete_length(s.output, s.n_streamed);
+    if (n_complete > s.n_streamed && s.on_text) {
+        s.on_text(s.output.substr(s.n_streamed, n_complete - s.n_streamed));
+    }
+    s.n_streamed = std::max(s.n_streamed, n_complete);
+}
+
+bool LLMModel::has_active_sequences() const {
+    for (const auto& s : slots_) {
+        if (s.is_active()) {
+            return true;
         }
     }
+    return false;
+}
+
+void LLMModel::release_slot(int slot) {
+    SequenceSlot& s = slots_[slot];
+    s.state = SequenceSlot::State::Idle;
+    kv_full_ = false;  // its KV cells may be evicted now
+    s.on_text = nullptr;
+    s.lora.reset();
+    s.cancel = nullptr;
+    s.prompt.clear();
+    s.prompt.shrink_to_fit();
+}
+
+static double percentile_ms(const std::vector<float>& sorted, double pct) {
+    if (sorted.empty()) return 0.0;
+    size_t idx = (size_t)(pct / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+std::string LLMModel::build_done_metrics(const SequenceSlot& s) {
+    // Calculate timing and metrics
+    auto end_time = std::chrono::high_resolution_clock::now();
+    double duration_seconds = std::chrono::duration<double>(end_time - s.start_time).count();
+    int tokens_generated = s.n_generated;
+    double tokens_per_second = duration_seconds > 0.0 ? tokens_generated / duration_seconds : 0.0;
     
-    // Fallback to argmax
-    int result = std::max_element(logits_copy.begin(), logits_copy.end()) - logits_copy.begin();
-    recent_tokens_.push_back(result);
-    if (recent_tokens_.size() > 128) {
-        recent_tokens_.erase(recent_tokens_.begin());
+    // Per-token decode distribution
+    const SequenceTiming& t = s.timing;
+    std::vector<float> token_ms = t.token_ms;
+    std::sort(token_ms.begin(), token_ms.end());
+    double decode_ms_total = 0.0;
+    for (float ms : token_ms) {
+        decode_ms_total += ms;
+    }
+    double decode_ms_mean = token_ms.empty() ? 0.0 : decode_ms_total / token_ms.size();
+    double decode_tokens_per_second = decode_ms_total > 0.0 ? token_ms.size() * 1000.0 / decode_ms_total : 0.0;
+    size_t prefill_tokens = s.prompt.size() - s.n_reused;
+    double prefill_tokens_per_second = t.prefill_ms > 0.0 ? prefill_tokens * 1000.0 / t.prefill_ms : 0.0;
+    
+    CoreMetrics& core = core_metrics();
+    core.ttft_seconds.observe(t.ttft_ms / 1000.0);
+    if (prefill_tokens_per_second > 0.0) {
+        core.prefill_tokens_per_second.observe(prefill_tokens_per_second);
+    }
+    if (decode_tokens_per_second > 0.0) {
+        core.decode_tokens_per_second.observe(decode_tokens_per_second);
+    }
+    
+    LLM_LOG_DEBUG("LLMModel", "Metrics - Sequence: " << s.id
+                              << ", Input tokens: " << s.prompt.size()
+                              << ", Generated tokens: " << tokens_generated
+                              << ", Duration: " << duration_seconds << "s"
+                              << ", Speed: " << tokens_per_second << " tokens/s"
+                              << ", TTFT: " << t.ttft_ms << "ms");
+    
+    // Get context usage
+    int context_used = s.prompt.size() + tokens_generated;
+    double context_usage_percent = (double)context_used / config_.context_size * 100.0;
+    
+    // Send enhanced metrics as JSON
+    std::ostringstream metrics;
+    metrics << "{\"input_tokens\":" << s.prompt.size()
+            << ",\"output_tokens\":" << tokens_generated
+            << ",\"duration_seconds\":" << duration_seconds
+            << ",\"tokens_per_second\":" << tokens_per_second
+            << ",\"first_token_latency_ms\":" << t.ttft_ms
+            << ",\"queue_wait_ms\":" << t.queue_wait_ms
+            << ",\"context_setup_ms\":" << t.context_setup_ms
+            << ",\"tokenize_ms\":" << t.tokenize_ms
+            << ",\"prefill_ms\":" << t.prefill_ms
+            << ",\"prefill_tokens\":" << prefill_tokens
+            << ",\"prefill_tokens_per_second\":" << prefill_tokens_per_second
+            << ",\"decode_tokens_per_second\":" << decode_tokens_per_second
+            << ",\"decode_ms_mean\":" << decode_ms_mean
+            << ",\"decode_ms_p50\":" << percentile_ms(token_ms, 50)
+            << ",\"decode_ms_p90\":" << percentile_ms(token_ms, 90)
+            << ",\"decode_ms_p99\":" << percentile_ms(token_ms, 99)
+            << ",\"decode_ms_max\":" << (token_ms.empty() ? 0.0 : token_ms.back())
+            << ",\"sampling_ms\":" << t.sampling_ms
+            << ",\"context_used\":" << context_used
+            << ",\"context_size\":" << config_.context_size
+            << ",\"context_usage_percent\":" << context_usage_percent
+            << ",\"kv_cache_type_k\":\"" << ggml_type_name(config_.cache_type_k) << "\""
+            << ",\"kv_cache_type_v\":\"" << ggml_type_name(config_.cache_type_v) << "\""
+            << ",\"kv_bytes_per_token\":" << kv_bytes_per_token()
+            << ",\"kv_bytes_sequence\":" << s.cache.size() * kv_bytes_per_token()
+            << ",\"temperature\":" << config_.temperature
+            << ",\"top_p\":" << config_.top_p
+            << ",\"top_k\":" << config_.top_k
+            << ",\"batch_size\":" << config_.batch_size
+            << ",\"threads\":" << config_.threads
+            << ",\"threads_batch\":" << ctx_params_.n_threads_batch
+            << ",\"ubatch_size\":" << ctx_params_.n_ubatch
+            << ",\"flash_attn\":" << (ctx_params_.flash_attn ? "true" : "false")
+            << ",\"gpu_layers\":" << config_.gpu_layers
+            << ",\"max_tokens_requested\":" << s.max_tokens
+            << ",\"eos_hit\":" << (s.eos_hit ? "true" : "false")
+            << ",\"stop_hit\":" << (s.stop_hit ? "true" : "false")
+            << ",\"cancelled\":" << (s.cancelled ? "true" : "false")
+            << ",\"sequence_id\":" << s.id
+            << ",\"prefix_tokens_reused\":" << s.n_reused
+            << ",\"prefix_cache_hits\":" << prefix_cache_hits_
+            << ",\"prefix_cache_misses\":" << prefix_cache_misses_
+            << ",\"prompt_tokens_truncated\":" << s.n_truncated
+            << ",\"context_shifts\":" << s.n_shifts
+            << ",\"context_full\":" << (s.context_full ? "true" : "false")
+            << ",\"spec_drafted\":" << s.n_drafted
+            << ",\"spec_accepted\":" << s.n_accepted
+            << ",\"spec_acceptance_rate\":" << (s.n_drafted > 0 ? (double)s.n_accepted / s.n_drafted : 0.0)
+            << "}";
+    last_metrics_ = metrics.str();
+    return "[DONE]" + last_metrics_;
+}
+
+std::vector<llama_token> LLMModel::tokenize(const std::string& text) {
+    std::vector<llama_token> tokens;
+    tokens.resize(text.size() + 1);
+    
+    // Get vocabulary from model
+    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    
+    int n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        n_tokens = llama_tokenize(vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), true, false);
+    }
+    
+    tokens.resize(n_tokens);
+    return tokens;
+}
+
+std::string LLMModel::detokenize(const std::vector<llama_token>& tokens) {
+    std::string result;
+    result.reserve(tokens.size() * 4);
+    for (llama_token token : tokens) {
+        pieces_.append(token, result);
     }
     return result;
 }
 
+int LLMModel::n_vocab() const {
+    return model_ ? llama_vocab_n_tokens(llama_model_get_vocab(model_)) : 0;
+}
+
+int LLMModel::n_ctx_train() const {
+    return model_ ? llama_model_n_ctx_train(model_) : 0;
+}
+
+size_t LLMModel::kv_bytes_per_token() const {
+    if (!model_) {
+        return 0;
+    }
+    // One K and one V row of n_head_kv * head_dim values per layer (GQA-aware)
+    const int64_t n_head = std::max(1, llama_model_n_head(model_));
+    const int64_t n_embd_kv = (int64_t)llama_model_n_embd(model_) / n_head * llama_model_n_head_kv(model_);
+    return (size_t)llama_model_n_layer(model_) *
+           (ggml_row_size(config_.cache_type_k, n_embd_kv) + ggml_row_size(config_.cache_type_v, n_embd_kv));
+}
+
+EmbeddingContext* LLMModel::embedding_context() {
+    if (!embedder_ && model_) {
+        auto embedder = std::make_unique<EmbeddingContext>();
+        if (!embedder->initialize(model_, config_)) {
+            return nullptr;
+        }
+        if (threadpool_) {
+            embedder->attach_threadpool(threadpool_, threadpool_batch_);
+        }
+        embedder_ = std::move(embedder);
+    }
+    return embedder_.get();
+}
+
+llama_token LLMModel::sample_next_token(int slot, const float* logits) {
+    const llama_vocab* vocab = llama_model_get_vocab(model_);
+    return samplers_[slot]->sample(logits, llama_vocab_n_tokens(vocab));
+}
+
 std::string LLMModel::get_model_info() const {
     if (!model_) {
         return "No model loaded";
@@ -474,11 +1547,31 @@ std::string LLMModel::get_model_info() const {
     oss << "Context size: " << config_.context_size << "\n";
     oss << "Batch size: " << config_.batch_size << "\n";
     oss << "Threads: " << config_.threads << "\n";
+    oss << "Batch threads: " << config_.threads_batch << "\n";
+    oss << "Compute CPUs: " << format_cpu_list(compute_cpus_)
+        << (host_cpus_.empty() ? "" : " (host " + format_cpu_list(host_cpus_) + ")") << "\n";
+    oss << "Ubatch size: " << config_.ubatch_size << "\n";
+    oss << "Flash attention: " << (config_.flash_attn ? "on" : "off") << "\n";
+    oss << "KV cache: K " << ggml_type_name(config_.cache_type_k) << ", V " << ggml_type_name(config_.cache_type_v)
+        << " (" << kv_bytes_per_token() / 1024.0 << " KiB/token)\n";
+    oss << "Chat template: " << chat_template_.description() << "\n";
+    static const char* overflow_names[] = {"error", "truncate_head", "keep_system_prefix", "sliding_window"};
+    oss << "Context overflow: " << overflow_names[(int)config_.overflow_policy]
+        << " (keep " << config_.overflow_keep << ")\n";
     oss << "GPU layers: " << config_.gpu_layers << "\n";
     oss << "Temperature: " << config_.temperature << "\n";
     oss << "Top-p: " << config_.top_p << "\n";
     oss << "Top-k: " << config_.top_k << "\n";
+    oss << "Min-p: " << config_.min_p << "\n";
+    oss << "Typical-p: " << config_.typical_p << "\n";
     oss << "Repeat penalty: " << config_.repeat_penalty << "\n";
+    oss << "Mirostat: " << config_.mirostat << "\n";
+    if (!config_.draft_model_path.empty()) {
+        oss << "Draft model: " << config_.draft_model_path << " (draft max " << config_.draft_max << ")\n";
+    } else if (config_.prompt_lookup) {
+        oss << "Prompt lookup: " << config_.lookup_ngram_min << "-" << config_.lookup_ngram_max
+            << "-grams (draft max " << config_.draft_max << ")\n";
+    }
     
     return oss.str();
 }
@@ -4,10 +4,34 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <random>
 #include "llama.h"
+#include "sequence.h"
+#include "sampler.h"
+#include "model_registry.h"
+#include "speculative.h"
+#include "token_pieces.h"
+#include "embedding.h"
+#include "grammar.h"
+#include "chat_template.h"
+#include "lora_adapters.h"
 
 namespace local_llm {
 
+// What to do when a prompt (or a generation) no longer fits the context
+enum class OverflowPolicy {
+    Error,             // fail the request
+    TruncateHead,      // drop the oldest prompt tokens
+    KeepSystemPrefix,  // keep the first overflow_keep tokens, drop the ones after them
+    SlidingWindow      // like KeepSystemPrefix, and shift the KV cache while generating
+};
+
+// Parse "error", "truncate_head", "keep_system_prefix" or "sliding_window"
+bool parse_overflow_policy(const std::string& name, OverflowPolicy& policy);
+
+// Parse a KV cache type: "f16", "q8_0" or "q4_0"
+bool parse_cache_type(const std::string& name, ggml_type& type);
+
 struct ModelConfig {
     std::string model_path;
     
@@ -16,11 +40,38 @@ struct ModelConfig {
     int batch_size = 512;
     int ubatch_size = 512;  // physical maximum batch size
     
+    // KV cache element types; a quantized V cache needs flash attention, which
+    // is turned on for it. q8_0 halves the cache, q4_0 quarters it.
+    ggml_type cache_type_k = GGML_TYPE_F16;
+    ggml_type cache_type_v = GGML_TYPE_F16;
+    
+    // Size context_size to the largest KV cache that fits kv_ram_budget_mb
+    // (0 = 75% of the free RAM once the weights are loaded)
+    bool context_auto = false;
+    int kv_ram_budget_mb = 0;
+    
     // Threading and performance
-    int threads = 4;
-    int threads_batch = 4;  // threads for batch processing
+    int threads = 0;        // decode threads (0 = one per compute CPU)
+    int threads_batch = 0;  // threads for batch processing (0 = same as threads)
     int gpu_layers = 0;     // CPU-only by default for edge devices
     
+    // Execution policy: ggml's compute threads live in a persistent threadpool
+    // pinned to cpu_mask; the Node thread is kept on the remaining CPUs
+    std::string cpu_mask;            // e.g. "1-3" (empty = the performance cores)
+    bool cpu_strict = false;         // one CPU per compute thread instead of a shared mask
+    int threadpool_poll = 50;        // 0-100: how long idle compute threads spin before sleeping
+    
+    // Thermal governor (see ThermalGovernor): trade threads and prefill chunk
+    // for temperature so sustained load stays under the throttle point
+    bool thermal_governor = false;
+    float thermal_target_c = 0.0f;   // 0 = 5 C below the passive trip point (75 C if unknown)
+    int thermal_interval_ms = 1000;  // sampling period
+    
+    // Weight loading (see ModelRegistry)
+    bool use_mmap = true;            // map the GGUF instead of copying it into RAM
+    bool use_mlock = false;          // pin the active model's weights in RAM
+    int model_ram_budget_mb = 0;     // resident model budget (0 = 75% of total RAM)
+    
     // Sampling parameters
     float temperature = 0.7f;
     float top_p = 0.9f;
@@ -37,6 +88,7 @@ struct ModelConfig {
     float presence_penalty = 0.0f;   // presence penalty
     
     // Advanced sampling
+    int mirostat = 0;                // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
     float mirostat_tau = 5.0f;       // mirostat target entropy
     float mirostat_eta = 0.1f;       // mirostat learning rate
     int mirostat_m = 100;            // mirostat number of tokens
@@ -58,18 +110,77 @@ struct ModelConfig {
     bool offload_kqv = false;        // offload KQV to GPU
     bool embeddings = false;         // extract embeddings
     
+    // Concurrency
+    int parallel_sequences = 4;      // sequences sharing one context (continuous batching)
+    int prefill_chunk = 0;           // prompt tokens per step while others decode (0 = ubatch_size)
+    int max_queue_depth = 64;        // requests waiting for a slot before new ones are rejected (0 = unbounded)
+    
+    // Speculative decoding with a small draft model (empty path = off)
+    std::string draft_model_path;
+    int draft_max = 8;               // tokens proposed per step
+    float draft_p_min = 0.5f;        // stop drafting below this draft-model confidence
+    bool prompt_lookup = false;      // draft from n-grams of the sequence itself (no draft model)
+    int lookup_ngram_min = 2;        // shortest n-gram matched by prompt lookup
+    int lookup_ngram_max = 4;        // longest n-gram matched by prompt lookup
+    
+    // Context overflow
+    OverflowPolicy overflow_policy = OverflowPolicy::SlidingWindow;
+    int overflow_keep = 0;           // head tokens (system prompt) that are never dropped
+    
+    // Startup warmup (see LLMModel::warmup): fault the weights in, build the
+    // context and run a first decode at load instead of on the first request.
+    // warmup_system_prompt is prefilled into every slot's KV cache as the
+    // system turn of the chat template, so chats that start with it skip it.
+    bool warmup = false;
+    std::string warmup_system_prompt;
+    
+    // LoRA adapters (see LoraAdapterCache), picked per request by name
+    std::string lora_dir = "loras";
+    int lora_cache_size = 8;         // adapters kept loaded
+    float lora_scale = 1.0f;         // strength every adapter is applied with
+    
+    // Offline batch files (see generateBatch) are read and written here
+    std::string jobs_dir = "jobs";
+    
+    // Saved KV sessions (see SessionStore)
+    std::string session_dir = "sessions";
+    int session_disk_budget_mb = 1024;  // oldest sessions are deleted beyond this
+    
     // Random seed
     int seed = 42;
 };
 
+// Phases of the startup warmup, in milliseconds
+struct WarmupStats {
+    bool done = false;
+    double prefetch_ms = 0.0;   // reading the GGUF into the page cache
+    double context_ms = 0.0;    // context, threadpool and batch creation
+    double decode_ms = 0.0;     // the first (dummy) decode
+    double prompt_ms = 0.0;     // prefilling the system prompt
+    double total_ms = 0.0;
+    uint64_t prefetch_bytes = 0;
+    int prompt_tokens = 0;
+};
+
 class LLMModel {
 public:
     LLMModel();
     ~LLMModel();
     
-    // Initialize model with configuration
+    // Initialize model with configuration. The weights come from the shared
+    // ModelRegistry, so initializing a model that is already loaded is cheap.
     bool initialize(const ModelConfig& config);
     
+    // Pay the first-request costs now: read the mapped weights into the page
+    // cache, create the context and its threadpool, decode one token so every
+    // weight is faulted in and the compute buffers are touched, and prefill
+    // warmup_system_prompt into all slots. Call after the final context size
+    // is set and before the model serves requests. False if the context
+    // could not be created.
+    bool warmup();
+    
+    const WarmupStats& warmup_stats() const { return warmup_stats_; }
+    
     // Generate text from prompt
     std::string generate(const std::string& prompt, int max_tokens = 256);
     
@@ -85,20 +196,21 @@ public:
     std::string get_model_info() const;
     
     // Update generation parameters
-    void set_temperature(float temp) { config_.temperature = temp; }
-    void set_top_p(float top_p) { config_.top_p = top_p; }
-    void set_top_k(int top_k) { config_.top_k = top_k; }
-    void set_min_p(float min_p) { config_.min_p = min_p; }
-    void set_typical_p(float typical_p) { config_.typical_p = typical_p; }
-    void set_tfs_z(float tfs_z) { config_.tfs_z = tfs_z; }
-    void set_top_a(float top_a) { config_.top_a = top_a; }
-    void set_repeat_penalty(float penalty) { config_.repeat_penalty = penalty; }
-    void set_repeat_penalty_last_n(int last_n) { config_.repeat_penalty_last_n = last_n; }
-    void set_frequency_penalty(float penalty) { config_.frequency_penalty = penalty; }
-    void set_presence_penalty(float penalty) { config_.presence_penalty = penalty; }
-    void set_mirostat_tau(float tau) { config_.mirostat_tau = tau; }
-    void set_mirostat_eta(float eta) { config_.mirostat_eta = eta; }
-    void set_mirostat_m(int m) { config_.mirostat_m = m; }
+    void set_temperature(float temp) { config_.temperature = temp; sampling_version_++; }
+    void set_top_p(float top_p) { config_.top_p = top_p; sampling_version_++; }
+    void set_top_k(int top_k) { config_.top_k = top_k; sampling_version_++; }
+    void set_min_p(float min_p) { config_.min_p = min_p; sampling_version_++; }
+    void set_typical_p(float typical_p) { config_.typical_p = typical_p; sampling_version_++; }
+    void set_tfs_z(float tfs_z) { config_.tfs_z = tfs_z; sampling_version_++; }
+    void set_top_a(float top_a) { config_.top_a = top_a; sampling_version_++; }
+    void set_repeat_penalty(float penalty) { config_.repeat_penalty = penalty; sampling_version_++; }
+    void set_repeat_penalty_last_n(int last_n) { config_.repeat_penalty_last_n = last_n; sampling_version_++; }
+    void set_frequency_penalty(float penalty) { config_.frequency_penalty = penalty; sampling_version_++; }
+    void set_presence_penalty(float penalty) { config_.presence_penalty = penalty; sampling_version_++; }
+    void set_mirostat(int mode) { config_.mirostat = mode; sampling_version_++; }
+    void set_mirostat_tau(float tau) { config_.mirostat_tau = tau; sampling_version_++; }
+    void set_mirostat_eta(float eta) { config_.mirostat_eta = eta; sampling_version_++; }
+    void set_mirostat_m(int m) { config_.mirostat_m = m; sampling_version_++; }
     void set_rope_freq_base(float freq_base) { config_.rope_freq_base = freq_base; }
     void set_rope_freq_scale(float freq_scale) { config_.rope_freq_scale = freq_scale; }
     void set_yarn_ext_factor(float factor) { config_.yarn_ext_factor = factor; }
@@ -110,29 +222,269 @@ public:
     void set_flash_attn(bool enabled) { config_.flash_attn = enabled; }
     void set_offload_kqv(bool enabled) { config_.offload_kqv = enabled; }
     void set_embeddings(bool enabled) { config_.embeddings = enabled; }
-    void set_threads_batch(int threads) { config_.threads_batch = threads; }
+    void set_threads(int threads);
+    void set_threads_batch(int threads);
     void set_ubatch_size(int size) { config_.ubatch_size = size; }
+    void set_prefill_chunk(int chunk) { config_.prefill_chunk = chunk; }
+    void set_batch_size(int size) { config_.batch_size = size; }
+    void set_context_size(int size) { config_.context_size = size; }
     
     // Cleanup backend (call at application shutdown)
     static void cleanup_backend();
+    
+    // Initialize the llama.cpp backend if nobody has yet
+    static void ensure_backend();
+    
+    // Registry load parameters for a config
+    static ModelLoadParams load_params(const ModelConfig& config);
+
+    // Multi-sequence primitives used by the request scheduler.
+    // None of these are thread-safe; callers serialize access.
+    
+    // Create the long-lived context on first use, and rebuild it when a
+    // context-affecting setting changed and no sequence is running
+    bool ensure_context();
+    
+    // A context setting changed but the rebuild waits for active sequences to finish
+    bool context_rebuild_pending() const;
+    
+    // Tokenize a prompt and prepend BOS when the vocab wants it
+    std::vector<llama_token> tokenize_prompt(const std::string& prompt);
+    
+    // Text of a token sequence
+    std::string detokenize(const std::vector<llama_token>& tokens);
+    
+    // Vocabulary size (0 before initialize); valid token ids are [0, n_vocab)
+    int n_vocab() const;
+    
+    // Context length the model was trained with (0 before initialize)
+    int n_ctx_train() const;
+    
+    // KV cache bytes one token position takes with the configured cache types
+    size_t kv_bytes_per_token() const;
+    
+    // Chat formatting of the loaded model (from its GGUF metadata)
+    const ChatTemplate& chat_template() const { return chat_template_; }
+    
+    // Shared weights; a holder keeps the vocabulary of a chat_template() copy valid
+    const ModelHandle& weights() const { return model_handle_; }
+    
+    // Pooled-embedding context, created on first use; null if that failed
+    EmbeddingContext* embedding_context();
+    
+    // CPUs for compute threads, and the allowed CPUs left for everything else
+    const std::vector<int>& compute_cpus() const { return compute_cpus_; }
+    const std::vector<int>& host_cpus() const { return host_cpus_; }
+    
+    // Pick an idle slot, preferring the one whose cache shares the longest prefix
+    // with `prompt` (only caches built under `adapter` count). Returns -1 if
+    // every slot is busy.
+    int acquire_slot(const std::vector<llama_token>& prompt, const std::string& adapter = std::string());
+    
+    // Start a request on `slot`, trimming its KV cache down to the reusable prefix.
+    // A prompt that does not fit is cut per overflow_policy (or the slot is
+    // finished with an error under OverflowPolicy::Error), and so is a request
+    // whose grammar or JSON schema does not compile or whose LoRA adapter
+    // (`adapter`, or the resident one named in `options`) is not loaded.
+    void begin_sequence(int slot, std::vector<llama_token> prompt, int max_tokens,
+                        std::function<void(const std::string&)> on_text,
+                        CancelToken cancel = nullptr,
+                        const RequestOptions& options = RequestOptions(),
+                        LoraAdapter adapter = nullptr);
+    
+    // Run one llama_decode over all active slots: a decode token for every
+    // generating sequence plus prefill chunks while the batch has room. While
+    // anyone is generating, prefill is capped at prefill_chunk tokens per step
+    // so a long prompt cannot stall the other streams. Adapters apply to the
+    // whole context, so a step only takes the sequences of one adapter; the
+    // adapter groups take turns of kAdapterTurnSteps steps. Returns false if
+    // nothing was decoded.
+    bool decode_step();
+    
+    // LoRA adapters of this model; thread-safe, and shared so callers can
+    // load and list adapters without the lock that serializes decode steps
+    const std::shared_ptr<LoraAdapterCache>& adapter_cache() const { return adapters_; }
+    
+    bool has_active_sequences() const;
+    
+    // Publish active sequences and KV cache occupancy to core_metrics()
+    void update_state_metrics() const;
+    int slot_count() const { return (int)slots_.size(); }
+    
+    // Thread counts in force (resolved at initialize) and the prefill chunk
+    int threads() const { return config_.threads; }
+    int threads_batch() const { return config_.threads_batch > 0 ? config_.threads_batch : config_.threads; }
+    int prefill_chunk() const { return config_.prefill_chunk > 0 ? config_.prefill_chunk : config_.ubatch_size; }
+    
+    // Slots the context is built with (slot_count() is 0 until it exists)
+    int parallel_sequences() const { return config_.parallel_sequences > 0 ? config_.parallel_sequences : 1; }
+    SequenceSlot& slot(int i) { return slots_[i]; }
+    
+    // Stream the text a Done slot still holds back (a possible stop string
+    // that never completed); nothing for cancelled or failed sequences
+    void flush_stream(int slot);
+    
+    // Hand a Done slot back to the idle pool. The KV cache is kept for reuse.
+    void release_slot(int slot);
+    
+    // [DONE]{...} metrics payload for a finished slot; also kept as the last metrics
+    std::string build_done_metrics(const SequenceSlot& slot);
+    
+    // Metrics JSON of the most recently finished request ("{}" before the first one)
+    std::string get_last_metrics() const { return last_metrics_; }
+    
+    // Time spent creating the context during the last ensure_context() call
+    double last_context_setup_ms() const { return last_context_setup_ms_; }
+    
+    // Drop everything held in the KV cache (all cached prefixes)
+    void reset_kv_cache();
+    
+    // Identifies the loaded weights, so saved sequence state is only restored onto them
+    uint64_t fingerprint() const;
+    
+    // Size of the serialised KV state of an idle slot (0 if it holds nothing)
+    size_t sequence_state_size(int slot);
+    
+    // Serialise an idle slot's KV state into `dst`; returns the bytes written
+    size_t copy_sequence_state(int slot, uint8_t* dst, size_t size);
+    
+    // Load saved KV state into an idle slot: one that already holds these tokens,
+    // otherwise the least recently used. Returns the slot, or -1 on failure.
+    int restore_sequence(const llama_token* tokens, size_t n_tokens,
+                         const uint8_t* state, size_t size);
 
 private:
     llama_context* ctx_;
     llama_model* model_;
+    ModelHandle model_handle_;  // keeps model_ alive in the shared registry
     ModelConfig config_;
-    std::vector<llama_token> recent_tokens_;  // For repeat penalty
+    TokenPieceCache pieces_;    // text of every token of model_
+    ChatTemplate chat_template_;
+    
+    // One sampler chain per slot (penalty and mirostat state are per sequence).
+    // sampling_version_ changes whenever a sampling parameter does, so chains are
+    // rebuilt lazily at the next request instead of per token.
+    std::vector<std::unique_ptr<Sampler>> samplers_;
+    uint64_t sampling_version_ = 1;
+    
+    // One random stream per model, seeded from config_.seed (random if < 0);
+    // each request's sampler is reseeded from it, so repeated and concurrent
+    // requests draw different samples while a fixed seed stays reproducible
+    std::mt19937 rng_;
+    
+    // Compiled grammars of constrained requests, reused across requests
+    GrammarCache grammars_;
+    
+    // LoRA adapters loaded for model_, and the one currently set on ctx_
+    // ("" = the base model)
+    std::shared_ptr<LoraAdapterCache> adapters_ = std::make_shared<LoraAdapterCache>();
+    std::string active_adapter_;
+    LoraAdapter active_lora_;        // held while set on ctx_
+    int adapter_turn_ = 0;           // decode steps the active adapter has had in a row
+    static const int kAdapterTurnSteps = 8;
+    
+    // Choose the adapter group for the next step and set it on the context
+    void select_adapter_group();
+    
+    // Set the adapter of `s` on ctx_ in place of the current one
+    bool apply_adapter(const SequenceSlot& s, std::string& error);
+    
+    // Grammar sampler for a request's options; null with `error` empty when
+    // the request is unconstrained. `forced` receives the grammar's forced-token table.
+    llama_sampler* compile_constraint(const RequestOptions& options, std::string& error,
+                                      std::shared_ptr<ForcedTokens>& forced);
+    
+    // Sequence slots sharing ctx_, plus the batch reused by every decode step
+    std::vector<SequenceSlot> slots_;
+    llama_batch batch_;
+    bool batch_initialized_ = false;
+    uint64_t slot_tick_ = 0;
+    
+    // Cancel tokens of the sequences in the batch currently being decoded;
+    // llama.cpp's abort callback stops the graph once all of them are set
+    std::vector<CancelToken> batch_cancel_;
+    static bool abort_callback(void* data);
+    
+    std::string last_metrics_ = "{}";
+    double last_context_setup_ms_ = 0.0;
+    WarmupStats warmup_stats_;
+    
+    // Resolved execution policy and the threadpools shared by every context
+    // of this model (threadpool_batch_ is null when prefill uses threadpool_)
+    std::vector<int> compute_cpus_;
+    std::vector<int> host_cpus_;
+    ggml_threadpool_t threadpool_ = nullptr;
+    ggml_threadpool_t threadpool_batch_ = nullptr;
+    int threadpool_threads_ = 0;
+    int threadpool_batch_threads_ = 0;
+    
+    // Pick compute CPUs and fill in automatic thread counts
+    void resolve_execution_policy();
+    
+    // Paused threadpool over compute_cpus_; null if ggml could not create it
+    ggml_threadpool_t new_threadpool(int n_threads) const;
+    
+    // Thread counts were raised past what the threadpools were built for
+    bool threadpool_undersized() const;
+    
+    // Separate context for embed(); null until first used
+    std::unique_ptr<EmbeddingContext> embedder_;
+    
+    // Proposes tokens for the generating sequences; null when speculation is off
+    std::unique_ptr<DraftSource> draft_;
+    
+    // Ask the draft source for continuations of every generating sequence
+    void draft_tokens(int n_batch, size_t n_ctx);
+    
+    // Prompt-prefix KV cache statistics
+    uint64_t prefix_cache_hits_ = 0;
+    uint64_t prefix_cache_misses_ = 0;
     
     // Internal generation helper
     std::string generate_internal(const std::string& prompt, int max_tokens);
     
+    // Run a single slot to completion (used by the direct generate paths)
+    int run_single_sequence(const std::string& prompt, int max_tokens,
+                            std::function<void(const std::string&)> on_text,
+                            std::string& error);
+    
+    // Free the KV cache held by idle slots (and finished ones) to make room for active ones
+    bool evict_idle_slots();
+    
+    // After llama_decode found no KV room for `spans` (slot, tokens): drop the
+    // prefill chunks and drafts from the step, else slide or end the longest
+    // generating sequence, and rebuild the batch. False if nothing is left to cut.
+    bool relieve_kv_pressure(std::vector<std::pair<int, int>>& spans);
+    bool kv_full_ = false;  // prefill was pushed out of a step; it waits for a release
+    
+    // Head tokens the overflow policy must keep for a prompt of this shape
+    size_t overflow_keep_tokens(const std::vector<llama_token>& prompt, size_t limit) const;
+    
+    // Cut a prompt that leaves no room to generate; false under OverflowPolicy::Error
+    bool fit_prompt(std::vector<llama_token>& prompt, int max_tokens, size_t& n_truncated) const;
+    
+    // Sliding window: discard half of the tokens after the kept head and shift
+    // the rest back. False if the policy or the KV cache does not allow it.
+    bool shift_context(SequenceSlot& s);
+    
+    // Release the context, batch and slots
+    void free_context();
+    
+    // llama_context_params for the current config_
+    llama_context_params make_context_params() const;
+    
+    // Parameters ctx_ was created with, to detect knobs that need a rebuild
+    llama_context_params ctx_params_;
+    
     // Tokenize text
     std::vector<llama_token> tokenize(const std::string& text);
     
-    // Detokenize tokens
-    std::string detokenize(const std::vector<llama_token>& tokens);
+    // Apply the slot's sampler chain to the logits row of one batch position
+    llama_token sample_next_token(int slot, const float* logits);
     
-    // Apply sampling
-    llama_token sample_next_token(const std::vector<float>& logits);
+    // Hand a sampled token to the sequence (text, EOS, budget); false once it is
+    // done. Text is streamed in whole UTF-8 characters.
+    bool emit_token(SequenceSlot& s, llama_token token, const llama_vocab* vocab);
 };
 
 } // namespace local_llm 
\ No newline at end of file
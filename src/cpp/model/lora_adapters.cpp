@@ -0,0 +1,299 @@
+#include "lora_adapters.h"
+#include "../common/json.h"
+#include "../common/logging.h"
+#include "../common/metrics.h"
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace local_llm {
+
+namespace {
+
+// A missing adapter is looked for again after this long
+const std::chrono::seconds kFailureRetry(10);
+
+struct LoraMetrics {
+    Gauge& loaded;
+    Counter& loads;
+    Counter& load_failures;
+    Counter& evictions;
+};
+
+LoraMetrics& lora_metrics() {
+    static LoraMetrics metrics = [] {
+        MetricsRegistry& r = MetricsRegistry::instance();
+        return LoraMetrics{
+            r.gauge("llm_lora_adapters_loaded", "LoRA adapters resident in memory"),
+            r.counter("llm_lora_loads_total", "LoRA adapters loaded from disk"),
+            r.counter("llm_lora_load_failures_total", "LoRA adapters that could not be loaded"),
+            r.counter("llm_lora_evictions_total", "LoRA adapters freed to make room for another"),
+        };
+    }();
+    return metrics;
+}
+
+} // namespace
+
+bool valid_adapter_name(const std::string& name) {
+    if (name.empty() || name.size() > 128 || name[0] == '.') {
+        return false;
+    }
+    for (char c : name) {
+        if (!std::isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+LoraAdapterCache::LoraAdapterCache() {
+    loader_ = std::thread(&LoraAdapterCache::run, this);
+}
+
+LoraAdapterCache::~LoraAdapterCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    queue_cv_.notify_all();
+    if (loader_.joinable()) {
+        loader_.join();
+    }
+    clear();
+}
+
+void LoraAdapterCache::configure(ModelHandle model, const std::string& dir, size_t capacity, float scale) {
+    clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    model_ = std::move(model);
+    dir_ = dir.empty() ? "loras" : dir;
+    capacity_ = std::max<size_t>(1, capacity);
+    scale_ = scale;
+}
+
+void LoraAdapterCache::clear() {
+    std::vector<Entry> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        dropped.swap(entries_);
+        failures_.clear();
+        queue_.clear();
+        model_.reset();
+        active_.clear();
+        generation_++;
+    }
+    lora_metrics().loaded.set(0);
+}
+
+void LoraAdapterCache::set_on_loaded(std::function<void()> on_loaded) {
+    // Waits for a callback in progress, so the old target may go away after this
+    std::lock_guard<std::mutex> lock(on_loaded_mutex_);
+    on_loaded_ = std::move(on_loaded);
+}
+
+void LoraAdapterCache::set_active(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_ = name;
+}
+
+LoraAdapter LoraAdapterCache::lookup(const std::string& name) {
+    for (auto& e : entries_) {
+        if (e.name == name) {
+            e.last_used = ++tick_;
+            hits_++;
+            return e.adapter;
+        }
+    }
+    return nullptr;
+}
+
+void LoraAdapterCache::expire_failures() {
+    const auto now = std::chrono::steady_clock::now();
+    failures_.erase(std::remove_if(failures_.begin(), failures_.end(),
+                                   [now](const Failure& f) { return now - f.at >= kFailureRetry; }),
+                    failures_.end());
+}
+
+LoraAdapterCache::Status LoraAdapterCache::find(const std::string& name, LoraAdapter& adapter,
+                                                std::string& error) {
+    if (!valid_adapter_name(name)) {
+        error = "Invalid LoRA adapter name: " + name;
+        return Status::Failed;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    adapter = lookup(name);
+    if (adapter) {
+        return Status::Ready;
+    }
+    expire_failures();
+    for (const auto& f : failures_) {
+        if (f.name == name) {
+            error = f.error;
+            return Status::Failed;
+        }
+    }
+    if (!model_) {
+        error = "Model not loaded";
+        return Status::Failed;
+    }
+    if (std::find(loading_.begin(), loading_.end(), name) == loading_.end() &&
+        std::find(queue_.begin(), queue_.end(), name) == queue_.end()) {
+        queue_.push_back(name);
+        queue_cv_.notify_one();
+    }
+    return Status::Loading;
+}
+
+LoraAdapter LoraAdapterCache::read_adapter(const ModelHandle& model, const std::string& dir, const std::string& name,
+                                           uint64_t& bytes, double& load_ms, std::string& error) {
+    const std::string path = dir + "/" + name + ".gguf";
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        error = "Unknown LoRA adapter: " + name;
+        return nullptr;
+    }
+    auto load_start = std::chrono::high_resolution_clock::now();
+    llama_adapter_lora* raw = llama_adapter_lora_init(model.get(), path.c_str());
+    if (!raw) {
+        // Typically trained for a different base model
+        error = "Failed to load LoRA adapter: " + name;
+        return nullptr;
+    }
+    bytes = (uint64_t)st.st_size;
+    load_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::high_resolution_clock::now() - load_start).count();
+    // The deleter holds the base weights, which must outlive the adapter
+    return LoraAdapter(raw, [model](llama_adapter_lora* a) { llama_adapter_lora_free(a); });
+}
+
+LoraAdapter LoraAdapterCache::insert(const std::string& name, LoraAdapter adapter, uint64_t bytes, double load_ms) {
+    if (LoraAdapter existing = lookup(name)) {
+        return existing;  // loaded twice at once; the copy just read is dropped
+    }
+    misses_++;
+    while (entries_.size() >= capacity_) {
+        auto victim = std::min_element(entries_.begin(), entries_.end(),
+                                       [](const Entry& a, const Entry& b) { return a.last_used < b.last_used; });
+        LLM_LOG_INFO("LoraAdapterCache", "Evicting LoRA adapter " << victim->name);
+        entries_.erase(victim);
+        lora_metrics().evictions.inc();
+    }
+    Entry entry;
+    entry.name = name;
+    entry.adapter = adapter;
+    entry.bytes = bytes;
+    entry.load_ms = load_ms;
+    entry.last_used = ++tick_;
+    entries_.push_back(std::move(entry));
+    LLM_LOG_INFO("LoraAdapterCache", "Loaded LoRA adapter " << name << " ("
+                                     << bytes / (1024 * 1024) << " MB) in " << load_ms << " ms");
+    lora_metrics().loads.inc();
+    lora_metrics().loaded.set((double)entries_.size());
+    return adapter;
+}
+
+LoraAdapter LoraAdapterCache::load(const std::string& name, std::string& error) {
+    if (!valid_adapter_name(name)) {
+        error = "Invalid LoRA adapter name: " + name;
+        return nullptr;
+    }
+    ModelHandle model;
+    std::string dir;
+    uint64_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (LoraAdapter adapter = lookup(name)) {
+            return adapter;
+        }
+        if (!model_) {
+            error = "Model not loaded";
+            return nullptr;
+        }
+        model = model_;
+        dir = dir_;
+        generation = generation_;
+    }
+    uint64_t bytes = 0;
+    double load_ms = 0.0;
+    LoraAdapter adapter = read_adapter(model, dir, name, bytes, load_ms, error);
+    if (!adapter) {
+        lora_metrics().load_failures.inc();
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation != generation_) {
+        error = "Model changed while the LoRA adapter was loading";
+        return nullptr;
+    }
+    return insert(name, std::move(adapter), bytes, load_ms);
+}
+
+void LoraAdapterCache::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        queue_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) {
+            return;
+        }
+        const std::string name = queue_.front();
+        queue_.pop_front();
+        loading_.push_back(name);
+        const ModelHandle model = model_;
+        const std::string dir = dir_;
+        const uint64_t generation = generation_;
+        lock.unlock();
+
+        uint64_t bytes = 0;
+        double load_ms = 0.0;
+        std::string error;
+        LoraAdapter adapter = model ? read_adapter(model, dir, name, bytes, load_ms, error) : nullptr;
+        if (!adapter) {
+            LLM_LOG_WARN("LoraAdapterCache", error);
+            lora_metrics().load_failures.inc();
+        }
+
+        lock.lock();
+        loading_.erase(std::find(loading_.begin(), loading_.end(), name));
+        if (generation == generation_) {
+            if (adapter) {
+                insert(name, std::move(adapter), bytes, load_ms);
+            } else {
+                failures_.push_back({name, error, std::chrono::steady_clock::now()});
+            }
+        }
+        lock.unlock();
+        adapter.reset();  // a stale or duplicate copy is freed outside the lock
+        {
+            std::lock_guard<std::mutex> callback_lock(on_loaded_mutex_);
+            if (on_loaded_) {
+                on_loaded_();
+            }
+        }
+        lock.lock();
+    }
+}
+
+std::string LoraAdapterCache::stats_json() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream oss;
+    oss << "{\"active\":" << json_quote(active_)
+        << ",\"scale\":" << scale_
+        << ",\"dir\":" << json_quote(dir_)
+        << ",\"capacity\":" << capacity_
+        << ",\"hits\":" << hits_
+        << ",\"misses\":" << misses_
+        << ",\"loading\":" << (loading_.size() + queue_.size())
+        << ",\"adapters\":[";
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        const Entry& e = entries_[i];
+        oss << (i > 0 ? "," : "") << "{\"name\":" << json_quote(e.name)
+            << ",\"bytes\":" << e.bytes
+            << ",\"load_ms\":" << e.load_ms << "}";
+    }
+    oss << "]}";
+    return oss.str();
+}
+
+} // namespace local_llm
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include "llama.h"
+#include "model_registry.h"
+
+namespace local_llm {
+
+// A LoRA adapter name is a file stem inside the adapter directory
+bool valid_adapter_name(const std::string& name);
+
+// A loaded adapter; the last holder frees it, and it keeps the base weights
+// alive until then
+using LoraAdapter = std::shared_ptr<llama_adapter_lora>;
+
+// LoRA adapters of one base model, loaded from <dir>/<name>.gguf on first use
+// and kept until capacity forces the least recently used one out. An adapter
+// is a few tens of MB next to the shared base weights, so switching between
+// fine-tuned variants costs a lookup instead of a model load.
+//
+// Reading an adapter takes long enough to stall decoding, so misses are
+// loaded on a thread of the cache: find() never blocks, and on_loaded runs
+// when a load finishes. Sequences hold their adapter, so eviction only drops
+// the cache's reference. Thread-safe.
+class LoraAdapterCache {
+public:
+    enum class Status { Ready, Loading, Failed };
+
+    LoraAdapterCache();
+    ~LoraAdapterCache();
+
+    LoraAdapterCache(const LoraAdapterCache&) = delete;
+    LoraAdapterCache& operator=(const LoraAdapterCache&) = delete;
+
+    // Serve adapters of `model` from `dir`; drops every adapter loaded so far.
+    // `scale` is only reported, the model applies it.
+    void configure(ModelHandle model, const std::string& dir, size_t capacity, float scale);
+
+    // The adapter if it is loaded; otherwise queue the load and return
+    // Loading, or Failed (with `error`) if it cannot be loaded
+    Status find(const std::string& name, LoraAdapter& adapter, std::string& error);
+
+    // Load on the calling thread (preloading from a worker); null with `error`
+    LoraAdapter load(const std::string& name, std::string& error);
+
+    // Called from the loader thread after each background load
+    void set_on_loaded(std::function<void()> on_loaded);
+
+    // Name of the adapter set on the context, for stats_json()
+    void set_active(const std::string& name);
+
+    // Drop every adapter (the base model is about to change)
+    void clear();
+
+    // {"active":...,"dir":...,"capacity":N,"adapters":[{"name":...,"bytes":N,"load_ms":X}],...}
+    std::string stats_json() const;
+
+private:
+    struct Entry {
+        std::string name;
+        LoraAdapter adapter;
+        uint64_t bytes = 0;     // size of the GGUF file
+        double load_ms = 0.0;
+        uint64_t last_used = 0;
+    };
+
+    // A load that failed, so waiting requests fail instead of retrying at once
+    struct Failure {
+        std::string name;
+        std::string error;
+        std::chrono::steady_clock::time_point at;
+    };
+
+    mutable std::mutex mutex_;
+    ModelHandle model_;
+    std::string dir_ = "loras";
+    std::string active_;
+    size_t capacity_ = 8;
+    float scale_ = 1.0f;
+    uint64_t generation_ = 0;  // bumped by configure()/clear(), so stale loads are dropped
+    std::vector<Entry> entries_;
+    std::vector<Failure> failures_;
+    uint64_t tick_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+
+    // Background loads
+    std::deque<std::string> queue_;
+    std::vector<std::string> loading_;
+    std::condition_variable queue_cv_;
+    bool stop_ = false;
+    std::thread loader_;
+
+    std::mutex on_loaded_mutex_;
+    std::function<void()> on_loaded_;
+
+    void run();
+
+    // Read <dir>/<name>.gguf (no lock held)
+    static LoraAdapter read_adapter(const ModelHandle& model, const std::string& dir, const std::string& name,
+                                    uint64_t& bytes, double& load_ms, std::string& error);
+
+    // Adapter `name` if loaded, marking it used (mutex_ held)
+    LoraAdapter lookup(const std::string& name);
+
+    // Add a loaded adapter, evicting the least recently used beyond capacity (mutex_ held)
+    LoraAdapter insert(const std::string& name, LoraAdapter adapter, uint64_t bytes, double load_ms);
+
+    // Forget failures old enough to be retried (mutex_ held)
+    void expire_failures();
+};
+
+} // namespace local_llm
@@ -0,0 +1,198 @@
+#include "model_registry.h"
+#include "../common/json.h"
+#include "../common/logging.h"
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+namespace local_llm {
+
+static bool same_params(const ModelLoadParams& a, const ModelLoadParams& b) {
+    return a.gpu_layers == b.gpu_layers && a.use_mmap == b.use_mmap && a.use_mlock == b.use_mlock;
+}
+
+static uint64_t file_size(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return 0;
+    }
+    return (uint64_t)st.st_size;
+}
+
+ModelRegistry& ModelRegistry::instance() {
+    static ModelRegistry registry;
+    return registry;
+}
+
+ModelRegistry::Entry* ModelRegistry::find(const std::string& path, const ModelLoadParams& params) {
+    for (auto& e : entries_) {
+        if (e.path == path && same_params(e.params, params)) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+const ModelRegistry::Entry* ModelRegistry::find(const std::string& path, const ModelLoadParams& params) const {
+    return const_cast<ModelRegistry*>(this)->find(path, params);
+}
+
+bool ModelRegistry::is_loading(const std::string& path, const ModelLoadParams& params) const {
+    for (const auto& l : loading_) {
+        if (l.path == path && same_params(l.params, params)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ModelHandle ModelRegistry::acquire(const std::string& path, const ModelLoadParams& params) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // Somebody else is loading this one: take theirs instead of a second copy
+    loaded_cv_.wait(lock, [&] { return !is_loading(path, params); });
+    if (Entry* e = find(path, params)) {
+        e->last_used = ++tick_;
+        LLM_LOG_INFO("ModelRegistry", "Reusing loaded model " << path);
+        return e->model;
+    }
+
+    make_room(file_size(path));
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = params.gpu_layers;
+    model_params.use_mmap = params.use_mmap;
+    model_params.use_mlock = params.use_mlock;
+
+    // Load without the lock: it takes seconds, and stats_json() is called
+    // from the JS thread. The loading entry keeps a second caller from
+    // loading the same file twice.
+    loading_.push_back({path, params});
+    lock.unlock();
+    llama_model* raw = llama_model_load_from_file(path.c_str(), model_params);
+    lock.lock();
+    loading_.erase(std::remove_if(loading_.begin(), loading_.end(),
+                                  [&](const Loading& l) { return l.path == path && same_params(l.params, params); }),
+                   loading_.end());
+    loaded_cv_.notify_all();
+    if (!raw) {
+        LLM_LOG_ERROR("ModelRegistry", "Failed to load model: " << path);
+        return nullptr;
+    }
+
+    Entry entry;
+    entry.path = path;
+    entry.params = params;
+    entry.model = ModelHandle(raw, llama_model_free);
+    entry.bytes = llama_model_size(raw);
+    entry.last_used = ++tick_;
+    entries_.push_back(entry);
+
+    LLM_LOG_INFO("ModelRegistry", "Loaded " << path << " (" << entry.bytes / (1024 * 1024) << " MB, mmap="
+                                  << (params.use_mmap ? "on" : "off") << ", mlock="
+                                  << (params.use_mlock ? "on" : "off") << "), resident "
+                                  << total_bytes() / (1024 * 1024) << " MB");
+    return entry.model;
+}
+
+bool ModelRegistry::preload(const std::string& path, const ModelLoadParams& params) {
+    return acquire(path, params) != nullptr;
+}
+
+uint64_t ModelRegistry::load_cost(const std::string& path, const ModelLoadParams& params) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find(path, params) ? 0 : file_size(path);
+}
+
+void ModelRegistry::set_budget_bytes(uint64_t bytes) {
+    budget_bytes_ = bytes;
+}
+
+uint64_t ModelRegistry::budget_bytes() const {
+    const uint64_t budget = budget_bytes_.load();
+    if (budget > 0) {
+        return budget;
+    }
+    struct sysinfo si;
+    if (sysinfo(&si) != 0) {
+        return 0;
+    }
+    return (uint64_t)si.totalram * si.mem_unit / 4 * 3;
+}
+
+uint64_t ModelRegistry::resident_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return total_bytes();
+}
+
+uint64_t ModelRegistry::in_use_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t total = 0;
+    for (const auto& e : entries_) {
+        if (e.model.use_count() > 1) {
+            total += e.bytes;
+        }
+    }
+    return total;
+}
+
+uint64_t ModelRegistry::total_bytes() const {
+    uint64_t total = 0;
+    for (const auto& e : entries_) {
+        total += e.bytes;
+    }
+    return total;
+}
+
+void ModelRegistry::make_room(uint64_t incoming) {
+    const uint64_t budget = budget_bytes();
+    if (budget == 0) {
+        return;
+    }
+    while (total_bytes() + incoming > budget) {
+        // Least recently used model that only the registry still references
+        auto victim = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->model.use_count() == 1 &&
+                (victim == entries_.end() || it->last_used < victim->last_used)) {
+                victim = it;
+            }
+        }
+        if (victim == entries_.end()) {
+            LLM_LOG_WARN("ModelRegistry", "RAM budget exceeded but every loaded model is in use");
+            return;
+        }
+        LLM_LOG_INFO("ModelRegistry", "Evicting " << victim->path);
+        entries_.erase(victim);
+    }
+}
+
+void ModelRegistry::evict_unused() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                  [](const Entry& e) { return e.model.use_count() == 1; }),
+                   entries_.end());
+}
+
+std::string ModelRegistry::stats_json() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream oss;
+    oss << "{\"budget_bytes\":" << budget_bytes()
+        << ",\"resident_bytes\":" << total_bytes()
+        << ",\"models\":[";
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        const Entry& e = entries_[i];
+        if (i > 0) {
+            oss << ",";
+        }
+        oss << "{\"path\":" << json_quote(e.path)
+            << ",\"bytes\":" << e.bytes
+            << ",\"in_use\":" << (e.model.use_count() - 1)
+            << ",\"mlock\":" << (e.params.use_mlock ? "true" : "false") << "}";
+    }
+    oss << "]}";
+    return oss.str();
+}
+
+} // namespace local_llm
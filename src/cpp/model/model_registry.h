@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include "llama.h"
+
+namespace local_llm {
+
+// How a GGUF is loaded; part of the registry key, since the same file loaded
+// with different settings is a different llama_model
+struct ModelLoadParams {
+    int gpu_layers = 0;
+    bool use_mmap = true;    // map the weights instead of reading them into RAM
+    bool use_mlock = false;  // pin the mapped weights so they are never paged out
+};
+
+using ModelHandle = std::shared_ptr<llama_model>;
+
+// Process-wide cache of loaded models. Handles are reference counted: every
+// LLMModel using a model holds one, and the registry keeps its own so the
+// weights stay warm after the last user goes away. Unused models are evicted
+// least-recently-used first once the resident total exceeds the RAM budget;
+// models that are in use are never evicted.
+class ModelRegistry {
+public:
+    static ModelRegistry& instance();
+
+    // Return the cached model or load it. Null if loading failed. The load
+    // itself runs outside the registry lock, so stats and other lookups stay
+    // quick meanwhile; a second caller for the same model waits for it.
+    ModelHandle acquire(const std::string& path, const ModelLoadParams& params);
+
+    // Load a model into the cache without using it yet
+    bool preload(const std::string& path, const ModelLoadParams& params);
+
+    // Bytes that loading `path` would add (0 if it is already cached)
+    uint64_t load_cost(const std::string& path, const ModelLoadParams& params) const;
+
+    // Resident budget in bytes; 0 derives it from sysinfo (75% of total RAM)
+    void set_budget_bytes(uint64_t bytes);
+    uint64_t budget_bytes() const;
+    uint64_t resident_bytes() const;
+
+    // Bytes of the models somebody other than the registry is holding
+    uint64_t in_use_bytes() const;
+
+    // Drop every model nobody is using
+    void evict_unused();
+
+    // Cached models as JSON: path, size, refs, mlock
+    std::string stats_json() const;
+
+private:
+    struct Entry {
+        std::string path;
+        ModelLoadParams params;
+        ModelHandle model;
+        uint64_t bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    ModelRegistry() = default;
+
+    // Evict unused entries until `incoming` more bytes fit (mutex held)
+    void make_room(uint64_t incoming);
+
+    // Sum of cached model sizes (mutex held)
+    uint64_t total_bytes() const;
+
+    Entry* find(const std::string& path, const ModelLoadParams& params);
+    const Entry* find(const std::string& path, const ModelLoadParams& params) const;
+
+    // A model some acquire() call is loading right now (mutex held)
+    struct Loading {
+        std::string path;
+        ModelLoadParams params;
+    };
+    bool is_loading(const std::string& path, const ModelLoadParams& params) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable loaded_cv_;  // a load finished (or failed)
+    std::vector<Entry> entries_;
+    std::vector<Loading> loading_;
+    std::atomic<uint64_t> budget_bytes_{0};
+    uint64_t tick_ = 0;
+};
+
+} // namespace local_llm
@@ -0,0 +1,381 @@
+#include "sampler.h"
+#include "llm_model.h"
+#include "../common/logging.h"
+#include <algorithm>
+#include <cmath>
+
+namespace local_llm {
+
+// llama.cpp no longer ships tail-free and top-a sampling, so both are provided
+// here as small llama_sampler stages. They run after top-k, on a few candidates.
+
+static void softmax_sorted(llama_token_data_array* cur_p) {
+    if (!cur_p->sorted) {
+        std::sort(cur_p->data, cur_p->data + cur_p->size,
+                  [](const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; });
+        cur_p->sorted = true;
+    }
+    const float max_logit = cur_p->data[0].logit;
+    float sum = 0.0f;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        cur_p->data[i].p = expf(cur_p->data[i].logit - max_logit);
+        sum += cur_p->data[i].p;
+    }
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        cur_p->data[i].p /= sum;
+    }
+}
+
+struct TailFreeState {
+    float z;
+    std::vector<float> derivatives;  // reused between calls
+};
+
+static const char* tail_free_name(const llama_sampler*) { return "tail-free"; }
+
+static void tail_free_apply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+    auto* st = static_cast<TailFreeState*>(smpl->ctx);
+    if (st->z >= 1.0f || cur_p->size <= 2) {
+        return;
+    }
+    softmax_sorted(cur_p);
+    
+    // Second derivative of the sorted probabilities, normalized
+    const size_t n = cur_p->size - 2;
+    st->derivatives.resize(n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        float d1 = cur_p->data[i].p - cur_p->data[i + 1].p;
+        float d2 = cur_p->data[i + 1].p - cur_p->data[i + 2].p;
+        st->derivatives[i] = fabsf(d1 - d2);
+        sum += st->derivatives[i];
+    }
+    if (sum <= 0.0f) {
+        return;
+    }
+    
+    size_t last_idx = cur_p->size;
+    float cum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        cum += st->derivatives[i] / sum;
+        if (cum > st->z) {
+            last_idx = i;
+            break;
+        }
+    }
+    cur_p->size = std::max<size_t>(last_idx, 1);
+}
+
+static llama_sampler* tail_free_init(float z);
+
+static llama_sampler* tail_free_clone(const llama_sampler* smpl) {
+    return tail_free_init(static_cast<const TailFreeState*>(smpl->ctx)->z);
+}
+
+static void tail_free_free(llama_sampler* smpl) {
+    delete static_cast<TailFreeState*>(smpl->ctx);
+}
+
+static const llama_sampler_i tail_free_iface = {
+    /* .name   = */ tail_free_name,
+    /* .accept = */ nullptr,
+    /* .apply  = */ tail_free_apply,
+    /* .reset  = */ nullptr,
+    /* .clone  = */ tail_free_clone,
+    /* .free   = */ tail_free_free,
+};
+
+static llama_sampler* tail_free_init(float z) {
+    return llama_sampler_init(&tail_free_iface, new TailFreeState{z, {}});
+}
+
+static const char* top_a_name(const llama_sampler*) { return "top-a"; }
+
+static void top_a_apply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+    const float a = *static_cast<float*>(smpl->ctx);
+    if (a <= 0.0f || cur_p->size <= 1) {
+        return;
+    }
+    softmax_sorted(cur_p);
+    
+    // Drop tokens below a * p_max^2; the list is sorted so this is a cut
+    const float threshold = a * cur_p->data[0].p * cur_p->data[0].p;
+    size_t keep = 1;
+    while (keep < cur_p->size && cur_p->data[keep].p >= threshold) {
+        keep++;
+    }
+    cur_p->size = keep;
+}
+
+static llama_sampler* top_a_init(float a);
+
+static llama_sampler* top_a_clone(const llama_sampler* smpl) {
+    return top_a_init(*static_cast<const float*>(smpl->ctx));
+}
+
+static void top_a_free(llama_sampler* smpl) {
+    delete static_cast<float*>(smpl->ctx);
+}
+
+static const llama_sampler_i top_a_iface = {
+    /* .name   = */ top_a_name,
+    /* .accept = */ nullptr,
+    /* .apply  = */ top_a_apply,
+    /* .reset  = */ nullptr,
+    /* .clone  = */ top_a_clone,
+    /* .free   = */ top_a_free,
+};
+
+static llama_sampler* top_a_init(float a) {
+    return llama_sampler_init(&top_a_iface, new float(a));
+}
+
+Sampler::Sampler() {}
+
+Sampler::~Sampler() {
+    free_chain();
+    set_grammar(nullptr);
+}
+
+void Sampler::set_grammar(llama_sampler* grammar, std::shared_ptr<ForcedTokens> forced) {
+    if (grammar_) {
+        llama_sampler_free(grammar_);
+    }
+    grammar_ = grammar;
+    forced_ = grammar ? std::move(forced) : nullptr;
+    grammar_state_ = ForcedTokens::start();
+    grammar_failed_ = false;
+}
+
+void Sampler::accept_grammar(llama_token token) {
+    llama_sampler_accept(grammar_, token);
+    grammar_state_ = ForcedTokens::advance(grammar_state_, token);
+}
+
+void Sampler::free_chain() {
+    if (chain_) {
+        llama_sampler_free(chain_);
+        chain_ = nullptr;
+    }
+}
+
+void Sampler::configure(const ModelConfig& config, int n_vocab, uint64_t version) {
+    if (configured_ && version == version_) {
+        return;
+    }
+    free_chain();
+    
+    const uint32_t seed = config.seed < 0 ? LLAMA_DEFAULT_SEED : (uint32_t)config.seed;
+    
+    llama_sampler_chain_params params = llama_sampler_chain_default_params();
+    params.no_perf = true;
+    chain_ = llama_sampler_chain_init(params);
+    
+    const bool penalties = config.repeat_penalty != 1.0f || config.frequency_penalty != 0.0f ||
+                           config.presence_penalty != 0.0f;
+    if (penalties && config.repeat_penalty_last_n != 0) {
+        llama_sampler_chain_add(chain_, llama_sampler_init_penalties(
+            config.repeat_penalty_last_n, config.repeat_penalty,
+            config.frequency_penalty, config.presence_penalty));
+    }
+    
+    n_vocab_ = n_vocab;
+    mirostat_tau_ = config.mirostat_tau;
+    mirostat_eta_ = config.mirostat_eta;
+    mirostat_m_ = config.mirostat_m;
+    
+    if (config.temperature <= 0.0f) {
+        terminal_ = -1;
+        llama_sampler_chain_add(chain_, llama_sampler_init_greedy());
+    } else if (config.mirostat == 1 || config.mirostat == 2) {
+        terminal_ = config.mirostat;
+        llama_sampler_chain_add(chain_, llama_sampler_init_temp(config.temperature));
+        llama_sampler_chain_add(chain_, make_terminal(seed));
+    } else {
+        if (config.top_k > 0) {
+            llama_sampler_chain_add(chain_, llama_sampler_init_top_k(config.top_k));
+        }
+        if (config.tfs_z < 1.0f) {
+            llama_sampler_chain_add(chain_, tail_free_init(config.tfs_z));
+        }
+        if (config.typical_p < 1.0f) {
+            llama_sampler_chain_add(chain_, llama_sampler_init_typical(config.typical_p, 1));
+        }
+        if (config.top_p < 1.0f) {
+            llama_sampler_chain_add(chain_, llama_sampler_init_top_p(config.top_p, 1));
+        }
+        if (config.min_p > 0.0f) {
+            llama_sampler_chain_add(chain_, llama_sampler_init_min_p(config.min_p, 1));
+        }
+        if (config.top_a > 0.0f) {
+            llama_sampler_chain_add(chain_, top_a_init(config.top_a));
+        }
+        terminal_ = 0;
+        llama_sampler_chain_add(chain_, llama_sampler_init_temp(config.temperature));
+        llama_sampler_chain_add(chain_, make_terminal(seed));
+    }
+    
+    // Top-k over a preselected shortlist is exact as long as penalties can only
+    // lower logits: a shortlist of k + last_n tokens still contains the final top-k.
+    // Mirostat and greedy-with-penalties look at the whole distribution.
+    preselect_ = 0;
+    const bool lowering_only = config.repeat_penalty >= 1.0f && config.frequency_penalty >= 0.0f &&
+                               config.presence_penalty >= 0.0f;
+    if (config.mirostat == 0 && config.temperature > 0.0f && config.top_k > 0 &&
+        lowering_only && config.repeat_penalty_last_n >= 0) {
+        const int shortlist = config.top_k + (penalties ? config.repeat_penalty_last_n : 0);
+        if (shortlist < n_vocab) {
+            preselect_ = shortlist;
+        }
+    }
+    
+    candidates_.reserve(n_vocab);
+    version_ = version;
+    configured_ = true;
+    LLM_LOG_DEBUG("Sampler", "Built chain with " << llama_sampler_chain_n(chain_)
+                             << " stages, preselect=" << preselect_);
+}
+
+llama_sampler* Sampler::make_terminal(uint32_t seed) const {
+    switch (terminal_) {
+        case 0: return llama_sampler_init_dist(seed);
+        case 1: return llama_sampler_init_mirostat(n_vocab_, seed, mirostat_tau_, mirostat_eta_, mirostat_m_);
+        case 2: return llama_sampler_init_mirostat_v2(seed, mirostat_tau_, mirostat_eta_);
+        default: return nullptr;
+    }
+}
+
+void Sampler::reset(uint32_t seed) {
+    if (!chain_) {
+        return;
+    }
+    llama_sampler_reset(chain_);
+    // A reset restarts the random stage at its construction seed, so without
+    // a fresh one identical prompts would always sample identically
+    llama_sampler* terminal = make_terminal(seed);
+    if (terminal) {
+        llama_sampler_free(llama_sampler_chain_remove(chain_, llama_sampler_chain_n(chain_) - 1));
+        llama_sampler_chain_add(chain_, terminal);
+    }
+}
+
+void Sampler::select_top_k(const float* logits, int n_vocab, int k) {
+    auto greater = [](const llama_token_data& a, const llama_token_data& b) {
+        return a.logit > b.logit;
+    };
+    
+    candidates_.clear();
+    for (int i = 0; i < k; ++i) {
+        candidates_.push_back({i, logits[i], 0.0f});
+    }
+    std::make_heap(candidates_.begin(), candidates_.end(), greater);
+    
+    // The heap front is the smallest logit kept so far; most of the vocab fails this check
+    for (int i = k; i < n_vocab; ++i) {
+        if (logits[i] <= candidates_.front().logit) {
+            continue;
+        }
+        std::pop_heap(candidates_.begin(), candidates_.end(), greater);
+        candidates_.back() = {i, logits[i], 0.0f};
+        std::push_heap(candidates_.begin(), candidates_.end(), greater);
+    }
+}
+
+void Sampler::select_all(const float* logits, int n_vocab) {
+    candidates_.resize(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) {
+        candidates_[i] = {i, logits[i], 0.0f};
+    }
+}
+
+llama_token Sampler::sample(const float* logits, int n_vocab) {
+    if (!logits || n_vocab <= 0 || !chain_) return 0;
+    
+    if (preselect_ > 0) {
+        select_top_k(logits, n_vocab, preselect_);
+    } else {
+        select_all(logits, n_vocab);
+    }
+    
+    llama_token_data_array cur_p = {
+        candidates_.data(),
+        candidates_.size(),
+        -1,
+        false,
+    };
+    llama_sampler_apply(chain_, &cur_p);
+    
+    llama_token result;
+    if (cur_p.selected >= 0 && cur_p.selected < (int64_t)cur_p.size) {
+        result = cur_p.data[cur_p.selected].id;
+    } else {
+        // Fallback to argmax
+        result = (llama_token)(std::max_element(logits, logits + n_vocab) - logits);
+    }
+    
+    if (grammar_) {
+        result = constrain(logits, n_vocab, result);
+    }
+    llama_sampler_accept(chain_, result);
+    return result;
+}
+
+llama_token Sampler::constrain(const float* logits, int n_vocab, llama_token chosen) {
+    // A state seen before with a single legal token: nothing to check or sample
+    llama_token forced;
+    if (forced_ && forced_->find(grammar_state_, forced)) {
+        grammar_forced_++;
+        accept_grammar(forced);
+        return forced;
+    }
+    
+    // Usually the model already wants a legal token, and checking that one
+    // token is far cheaper than masking the whole vocabulary
+    llama_token_data single = {chosen, logits[chosen], 0.0f};
+    llama_token_data_array one = {&single, 1, -1, false};
+    llama_sampler_apply(grammar_, &one);
+    if (single.logit != -INFINITY) {
+        accept_grammar(chosen);
+        return chosen;
+    }
+    
+    // Rejected: mask the full vocabulary (the shortlist may hold no legal token)
+    grammar_full_masks_++;
+    select_all(logits, n_vocab);
+    llama_token_data_array cur_p = {candidates_.data(), candidates_.size(), -1, false};
+    llama_sampler_apply(grammar_, &cur_p);
+    candidates_.erase(std::remove_if(candidates_.begin(), candidates_.end(),
+                                     [](const llama_token_data& t) { return t.logit == -INFINITY; }),
+                      candidates_.end());
+    if (candidates_.empty()) {
+        // Dead end: the caller ends the sequence rather than emit an illegal token
+        LLM_LOG_WARN("Sampler", "Grammar allows no token, ending the sequence");
+        grammar_failed_ = true;
+        return chosen;
+    }
+    
+    llama_token result = candidates_[0].id;
+    if (candidates_.size() == 1) {
+        // Forced continuation (a fixed key, a closing brace): nothing to sample,
+        // and the next request reaching this state skips the mask
+        grammar_forced_++;
+        if (forced_) {
+            forced_->record(grammar_state_, result);
+        }
+    } else {
+        cur_p = {candidates_.data(), candidates_.size(), -1, false};
+        llama_sampler_apply(chain_, &cur_p);
+        if (cur_p.selected >= 0 && cur_p.selected < (int64_t)cur_p.size) {
+            result = cur_p.data[cur_p.selected].id;
+        } else {
+            result = std::max_element(candidates_.begin(), candidates_.end(),
+                                      [](const llama_token_data& a, const llama_token_data& b) {
+                                          return a.logit < b.logit;
+                                      })->id;
+        }
+    }
+    accept_grammar(result);
+    return result;
+}
+
+} // namespace local_llm
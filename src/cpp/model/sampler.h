@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include "llama.h"
+#include "grammar.h"
+
+namespace local_llm {
+
+struct ModelConfig;
+
+// Token sampler built on llama.cpp's native llama_sampler chain.
+// The chain is assembled from every ModelConfig sampling field and only rebuilt
+// when those fields change. Candidates are written into a buffer that is
+// allocated once, straight from the llama_get_logits row; when top-k is active
+// only the best few hundred tokens are ever copied.
+class Sampler {
+public:
+    Sampler();
+    ~Sampler();
+    
+    Sampler(const Sampler&) = delete;
+    Sampler& operator=(const Sampler&) = delete;
+    
+    // Rebuild the chain if `version` differs from the one it was built for
+    void configure(const ModelConfig& config, int n_vocab, uint64_t version);
+    
+    // Forget penalty/mirostat history at the start of a request, and reseed
+    // the random stage so every request draws its own stream
+    void reset(uint32_t seed);
+    
+    // Constrain the next request to a grammar sampler (owned from now on);
+    // null removes the constraint. `forced` remembers the states in which the
+    // grammar allows a single token, shared with other requests of the grammar.
+    void set_grammar(llama_sampler* grammar, std::shared_ptr<ForcedTokens> forced = nullptr);
+    
+    // Sample one token from `n_vocab` raw logits and record it in the chain state
+    llama_token sample(const float* logits, int n_vocab);
+    
+    // Grammar checks that had to mask the whole vocabulary / that found a single legal token
+    uint64_t grammar_full_masks() const { return grammar_full_masks_; }
+    uint64_t grammar_forced() const { return grammar_forced_; }
+    
+    // The grammar allowed no token at the last sample(); the sequence cannot
+    // continue and the returned token is not part of the grammar
+    bool grammar_failed() const { return grammar_failed_; }
+
+private:
+    llama_sampler* chain_ = nullptr;
+    llama_sampler* grammar_ = nullptr;
+    std::shared_ptr<ForcedTokens> forced_;
+    uint64_t grammar_state_ = 0;  // ForcedTokens hash of the tokens the grammar accepted
+    bool grammar_failed_ = false;
+    uint64_t grammar_full_masks_ = 0;
+    uint64_t grammar_forced_ = 0;
+    uint64_t version_ = 0;
+    bool configured_ = false;
+    
+    // Size of the top-k preselection, 0 = feed the whole vocabulary
+    int preselect_ = 0;
+    
+    // The last stage draws the token: 0 = dist, 1/2 = mirostat v1/v2, -1 = greedy.
+    // Its parameters are kept to rebuild it with a new seed.
+    int terminal_ = -1;
+    int n_vocab_ = 0;
+    float mirostat_tau_ = 5.0f;
+    float mirostat_eta_ = 0.1f;
+    int mirostat_m_ = 100;
+    
+    // The random last stage for `seed`; null for greedy
+    llama_sampler* make_terminal(uint32_t seed) const;
+    
+    std::vector<llama_token_data> candidates_;
+    
+    void free_chain();
+    
+    // Fill candidates_ with the k largest logits (min-heap, O(n_vocab log k))
+    void select_top_k(const float* logits, int n_vocab, int k);
+    
+    // Fill candidates_ with the whole vocabulary
+    void select_all(const float* logits, int n_vocab);
+    
+    // Token the grammar allows, given the chain's unconstrained pick
+    llama_token constrain(const float* logits, int n_vocab, llama_token chosen);
+    
+    // Advance the grammar past `token`
+    void accept_grammar(llama_token token);
+};
+
+} // namespace local_llm
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include "llama.h"
+#include "stop_sequences.h"
+
+namespace local_llm {
+
+// Per-request cancellation token; set from any thread, polled by the decode loop
+using CancelToken = std::shared_ptr<std::atomic<bool>>;
+
+inline CancelToken make_cancel_token() {
+    return std::make_shared<std::atomic<bool>>(false);
+}
+
+// Length of the shared prefix of two token lists
+inline size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    const size_t n_max = a.size() < b.size() ? a.size() : b.size();
+    while (n < n_max && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Append one single-sequence token to a batch created with llama_batch_init
+inline void batch_add(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+    const int i = batch.n_tokens;
+    batch.token[i] = token;
+    batch.pos[i] = pos;
+    batch.n_seq_id[i] = 1;
+    batch.seq_id[i][0] = seq;
+    batch.logits[i] = logits;
+    batch.n_tokens++;
+}
+
+// Scheduling class: queued interactive requests are always admitted before
+// batch ones, and displace the newest queued batch request when the queue is full
+enum class RequestPriority { Interactive, Batch };
+
+// Per-request generation options that do not belong in ModelConfig
+struct RequestOptions {
+    // Constrained decoding: a GBNF grammar (root rule "root"), or a JSON schema
+    // that is converted to one. json_schema wins when both are set.
+    std::string grammar;
+    std::string json_schema;
+    
+    RequestPriority priority = RequestPriority::Interactive;
+    int deadline_ms = 0;  // fail the request if no slot took it within this long (0 = wait)
+    
+    // Generation ends when the text produces one of `stop` (which is not
+    // returned) or a token in `stop_tokens` is sampled; end-of-generation
+    // tokens of the vocabulary always stop it
+    std::vector<std::string> stop;
+    std::vector<llama_token> stop_tokens;
+    
+    // LoRA adapter to generate with, by name (empty = the base model)
+    std::string adapter;
+};
+
+// Where the time of one request went, in milliseconds
+struct SequenceTiming {
+    double queue_wait_ms = 0.0;     // submit until a slot took the request
+    double context_setup_ms = 0.0;  // context (re)creation charged to this request
+    double tokenize_ms = 0.0;
+    double prefill_ms = 0.0;        // start until the last prompt chunk was decoded
+    double ttft_ms = 0.0;           // start until the first token was emitted
+    double sampling_ms = 0.0;       // total time spent in the sampler
+    std::vector<float> token_ms;    // gap between consecutive emitted tokens
+    std::chrono::high_resolution_clock::time_point last_token_time;
+};
+
+// One sequence (seq_id) inside the shared llama_context.
+// A slot outlives the request that used it: `cache` keeps the tokens that are
+// still resident in the KV cache so the next request can reuse the prefix.
+struct SequenceSlot {
+    enum class State {
+        Idle,     // free, KV cache may still hold a reusable prefix
+        Prefill,  // prompt tokens still being ingested
+        Decode,   // generating, one token per step
+        Done      // finished, waiting for the owner to collect it
+    };
+    
+    llama_seq_id id = 0;
+    State state = State::Idle;
+    
+    std::vector<llama_token> prompt;  // full prompt of the current request
+    std::vector<llama_token> cache;   // tokens resident in the KV cache for this sequence
+    std::string cache_adapter;        // LoRA adapter `cache` was computed under ("" = none)
+    std::string adapter;              // LoRA adapter of the current request
+    std::shared_ptr<llama_adapter_lora> lora;  // held while the request runs
+    size_t n_reused = 0;              // prompt tokens served from the prefix cache
+    
+    int max_tokens = 0;
+    int n_generated = 0;
+    llama_token pending = -1;         // sampled token waiting to be decoded
+    int32_t i_batch = -1;             // batch index holding this sequence's logits
+    bool eos_hit = false;
+    bool stop_hit = false;            // ended by a stop string or stop token
+    bool cancelled = false;
+    bool context_full = false;        // stopped because the context ran out
+    size_t n_truncated = 0;           // prompt tokens dropped by the overflow policy
+    int n_shifts = 0;                 // sliding-window KV shifts while generating
+    
+    // Speculative decoding: tokens proposed for this step and running totals
+    std::vector<llama_token> draft;
+    int n_drafted = 0;
+    int n_accepted = 0;
+    CancelToken cancel;               // may be null for uncancellable requests
+    
+    std::string output;               // accumulated generated text
+    size_t n_streamed = 0;            // bytes of output already passed to on_text
+    StopMatcher stop;
+    std::vector<llama_token> stop_tokens;
+    std::string error;                // set when the sequence failed
+    std::function<void(const std::string&)> on_text;
+    
+    std::chrono::high_resolution_clock::time_point start_time;
+    SequenceTiming timing;
+    uint64_t last_used = 0;           // LRU tick for slot selection
+    
+    bool is_active() const { return state == State::Prefill || state == State::Decode; }
+    bool cancel_requested() const { return cancel && cancel->load(std::memory_order_relaxed); }
+};
+
+} // namespace local_llm
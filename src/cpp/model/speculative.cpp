@@ -0,0 +1,260 @@
+#include "speculative.h"
+#include "llm_model.h"
+#include "../common/logging.h"
+#include <algorithm>
+#include <cmath>
+
+namespace local_llm {
+
+DraftModelSource::~DraftModelSource() {
+    if (batch_initialized_) {
+        llama_batch_free(batch_);
+    }
+    if (ctx_) {
+        llama_free(ctx_);
+    }
+}
+
+bool DraftModelSource::initialize(const llama_model* target, const ModelConfig& config, int n_seq, int n_ctx) {
+    ModelLoadParams params = LLMModel::load_params(config);
+    params.use_mlock = false;
+    model_ = ModelRegistry::instance().acquire(config.draft_model_path, params);
+    if (!model_) {
+        return false;
+    }
+
+    // Draft tokens are fed straight to the target, so the vocabularies must match
+    const llama_vocab* target_vocab = llama_model_get_vocab(target);
+    const llama_vocab* draft_vocab = llama_model_get_vocab(model_.get());
+    if (llama_vocab_n_tokens(target_vocab) != llama_vocab_n_tokens(draft_vocab) ||
+        llama_vocab_bos(target_vocab) != llama_vocab_bos(draft_vocab) ||
+        llama_vocab_eos(target_vocab) != llama_vocab_eos(draft_vocab)) {
+        LLM_LOG_ERROR("DraftModelSource", "Draft model vocabulary does not match the target, "
+                                          "speculative decoding disabled");
+        model_.reset();
+        return false;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_batch = config.batch_size;
+    ctx_params.n_ubatch = std::min(config.ubatch_size, config.batch_size);
+    ctx_params.n_seq_max = n_seq;
+    ctx_params.n_threads = config.threads;
+    ctx_params.n_threads_batch = config.threads_batch > 0 ? config.threads_batch : config.threads;
+    ctx_params.flash_attn = config.flash_attn;
+    ctx_ = llama_init_from_model(model_.get(), ctx_params);
+    if (!ctx_) {
+        LLM_LOG_ERROR("DraftModelSource", "Failed to create draft context");
+        model_.reset();
+        return false;
+    }
+
+    n_batch_ = (int)llama_n_batch(ctx_);
+    n_vocab_ = llama_vocab_n_tokens(draft_vocab);
+    p_min_ = config.draft_p_min;
+    batch_ = llama_batch_init(n_batch_, 0, 1);
+    batch_initialized_ = true;
+    cache_.assign(n_seq, {});
+
+    LLM_LOG_INFO("DraftModelSource", "Draft model " << config.draft_model_path << " ready, draft_max="
+                                     << config.draft_max << ", p_min=" << p_min_);
+    return true;
+}
+
+void DraftModelSource::attach_threadpool(ggml_threadpool_t threadpool, ggml_threadpool_t threadpool_batch) {
+    if (ctx_) {
+        llama_attach_threadpool(ctx_, threadpool, threadpool_batch);
+    }
+}
+
+void DraftModelSource::reset_sequence(llama_seq_id seq) {
+    if (ctx_ && seq < (llama_seq_id)cache_.size()) {
+        llama_kv_self_seq_rm(ctx_, seq, -1, -1);
+        cache_[seq].clear();
+    }
+}
+
+llama_token DraftModelSource::greedy(const float* logits, float& p) const {
+    int best = 0;
+    for (int i = 1; i < n_vocab_; ++i) {
+        if (logits[i] > logits[best]) {
+            best = i;
+        }
+    }
+    // Probability of the argmax, for the confidence cut-off
+    double sum = 0.0;
+    const float max_logit = logits[best];
+    for (int i = 0; i < n_vocab_; ++i) {
+        sum += std::exp((double)(logits[i] - max_logit));
+    }
+    p = (float)(1.0 / sum);
+    return best;
+}
+
+llama_token DraftModelSource::catch_up(llama_seq_id seq, const std::vector<llama_token>& tokens, float& p) {
+    std::vector<llama_token>& cache = cache_[seq];
+
+    // Keep the shared prefix; the last token is always decoded for fresh logits
+    size_t n_common = common_prefix(cache, tokens);
+    if (n_common == tokens.size()) {
+        n_common--;
+    }
+    if (n_common < cache.size()) {
+        if (!llama_kv_self_seq_rm(ctx_, seq, (llama_pos)n_common, -1)) {
+            llama_kv_self_seq_rm(ctx_, seq, -1, -1);
+            n_common = 0;
+        }
+        cache.resize(n_common);
+    }
+
+    while (cache.size() < tokens.size()) {
+        batch_.n_tokens = 0;
+        const size_t n_chunk = std::min(tokens.size() - cache.size(), (size_t)n_batch_);
+        for (size_t j = 0; j < n_chunk; ++j) {
+            const size_t pos = cache.size() + j;
+            batch_add(batch_, tokens[pos], (llama_pos)pos, seq, pos + 1 == tokens.size());
+        }
+        if (llama_decode(ctx_, batch_) != 0) {
+            llama_kv_self_seq_rm(ctx_, seq, (llama_pos)cache.size(), -1);
+            return -1;
+        }
+        cache.insert(cache.end(), tokens.begin() + cache.size(), tokens.begin() + cache.size() + n_chunk);
+    }
+    return greedy(llama_get_logits_ith(ctx_, batch_.n_tokens - 1), p);
+}
+
+void DraftModelSource::draft(std::vector<DraftRequest>& requests) {
+    if (!ctx_) {
+        return;
+    }
+
+    // Sync every sequence with the target and take its first draft token
+    std::vector<DraftRequest*> drafting;
+    std::vector<llama_token> tokens;
+    for (auto& r : requests) {
+        r.out->clear();
+        if (r.n_max <= 0 || r.slot->id >= (llama_seq_id)cache_.size()) {
+            continue;
+        }
+        tokens.assign(r.slot->cache.begin(), r.slot->cache.end());
+        tokens.push_back(r.slot->pending);
+        float p = 0.0f;
+        llama_token next = catch_up(r.slot->id, tokens, p);
+        if (next < 0 || p < p_min_) {
+            continue;
+        }
+        r.out->push_back(next);
+        if (r.n_max > 1) {
+            drafting.push_back(&r);
+        }
+    }
+
+    // Then extend all of them together, one batched draft decode per token
+    while (!drafting.empty()) {
+        batch_.n_tokens = 0;
+        for (DraftRequest* r : drafting) {
+            const llama_seq_id seq = r->slot->id;
+            batch_add(batch_, r->out->back(), (llama_pos)cache_[seq].size(), seq, true);
+        }
+        if (llama_decode(ctx_, batch_) != 0) {
+            for (DraftRequest* r : drafting) {
+                llama_kv_self_seq_rm(ctx_, r->slot->id, (llama_pos)cache_[r->slot->id].size(), -1);
+            }
+            return;
+        }
+
+        std::vector<DraftRequest*> still_drafting;
+        for (int i = 0; i < (int)drafting.size(); ++i) {
+            DraftRequest* r = drafting[i];
+            cache_[r->slot->id].push_back(r->out->back());
+            float p = 0.0f;
+            llama_token next = greedy(llama_get_logits_ith(ctx_, i), p);
+            if (p < p_min_) {
+                continue;
+            }
+            r->out->push_back(next);
+            if ((int)r->out->size() < r->n_max) {
+                still_drafting.push_back(r);
+            }
+        }
+        drafting.swap(still_drafting);
+    }
+}
+
+NgramDraftSource::NgramDraftSource(int n_seq, int ngram_min, int ngram_max)
+    : ngram_min_(std::max(1, ngram_min)),
+      ngram_max_(std::max(std::max(1, ngram_min), ngram_max)),
+      index_(n_seq) {}
+
+void NgramDraftSource::reset_sequence(llama_seq_id seq) {
+    if (seq < (llama_seq_id)index_.size()) {
+        index_[seq].tokens.clear();
+        index_[seq].next_pos.clear();
+    }
+}
+
+uint64_t NgramDraftSource::hash_ngram(const llama_token* tokens, int n) {
+    // FNV-1a over the token ids, seeded with the length so 2- and 3-grams never collide
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)n;
+    for (int i = 0; i < n; ++i) {
+        h ^= (uint32_t)tokens[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void NgramDraftSource::update(SequenceIndex& idx, const std::vector<llama_token>& history) {
+    // A new request or a context shift rewrote the history: start over
+    const size_t n_common = common_prefix(idx.tokens, history);
+    if (n_common < idx.tokens.size()) {
+        idx.tokens.clear();
+        idx.next_pos.clear();
+    }
+
+    // The n-gram ending at the last token is what we look up, so it is only
+    // indexed one step later; later occurrences overwrite earlier ones
+    const size_t n_index = history.size() - 1;
+    for (size_t end = idx.tokens.size(); end < n_index; ++end) {
+        for (int n = ngram_min_; n <= ngram_max_ && (size_t)n <= end + 1; ++n) {
+            idx.next_pos[hash_ngram(&history[end + 1 - n], n)] = (int32_t)(end + 1);
+        }
+    }
+    idx.tokens.assign(history.begin(), history.begin() + n_index);
+}
+
+void NgramDraftSource::draft(std::vector<DraftRequest>& requests) {
+    for (auto& r : requests) {
+        r.out->clear();
+        if (r.n_max <= 0 || r.slot->id >= (llama_seq_id)index_.size()) {
+            continue;
+        }
+        history_.assign(r.slot->cache.begin(), r.slot->cache.end());
+        history_.push_back(r.slot->pending);
+
+        SequenceIndex& idx = index_[r.slot->id];
+        update(idx, history_);
+
+        // Longest suffix n-gram that occurred before wins
+        for (int n = ngram_max_; n >= ngram_min_; --n) {
+            if ((size_t)n > history_.size()) {
+                continue;
+            }
+            auto it = idx.next_pos.find(hash_ngram(&history_[history_.size() - n], n));
+            if (it == idx.next_pos.end()) {
+                continue;
+            }
+            // Hashes can collide; only propose after a real match
+            const size_t start = (size_t)it->second;
+            if (!std::equal(history_.end() - n, history_.end(), history_.begin() + (start - n))) {
+                continue;
+            }
+            for (size_t pos = start; pos < history_.size() && (int)r.out->size() < r.n_max; ++pos) {
+                r.out->push_back(history_[pos]);
+            }
+            break;
+        }
+    }
+}
+
+} // namespace local_llm
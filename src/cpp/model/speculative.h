@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "llama.h"
+#include "sequence.h"
+#include "model_registry.h"
+
+namespace local_llm {
+
+struct ModelConfig;
+
+// One sequence asking for draft tokens. The sequence's resident tokens plus
+// its pending token are the context; up to n_max continuations go into `out`.
+struct DraftRequest {
+    const SequenceSlot* slot = nullptr;
+    int n_max = 0;
+    std::vector<llama_token>* out = nullptr;
+};
+
+// Proposes tokens for speculative decoding. LLMModel verifies them with a
+// single batched decode of the target model, so a source only has to be
+// cheap, not right: every accepted token is exactly what the target's sampler
+// would have produced anyway.
+class DraftSource {
+public:
+    virtual ~DraftSource() = default;
+
+    // Fill each request's `out` (left empty when there is nothing worth proposing)
+    virtual void draft(std::vector<DraftRequest>& requests) = 0;
+
+    // Forget what a sequence had; called when its slot is reset
+    virtual void reset_sequence(llama_seq_id /*seq*/) {}
+};
+
+// Draft tokens from a small model sharing the target's vocabulary. The draft
+// context mirrors the target's sequence ids and keeps its own KV cache per
+// sequence, which is trimmed back to the common prefix before each draft.
+class DraftModelSource : public DraftSource {
+public:
+    DraftModelSource() = default;
+    ~DraftModelSource() override;
+
+    // Load the draft GGUF and create its context; false if it cannot be used
+    // with `target` (e.g. a different vocabulary)
+    bool initialize(const llama_model* target, const ModelConfig& config, int n_seq, int n_ctx);
+
+    void draft(std::vector<DraftRequest>& requests) override;
+    void reset_sequence(llama_seq_id seq) override;
+    
+    // Decode on the target's threadpool instead of spinning up threads per draft
+    void attach_threadpool(ggml_threadpool_t threadpool, ggml_threadpool_t threadpool_batch);
+
+private:
+    ModelHandle model_;
+    llama_context* ctx_ = nullptr;
+    llama_batch batch_;
+    bool batch_initialized_ = false;
+    int n_batch_ = 0;
+    int n_vocab_ = 0;
+    float p_min_ = 0.0f;
+
+    // Tokens resident in the draft KV cache, per sequence id
+    std::vector<std::vector<llama_token>> cache_;
+
+    // Bring the draft KV cache for `seq` up to `tokens`; returns the draft
+    // model's greedy next token (and its probability), or -1 on failure
+    llama_token catch_up(llama_seq_id seq, const std::vector<llama_token>& tokens, float& p);
+
+    // Greedy token and its probability from one logits row
+    llama_token greedy(const float* logits, float& p) const;
+};
+
+// Draft-free speculation (prompt lookup): when the last few tokens of a
+// sequence already occurred earlier in its prompt or output, propose what
+// followed them back then. Costs a hash lookup per step and no extra RAM for a
+// model, and pays off on summarisation and code edits that copy long spans.
+class NgramDraftSource : public DraftSource {
+public:
+    NgramDraftSource(int n_seq, int ngram_min, int ngram_max);
+
+    void draft(std::vector<DraftRequest>& requests) override;
+    void reset_sequence(llama_seq_id seq) override;
+
+private:
+    // Per sequence: the history indexed so far and, for every n-gram in it,
+    // the position right after its most recent occurrence
+    struct SequenceIndex {
+        std::vector<llama_token> tokens;
+        std::unordered_map<uint64_t, int32_t> next_pos;
+    };
+
+    int ngram_min_;
+    int ngram_max_;
+    std::vector<SequenceIndex> index_;
+    std::vector<llama_token> history_;  // scratch: cache + pending of one request
+
+    static uint64_t hash_ngram(const llama_token* tokens, int n);
+
+    // Index the n-grams that end before the last token of `history`
+    void update(SequenceIndex& idx, const std::vector<llama_token>& history);
+};
+
+} // namespace local_llm
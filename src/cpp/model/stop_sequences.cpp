@@ -0,0 +1,64 @@
+#include "stop_sequences.h"
+#include "token_pieces.h"
+#include <algorithm>
+
+namespace local_llm {
+
+void StopMatcher::reset(const std::vector<std::string>& stops) {
+    stops_.clear();
+    max_length_ = 0;
+    for (const auto& stop : stops) {
+        if (!stop.empty()) {
+            stops_.push_back(stop);
+            max_length_ = std::max(max_length_, stop.size());
+        }
+    }
+}
+
+size_t StopMatcher::find(const std::string& text, size_t from) const {
+    // A match ending past `from` starts at most max_length_ - 1 bytes before it
+    const size_t start = from >= max_length_ ? from - (max_length_ - 1) : 0;
+    size_t best = std::string::npos;
+    for (const auto& stop : stops_) {
+        const size_t at = text.find(stop, start);
+        if (at != std::string::npos && at < best) {
+            best = at;
+        }
+    }
+    return best;
+}
+
+size_t StopMatcher::partial_suffix(const std::string& text, size_t floor) const {
+    if (stops_.empty() || text.size() <= floor) {
+        return 0;
+    }
+    const size_t longest = std::min(max_length_ - 1, text.size() - floor);
+    for (size_t n = longest; n > 0; --n) {
+        const size_t at = text.size() - n;
+        for (const auto& stop : stops_) {
+            if (stop.size() > n && text.compare(at, n, stop, 0, n) == 0) {
+                return n;
+            }
+        }
+    }
+    return 0;
+}
+
+bool StopMatcher::truncate(std::string& text, size_t from, size_t streamed) const {
+    if (stops_.empty()) {
+        return false;
+    }
+    const size_t at = find(text, from);
+    if (at == std::string::npos) {
+        return false;
+    }
+    text.resize(std::max(at, streamed));
+    return true;
+}
+
+size_t StopMatcher::streamable_length(const std::string& text, size_t streamed) const {
+    const size_t n_complete = utf8_complete_length(text, streamed);
+    return std::max(streamed, std::min(n_complete, text.size() - partial_suffix(text, streamed)));
+}
+
+} // namespace local_llm
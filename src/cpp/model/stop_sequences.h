@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace local_llm {
+
+// Stop strings of one request, matched incrementally as text is generated.
+// Each check only looks at the bytes a token added plus the few before them
+// that a stop string could straddle, and the text that might still turn into
+// a stop string is held back from the stream until it is decided.
+class StopMatcher {
+public:
+    // Empty strings are ignored
+    void reset(const std::vector<std::string>& stops);
+
+    bool empty() const { return stops_.empty(); }
+
+    // Earliest position in `text` where a stop string starts, considering only
+    // matches that end past `from` (the bytes appended since the last check);
+    // std::string::npos if none
+    size_t find(const std::string& text, size_t from) const;
+
+    // Length of the longest suffix of text[floor, size) that is a proper
+    // prefix of a stop string, i.e. may still complete into one
+    size_t partial_suffix(const std::string& text, size_t floor) const;
+
+    // If text appended past `from` completed a stop string, cut `text` where
+    // the string starts (but never below `streamed`, which already went out)
+    // and return true
+    bool truncate(std::string& text, size_t from, size_t streamed) const;
+
+    // How much of `text` may be streamed, given that text[0, streamed) already
+    // was: a character split across tokens is held back until its last byte
+    // arrives, and text that may start a stop string until it is decided
+    size_t streamable_length(const std::string& text, size_t streamed) const;
+
+private:
+    std::vector<std::string> stops_;
+    size_t max_length_ = 0;
+};
+
+} // namespace local_llm
@@ -0,0 +1,38 @@
+#include "token_pieces.h"
+#include "../common/logging.h"
+
+namespace local_llm {
+
+void TokenPieceCache::build(const llama_vocab* vocab) {
+    clear();
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    offsets_.reserve(n_vocab + 1);
+    // Most pieces are a few bytes; one reservation avoids regrowing the arena
+    arena_.reserve((size_t)n_vocab * 8);
+
+    std::vector<char> buf(64);
+    for (llama_token token = 0; token < n_vocab; ++token) {
+        offsets_.push_back((uint32_t)arena_.size());
+        int n = llama_token_to_piece(vocab, token, buf.data(), (int32_t)buf.size(), 0, false);
+        if (n < 0) {
+            // Too small: the negated result is the size needed
+            buf.resize(-n);
+            n = llama_token_to_piece(vocab, token, buf.data(), (int32_t)buf.size(), 0, false);
+        }
+        if (n > 0) {
+            arena_.insert(arena_.end(), buf.data(), buf.data() + n);
+        }
+    }
+    offsets_.push_back((uint32_t)arena_.size());
+    arena_.shrink_to_fit();
+
+    LLM_LOG_DEBUG("TokenPieceCache", "Cached " << n_vocab << " token pieces in "
+                                     << arena_.size() / 1024 << " KB");
+}
+
+void TokenPieceCache::clear() {
+    arena_.clear();
+    offsets_.clear();
+}
+
+} // namespace local_llm
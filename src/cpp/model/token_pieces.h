@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+
+namespace local_llm {
+
+// Length of the longest prefix of s[0, size) that does not end inside a
+// multi-byte UTF-8 character. Bytes before `from` are known to be complete.
+inline size_t utf8_complete_length(const std::string& s, size_t from) {
+    const size_t size = s.size();
+    // A character is at most 4 bytes, so only the last 3 can start an unfinished one
+    size_t i = size;
+    while (i > from && i + 3 > size) {
+        const unsigned char c = (unsigned char)s[i - 1];
+        if ((c & 0xC0) != 0x80) {
+            // Lead (or ASCII) byte: is its character complete?
+            size_t need = 1;
+            if ((c & 0xE0) == 0xC0) need = 2;
+            else if ((c & 0xF0) == 0xE0) need = 3;
+            else if ((c & 0xF8) == 0xF0) need = 4;
+            return size - (i - 1) >= need ? size : i - 1;
+        }
+        i--;
+    }
+    return size;
+}
+
+// The text of every token, rendered once when a model is loaded and stored in
+// one contiguous arena. Detokenizing is then a lookup and a memcpy instead of
+// a llama_token_to_piece call per token, and no piece is cut off by a
+// fixed-size buffer.
+class TokenPieceCache {
+public:
+    // Render every token of `vocab` (control tokens render empty)
+    void build(const llama_vocab* vocab);
+    void clear();
+
+    int n_tokens() const { return offsets_.empty() ? 0 : (int)offsets_.size() - 1; }
+
+    // Append the piece of `token`; out-of-range ids append nothing
+    void append(llama_token token, std::string& out) const {
+        if (token < 0 || token >= n_tokens()) {
+            return;
+        }
+        out.append(arena_.data() + offsets_[token], offsets_[token + 1] - offsets_[token]);
+    }
+
+private:
+    std::vector<char> arena_;
+    std::vector<uint32_t> offsets_;  // n_tokens + 1 entries; piece i is [offsets_[i], offsets_[i + 1])
+};
+
+} // namespace local_llm
@@ -8,6 +8,10 @@ const fs = require('fs-extra');
 // Import the native addon
 const { LLMNodeBinding } = require('../../build/Release/llm_node');
 
+// Used when a chat has no system prompt of its own (keeps the model from
+// simulating both sides of a conversation); also what warmup prefills
+const DEFAULT_SYSTEM_PROMPT = 'You are a helpful AI assistant. Answer the user\'s question directly without simulating conversations or pretending to be the user. Do not generate fake user responses or continue conversations on your own.';
+
 class LLMServer {
     constructor() {
         this.app = express();
@@ -48,10 +52,19 @@ class LLMServer {
             res.json({
                 status: 'running',
                 timestamp: new Date().toISOString(),
-                modelInitialized: this.isInitialized
+                modelInitialized: this.isInitialized,
+                queue: this.llm.getQueueStats(),
+                warmup: this.llm.getWarmupStats(),
+                governor: this.llm.getGovernorState()
             });
         });
         
+        // Prometheus scrape target
+        this.app.get('/metrics', (req, res) => {
+            res.set('Content-Type', 'text/plain; version=0.0.4');
+            res.send(this.llm.getPrometheusMetrics());
+        });
+        
         // Initialize model
         this.app.post('/api/initialize', async (req, res) => {
             try {
@@ -67,14 +80,21 @@ class LLMServer {
                     return res.status(400).json({ error: 'Model file not found' });
                 }
                 
-                const success = this.llm.initialize(config);
+                // Warm the system prompt chats will actually start with
+                if (config.warmup && config.warmupSystemPrompt === undefined) {
+                    config.warmupSystemPrompt = DEFAULT_SYSTEM_PROMPT;
+                }
+                
+                // Loads on a worker thread; the old model is gone until it finishes
+                this.isInitialized = false;
+                const success = await this.llm.initializeAsync(config);
                 this.isInitialized = success;
                 
                 if (success) {
                     res.json({ 
                         success: true, 
                         message: 'Model initialized successfully',
-                        modelInfo: this.llm.getModelInfo()
+                        modelInfo: await this.llm.getModelInfoAsync()
                     });
                 } else {
                     res.status(500).json({ error: 'Failed to initialize model' });
@@ -92,13 +112,27 @@ class LLMServer {
                     return res.status(400).json({ error: 'Model not initialized' });
                 }
                 
-                const { prompt, maxTokens = 512 } = req.body;
+                // HTTP callers default to the batch class so they never delay live chats
+                const {
+                    prompt, maxTokens = 512, grammar, jsonSchema, priority = 'batch', deadlineMs, stop, lora
+                } = req.body;
                 
                 if (!prompt) {
                     return res.status(400).json({ error: 'prompt is required' });
                 }
                 
-                const result = this.llm.generate(prompt, maxTokens);
+                // grammar (GBNF) or jsonSchema constrain the output while sampling
+                const result = await this.llm.generateAsync(prompt, maxTokens, {
+                    grammar, jsonSchema, priority, deadlineMs, stop, lora
+                });
+                if (/^(Invalid grammar|Invalid JSON schema|Unsupported JSON schema|Invalid LoRA|Unknown LoRA|Failed to load LoRA)/.test(result)) {
+                    return res.status(400).json({ error: result });
+                }
+                // Overloaded: tell the client to come back instead of holding the connection
+                if (/^Error: Queue (full|deadline exceeded)/.test(result)) {
+                    res.set('Retry-After', '1');
+                    return res.status(503).json({ error: result });
+                }
                 res.json({ result });
                 
             } catch (error) {
@@ -107,17 +141,71 @@ class LLMServer {
             }
         });
         
+        // Offline batch: prompts inline or a JSONL file in jobsDir, results
+        // inline or streamed to a JSONL file there as each one finishes.
+        // The binding rejects file names that would leave jobsDir.
+        this.app.post('/api/generate-batch', async (req, res) => {
+            try {
+                if (!this.isInitialized) {
+                    return res.status(400).json({ error: 'Model not initialized' });
+                }
+                
+                const {
+                    prompts, inputPath, outputPath, maxTokens = 512, grammar, jsonSchema, stop, lora
+                } = req.body;
+                const input = inputPath || prompts;
+                if (!Array.isArray(input) && typeof input !== 'string') {
+                    return res.status(400).json({ error: 'prompts (array) or inputPath is required' });
+                }
+                
+                const summary = await this.llm.generateBatch(input, {
+                    maxTokens, outputPath, grammar, jsonSchema, stop, lora
+                });
+                res.json(summary);
+                
+            } catch (error) {
+                console.error('Batch generation error:', error);
+                res.status(500).json({ error: error.message });
+            }
+        });
+        
+        // LoRA adapters: the ones loaded, and preloading one before it is requested
+        this.app.get('/api/lora', (req, res) => {
+            res.json(this.llm.getLoraAdapters());
+        });
+        
+        this.app.post('/api/lora/load', async (req, res) => {
+            try {
+                if (!this.isInitialized) {
+                    return res.status(400).json({ error: 'Model not initialized' });
+                }
+                const { name } = req.body;
+                if (typeof name !== 'string' || !name) {
+                    return res.status(400).json({ error: 'name is required' });
+                }
+                const result = await this.llm.loadLora(name);
+                if (!result.success) {
+                    return res.status(400).json({ error: result.error });
+                }
+                res.json({ success: true, adapters: this.llm.getLoraAdapters() });
+                
+            } catch (error) {
+                console.error('LoRA load error:', error);
+                res.status(500).json({ error: error.message });
+            }
+        });
+        
         // Update parameters
         this.app.post('/api/parameters', async (req, res) => {
             try {
                 const {
                     temperature, topP, topK, minP, typicalP, tfsZ, topA,
                     repeatPenalty, repeatPenaltyLastN, frequencyPenalty, presencePenalty,
-                    mirostatTau, mirostatEta, mirostatM,
+                    mirostat, mirostatTau, mirostatEta, mirostatM,
                     ropeFreqBase, ropeFreqScale,
                     yarnExtFactor, yarnAttnFactor, yarnBetaFast, yarnBetaSlow, yarnOrigCtx,
                     defragThold, flashAttn, offloadKqv, embeddings,
-                    threadsBatch, ubatchSize
+                    threads, threadsBatch, ubatchSize
                 } = req.body;
                 
                 // Basic sampling parameters
@@ -136,6 +224,7 @@ class LLMServer {
                 if (presencePenalty !== undefined) this.llm.setPresencePenalty(presencePenalty);
                 
                 // Mirostat parameters
+                if (mirostat !== undefined) this.llm.setMirostat(mirostat);
                 if (mirostatTau !== undefined) this.llm.setMirostatTau(mirostatTau);
                 if (mirostatEta !== undefined) this.llm.setMirostatEta(mirostatEta);
                 if (mirostatM !== undefined) this.llm.setMirostatM(mirostatM);
@@ -156,6 +245,7 @@ class LLMServer {
                 if (flashAttn !== undefined) this.llm.setFlashAttn(flashAttn);
                 if (offloadKqv !== undefined) this.llm.setOffloadKqv(offloadKqv);
                 if (embeddings !== undefined) this.llm.setEmbeddings(embeddings);
+                if (threads !== undefined) this.llm.setThreads(threads);
                 if (threadsBatch !== undefined) this.llm.setThreadsBatch(threadsBatch);
                 if (ubatchSize !== undefined) this.llm.setUbatchSize(ubatchSize);
                 
@@ -168,9 +258,9 @@ class LLMServer {
         });
         
         // Get model info
-        this.app.get('/api/model-info', (req, res) => {
+        this.app.get('/api/model-info', async (req, res) => {
             try {
-                const info = this.llm.getModelInfo();
+                const info = await this.llm.getModelInfoAsync();
                 res.json({ info });
             } catch (error) {
                 console.error('Model info error:', error);
@@ -223,8 +313,9 @@ class LLMServer {
                     return res.status(400).json({ error: 'Model file not found' });
                 }
                 
-                // Initialize the new model
-                const success = this.llm.initialize({
+                // Hot-swaps on a worker thread: the current model keeps serving
+                // until the new one is ready, and stays active if loading fails
+                const success = await this.llm.initializeAsync({
                     modelPath,
                     contextSize: 2048,
                     batchSize: 512,
@@ -237,13 +328,13 @@ class LLMServer {
                     seed: 42
                 });
                 
-                this.isInitialized = success;
+                this.isInitialized = success || this.llm.isReady();
                 
                 if (success) {
                     res.json({ 
                         success: true, 
                         message: 'Model changed successfully',
-                        modelInfo: this.llm.getModelInfo()
+                        modelInfo: await this.llm.getModelInfoAsync()
                     });
                 } else {
                     res.status(500).json({ error: 'Failed to change model' });
@@ -254,6 +345,79 @@ class LLMServer {
             }
         });
 
+        // Load a model into memory ahead of a change-model call
+        this.app.post('/api/preload-model', async (req, res) => {
+            try {
+                const { modelPath } = req.body;
+                
+                if (!modelPath) {
+                    return res.status(400).json({ error: 'modelPath is required' });
+                }
+                if (!await fs.pathExists(modelPath)) {
+                    return res.status(400).json({ error: 'Model file not found' });
+                }
+                
+                const success = await this.llm.preloadModel(modelPath);
+                if (success) {
+                    res.json({ success: true, loaded: this.llm.getLoadedModels() });
+                } else {
+                    res.status(500).json({ error: 'Failed to preload model' });
+                }
+            } catch (error) {
+                console.error('Model preload error:', error);
+                res.status(500).json({ error: error.message });
+            }
+        });
+
+        // Exact prompt token count, for context budgeting in the UI
+        this.app.post('/api/count-tokens', (req, res) => {
+            try {
+                const { text } = req.body;
+                
+                if (typeof text !== 'string') {
+                    return res.status(400).json({ error: 'text is required' });
+                }
+                if (!this.isInitialized) {
+                    return res.status(400).json({ error: 'Model not initialized' });
+                }
+                
+                res.json({ tokens: this.llm.countTokens(text) });
+            } catch (error) {
+                console.error('Count tokens error:', error);
+                res.status(500).json({ error: error.message });
+            }
+        });
+
+        // Pooled embeddings, batched natively (e.g. for RAG indexing)
+        this.app.post('/api/embed', async (req, res) => {
+            try {
+                const { texts, normalize = true } = req.body;
+                
+                if (!Array.isArray(texts) || texts.length === 0) {
+                    return res.status(400).json({ error: 'texts must be a non-empty array' });
+                }
+                if (!this.isInitialized) {
+                    return res.status(400).json({ error: 'Model not initialized' });
+                }
+                
+                const flat = await this.llm.embed(texts, { normalize });
+                const dim = flat.length / texts.length;
+                const embeddings = [];
+                for (let i = 0; i < texts.length; i++) {
+                    embeddings.push(Array.from(flat.subarray(i * dim, (i + 1) * dim)));
+                }
+                res.json({ dim, embeddings });
+            } catch (error) {
+                console.error('Embedding error:', error);
+                res.status(500).json({ error: error.message });
+            }
+        });
+
+        // Models resident in memory
+        this.app.get('/api/loaded-models', (req, res) => {
+            res.json(this.llm.getLoadedModels());
+        });
+
         // Download model
         this.app.post('/api/download-model', async (req, res) => {
             try {
@@ -345,7 +509,7 @@ class LLMServer {
                 
                 // Check if model is currently active
                 if (this.isInitialized) {
-                    const modelInfo = this.llm.getModelInfo();
+                    const modelInfo = await this.llm.getModelInfoAsync();
                     if (modelInfo && modelInfo.includes(filePath)) {
                         return res.status(400).json({ error: 'Cannot remove currently active model. Please change to a different model first.' });
                     }
@@ -383,6 +547,9 @@ class LLMServer {
         this.io.on('connection', (socket) => {
             console.log('Client connected:', socket.id);
             
+            // Native request ids of this client's in-flight streams
+            const activeRequests = new Set();
+            
             // Handle streaming generation
             socket.on('generate-stream', async (data) => {
                 try {
@@ -394,7 +561,19 @@ class LLMServer {
                         return;
                     }
                     
-                    const { prompt, systemPrompt, maxTokens = 512 } = data;
+                    const {
+                        prompt,
+                        systemPrompt,
+                        maxTokens = 512,
+                        flushIntervalMs = 50,
+                        flushTokens = 16,
+                        sessionId,
+                        grammar,
+                        jsonSchema,
+                        stop,
+                        lora,
+                        messages
+                    } = data;
                     
                     console.log('Received generation request:');
                     console.log('User prompt:', prompt);
@@ -406,24 +585,53 @@ class LLMServer {
                         return;
                     }
                     
-                    // Combine system prompt with user prompt if provided
-                    let fullPrompt = prompt;
-                    if (systemPrompt && systemPrompt.trim()) {
-                        fullPrompt = `${systemPrompt.trim()}\n\n${prompt}`;
-                        console.log('Combined prompt with system prompt');
-                    } else {
+                    // The model's own chat template formats the turns; earlier
+                    // turns (messages) are sent back by the client as they were
+                    let system = systemPrompt && systemPrompt.trim();
+                    if (!system) {
                         // Default system prompt to prevent fake conversations
-                        fullPrompt = `You are a helpful AI assistant. Answer the user's question directly without simulating conversations or pretending to be the user. Do not generate fake user responses or continue conversations on your own.\n\n${prompt}`;
+                        system = DEFAULT_SYSTEM_PROMPT;
                         console.log('Using default system prompt to prevent fake conversations');
                     }
+                    const history = Array.isArray(messages) ? messages : [];
+                    const chat = [{ role: 'system', content: system }, ...history, { role: 'user', content: prompt }];
                     
-                    console.log('Full prompt being sent to model:', fullPrompt);
+                    // Keyed per conversation, so a follow-up only tokenizes its new turns
+                    const promptTokens = this.llm.applyChatTemplate(chat, {
+                        conversationId: sessionId || socket.id
+                    });
+                    console.log('Chat prompt tokens:', promptTokens.length);
                     console.log('=== END GENERATION REQUEST ===');
                     
-                    // Start streaming generation
-                    this.llm.generateStream(fullPrompt, (text) => {
+                    // A conversation with a saved session resumes from its KV
+                    // cache instead of prefilling the whole history again
+                    if (sessionId) {
+                        const restored = await this.llm.loadSession(sessionId);
+                        if (!restored.success) {
+                            console.log(`Session ${sessionId} not restored: ${restored.error}`);
+                        }
+                    }
+                    
+                    // Start streaming generation; tokens arrive in batches of up to
+                    // flushTokens, at most flushIntervalMs apart
+                    const requestId = this.llm.generateFromTokens(promptTokens, (text) => {
+                        if (text.startsWith('[DONE]')) {
+                            activeRequests.delete(requestId);
+                            if (sessionId) {
+                                this.llm.saveSession(sessionId, requestId).then((saved) => {
+                                    if (!saved.success) {
+                                        console.log(`Session ${sessionId} not saved: ${saved.error}`);
+                                    }
+                                });
+                            }
+                        }
                         socket.emit('stream-chunk', { text });
-                    }, maxTokens);
+                    }, maxTokens, {
+                        flushIntervalMs, flushTokens, grammar, jsonSchema, stop, lora, priority: 'interactive'
+                    });
+                    if (requestId) {
+                        activeRequests.add(requestId);
+                    }
                     
                 } catch (error) {
                     console.error('Stream generation error:', error);
@@ -434,7 +642,11 @@ class LLMServer {
             // Handle stop generation
             socket.on('stop-generation', () => {
                 try {
-                    this.llm.stopGeneration();
+                    // Only this client's streams; other users keep generating
+                    for (const requestId of activeRequests) {
+                        this.llm.stopGeneration(requestId);
+                    }
+                    activeRequests.clear();
                     socket.emit('generation-stopped');
                 } catch (error) {
                     console.error('Stop generation error:', error);
@@ -443,6 +655,11 @@ class LLMServer {
             
             socket.on('disconnect', () => {
                 console.log('Client disconnected:', socket.id);
+                // Nobody is listening anymore, free the cores
+                for (const requestId of activeRequests) {
+                    this.llm.stopGeneration(requestId);
+                }
+                activeRequests.clear();
             });
             
             // Handle download cancellation
@@ -1,4 +1,8 @@
-const { LLMNodeBinding } = require('../build/Release/llm_node');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+// The test build of the addon: the same binding plus the `testing` hooks
+const { LLMNodeBinding, testing } = require('../build/Release/llm_node_test');
 
 // Mock model path for testing (you'll need to provide a real model)
 const TEST_MODEL_PATH = './models/test-model.gguf';
@@ -25,6 +29,21 @@ function testInitialization() {
     console.log('✅ Initialization test passed');
 }
 
+async function testAsyncInitialization() {
+    console.log('🧪 Testing async model initialization...');
+    const llm = new LLMNodeBinding();
+    
+    // Resolves (rather than throws) with false for an invalid model path
+    const success = await llm.initializeAsync({
+        modelPath: '/nonexistent/model.gguf',
+        threads: 1,
+        contextSize: 512
+    });
+    
+    console.assert(success === false, 'Should resolve false with invalid model path');
+    console.log('✅ Async initialization test passed');
+}
+
 function testParameterUpdates() {
     console.log('🧪 Testing parameter updates...');
     const llm = new LLMNodeBinding();
@@ -48,14 +67,285 @@ function testReadyState() {
     console.log('✅ Ready state test passed');
 }
 
-function runAllTests() {
+function testMetrics() {
+    console.log('🧪 Testing metrics...');
+    const llm = new LLMNodeBinding();
+    
+    // No request has finished yet, so the metrics object is empty
+    const metrics = llm.getMetrics();
+    console.assert(metrics && typeof metrics === 'object', 'Metrics should be an object');
+    console.assert(Object.keys(metrics).length === 0, 'Metrics should be empty before any request');
+    console.log('✅ Metrics test passed');
+}
+
+function testTokenApi() {
+    console.log('🧪 Testing token API...');
+    const llm = new LLMNodeBinding();
+    
+    // Without a model there is nothing to tokenize against
+    const tokens = llm.tokenize('hello');
+    console.assert(tokens instanceof Int32Array && tokens.length === 0, 'Should return an empty Int32Array');
+    console.assert(llm.countTokens('hello') === -1, 'Should count -1 tokens without a model');
+    let threw = false;
+    try {
+        llm.detokenize(new Int32Array([1, 2, 3]));
+    } catch (error) {
+        threw = true;
+    }
+    console.assert(threw, 'Detokenize should throw without a model');
+    console.log('✅ Token API test passed');
+}
+
+function testQueueStats() {
+    console.log('🧪 Testing queue stats...');
+    const llm = new LLMNodeBinding();
+    
+    // No scheduler before initialization: every counter is zero
+    const stats = llm.getQueueStats();
+    console.assert(stats.queued_interactive === 0 && stats.queued_batch === 0, 'Queue should be empty');
+    console.assert(stats.admitted === 0 && stats.rejected_full === 0, 'Nothing should be admitted or rejected');
+    console.log('✅ Queue stats test passed');
+}
+
+function testPrometheusMetrics() {
+    console.log('🧪 Testing Prometheus metrics...');
+    const llm = new LLMNodeBinding();
+    
+    const text = llm.getPrometheusMetrics();
+    console.assert(typeof text === 'string', 'Metrics should be text');
+    console.assert(text.includes('# TYPE llm_requests_total counter'), 'Request counter should be exported');
+    console.assert(text.includes('llm_ttft_seconds_bucket{le="+Inf"}'), 'TTFT histogram should be exported');
+    console.log('✅ Prometheus metrics test passed');
+}
+
+async function testLoraWithoutModel() {
+    console.log('🧪 Testing LoRA adapters without a model...');
+    const llm = new LLMNodeBinding();
+    
+    const adapters = llm.getLoraAdapters();
+    console.assert(typeof adapters === 'object', 'Adapter list should be an object');
+    const result = await llm.loadLora('assistant');
+    console.assert(!result.success && result.error, 'Loading an adapter should fail without a model');
+    console.log('✅ LoRA adapters test passed');
+}
+
+async function testEmbedWithoutModel() {
+    console.log('🧪 Testing embeddings without a model...');
+    const llm = new LLMNodeBinding();
+    
+    let rejected = false;
+    try {
+        await llm.embed(['hello', 'world']);
+    } catch (error) {
+        rejected = true;
+    }
+    console.assert(rejected, 'Embed should reject without a model');
+    console.log('✅ Embeddings test passed');
+}
+
+async function testBatchWithoutModel() {
+    console.log('🧪 Testing batch generation without a model...');
+    const llm = new LLMNodeBinding();
+    
+    let rejected = false;
+    try {
+        await llm.generateBatch(['hello', { id: 'b', prompt: 'world' }], { maxTokens: 8 });
+    } catch (error) {
+        rejected = true;
+    }
+    console.assert(rejected, 'generateBatch should reject without a model');
+    console.log('✅ Batch generation test passed');
+}
+
+function testStopHoldback() {
+    console.log('🧪 Testing stop string holdback...');
+    
+    // A stop string split across chunks is never streamed, even in part
+    let result = testing.stopStream(['</end>'], ['Hello <', '/e', 'nd> tail']);
+    console.assert(result.stopped, 'Should stop on a split stop string');
+    console.assert(result.output === 'Hello ', 'Output should end before the stop string');
+    console.assert(result.streamed.join('') === 'Hello ', 'Nothing of the stop string should be streamed');
+    console.assert(result.streamed[0] === 'Hello ' && result.streamed[1] === '', 'Possible stop prefix should be held back');
+    
+    // A false start is released as soon as the next chunk rules it out
+    result = testing.stopStream(['</end>'], ['a <', 'b']);
+    console.assert(!result.stopped, 'Should not stop on a false start');
+    console.assert(result.streamed[0] === 'a ' && result.streamed[1] === '<b', 'Held text should follow once decided');
+    
+    result = testing.stopStream([], ['no ', 'stops']);
+    console.assert(result.streamed.join('') === 'no stops', 'Without stop strings everything streams');
+    console.log('✅ Stop string holdback test passed');
+}
+
+function testUtf8CompleteLength() {
+    console.log('🧪 Testing UTF-8 boundaries...');
+    
+    const text = Buffer.from('hé😀');  // 1 + 2 + 4 bytes
+    console.assert(testing.utf8CompleteLength(text) === 7, 'Complete text is streamed whole');
+    console.assert(testing.utf8CompleteLength(text.subarray(0, 2)) === 1, 'Half of a 2-byte character is held');
+    for (let cut = 4; cut < 7; cut++) {
+        console.assert(testing.utf8CompleteLength(text.subarray(0, cut)) === 3, 'Part of a 4-byte character is held');
+    }
+    console.assert(testing.utf8CompleteLength(Buffer.from('abc')) === 3, 'ASCII is always complete');
+    console.log('✅ UTF-8 boundary test passed');
+}
+
+function testJsonSchemaToGbnf() {
+    console.log('🧪 Testing JSON schema conversion...');
+    
+    const schema = JSON.stringify({
+        type: 'object',
+        properties: { name: { type: 'string' }, mood: { enum: ['happy', 'sad'] }, age: { type: 'integer' } },
+        required: ['name', 'mood']
+    });
+    const result = testing.jsonSchemaToGbnf(schema);
+    console.assert(result.ok && result.error === '', 'Schema should convert');
+    console.assert(result.gbnf.startsWith('root ::= '), 'Grammar should start at root');
+    console.assert(result.gbnf.includes('"\\"name\\""') && result.gbnf.includes('"\\"age\\""'), 'Keys should be literals');
+    console.assert(result.gbnf.includes('"\\"happy\\""') && result.gbnf.includes('"\\"sad\\""'), 'Enum members should be literals');
+    console.assert(result.gbnf.includes('integer ::='), 'Referenced primitives should be defined');
+    
+    const ref = testing.jsonSchemaToGbnf('{"$ref": "#/defs/x"}');
+    console.assert(!ref.ok && ref.error.includes('$ref'), '$ref should be rejected');
+    const bad = testing.jsonSchemaToGbnf('{"type": "date"}');
+    console.assert(!bad.ok && bad.error.includes('date'), 'Unknown types should be rejected');
+    console.assert(testing.jsonSchemaToGbnf('{}').ok, 'An empty schema accepts any value');
+    console.log('✅ JSON schema conversion test passed');
+}
+
+function testParseCpuList() {
+    console.log('🧪 Testing CPU list parsing...');
+    
+    const same = (a, b) => JSON.stringify(a) === JSON.stringify(b);
+    console.assert(same(testing.parseCpuList('0-3'), [0, 1, 2, 3]), 'Ranges should expand');
+    console.assert(same(testing.parseCpuList('3,1,1-2'), [1, 2, 3]), 'Lists should be sorted and deduplicated');
+    console.assert(same(testing.parseCpuList('0-1,4'), [0, 1, 4]), 'Ranges and singles should mix');
+    for (const bad of ['', '2-1', 'a', '1-', '-1', '0,x']) {
+        console.assert(testing.parseCpuList(bad) === null, `"${bad}" should be rejected`);
+    }
+    console.log('✅ CPU list parsing test passed');
+}
+
+function testReadBatchJsonl() {
+    console.log('🧪 Testing batch file parsing...');
+    const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'llm-batch-'));
+    
+    try {
+        const good = path.join(dir, 'good.jsonl');
+        fs.writeFileSync(good, '"plain prompt"\n\n{"id": 7, "prompt": "second", "maxTokens": 16}\n' +
+                               '{"prompt": "third", "max_tokens": 8}\n');
+        let result = testing.readBatchJsonl(good);
+        console.assert(result.ok, 'A valid file should parse');
+        console.assert(result.items.length === 3, 'Blank lines should be skipped');
+        console.assert(result.items[0].prompt === 'plain prompt' && result.items[0].maxTokens === 0, 'A string line is a prompt');
+        console.assert(result.items[1].id === '7' && result.items[1].maxTokens === 16, 'Object lines keep id and maxTokens');
+        console.assert(result.items[2].maxTokens === 8, 'max_tokens is accepted too');
+        
+        const bad = path.join(dir, 'bad.jsonl');
+        fs.writeFileSync(bad, '"ok"\n{"id": 1}\n');
+        result = testing.readBatchJsonl(bad);
+        console.assert(!result.ok && result.error.startsWith('Line 2'), 'Errors should name the line');
+        
+        result = testing.readBatchJsonl(path.join(dir, 'missing.jsonl'));
+        console.assert(!result.ok && result.error.includes('Cannot open'), 'A missing file should fail');
+    } finally {
+        fs.rmSync(dir, { recursive: true, force: true });
+    }
+    console.log('✅ Batch file parsing test passed');
+}
+
+function testGovernorLevels() {
+    console.log('🧪 Testing thermal governor levels...');
+    
+    const cool = { temperatureC: 60, curFreqKhz: 2400000, maxFreqKhz: 2400000, limitFreqKhz: 2400000, busy: true };
+    const dip = { ...cool, curFreqKhz: 1500000 };
+    const steps = testing.governorSteps({ threads: 4, prefillChunk: 512, targetC: 70, hysteresisC: 3 }, [
+        cool,
+        { ...cool, temperatureC: 71 },
+        { ...dip, freqCapped: true },
+        { ...dip, limitFreqKhz: 1500000 },
+        dip, dip, dip,
+        { ...dip, busy: false },
+        cool, cool, cool, cool
+    ]);
+    console.assert(steps[0].level === 0 && !steps[0].changed, 'Cool and at full clock: full speed');
+    console.assert(steps[1].level === 1 && steps[1].changed, 'Reaching the target steps down');
+    console.assert(steps[1].threads === 3 && steps[1].prefill_chunk === 256, 'One level gives up a thread and half the chunk');
+    console.assert(steps[2].level === 2 && steps[2].freq_capped, 'A firmware frequency cap steps down below the target');
+    console.assert(steps[2].cur_freq_khz === 1500000 && steps[2].max_freq_khz === 2400000, 'Clocks should be reported');
+    console.assert(steps[3].level === 2 && !steps[3].freq_capped, 'Running at a user-set scaling_max_freq is not a cap');
+    console.assert(steps[4].level === 2 && steps[5].level === 2 && !steps[5].freq_capped, 'A short dip is not a cap');
+    console.assert(steps[6].level === 3 && steps[6].freq_capped, 'A clock held below its limit under load is a cap');
+    console.assert(steps[7].level === 3 && !steps[7].freq_capped, 'A low clock while idle is not throttling');
+    console.assert(steps.slice(7, 11).every((s) => s.level === 3), 'Stepping up waits for several cool samples');
+    console.assert(steps[11].level === 2 && steps[11].changed, 'Five cool samples step back up');
+    
+    const throttled = testing.governorSteps({ threads: 1 }, [{ temperatureC: 40, throttled: true }]);
+    console.assert(throttled[0].level === 1 && throttled[0].threads === 1, 'Firmware throttling steps down, never below one thread');
+    console.log('✅ Thermal governor test passed');
+}
+
+function testNgramDraft() {
+    console.log('🧪 Testing n-gram drafts...');
+    
+    const same = (a, b) => JSON.stringify(a) === JSON.stringify(b);
+    const drafts = testing.ngramDraft([
+        [1, 2, 3, 4, 5, 1, 2],
+        [1, 2, 3, 4, 5, 1, 2, 3],
+        [9, 8, 7, 6]
+    ], { nMax: 3, ngramMin: 2, ngramMax: 3 });
+    console.assert(same(drafts[0], [3, 4, 5]), 'A repeated 2-gram proposes what followed it');
+    console.assert(same(drafts[1], [4, 5, 1]), 'The longest repeated n-gram wins as history grows');
+    console.assert(same(drafts[2], []), 'A rewritten history without repeats proposes nothing');
+    
+    const capped = testing.ngramDraft([[1, 2, 3, 1, 2]], { nMax: 8, ngramMin: 2, ngramMax: 2 });
+    console.assert(same(capped[0], [3, 1, 2]), 'A draft stops at the end of the history');
+    console.log('✅ N-gram draft test passed');
+}
+
+function testPrometheusRender() {
+    console.log('🧪 Testing Prometheus rendering...');
+    
+    const text = testing.renderMetrics({
+        counters: { test_requests_total: 3 },
+        gauges: { test_level: 2.5 },
+        histograms: { test_latency_seconds: { bounds: [0.1, 1], values: [0.05, 0.5, 0.7, 5] } }
+    });
+    const lines = text.split('\n');
+    console.assert(lines.includes('# TYPE test_requests_total counter') && lines.includes('test_requests_total 3'), 'Counters should render');
+    console.assert(lines.includes('# TYPE test_level gauge') && lines.includes('test_level 2.5'), 'Gauges should render');
+    console.assert(lines.includes('# TYPE test_latency_seconds histogram'), 'Histograms should be typed');
+    console.assert(lines.includes('test_latency_seconds_bucket{le="0.1"} 1'), 'Buckets hold values up to their bound');
+    console.assert(lines.includes('test_latency_seconds_bucket{le="1"} 3'), 'Buckets should be cumulative');
+    console.assert(lines.includes('test_latency_seconds_bucket{le="+Inf"} 4'), 'The +Inf bucket counts everything');
+    console.assert(lines.includes('test_latency_seconds_sum 6.25') && lines.includes('test_latency_seconds_count 4'), 'Sum and count should render');
+    console.log('✅ Prometheus rendering test passed');
+}
+
+async function runAllTests() {
     console.log('🚀 Running LLM System Tests\n');
     
     try {
         testSystemInfo();
         testInitialization();
+        await testAsyncInitialization();
         testParameterUpdates();
         testReadyState();
+        testMetrics();
+        testQueueStats();
+        testPrometheusMetrics();
+        testTokenApi();
+        await testEmbedWithoutModel();
+        await testBatchWithoutModel();
+        await testLoraWithoutModel();
+        testStopHoldback();
+        testUtf8CompleteLength();
+        testJsonSchemaToGbnf();
+        testParseCpuList();
+        testReadBatchJsonl();
+        testGovernorLevels();
+        testNgramDraft();
+        testPrometheusRender();
         
         console.log('\n🎉 All tests passed!');
     } catch (error) {
@@ -72,7 +362,23 @@ if (require.main === module) {
 module.exports = {
     testSystemInfo,
     testInitialization,
+    testAsyncInitialization,
     testParameterUpdates,
     testReadyState,
+    testMetrics,
+    testQueueStats,
+    testPrometheusMetrics,
+    testTokenApi,
+    testEmbedWithoutModel,
+    testBatchWithoutModel,
+    testLoraWithoutModel,
+    testStopHoldback,
+    testUtf8CompleteLength,
+    testJsonSchemaToGbnf,
+    testParseCpuList,
+    testReadBatchJsonl,
+    testGovernorLevels,
+    testNgramDraft,
+    testPrometheusRender,
     runAllTests
 }; 
\ No newline at end of file